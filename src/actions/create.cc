@@ -2,9 +2,11 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 #include <sstream>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -17,16 +19,24 @@
 #include "utils/optparse.h"
 #include "utils/log.hh"
 #include "utils/tools.hh"
+#include "utils/layout.hh"
+#include "utils/image.hh"
+#include "utils/compress.hh"
+#include "crypto/symmetric.hh"
+#include "crypto/keyslots.hh"
+#include "utils/password.hh"
 #include "fs.hh"
 
 using LogString = slog::LogString;
 using Superblock = hush::fs::Superblock;
+using CipherSuite = hush::crypto::CipherSuite;
+using Compression = hush::fs::Compression;
 
 static void usage();
-static uint64_t parse_size(std::string);
-static void format(int, uint64_t);
-static std::shared_ptr<Superblock> write_superblock(int, uint64_t);
+static void format(int, uint64_t, bool, bool, CipherSuite, Compression, hush::fs::KeySlot const &);
+static std::shared_ptr<Superblock> write_superblock(int, uint64_t, bool, bool, CipherSuite, Compression);
 static void write_root_inode(int, std::shared_ptr<Superblock> const &);
+static void write_key_slots(int, hush::fs::KeySlot const &);
 static void write_inode_bitmap(int, std::shared_ptr<Superblock> const &);
 static void write_block_bitmap(int, std::shared_ptr<Superblock> const &);
 static void write_inode_table(int, std::shared_ptr<Superblock> const &);
@@ -35,36 +45,58 @@ static slog::Log logger(slog::LogLevel::DEBUG);
 
 extern std::string prgname;
 
-inline uint64_t MAX(uint64_t a, uint64_t b)
+/*
+ * A thin image stops at the end of its metadata, and since the inode and
+ * tag tables are all zeros we leave them as a hole instead of writing them out. MountInfo
+ * extends the file as blocks get allocated.
+ */
+static void format(int fd, uint64_t filelen, bool thin, bool dedup, CipherSuite suite,
+		Compression compression, hush::fs::KeySlot const & slot)
 {
-	return (a > b) ? a : b;
-}
-
-static void format(int fd, uint64_t filelen)
-{
-	std::shared_ptr<Superblock> sb = write_superblock(fd, filelen);
+	std::shared_ptr<Superblock> sb = write_superblock(fd, filelen, thin, dedup, suite, compression);
+	write_key_slots(fd, slot);
 	write_inode_bitmap(fd, sb);
 	write_block_bitmap(fd, sb);
-	write_inode_table(fd, sb);
+	if (!thin)
+		write_inode_table(fd, sb);
 	//write_root_inode(fd, sb);
 
+	if (thin && ftruncate(fd, sb->fields.first_datablock * HUSHFS_BLOCK_SIZE) != 0) {
+		LogString ls("Couldn't size thin image to %1 blocks", sb->fields.first_datablock);
+		logger.critical(ls);
+		throw ls.str();
+	}
+
 	sb.reset();
 }
 
-static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen)
+static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen, bool thin,
+		bool dedup, CipherSuite suite, Compression compression)
 {
 	uint64_t num_blocks = (uint64_t)(filelen / HUSHFS_BLOCK_SIZE);
-	uint64_t num_inodes = num_blocks;
+	hush::fs::BlockGroup g = hush::fs::plan_group(0, num_blocks, 0);
+	// the index is all zeros to begin with, like the inode and tag tables
+	uint64_t dedup_offset = g.first_datablock;
+	uint64_t dedup_blocks = dedup ? hush::fs::plan_dedup_index(g) : 0;
 	uint64_t inodes_per_block = (uint64_t)(HUSHFS_BLOCK_SIZE / sizeof(hush::fs::Inode));
-	uint64_t ibb = MAX(1, (uint64_t)((num_inodes / 8) / HUSHFS_BLOCK_SIZE));
-	uint64_t bbb = MAX(1, (uint64_t)((num_blocks / 8) / HUSHFS_BLOCK_SIZE));
-	uint64_t inode_table_blocks = (uint64_t)(num_inodes / inodes_per_block) + 1;
-	uint64_t start_bitmap_block = 1;
+	uint64_t num_inodes = g.total_inodes;
+	uint64_t ibb = g.inode_bitmap_blocks;
+	uint64_t bbb = g.block_bitmap_blocks;
+	uint64_t inode_table_blocks = g.inode_table_blocks;
+	uint64_t start_bitmap_block = g.inode_bitmap_offset;
+	uint64_t flags = HUSHFS_FLAG_KEY_SLOTS;
 	auto sb = std::make_shared<Superblock>();
 
+	if (thin)
+		flags |= HUSHFS_FLAG_THIN;
+	if (dedup)
+		flags |= HUSHFS_FLAG_DEDUP;
+
 	*sb = {
 		.fields = {
 			.version             = HUSHFS_VERSION,
+			.cipher              = (uint8_t)suite,
+			.compression         = (uint8_t)compression,
 			.block_size          = HUSHFS_BLOCK_SIZE,
 			.disk_size           = filelen,
 			.total_inodes        = num_inodes,
@@ -73,13 +105,21 @@ static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen)
 			.block_bitmap_blocks = bbb,
 			.inode_table_blocks  = inode_table_blocks,
 			.inodes_per_block    = inodes_per_block,
-			.inode_bitmap_offset = start_bitmap_block,
-			.block_bitmap_offset = start_bitmap_block + ibb,
-			.inode_table_offset  = start_bitmap_block + ibb + bbb,
-			.first_datablock     = start_bitmap_block + ibb + bbb + inode_table_blocks,
+			.inode_bitmap_offset = g.inode_bitmap_offset,
+			.block_bitmap_offset = g.block_bitmap_offset,
+			.inode_table_offset  = g.inode_table_offset,
+			.first_datablock     = g.first_datablock,
+			.free_blocks         = g.free_blocks,
+			.free_inodes         = g.free_inodes,
+			.group_count         = 1,
+			.flags               = flags,
+			.dedup_index_offset  = dedup ? dedup_offset : 0,
+			.dedup_index_blocks  = dedup_blocks,
 		}
 	};
 
+	sb->groups[0] = g;
+
 	memcpy(&sb->fields.magic, HUSHFS_MAGIC, 4);
 
 	logger.debug("Creating superblock\n"
@@ -87,6 +127,7 @@ static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen)
 			"\t.fields = {\n"
 			"\t\t.magic               = \"HusH\"\n"
 			"\t\t.version             = %1\n"
+			"\t\t.cipher              = %16\n"
 			"\t\t.block_size          = %2\n"
 			"\t\t.disk_size           = %3\n"
 			"\t\t.total_inodes        = %4\n"
@@ -99,6 +140,9 @@ static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen)
 			"\t\t.block_bitmap_offset = %11\n"
 			"\t\t.inode_table_offset  = %12\n"
 			"\t\t.first_datablock     = %13\n"
+			"\t\t.free_blocks         = %14\n"
+			"\t\t.group_count         = 1\n"
+			"\t\t.flags               = %15\n"
 			"\t}\n"
 			"}", 
 			HUSHFS_VERSION,
@@ -113,7 +157,10 @@ static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen)
 			start_bitmap_block,
 			start_bitmap_block + ibb,
 			start_bitmap_block + ibb + bbb,
-			start_bitmap_block + ibb + bbb + inode_table_blocks
+			g.first_datablock,
+			g.free_blocks,
+			sb->fields.flags,
+			hush::crypto::suite_name(suite)
 	);
 
 	write_block(fd, sb.get(), 0);
@@ -122,6 +169,17 @@ static std::shared_ptr<Superblock> write_superblock(int fd, uint64_t filelen)
 	return sb;
 }
 
+static void write_key_slots(int fd, hush::fs::KeySlot const & slot)
+{
+	std::vector<hush::fs::KeySlot> slots(HUSHFS_KEY_SLOTS);
+
+	// the rest stay inactive until `hush keyslot -a`
+	slots[0] = slot;
+	write_data(fd, slots.data(), HUSHFS_BLOCK_SIZE, slots.size() * sizeof(slots[0]));
+
+	logger.info("Wrote %1 key slots", HUSHFS_KEY_SLOTS);
+}
+
 static void write_inode_bitmap(int fd, std::shared_ptr<Superblock> const & sb)
 {
 	uint8_t *map;
@@ -130,7 +188,7 @@ static void write_inode_bitmap(int fd, std::shared_ptr<Superblock> const & sb)
 	map = new uint8_t[size] {};
 
 	// no inodes are used right now, so we write an empty map
-	write_data(fd, map, sb->fields.inode_bitmap_offset * HUSHFS_BLOCK_SIZE, size, true);
+	write_data(fd, map, sb->fields.inode_bitmap_offset * HUSHFS_BLOCK_SIZE, size);
 	logger.info("Wrote inode bitmap, size: %1", size);
 
 	delete[] map;
@@ -138,19 +196,13 @@ static void write_inode_bitmap(int fd, std::shared_ptr<Superblock> const & sb)
 
 static void write_block_bitmap(int fd, std::shared_ptr<Superblock> const & sb)
 {
-	uint64_t j = 0, size = sb->fields.block_bitmap_blocks * HUSHFS_BLOCK_SIZE;
+	uint64_t size = sb->fields.block_bitmap_blocks * HUSHFS_BLOCK_SIZE;
 	uint8_t *map = new uint8_t[size] {};
-	uint8_t byte = map[j];
 
-	for (uint64_t i = 0; i < sb->fields.first_datablock; i++) {
-		if (i != 0 && (i % 8) == 0) {
-			j++;
-			byte = map[j];
-		}
-		byte = byte | (0x80 >> i);
-	}
+	// the superblock, both bitmaps and the inode table are all in use
+	hush::fs::mark_bits(map, 0, hush::fs::group_metadata_blocks(sb->groups[0]));
 
-	write_data(fd, map, sb->fields.block_bitmap_offset * HUSHFS_BLOCK_SIZE, size, true);
+	write_data(fd, map, sb->fields.block_bitmap_offset * HUSHFS_BLOCK_SIZE, size);
 
 	logger.info("Wrote block bitmap, size: %1", size);
 
@@ -165,17 +217,13 @@ static void write_inode_table(int fd, std::shared_ptr<Superblock> const & sb)
 	logger.debug("Writing inode table: %1 blocks", sb->fields.inode_table_blocks);
 	// the inodes are all initially empty so we just write zeros here
 	for (int i = 0; i < sb->fields.inode_table_blocks; i++) {
-		write_block(fd, &block, (startblock++) * HUSHFS_BLOCK_SIZE, true);
+		write_block(fd, &block, (startblock++) * HUSHFS_BLOCK_SIZE);
 	}
-
-	size_t tell = lseek(fd, 0, SEEK_CUR);
-	logger.debug("tell = %1 block = %2", tell, tell / HUSHFS_BLOCK_SIZE);
 }
 
 static void write_root_inode(int fd, std::shared_ptr<Superblock> const & sb)
 {
 	struct timespec ts = {};
-	size_t bytes;
 
 	clock_gettime(CLOCK_REALTIME, &ts);
 	hush::fs::Inode inode = {
@@ -191,61 +239,18 @@ static void write_root_inode(int fd, std::shared_ptr<Superblock> const & sb)
 		},
 	};
 
-	bytes = write(fd, &inode, sizeof inode);
-
-	if (bytes != sizeof inode) {
-		LogString ls("Error writing root inode: Wrote %1 bytes, expected %2 ", bytes, sizeof inode);
-		logger.critical(ls);
-		throw ls.str();
-	}
+	hush::fs::store_inode(fd, *sb, inode);
 
 	logger.info("Wrote root inode, size: %1", sizeof(inode));
 }
 
 static void usage()
 {
-	std::cerr << "Usage " << prgname << " [-S] -k .path/to/keyfile -s N[k|g|m] secret.img" << std::endl;
-}
-
-static uint64_t parse_size(std::string s)
-{
-	std::string suffix;
-	std::string::size_type end = 0;
-	uint64_t n;
-
-	n = std::stoull(s, &end, 10);
-
-	if (end == 0) {
-		std::cerr << "Invalid size specified" << std::endl;
-		n = 0;
-	}
-
-	if (end) {
-		if (end < s.length() - 1)
-			std::cerr << "Invalid size specified" << std::endl;
-		suffix = s.substr(end);
-		std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::tolower);
-	}
-
-	if (! suffix.empty()) {
-		switch (suffix.at(0)) {
-			case 'k':
-				n *= KB;
-				break;
-			case 'm':
-				n *= MB;
-				break;
-			case 'g':
-				n *= GB;
-				break;
-			default:
-				std::cerr << "Invalid size modifier. If present, must be one of k, g, or m"
-						  << std::endl;
-				n = 0;
-		}
-	}
-
-	return n;
+	std::cerr << "Usage " << prgname << " [-S|-t] [-D] [-c aes256gcm|xchacha20poly1305] [-z lz4|zstd] "
+		"[-C ms] [-k .path/to/keyfile] -s N[k|m|g|t] secret.img" << std::endl
+		<< "'-D'  keep a dedup index, so identical blocks are stored once" << std::endl
+		<< "'-C ms'  tune the passphrase hash to take about ms to unlock" << std::endl
+		<< "'-z'  compress blocks before sealing them" << std::endl;
 }
 
 int hush_create(struct optparse *opts)
@@ -253,15 +258,51 @@ int hush_create(struct optparse *opts)
 	int opt, ret = 0, fd, nullbyte = 0;
 	std::string filename, keypath;
 	uint64_t filelen = 0;
+	unsigned long calibrate_ms = 0;
+	unsigned took_ms;
 	char *tmp;
-	bool no_sparse = false;
-	off_t curpos;
-
-	while ((opt = optparse(opts, "Sk:s:h")) != -1) {
+	bool no_sparse = false, thin = false, dedup = false;
+	CipherSuite suite = hush::crypto::Symmetric::best_suite();
+	Compression compression = Compression::None;
+	hush::utils::Password secret;
+	hush::crypto::SecretKey volume_key;
+	hush::fs::KeySlot slot;
+	hush::crypto::KdfParams kdf;
+
+	while ((opt = optparse(opts, "StDc:z:C:k:s:h")) != -1) {
 		switch (opt) {
+			case 'c':
+				if (!hush::crypto::parse_suite(opts->optarg, suite)) {
+					std::cerr << "Unknown cipher suite " << opts->optarg << std::endl;
+					ret = 1;
+					goto bye;
+				}
+				break;
+			case 'z':
+				if (!hush::fs::parse_compression(opts->optarg, compression)) {
+					std::cerr << "Unknown compression " << opts->optarg << std::endl;
+					ret = 1;
+					goto bye;
+				}
+				break;
+			case 'C':
+				calibrate_ms = strtoul(opts->optarg, &tmp, 10);
+				if (tmp == opts->optarg || *tmp != '\0' || calibrate_ms == 0 ||
+						calibrate_ms > UINT32_MAX) {
+					std::cerr << "Not a time in ms: " << opts->optarg << std::endl;
+					ret = 1;
+					goto bye;
+				}
+				break;
 			case 'S':
 				no_sparse = true;
 				break;
+			case 't':
+				thin = true;
+				break;
+			case 'D':
+				dedup = true;
+				break;
 			case 'k':
 				keypath = opts->optarg;
 				break;
@@ -279,14 +320,57 @@ int hush_create(struct optparse *opts)
 	if ((tmp = optparse_arg(opts)) != nullptr)
 		filename = tmp;
 
-	if (filename.empty() || keypath.empty() || filelen == 0) {
+	if (filename.empty() || filelen == 0 || (thin && no_sparse)) {
 		usage();
 		ret = 1;
 		goto bye;
 	}
 
+	if (!hush::crypto::Symmetric::is_available(suite)) {
+		std::cerr << "Cipher suite " << hush::crypto::suite_name(suite) <<
+			" isn't supported on this CPU" << std::endl;
+		ret = 1;
+		goto bye;
+	}
+
+	if (!hush::fs::compression_available(compression)) {
+		std::cerr << "This build of " << prgname << " has no " <<
+			hush::fs::compression_name(compression) << " support" << std::endl;
+		ret = 1;
+		goto bye;
+	}
+
+	if (compression != Compression::None && suite == CipherSuite::XSalsa20Poly1305) {
+		std::cerr << hush::crypto::suite_name(suite) << " can't authenticate compressed blocks, "
+			"pick another cipher suite" << std::endl;
+		ret = 1;
+		goto bye;
+	}
+
+	// the volume key is random, what we ask for here only unlocks slot 0
+	try {
+		if (keypath.empty())
+			secret.ask("Volume passphrase: ", true, true);
+		else
+			secret.read(keypath);
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+		ret = 1;
+		goto bye;
+	}
+
+	if (calibrate_ms > 0) {
+		printf("Calibrating passphrase hashing for %lums\n", calibrate_ms);
+		kdf = hush::crypto::calibrate_kdf(calibrate_ms, took_ms);
+		printf("Using opslimit %llu, memlimit %zu (%ums)\n", kdf.opslimit, kdf.memlimit,
+				took_ms);
+	}
+
+	volume_key.random_key();
+	hush::crypto::seal_key_slot(slot, volume_key, secret.get(), kdf);
+
 	std::cout << "Creating file " << filename << " of " << filelen << 
-		" bytes with key " << keypath << std::endl;
+		" bytes using " << hush::crypto::suite_name(suite) << std::endl;
 
 	
 	if ((fd = open(filename.c_str(), O_CREAT | O_RDWR | O_EXCL, 0600)) == -1) {
@@ -302,26 +386,27 @@ int hush_create(struct optparse *opts)
 	}
 
 	try {
-		format(fd, filelen);
+		format(fd, filelen, thin, dedup, suite, compression, slot);
 	} catch (...) {
 		close(fd);
 		throw;
 	}
 
-	if (no_sparse) {
+	if (thin) {
+		logger.info("Creating thin image");
+	} else if (no_sparse) {
 		logger.info("Not creating sparse file");
 		char empty[8192] = {};
-		while ((curpos = lseek(fd, 0, SEEK_CUR)) < filelen) {
-			uint64_t sz = filelen-curpos;
+		struct stat st;
 
-			sz = sz > 8192 ? 8192 : sz;
-			write(fd, empty, sz);
-		}
+		// the metadata ends with the last block written
+		fstat(fd, &st);
+		for (uint64_t pos = st.st_size; pos < filelen; pos += sizeof empty)
+			write_data(fd, empty, pos, std::min((uint64_t)sizeof empty, filelen - pos));
 	} else {
 		logger.info("Creating sparse file");
 		// create sparse file
-		lseek(fd, filelen-1, SEEK_SET);
-		write(fd, &nullbyte, 1);
+		write_data(fd, &nullbyte, filelen - 1, 1);
 	}
 
 
@@ -0,0 +1,670 @@
+#include <algorithm> // sort, min
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "defrag.hh"
+#include "utils/optparse.h"
+#include "utils/log.hh"
+#include "utils/tools.hh"
+#include "utils/layout.hh"
+#include "utils/image.hh"
+#include "utils/blockmap.hh"
+#include "utils/blockio.hh"
+#include "utils/dedup.hh"
+#include "utils/password.hh"
+#include "crypto/keyslots.hh"
+#include "fs.hh"
+
+using LogString = slog::LogString;
+using hush::fs::BlockGroup;
+using hush::fs::Extent;
+using hush::fs::Inode;
+using hush::fs::InodeTableBlock;
+using hush::fs::Superblock;
+
+// blocks copied per read/write pair, 1MiB
+#define BATCH_BLOCKS 256
+// free runs shorter than this aren't worth a fallocate call
+#define HOLE_MIN_BLOCKS 16
+// each pass frees space that can let a file skipped earlier find a run
+#define MAX_PASSES 4
+
+using Image = struct __defrag_image {
+	int fd;
+	Superblock sb;
+	std::vector<std::vector<uint8_t>> inode_maps;
+	std::vector<std::vector<uint8_t>> block_maps;
+	// bitmap blocks, per group, changed since the last flush
+	std::vector<std::set<uint64_t>> dirty;
+	// nothing below this block is free
+	uint64_t hint;
+	// set once unlocked, when there are sealed blocks to move
+	hush::fs::BlockIO *io;
+	// blocks in the dedup index
+	std::unordered_map<uint64_t, hush::fs::DedupRef> shared;
+};
+
+using FileInfo = struct {
+	uint64_t i_no;
+	uint64_t first;
+	uint64_t last;
+	uint64_t nblocks;
+	uint64_t extents;
+};
+
+using Stats = struct {
+	uint64_t files;
+	uint64_t fragmented;
+	uint64_t extents;
+	uint64_t blocks;
+	uint64_t free_runs;
+	uint64_t last_used;
+	uint64_t pinned;
+};
+
+static void usage();
+static void load(int, Image &);
+static bool is_used(Image const &, uint64_t);
+static void set_used(Image &, uint64_t, bool);
+static void flush_maps(Image &);
+static bool find_run(Image &, uint64_t, uint64_t &);
+static std::vector<FileInfo> survey(Image &, Stats &);
+static bool has_sealed_blocks(Image const &);
+static uint64_t next_epoch(Image &);
+static void store_tree(Image &, hush::fs::MerkleTree::Roots const &);
+static void move_file(Image &, uint64_t, uint64_t);
+static void release_space(Image &);
+static void print_stats(char const *, Stats const &);
+
+static slog::Log logger(slog::LogLevel::INFO);
+
+extern std::string prgname;
+
+static void load(int fd, Image & img)
+{
+	img.fd = fd;
+	hush::fs::load_superblock(fd, img.sb);
+
+	for (uint64_t g = 0; g < img.sb.fields.group_count; g++) {
+		std::vector<uint8_t> imap, bmap;
+
+		hush::fs::load_group_maps(fd, img.sb.groups[g], imap, bmap);
+		img.inode_maps.push_back(std::move(imap));
+		img.block_maps.push_back(std::move(bmap));
+		img.dirty.emplace_back();
+	}
+
+	img.hint = img.sb.groups[0].first_datablock;
+	img.io = nullptr;
+
+	if (img.sb.fields.flags & HUSHFS_FLAG_DEDUP)
+		img.shared = hush::fs::load_dedup_refs(fd, img.sb);
+}
+
+static bool is_used(Image const & img, uint64_t block)
+{
+	int g = hush::fs::group_of_block(img.sb, block);
+
+	return hush::fs::test_bit(img.block_maps[g].data(), block - img.sb.groups[g].start_block);
+}
+
+static void set_used(Image & img, uint64_t block, bool used)
+{
+	int g = hush::fs::group_of_block(img.sb, block);
+	BlockGroup & bg = img.sb.groups[g];
+	uint64_t bit = block - bg.start_block;
+	uint8_t mask = 0x80 >> (bit % 8);
+
+	if (used) {
+		img.block_maps[g][bit / 8] |= mask;
+		bg.free_blocks--;
+		img.sb.fields.free_blocks--;
+	} else {
+		img.block_maps[g][bit / 8] &= ~mask;
+		bg.free_blocks++;
+		img.sb.fields.free_blocks++;
+		img.hint = std::min(img.hint, block);
+	}
+
+	img.dirty[g].insert(bit / (HUSHFS_BLOCK_SIZE * 8));
+}
+
+static void flush_maps(Image & img)
+{
+	for (uint64_t g = 0; g < img.dirty.size(); g++) {
+		BlockGroup const & bg = img.sb.groups[g];
+
+		for (uint64_t b : img.dirty[g])
+			write_block(img.fd, img.block_maps[g].data() + (b * HUSHFS_BLOCK_SIZE),
+					(bg.block_bitmap_offset + b) * HUSHFS_BLOCK_SIZE);
+		img.dirty[g].clear();
+	}
+}
+
+/*
+ * Lowest run of `n` free blocks that doesn't straddle a group boundary. Whole
+ * bytes of the bitmap that are fully used get skipped eight blocks at a time.
+ */
+static bool find_run(Image & img, uint64_t n, uint64_t & start)
+{
+	for (uint64_t g = 0; g < img.sb.fields.group_count; g++) {
+		BlockGroup const & bg = img.sb.groups[g];
+		std::vector<uint8_t> const & map = img.block_maps[g];
+		uint64_t end = bg.start_block + bg.total_blocks;
+		uint64_t b = std::max(img.hint, bg.first_datablock), run = 0;
+
+		if (b >= end)
+			continue;
+
+		while (b < end) {
+			uint64_t bit = b - bg.start_block;
+
+			if (run == 0 && bit % 8 == 0 && map[bit / 8] == 0xFF) {
+				b += 8;
+				continue;
+			}
+
+			if (hush::fs::test_bit(map.data(), bit)) {
+				run = 0;
+			} else if (++run == n) {
+				start = b - n + 1;
+				return true;
+			}
+			b++;
+		}
+	}
+	return false;
+}
+
+static std::vector<FileInfo> survey(Image & img, Stats & stats)
+{
+	std::vector<FileInfo> files;
+	std::vector<InodeTableBlock> table(BATCH_BLOCKS);
+	uint64_t ipb = HUSHFS_BLOCK_SIZE / sizeof(Inode);
+
+	stats = {};
+
+	for (uint64_t g = 0; g < img.sb.fields.group_count; g++) {
+		BlockGroup const & bg = img.sb.groups[g];
+
+		for (uint64_t t = 0; t < bg.inode_table_blocks; t += BATCH_BLOCKS) {
+			uint64_t n = std::min((uint64_t)BATCH_BLOCKS, bg.inode_table_blocks - t);
+
+			read_data(img.fd, table.data(), (bg.inode_table_offset + t) * HUSHFS_BLOCK_SIZE,
+					n * HUSHFS_BLOCK_SIZE);
+
+			for (uint64_t i = 0; i < n * ipb && (t * ipb) + i < bg.total_inodes; i++) {
+				Inode const & inode = table[i / ipb].inodes[i % ipb];
+				FileInfo f = { bg.first_inode + (t * ipb) + i + 1, UINT64_MAX, 0, 0, 0 };
+				bool pinned = false;
+
+				if (!hush::fs::test_bit(img.inode_maps[g].data(), (t * ipb) + i))
+					continue;
+
+				hush::fs::walk_block_map(img.fd, inode.fields,
+						[&](uint64_t, uint64_t physical, bool) -> bool {
+					auto it = img.shared.find(physical);
+
+					f.first = std::min(f.first, physical);
+					f.last = std::max(f.last, physical);
+					f.nblocks++;
+					if (it != img.shared.end() && it->second.refs > 1)
+						pinned = true;
+					return true;
+				});
+
+				if (f.nblocks == 0)
+					continue;
+
+				f.extents = hush::fs::file_extents(img.fd, inode.fields).size();
+
+				stats.files++;
+				stats.blocks += f.nblocks;
+				stats.extents += f.extents;
+				stats.last_used = std::max(stats.last_used, f.last);
+				if (f.extents > 1)
+					stats.fragmented++;
+
+				// other files point at its shared blocks too, so it stays put
+				if (pinned)
+					stats.pinned++;
+				else
+					files.push_back(f);
+			}
+		}
+	}
+
+	for (uint64_t g = 0; g < img.sb.fields.group_count; g++) {
+		BlockGroup const & bg = img.sb.groups[g];
+		bool in_run = false;
+
+		for (uint64_t b = bg.first_datablock; b < bg.start_block + bg.total_blocks; b++) {
+			bool used = is_used(img, b);
+			if (!used && !in_run)
+				stats.free_runs++;
+			in_run = !used;
+		}
+	}
+
+	return files;
+}
+
+/*
+ * Any data block with a BlockTag that says it's been written. Those are
+ * sealed to their block number and can't be moved without the key.
+ */
+static bool has_sealed_blocks(Image const & img)
+{
+	std::vector<hush::fs::BlockTag> tags(HUSHFS_TAGS_PER_BLOCK);
+
+	for (uint64_t g = 0; g < img.sb.fields.group_count; g++) {
+		BlockGroup const & bg = img.sb.groups[g];
+
+		for (uint64_t b = 0; b < bg.tag_table_blocks; b++) {
+			read_block(img.fd, tags.data(), (bg.tag_table_offset + b) * HUSHFS_BLOCK_SIZE);
+			for (auto const & t : tags) {
+				if (t.flags & HUSHFS_TAG_WRITTEN)
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+// resealing moved blocks needs fresh nonces, the same as a mount does
+static uint64_t next_epoch(Image & img)
+{
+	img.sb.fields.mount_epoch++;
+	write_block(img.fd, &img.sb, 0);
+	if (fsync(img.fd) != 0)
+		throw std::string("Couldn't sync mount epoch");
+
+	return img.sb.fields.mount_epoch;
+}
+
+static void store_tree(Image & img, hush::fs::MerkleTree::Roots const & roots)
+{
+	if (roots.dirty) {
+		img.sb.fields.flags |= HUSHFS_FLAG_TREE_DIRTY;
+	} else {
+		if (fsync(img.fd) != 0)
+			throw std::string("Couldn't sync tag tables");
+
+		img.sb.fields.merkle_groups = roots.groups;
+		std::copy(roots.root.begin(), roots.root.end(), img.sb.fields.merkle_root);
+		for (uint64_t g = 0; g < roots.groups; g++) {
+			std::copy(roots.group_roots[g].begin(), roots.group_roots[g].end(),
+					img.sb.groups[g].merkle_root);
+		}
+		img.sb.fields.flags &= ~HUSHFS_FLAG_TREE_DIRTY;
+	}
+
+	write_block(img.fd, &img.sb, 0);
+	if (fsync(img.fd) != 0)
+		throw std::string("Couldn't sync superblock");
+}
+
+/*
+ * Copy every block of a file, data first in file order and then its indirect
+ * blocks, to the run starting at `dest`. Indirect blocks are moved as they
+ * are; sealed data blocks are authenticated along with their block number,
+ * so they're opened and resealed for their new spot. The ordering keeps the
+ * old copy authoritative until the inode is rewritten, so a crash part way
+ * through costs at most some leaked blocks that fsck -y will reclaim.
+ */
+static void move_file(Image & img, uint64_t i_no, uint64_t dest)
+{
+	Inode inode;
+	std::vector<uint64_t> order, indirect;
+	std::unordered_map<uint64_t, uint64_t> moved;
+	std::vector<uint8_t> buf(BATCH_BLOCKS * HUSHFS_BLOCK_SIZE);
+	std::vector<uint64_t> ptrs(HUSHFS_PTRS_PER_BLOCK);
+	uint64_t data_blocks, n;
+
+	hush::fs::load_inode(img.fd, img.sb, i_no, inode);
+	hush::fs::walk_block_map(img.fd, inode.fields,
+			[&](uint64_t, uint64_t physical, bool is_indirect) -> bool {
+		(is_indirect ? indirect : order).push_back(physical);
+		return true;
+	});
+	data_blocks = order.size();
+	order.insert(order.end(), indirect.begin(), indirect.end());
+
+	for (uint64_t i = 0; i < order.size(); i++) {
+		moved[order[i]] = dest + i;
+		set_used(img, dest + i, true);
+	}
+	flush_maps(img);
+
+	for (uint64_t i = 0; i < order.size(); i += n) {
+		// without a key nothing's sealed, and data blocks are copied like the rest
+		bool sealed_phase = img.io != nullptr && i < data_blocks;
+		uint64_t end = sealed_phase ? data_blocks : order.size();
+		n = std::min((uint64_t)BATCH_BLOCKS, end - i);
+
+		if (sealed_phase) {
+			std::vector<uint64_t> from(order.begin() + i, order.begin() + i + n), to;
+
+			for (uint64_t j = 0; j < n; j++)
+				to.push_back(dest + i + j);
+			img.io->relocate(from, to);
+			continue;
+		}
+
+		// one read per run of blocks that are already next to each other
+		for (uint64_t j = 0; j < n; ) {
+			uint64_t k = j + 1;
+			while (k < n && order[i + k] == order[i + j] + (k - j))
+				k++;
+			read_data(img.fd, buf.data() + (j * HUSHFS_BLOCK_SIZE),
+					order[i + j] * HUSHFS_BLOCK_SIZE, (k - j) * HUSHFS_BLOCK_SIZE);
+			j = k;
+		}
+
+		write_data(img.fd, buf.data(), (dest + i) * HUSHFS_BLOCK_SIZE, n * HUSHFS_BLOCK_SIZE);
+	}
+
+	for (uint64_t old : indirect) {
+		uint64_t pos = moved[old] * HUSHFS_BLOCK_SIZE;
+
+		read_block(img.fd, ptrs.data(), pos);
+		for (auto & p : ptrs) {
+			if (p != 0)
+				p = moved[p];
+		}
+		write_block(img.fd, ptrs.data(), pos);
+	}
+
+	fsync(img.fd);
+
+	for (auto & p : inode.fields.direct_ptr) {
+		if (p != 0)
+			p = moved[p];
+	}
+	if (inode.fields.single_indirect_ptr)
+		inode.fields.single_indirect_ptr = moved[inode.fields.single_indirect_ptr];
+	if (inode.fields.double_indirect_ptr)
+		inode.fields.double_indirect_ptr = moved[inode.fields.double_indirect_ptr];
+	if (inode.fields.triple_indirect_ptr)
+		inode.fields.triple_indirect_ptr = moved[inode.fields.triple_indirect_ptr];
+
+	hush::fs::store_inode(img.fd, img.sb, inode);
+	fsync(img.fd);
+
+	/*
+	 * Only unshared blocks get here. Should we crash before this, fsck -y
+	 * drops the stale entries, and the moved blocks just aren't shareable.
+	 */
+	for (uint64_t i = 0; i < data_blocks; i++) {
+		auto it = img.shared.find(order[i]);
+		hush::fs::DedupEntry e;
+
+		if (it == img.shared.end())
+			continue;
+
+		hush::fs::read_dedup_entry(img.fd, img.sb, it->second.slot, e);
+		hush::fs::DedupRef ref = it->second;
+
+		e.block = dest + i;
+		hush::fs::write_dedup_entry(img.fd, img.sb, ref.slot, e);
+		img.shared.erase(it);
+		img.shared[dest + i] = ref;
+	}
+
+	for (uint64_t old : order)
+		set_used(img, old, false);
+	flush_maps(img);
+}
+
+/*
+ * Give free space back to the host. Trailing groups that compaction emptied
+ * are dropped and the file truncated; every other sizeable free run is
+ * punched out so the host filesystem (and its backups) can skip it.
+ */
+static void release_space(Image & img)
+{
+	uint64_t punched = 0, file_size;
+
+	while (img.sb.fields.group_count > 1) {
+		BlockGroup const & bg = img.sb.groups[img.sb.fields.group_count - 1];
+
+		// its root is in the keyed tag tree root, which can't be redone without the key
+		if (img.io == nullptr && img.sb.fields.group_count <= img.sb.fields.merkle_groups) {
+			logger.info("Keeping group %1, dropping it from the tag tree takes the key",
+					img.sb.fields.group_count - 1);
+			break;
+		}
+
+		if (bg.free_blocks != bg.total_blocks - hush::fs::group_metadata_blocks(bg) ||
+				bg.free_inodes != bg.total_inodes)
+			break;
+
+		img.sb.fields.group_count--;
+		img.sb.fields.disk_size = bg.start_block * HUSHFS_BLOCK_SIZE;
+		img.sb.fields.total_blocks -= bg.total_blocks;
+		img.sb.fields.total_inodes -= bg.total_inodes;
+		img.sb.fields.free_blocks -= bg.free_blocks;
+		img.sb.fields.free_inodes -= bg.free_inodes;
+		img.inode_maps.pop_back();
+		img.block_maps.pop_back();
+		img.dirty.pop_back();
+
+		logger.info("Dropped empty group %1 (%2 blocks)", img.sb.fields.group_count,
+				bg.total_blocks);
+	}
+
+	write_block(img.fd, &img.sb, 0);
+	fsync(img.fd);
+
+	/*
+	 * Files are packed at the front now, so a thin image can give back
+	 * everything after its last used block, as long as the last group's
+	 * metadata stays inside the file.
+	 */
+	file_size = img.sb.fields.disk_size;
+	if (img.sb.fields.flags & HUSHFS_FLAG_THIN) {
+		uint64_t keep = img.sb.groups[img.sb.fields.group_count - 1].first_datablock;
+
+		for (uint64_t b = img.sb.fields.total_blocks; b > keep; b--) {
+			if (is_used(img, b - 1)) {
+				keep = b;
+				break;
+			}
+		}
+		file_size = keep * HUSHFS_BLOCK_SIZE;
+	}
+
+	if (ftruncate(img.fd, file_size) != 0)
+		logger.warn("Couldn't truncate image to %1 bytes", file_size);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	for (uint64_t g = 0; g < img.sb.fields.group_count; g++) {
+		BlockGroup const & bg = img.sb.groups[g];
+		uint64_t end = bg.start_block + bg.total_blocks, run = 0;
+
+		for (uint64_t b = bg.first_datablock; b <= end; b++) {
+			if (b < end && !is_used(img, b)) {
+				run++;
+				continue;
+			}
+
+			if (run >= HOLE_MIN_BLOCKS) {
+				if (fallocate(img.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+							(b - run) * HUSHFS_BLOCK_SIZE, run * HUSHFS_BLOCK_SIZE) == 0)
+					punched += run;
+			}
+			run = 0;
+		}
+	}
+#endif
+
+	logger.info("Punched %1 free blocks out of the backing file", punched);
+}
+
+static void print_stats(char const *when, Stats const & s)
+{
+	std::cout << when << ": " << s.files << " files, " << s.fragmented << " fragmented, "
+		<< s.extents << " extents over " << s.blocks << " blocks, "
+		<< s.free_runs << " free space fragments, last used block " << s.last_used;
+	if (s.pinned)
+		std::cout << ", " << s.pinned << " files with shared blocks left in place";
+	std::cout << std::endl;
+}
+
+static void usage()
+{
+	std::cerr << "Usage " << prgname << " [-n] [-u unlockfile] secret.img" << std::endl;
+}
+
+int hush_defrag(struct optparse *opts)
+{
+	int opt, ret = 0, fd;
+	bool dry_run = false;
+	uint64_t moved = 0, dest;
+	std::string filename, unlockpath;
+	std::vector<FileInfo> files;
+	std::unique_ptr<hush::crypto::SecretKey> volume_key;
+	std::unique_ptr<hush::crypto::Symmetric> symmetric;
+	std::unique_ptr<hush::crypto::KeyRing> keyring;
+	std::unique_ptr<hush::utils::WorkPool> pool;
+	std::unique_ptr<hush::fs::MerkleTree> tree;
+	std::unique_ptr<hush::fs::BlockIO> io;
+	Stats before, after;
+	Image img;
+	char *tmp;
+
+	while ((opt = optparse(opts, "nu:h")) != -1) {
+		switch (opt) {
+			case 'u':
+				unlockpath = opts->optarg;
+				break;
+			case 'n':
+				dry_run = true;
+				break;
+			case 'h':
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if ((tmp = optparse_arg(opts)) != nullptr)
+		filename = tmp;
+
+	if (filename.empty()) {
+		usage();
+		return 1;
+	}
+
+	if ((fd = open(filename.c_str(), dry_run ? O_RDONLY : O_RDWR)) == -1) {
+		std::cerr << "Error opening file " << filename << std::endl;
+		return 1;
+	}
+
+	if (flock(fd, LOCK_EX) != 0) {
+		std::cerr << "Error obtaining exclusive lock on file " << filename << std::endl;
+		close(fd);
+		return 1;
+	}
+
+	// a mount would write its own bitmaps and superblock back over ours
+	if (!dry_run && !hush::fs::claim_image(fd)) {
+		std::cerr << filename << " is mounted, unmount it before defragmenting" << std::endl;
+		flock(fd, LOCK_UN);
+		close(fd);
+		return 1;
+	}
+
+	try {
+		load(fd, img);
+
+		if (!dry_run && has_sealed_blocks(img)) {
+			std::vector<hush::fs::KeySlot> slots;
+			hush::utils::Password secret;
+
+			hush::fs::load_key_slots(fd, slots);
+			if (unlockpath.empty())
+				secret.ask("Passphrase: ", false, true);
+			else
+				secret.read(unlockpath);
+
+			volume_key.reset(new hush::crypto::SecretKey());
+			if (hush::crypto::unlock_key_slots(slots, secret.get(), *volume_key) == -1)
+				throw std::string("No key slot opens with that passphrase");
+
+			symmetric.reset(new hush::crypto::Symmetric(
+						(hush::crypto::CipherSuite)img.sb.fields.cipher));
+			keyring.reset(new hush::crypto::KeyRing(*volume_key));
+			pool.reset(new hush::utils::WorkPool());
+			tree.reset(new hush::fs::MerkleTree(fd, img.sb,
+						[&img](hush::fs::MerkleTree::Roots const & roots) {
+							store_tree(img, roots);
+						}));
+			tree->open(*volume_key);
+			next_epoch(img);
+			io.reset(new hush::fs::BlockIO(fd, img.sb, *symmetric, *keyring, *pool,
+						[&img] { return next_epoch(img); }, tree.get()));
+			img.io = io.get();
+		}
+
+		files = survey(img, before);
+		print_stats("before", before);
+
+		if (!dry_run) {
+			for (int pass = 0; pass < MAX_PASSES; pass++) {
+				uint64_t before_pass = moved;
+
+				if (pass > 0)
+					files = survey(img, after);
+
+				// the files furthest from the front go first, so they can fill the gaps
+				std::sort(files.begin(), files.end(), [](FileInfo const & a, FileInfo const & b) {
+					return a.last > b.last;
+				});
+
+				for (FileInfo const & f : files) {
+					if (!find_run(img, f.nblocks, dest))
+						continue;
+					if (f.extents == 1 && dest >= f.first)
+						continue;
+
+					move_file(img, f.i_no, dest);
+					moved++;
+				}
+
+				if (moved == before_pass)
+					break;
+			}
+
+			release_space(img);
+			if (tree)
+				tree->flush();
+			logger.info("Made %1 file moves", moved);
+
+			survey(img, after);
+			print_stats("after", after);
+		}
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		ret = 1;
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+		ret = 1;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return ret;
+}
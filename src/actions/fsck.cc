@@ -0,0 +1,456 @@
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "fsck.hh"
+#include "utils/optparse.h"
+#include "utils/log.hh"
+#include "utils/tools.hh"
+#include "utils/layout.hh"
+#include "utils/image.hh"
+#include "utils/bitmap.hh"
+#include "utils/blockmap.hh"
+#include "utils/dedup.hh"
+#include "fs.hh"
+
+using LogString = slog::LogString;
+using hush::fs::BlockGroup;
+using hush::fs::Inode;
+using hush::fs::InodeTableBlock;
+using hush::fs::Superblock;
+using hush::utils::AtomicBitmap;
+
+// inode table blocks handed to a worker at a time
+#define CHUNK_BLOCKS 256
+#define MAX_REPORTED 100
+
+using Chunk = struct {
+	uint64_t group;
+	uint64_t first_block;
+	uint64_t nblocks;
+};
+
+/*
+ * Everything the workers share. The on-disk bitmaps are only ever read while
+ * the workers run; what the workers learn goes into `seen_blocks` and
+ * `used_inodes`, which are lock-free, and into `problems`, which isn't but is
+ * only touched when something is wrong.
+ */
+using Check = struct __check {
+	std::string filename;
+	Superblock sb;
+	std::vector<std::vector<uint8_t>> inode_maps;
+	std::vector<std::vector<uint8_t>> block_maps;
+	std::vector<Chunk> chunks;
+	std::atomic<uint64_t> next_chunk;
+	std::unique_ptr<AtomicBitmap> seen_blocks;
+	std::unique_ptr<AtomicBitmap> used_inodes;
+	// blocks in the dedup index, and how many pointers to each we found, by slot
+	std::unordered_map<uint64_t, hush::fs::DedupRef> shared;
+	std::unique_ptr<std::atomic<uint32_t>[]> claims;
+	std::mutex lock;
+	std::vector<std::string> problems;
+	// found something rebuilding the bitmaps can't fix
+	bool damaged = false;
+};
+
+static void usage();
+static void load(int, Check &);
+static void scan(Check &, unsigned);
+static void worker(Check &);
+static void check_inode(int, Check &, uint64_t, uint64_t, Inode const &);
+static bool reconcile(int, Check &, bool);
+static bool check_dedup(int, Check &, bool);
+static void report(Check &, LogString const &, bool fixable=true);
+
+static slog::Log logger(slog::LogLevel::INFO);
+
+extern std::string prgname;
+
+static void report(Check & c, LogString const & ls, bool fixable)
+{
+	std::lock_guard<std::mutex> guard(c.lock);
+
+	c.problems.push_back(ls.str());
+	if (!fixable)
+		c.damaged = true;
+}
+
+static void load(int fd, Check & c)
+{
+	hush::fs::load_superblock(fd, c.sb);
+
+	for (uint64_t g = 0; g < c.sb.fields.group_count; g++) {
+		BlockGroup const & bg = c.sb.groups[g];
+		std::vector<uint8_t> imap, bmap;
+
+		hush::fs::load_group_maps(fd, bg, imap, bmap);
+		c.inode_maps.push_back(std::move(imap));
+		c.block_maps.push_back(std::move(bmap));
+
+		for (uint64_t b = 0; b < bg.inode_table_blocks; b += CHUNK_BLOCKS) {
+			uint64_t n = bg.inode_table_blocks - b;
+			c.chunks.push_back({ g, bg.inode_table_offset + b, n < CHUNK_BLOCKS ? n : CHUNK_BLOCKS });
+		}
+	}
+
+	c.seen_blocks.reset(new AtomicBitmap(c.sb.fields.total_blocks));
+	c.used_inodes.reset(new AtomicBitmap(c.sb.fields.total_inodes));
+	c.next_chunk = 0;
+
+	if (c.sb.fields.flags & HUSHFS_FLAG_DEDUP) {
+		uint64_t slots = c.sb.fields.dedup_index_blocks * HUSHFS_DEDUP_PER_BLOCK;
+
+		c.shared = hush::fs::load_dedup_refs(fd, c.sb);
+		c.claims.reset(new std::atomic<uint32_t>[slots]);
+		for (uint64_t i = 0; i < slots; i++)
+			c.claims[i] = 0;
+	}
+}
+
+static void check_inode(int fd, Check & c, uint64_t group, uint64_t idx, Inode const & inode)
+{
+	BlockGroup const & bg = c.sb.groups[group];
+	uint64_t i_no = bg.first_inode + idx + 1;
+	bool in_use = inode.fields.inode_number != 0;
+	bool marked = hush::fs::test_bit(c.inode_maps[group].data(), idx);
+
+	if (in_use != marked)
+		report(c, LogString("Inode %1 is %2 but %3 in the inode bitmap", i_no,
+					in_use ? "in use" : "empty", marked ? "used" : "free"));
+
+	if (!in_use)
+		return;
+
+	c.used_inodes->test_and_set(i_no - 1);
+
+	if (inode.fields.inode_number != i_no)
+		report(c, LogString("Inode %1 claims to be inode %2", i_no, inode.fields.inode_number), false);
+
+	hush::fs::walk_block_map(fd, inode.fields,
+			[&](uint64_t logical, uint64_t block, bool indirect) -> bool {
+		int g = hush::fs::group_of_block(c.sb, block);
+
+		if (g == -1 || block < c.sb.groups[g].first_datablock) {
+			report(c, LogString("Inode %1 block %2 points at %3 which is not a data block",
+						i_no, logical, block), false);
+			return false;
+		}
+
+		auto shared = indirect ? c.shared.end() : c.shared.find(block);
+
+		if (shared != c.shared.end()) {
+			// deduplicated, check_dedup compares the count with the index
+			c.claims[shared->second.slot]++;
+			c.seen_blocks->test_and_set(block);
+		} else if (c.seen_blocks->test_and_set(block)) {
+			report(c, LogString("Block %1 is claimed by more than one file (again by inode %2)",
+						block, i_no), false);
+			return false;
+		}
+
+		if (!hush::fs::test_bit(c.block_maps[g].data(), block - c.sb.groups[g].start_block))
+			report(c, LogString("Block %1 is used by inode %2 but free in the block bitmap",
+						block, i_no));
+		return true;
+	});
+}
+
+static void worker(Check & c)
+{
+	uint64_t ipb = HUSHFS_BLOCK_SIZE / sizeof(Inode);
+	std::vector<InodeTableBlock> table(CHUNK_BLOCKS);
+	uint64_t idx;
+	int fd;
+
+	// our own fd, so reads on other threads can't move our file offset
+	if ((fd = open(c.filename.c_str(), O_RDONLY)) == -1) {
+		report(c, LogString("Worker couldn't open %1", c.filename), false);
+		return;
+	}
+
+	while ((idx = c.next_chunk.fetch_add(1)) < c.chunks.size()) {
+		Chunk const & chunk = c.chunks[idx];
+		BlockGroup const & bg = c.sb.groups[chunk.group];
+		uint64_t base = (chunk.first_block - bg.inode_table_offset) * ipb;
+
+		try {
+			read_data(fd, table.data(), chunk.first_block * HUSHFS_BLOCK_SIZE,
+					chunk.nblocks * HUSHFS_BLOCK_SIZE);
+
+			for (uint64_t b = 0; b < chunk.nblocks; b++) {
+				for (uint64_t i = 0; i < ipb; i++) {
+					uint64_t n = base + (b * ipb) + i;
+					if (n >= bg.total_inodes)
+						break;
+					check_inode(fd, c, chunk.group, n, table[b].inodes[i]);
+				}
+			}
+		} catch (std::string const & e) {
+			report(c, LogString("Error scanning inode table blocks %1-%2: %3",
+						chunk.first_block, chunk.first_block + chunk.nblocks - 1, e), false);
+		}
+	}
+
+	close(fd);
+}
+
+static void scan(Check & c, unsigned nthreads)
+{
+	std::vector<std::thread> threads;
+
+	for (unsigned i = 0; i < nthreads; i++)
+		threads.emplace_back(worker, std::ref(c));
+
+	for (auto & t : threads)
+		t.join();
+}
+
+/*
+ * Every block in the dedup index should be pointed at exactly as many times
+ * as its refcount says. A crash can leave counts too high, never too low,
+ * but either way the pointers we found are the truth: repairing writes those
+ * counts back, and gives up the slots of blocks nothing points at any more
+ * so reconcile can free them. Returns true if the index is now consistent.
+ */
+static bool check_dedup(int fd, Check & c, bool repair)
+{
+	uint64_t wrong = 0;
+
+	if (!(c.sb.fields.flags & HUSHFS_FLAG_DEDUP))
+		return true;
+
+	for (auto const & s : c.shared) {
+		uint32_t found = c.claims[s.second.slot];
+		hush::fs::DedupEntry e;
+
+		if (found == s.second.refs)
+			continue;
+
+		if (wrong++ < MAX_REPORTED)
+			report(c, LogString("Block %1 is shared %2 times but the dedup index counts %3",
+						s.first, found, s.second.refs));
+
+		if (repair) {
+			hush::fs::read_dedup_entry(fd, c.sb, s.second.slot, e);
+			e.refs = found;
+			if (found == 0)
+				e.block = HUSHFS_DEDUP_DELETED;
+			hush::fs::write_dedup_entry(fd, c.sb, s.second.slot, e);
+		}
+	}
+
+	if (c.sb.fields.flags & HUSHFS_FLAG_DEDUP_DIRTY) {
+		report(c, LogString("The dedup index wasn't closed cleanly"));
+		if (repair) {
+			fsync(fd);
+			c.sb.fields.flags &= ~HUSHFS_FLAG_DEDUP_DIRTY;
+			write_block(fd, &c.sb, 0);
+		}
+		wrong++;
+	}
+
+	if (repair && wrong)
+		fsync(fd);
+
+	return wrong == 0 || repair;
+}
+
+/*
+ * With the scan done we know exactly which blocks and inodes are in use, so
+ * compare that against the bitmaps and free counts and, if asked, write the
+ * right answer back. Returns true if everything on disk is now consistent.
+ */
+static bool reconcile(int fd, Check & c, bool repair)
+{
+	uint64_t free_blocks = 0, free_inodes = 0;
+	bool clean = true, dirty_sb = false;
+
+	for (uint64_t g = 0; g < c.sb.fields.group_count; g++) {
+		BlockGroup & bg = c.sb.groups[g];
+		uint64_t meta = hush::fs::group_metadata_blocks(bg);
+		std::vector<uint8_t> bmap(c.block_maps[g].size()), imap(c.inode_maps[g].size());
+		uint64_t used_blocks = meta, used_inodes = 0, leaked = 0;
+
+		hush::fs::mark_bits(bmap.data(), 0, meta);
+		for (uint64_t b = meta; b < bg.total_blocks; b++) {
+			bool used = c.seen_blocks->test(bg.start_block + b);
+			bool marked = hush::fs::test_bit(c.block_maps[g].data(), b);
+
+			if (used) {
+				hush::fs::mark_bits(bmap.data(), b, 1);
+				used_blocks++;
+			} else if (marked) {
+				leaked++;
+			}
+		}
+
+		for (uint64_t i = 0; i < bg.total_inodes; i++) {
+			if (c.used_inodes->test(bg.first_inode + i)) {
+				hush::fs::mark_bits(imap.data(), i, 1);
+				used_inodes++;
+			}
+		}
+
+		if (leaked)
+			report(c, LogString("Group %1: %2 blocks are marked used but nothing references them",
+						g, leaked));
+
+		for (uint64_t b = 0; b < meta; b++) {
+			if (!hush::fs::test_bit(c.block_maps[g].data(), b)) {
+				report(c, LogString("Group %1: metadata block %2 is free in the block bitmap",
+							g, bg.start_block + b));
+				break;
+			}
+		}
+
+		if (bg.free_blocks != bg.total_blocks - used_blocks) {
+			report(c, LogString("Group %1: free block count is %2, should be %3", g,
+						bg.free_blocks, bg.total_blocks - used_blocks));
+			bg.free_blocks = bg.total_blocks - used_blocks;
+			dirty_sb = true;
+		}
+
+		if (bg.free_inodes != bg.total_inodes - used_inodes) {
+			report(c, LogString("Group %1: free inode count is %2, should be %3", g,
+						bg.free_inodes, bg.total_inodes - used_inodes));
+			bg.free_inodes = bg.total_inodes - used_inodes;
+			dirty_sb = true;
+		}
+
+		free_blocks += bg.free_blocks;
+		free_inodes += bg.free_inodes;
+
+		if (bmap != c.block_maps[g]) {
+			clean = false;
+			if (repair)
+				write_data(fd, bmap.data(), bg.block_bitmap_offset * HUSHFS_BLOCK_SIZE, bmap.size());
+		}
+
+		if (imap != c.inode_maps[g]) {
+			clean = false;
+			if (repair)
+				write_data(fd, imap.data(), bg.inode_bitmap_offset * HUSHFS_BLOCK_SIZE, imap.size());
+		}
+	}
+
+	if (c.sb.fields.free_blocks != free_blocks || c.sb.fields.free_inodes != free_inodes) {
+		report(c, LogString("Superblock free counts are %1 blocks / %2 inodes, should be %3 / %4",
+					c.sb.fields.free_blocks, c.sb.fields.free_inodes, free_blocks, free_inodes));
+		c.sb.fields.free_blocks = free_blocks;
+		c.sb.fields.free_inodes = free_inodes;
+		dirty_sb = true;
+	}
+
+	if (dirty_sb) {
+		clean = false;
+		if (repair) {
+			// group 0 is also described by the top level fields
+			write_block(fd, &c.sb, 0);
+		}
+	}
+
+	if (repair && !clean)
+		fsync(fd);
+
+	return clean || repair;
+}
+
+static void usage()
+{
+	std::cerr << "Usage " << prgname << " [-y] [-j threads] secret.img" << std::endl;
+}
+
+int hush_fsck(struct optparse *opts)
+{
+	int opt, ret = 0, fd;
+	unsigned nthreads = std::thread::hardware_concurrency();
+	bool repair = false, ok;
+	Check c;
+	char *tmp;
+
+	while ((opt = optparse(opts, "yj:h")) != -1) {
+		switch (opt) {
+			case 'y':
+				repair = true;
+				break;
+			case 'j':
+				nthreads = std::strtoul(opts->optarg, nullptr, 10);
+				break;
+			case 'h':
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if ((tmp = optparse_arg(opts)) != nullptr)
+		c.filename = tmp;
+
+	if (c.filename.empty()) {
+		usage();
+		return 1;
+	}
+
+	if (nthreads == 0)
+		nthreads = 1;
+
+	if ((fd = open(c.filename.c_str(), repair ? O_RDWR : O_RDONLY)) == -1) {
+		std::cerr << "Error opening file " << c.filename << std::endl;
+		return 1;
+	}
+
+	if (flock(fd, LOCK_EX) != 0) {
+		std::cerr << "Error obtaining exclusive lock on file " << c.filename << std::endl;
+		close(fd);
+		return 1;
+	}
+
+	// a mount allocates from its own copies of the bitmaps and counts, and writes them back
+	if (repair && !hush::fs::claim_image(fd)) {
+		std::cerr << c.filename << " is mounted, unmount it before repairing" << std::endl;
+		flock(fd, LOCK_UN);
+		close(fd);
+		return 1;
+	}
+
+	try {
+		load(fd, c);
+		logger.info("Checking %1 inodes in %2 groups with %3 threads",
+				c.sb.fields.total_inodes, c.sb.fields.group_count, nthreads);
+		scan(c, nthreads);
+		ok = check_dedup(fd, c, repair);
+		ok = reconcile(fd, c, repair) && ok;
+
+		for (uint64_t i = 0; i < c.problems.size() && i < MAX_REPORTED; i++)
+			std::cout << c.problems[i] << std::endl;
+		if (c.problems.size() > MAX_REPORTED)
+			std::cout << "... and " << c.problems.size() - MAX_REPORTED << " more" << std::endl;
+
+		if (c.problems.empty())
+			std::cout << c.filename << ": clean" << std::endl;
+		else if (repair)
+			std::cout << c.filename << ": bitmaps and free counts repaired" << std::endl;
+
+		ret = (ok && !c.damaged) ? 0 : 1;
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		ret = 1;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return ret;
+}
@@ -12,9 +12,8 @@
 #include "utils/password.hh"
 #include "utils/b64.hh"
 #include "utils/tools.hh"
-#include "crypto/secretkey.hh"
-#include "crypto/symmetric.hh"
-#include "crypto/ciphertext.hh"
+#include "crypto/kdf.hh"
+#include "crypto/keyfile.hh"
 
 #define PKLEN crypto_box_PUBLICKEYBYTES
 #define SKLEN crypto_box_SECRETKEYBYTES
@@ -24,7 +23,9 @@ static void usage();
 
 static void usage()
 {
-	std::cerr << "Usage " << prgname << " -p .path/to/privkey" << std::endl;
+	std::cerr << "Usage " << prgname << " [-c ms] -p .path/to/privkey" << std::endl
+		<< "'-c ms', '--calibrate ms'  tune the passphrase hash to take about ms to unlock"
+		<< std::endl;
 }
 
 
@@ -33,21 +34,28 @@ int hush_keygen(struct optparse *opts)
 	int opt, ret = 0;
 	unsigned char *pubkey = NULL;
 	unsigned char *privkey = NULL;
+	unsigned calibrate_ms = 0, took_ms;
 	size_t idx;
 	std::string pubpath, privpath(DEFAULT_KEYPATH), pem;
 	hush::utils::Password password;
-	hush::crypto::SecretKey secretkey;
-	hush::crypto::CipherText ciphertext;
-	hush::crypto::Symmetric symmetric;
-	hush::secure::vector<unsigned char> message;
+	hush::crypto::KdfParams kdf;
 	std::vector<unsigned char> s_message;
 	hush::utils::B64<std::vector<unsigned char>, std::string> b64;
-
-	while ((opt = optparse(opts, "p:h")) != -1) {
+	struct optparse_long longopts[] = {
+		{ "path",      'p', OPTPARSE_REQUIRED },
+		{ "calibrate", 'c', OPTPARSE_REQUIRED },
+		{ "help",      'h', OPTPARSE_NONE },
+		{ 0 },
+	};
+
+	while ((opt = optparse_long(opts, longopts, nullptr)) != -1) {
 		switch (opt) {
 			case 'p':
 				privpath = opts->optarg;
 				break;
+			case 'c':
+				calibrate_ms = strtoul(opts->optarg, nullptr, 10);
+				break;
 			case 'h':
 			default:
 				usage();
@@ -68,9 +76,14 @@ int hush_keygen(struct optparse *opts)
 		return 1;
 	}
 
+	if (calibrate_ms > 0) {
+		printf("Calibrating passphrase hashing for %ums\n", calibrate_ms);
+		kdf = hush::crypto::calibrate_kdf(calibrate_ms, took_ms);
+		printf("Using opslimit %llu, memlimit %zu (%ums)\n", kdf.opslimit, kdf.memlimit,
+				took_ms);
+	}
+
 	password.ask("Password: ", true, true);
-	secretkey.set_salt();
-	secretkey.generate_key(password.get());
 
 	pubkey = (unsigned char *)sodium_malloc(PKLEN);
 	privkey = (unsigned char *)sodium_malloc(SKLEN);
@@ -78,10 +91,7 @@ int hush_keygen(struct optparse *opts)
 	printf("Generating Key Pair\n");
 	crypto_box_keypair(pubkey, privkey);
 
-	message.clear();
-	message.assign(privkey, privkey+SKLEN);
-	symmetric.encipher(ciphertext, secretkey, message);
-	pem = b64.pemify(b64.encode(ciphertext), "PRIVATE");
+	pem = hush::crypto::seal_private_key(privkey, SKLEN, password.get(), kdf);
 
 	create_and_write(privpath, pem.data(), pem.size(), 0600);
 
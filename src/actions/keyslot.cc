@@ -0,0 +1,207 @@
+#include <algorithm> // find_if, count_if
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <sodium.h>
+
+#include "keyslot.hh"
+#include "utils/optparse.h"
+#include "utils/log.hh"
+#include "utils/image.hh"
+#include "utils/password.hh"
+#include "crypto/keyslots.hh"
+#include "fs.hh"
+
+using hush::fs::KeySlot;
+using hush::fs::Superblock;
+
+static void usage();
+static void list(std::vector<KeySlot> const &);
+static int unlock(std::vector<KeySlot> const &, std::string const &, hush::crypto::SecretKey &);
+
+static slog::Log logger(slog::LogLevel::INFO);
+
+extern std::string prgname;
+
+static void list(std::vector<KeySlot> const & slots)
+{
+	for (unsigned i = 0; i < slots.size(); i++) {
+		std::cout << "slot " << i << ": ";
+		if (slots[i].active)
+			std::cout << "active, opslimit " << slots[i].opslimit <<
+				", memlimit " << slots[i].memlimit << std::endl;
+		else
+			std::cout << "empty" << std::endl;
+	}
+}
+
+static int unlock(std::vector<KeySlot> const & slots, std::string const & keypath,
+		hush::crypto::SecretKey & volume_key)
+{
+	hush::utils::Password secret;
+
+	if (keypath.empty())
+		secret.ask("Existing passphrase: ", false, true);
+	else
+		secret.read(keypath);
+
+	return hush::crypto::unlock_key_slots(slots, secret.get(), volume_key);
+}
+
+static void usage()
+{
+	std::cerr << "Usage " << prgname << " [-l] [-a] [-r N] [-u .path/to/keyfile] "
+		"[-k .path/to/new/keyfile] [-c ms] secret.img" << std::endl
+		<< "'-l'  list the key slots" << std::endl
+		<< "'-a'  add a passphrase, or the keyfile given with -k, to a free slot" << std::endl
+		<< "'-c ms'  tune the added slot's passphrase hash to take about ms to unlock" << std::endl
+		<< "'-r N'  empty slot N" << std::endl
+		<< "'-u'  unlock with a keyfile instead of asking for a passphrase" << std::endl
+		<< "Changing a passphrase is an add followed by a remove." << std::endl;
+}
+
+int hush_keyslot(struct optparse *opts)
+{
+	int opt, ret = 0, fd, opened, remove = -1;
+	long n;
+	unsigned long calibrate_ms = 0;
+	unsigned took_ms;
+	bool add = false, show = false;
+	std::string filename, keypath, unlockpath;
+	std::vector<KeySlot> slots;
+	hush::crypto::SecretKey volume_key;
+	hush::utils::Password secret;
+	hush::crypto::KdfParams kdf;
+	Superblock sb;
+	char *tmp;
+
+	while ((opt = optparse(opts, "lar:k:u:c:h")) != -1) {
+		switch (opt) {
+			case 'l':
+				show = true;
+				break;
+			case 'a':
+				add = true;
+				break;
+			case 'r':
+				n = strtol(opts->optarg, &tmp, 10);
+				if (tmp == opts->optarg || *tmp != '\0' || n < 0 || n >= HUSHFS_KEY_SLOTS) {
+					std::cerr << "There's no key slot " << opts->optarg << std::endl;
+					usage();
+					return 1;
+				}
+				remove = n;
+				break;
+			case 'k':
+				keypath = opts->optarg;
+				break;
+			case 'u':
+				unlockpath = opts->optarg;
+				break;
+			case 'c':
+				calibrate_ms = strtoul(opts->optarg, &tmp, 10);
+				if (tmp == opts->optarg || *tmp != '\0' || calibrate_ms == 0 ||
+						calibrate_ms > UINT32_MAX) {
+					std::cerr << "Not a time in ms: " << opts->optarg << std::endl;
+					usage();
+					return 1;
+				}
+				break;
+			case 'h':
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if ((tmp = optparse_arg(opts)) != nullptr)
+		filename = tmp;
+
+	if (filename.empty() || (!show && !add && remove == -1)) {
+		usage();
+		return 1;
+	}
+
+	if ((fd = open(filename.c_str(), show ? O_RDONLY : O_RDWR)) == -1) {
+		std::cerr << "Error opening file " << filename << std::endl;
+		return 1;
+	}
+
+	// slots aren't in the superblock, so a mounted hush never writes over them
+	if (flock(fd, show ? LOCK_SH : LOCK_EX) != 0) {
+		std::cerr << "Error obtaining lock on file " << filename << std::endl;
+		close(fd);
+		return 1;
+	}
+
+	try {
+		hush::fs::load_superblock(fd, sb);
+		if (!(sb.fields.flags & HUSHFS_FLAG_KEY_SLOTS))
+			throw std::string("This image predates key slots");
+
+		hush::fs::load_key_slots(fd, slots);
+
+		if (show)
+			list(slots);
+
+		if (add || remove != -1) {
+			if ((opened = unlock(slots, unlockpath, volume_key)) == -1)
+				throw std::string("No key slot opens with that passphrase");
+			logger.info("Unlocked with slot %1", opened);
+		}
+
+		if (add) {
+			auto it = std::find_if(slots.begin(), slots.end(),
+					[](KeySlot const & s) { return !s.active; });
+
+			if (it == slots.end())
+				throw std::string("All key slots are in use");
+
+			if (keypath.empty())
+				secret.ask("New passphrase: ", true, true);
+			else
+				secret.read(keypath);
+
+			if (calibrate_ms > 0) {
+				std::cout << "Calibrating passphrase hashing for " << calibrate_ms <<
+					"ms" << std::endl;
+				kdf = hush::crypto::calibrate_kdf(calibrate_ms, took_ms);
+				std::cout << "Using opslimit " << kdf.opslimit << ", memlimit " <<
+					kdf.memlimit << " (" << took_ms << "ms)" << std::endl;
+			}
+
+			hush::crypto::seal_key_slot(*it, volume_key, secret.get(), kdf);
+			hush::fs::store_key_slot(fd, it - slots.begin(), *it);
+			std::cout << "Added key slot " << (it - slots.begin()) << std::endl;
+		}
+
+		if (remove != -1) {
+			if (std::count_if(slots.begin(), slots.end(),
+						[](KeySlot const & s) { return s.active; }) < 2 ||
+					!slots[remove].active)
+				throw std::string("Refusing to remove the last, or an empty, key slot");
+
+			sodium_memzero(&slots[remove], sizeof slots[remove]);
+			hush::fs::store_key_slot(fd, remove, slots[remove]);
+			std::cout << "Removed key slot " << remove << std::endl;
+		}
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		ret = 1;
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+		ret = 1;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return ret;
+}
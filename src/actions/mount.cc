@@ -15,22 +15,82 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <atomic>
+#include <future>
+#include <memory>
 
 #include "utils/optparse.h"
+#include "utils/mountinfo.hh"
+#include "crypto/symmetric.hh"
+#include "crypto/keyslots.hh"
+#include "crypto/keycache.hh"
+#include "utils/image.hh"
+#include "utils/password.hh"
+#include "utils/blockio.hh"
+#include "utils/rekey.hh"
+#include "utils/dedup.hh"
+#include "utils/prealloc.hh"
+#include "utils/uring.hh"
+#include "utils/direct.hh"
+#include "config.h"
 #include "mount.hh"
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
+// inode table blocks of each group to have the kernel read ahead at mount
+#define PREFETCH_INODE_BLOCKS 64
 
 extern std::string prgname;
 
 static char const *hello_str = "Hello World!\n";
 static char const *hello_name = "hello";
 static bool __debug = false;
+static int image_fd = -1;
+static std::unique_ptr<hush::crypto::Symmetric> symmetric;
+static std::unique_ptr<hush::utils::WorkPool> crypto_pool;
+static uint64_t mount_epoch;
+static std::unique_ptr<hush::crypto::SecretKey> volume_key;
+static std::unique_ptr<hush::crypto::KeyRing> keyring;
+static std::unique_ptr<hush::fs::MerkleTree> tag_tree;
+static std::unique_ptr<hush::fs::BlockIO> blockio;
+static std::unique_ptr<hush::fs::Rekeyer> rekeyer;
+static std::unique_ptr<hush::fs::Dedup> dedup;
+
+using hush::fs::MountInfo;
 
 static void usage(void)
 {
 	std::cout << "Usage: " << prgname << " [opts] /home/user/hush.img "
-	<< "/mount/point" << std::endl << "'-h'  help" << std::endl;
+	<< "/mount/point" << std::endl << "'-h'  help" << std::endl
+	<< "'-j N'  use N crypto threads (default: one per core, less one)" << std::endl
+	<< "'-u path'  unlock with a keyfile instead of asking for a passphrase" << std::endl
+	<< "'-R'  rotate the data key, resealing every block in the background" << std::endl
+	<< "'-B N'  reseal at most N blocks per second (default: no limit)" << std::endl
+	<< "'-C N'  keep the resealing thread to N% of a core (default: 100)" << std::endl
+	<< "'-K N'  keep the unlocked key in the session keyring for N seconds" << std::endl
+	<< "'-U'  with -K, use the user keyring, which outlives the session" << std::endl
+	<< "'-F'  forget any cached key and ask for the passphrase" << std::endl
+#ifdef __linux__
+	<< "'-I'  do image I/O through an io_uring" << std::endl
+#endif
+	<< "'-O'  open the image O_DIRECT, leaving caching to hush" << std::endl
+	<< "'-T'  after a crash, rebuild the tag tree from the tag tables as they are" << std::endl;
+}
+
+/*
+ * Ask for the start of every inode table while the key is still being
+ * derived, so the first lookups find it in the page cache.
+ */
+static void prefetch_inodes(int fd, Superblock const & sb)
+{
+#ifdef POSIX_FADV_WILLNEED
+	for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+		hush::fs::BlockGroup const & bg = sb.groups[g];
+		uint64_t blocks = min(bg.inode_table_blocks, (uint64_t)PREFETCH_INODE_BLOCKS);
+
+		posix_fadvise(fd, bg.inode_table_offset * HUSHFS_BLOCK_SIZE,
+				blocks * HUSHFS_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+	}
+#endif
 }
 
 static int hush_stat(fuse_ino_t ino, struct stat *stbuf)
@@ -157,6 +217,57 @@ static void hush_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	reply_buf_limited(req, hello_str, strlen(hello_str), off, size);
 }
 
+static void hush_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	if (__debug)
+		std::cerr << "hush_statfs(req=x, ino=" << ino << ")" << std::endl;
+
+	MountInfo & mi = MountInfo::get_instance(image_fd);
+
+	// cheap enough to do here, and it makes `df` notice an online resize
+	try {
+		mi.refresh();
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+	}
+
+	Superblock const & sb = mi.get_superblock();
+
+	memset(&st, 0, sizeof(st));
+	st.f_bsize   = HUSHFS_BLOCK_SIZE;
+	st.f_frsize  = HUSHFS_BLOCK_SIZE;
+	st.f_blocks  = sb.fields.total_blocks;
+	st.f_bfree   = sb.fields.free_blocks;
+	st.f_bavail  = sb.fields.free_blocks;
+	st.f_files   = sb.fields.total_inodes;
+	st.f_ffree   = sb.fields.free_inodes;
+	st.f_favail  = sb.fields.free_inodes;
+	st.f_namemax = HUSHFS_FILENAME_MAXLEN;
+
+	fuse_reply_statfs(req, &st);
+}
+
+static void hush_destroy(void *userdata)
+{
+	if (__debug)
+		std::cerr << "hush_destroy(userdata=" << userdata << ")" << std::endl;
+
+	// allocations only update the superblock in memory until now
+	try {
+		if (rekeyer)
+			rekeyer->stop();
+		if (dedup)
+			dedup->close();
+		if (tag_tree)
+			tag_tree->flush();
+		MountInfo::get_instance(image_fd).sync();
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+	}
+}
+
 // XXX
 static void hush_create(fuse_req_t req, fuse_ino_t parent, char const *name, mode_t mode, struct fuse_file_info *fi)
 {
@@ -166,27 +277,166 @@ static void hush_create(fuse_req_t req, fuse_ino_t parent, char const *name, mod
 			std::endl;
 }
 
+#if FUSE_VERSION >= 29
+/*
+ * Plain preallocation only; punching holes and zeroing ranges wait on a
+ * write path. The range reads back as zeros until it's written.
+ */
+static void hush_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+		off_t length, struct fuse_file_info *fi)
+{
+	MountInfo & mi = MountInfo::get_instance(image_fd);
+	hush::fs::Inode inode;
+
+	(void) fi;
+	if (__debug)
+		std::cerr << "hush_fallocate(req=x, ino=" << ino << ", mode=" << mode << ", offset=" <<
+			offset << ", length=" << length << ")" << std::endl;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if (offset < 0 || length <= 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	// without a key there's nothing to seal blocks with, nor to mark them unwritten
+	if (!blockio) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	try {
+		if (!mi.inode_in_use(ino)) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		hush::fs::load_inode(image_fd, mi.get_superblock(), ino, inode);
+		if (inode.fields.inode_number != ino) {
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+		if (inode.fields.type != hush::fs::FileType::File) {
+			fuse_reply_err(req, EISDIR);
+			return;
+		}
+		fuse_reply_err(req, hush::fs::preallocate(image_fd, inode, offset, length,
+					mode & FALLOC_FL_KEEP_SIZE, mi, *blockio));
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		fuse_reply_err(req, EIO);
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+		fuse_reply_err(req, EIO);
+	}
+}
+#endif
+
 static struct fuse_lowlevel_ops hush_oper = {
+	.destroy = hush_destroy,
 	.lookup  = hush_lookup,
 	.getattr = hush_getattr,
 	.readdir = hush_readdir,
 	.open    = hush_open,
 	.read    = hush_read,
+	.statfs  = hush_statfs,
 	.create  = hush_create,
+#if FUSE_VERSION >= 29
+	.fallocate = hush_fallocate,
+#endif
 };
 
+/*
+ * Everything from the superblock on is read and written through the device
+ * attached here.
+ */
+static void attach_image_device(bool uring, bool direct)
+{
+	std::unique_ptr<hush::fs::BlockDevice> dev;
+
+#ifdef __linux__
+	if (uring) {
+		try {
+			dev.reset(new hush::fs::UringDevice(image_fd, HUSHFS_URING_ENTRIES));
+		} catch (std::runtime_error const & e) {
+			std::cerr << e.what() << ", using pread/pwrite" << std::endl;
+		}
+	}
+#endif
+
+	// the kernel caches nothing now, and takes nothing that isn't whole aligned blocks
+	if (direct) {
+		if (!dev)
+			dev.reset(new hush::fs::PosixDevice(image_fd));
+		dev.reset(new hush::fs::DirectDevice(dev.release(), HUSHFS_DIRECT_BOUNCE_BLOCKS,
+					HUSHFS_DIRECT_CACHE_BLOCKS));
+	}
+
+	if (dev)
+		hush::fs::attach_device(image_fd, dev.release());
+}
+
 int hush_mount(int main_argc, struct optparse *opts)
 {
 	struct fuse_chan *ch;
 	char *mountpoint, *tmp;
 	int err = -1, opt;
+	long n;
+	unsigned crypto_threads = 0;
+	bool rotate = false, forget = false, cached = false, uring = false, direct = false;
+	bool rebuild_tree = false;
+	unsigned cache_seconds = 0;
+	auto cache_scope = hush::crypto::KeyCacheScope::Session;
+	std::string cache_name;
+	hush::fs::RekeyBudget budget;
+	std::string unlockpath;
 	struct fuse_args args;
 	std::string disk_image;
 	std::vector<std::string> args_in;
 	std::vector<char*> args_out;
 
-	while ((opt = optparse(opts, "hd")) != -1) {
+	while ((opt = optparse(opts, "hdj:u:RB:C:K:UFIOT")) != -1) {
 		switch (opt) {
+			case 'u':
+				unlockpath = opts->optarg;
+				break;
+			case 'R':
+				rotate = true;
+				break;
+			case 'B':
+				budget.blocks_per_second = strtoull(opts->optarg, nullptr, 10);
+				break;
+			case 'C':
+				n = strtol(opts->optarg, &tmp, 10);
+				if (tmp == opts->optarg || *tmp != '\0' || n < 1 || n > 100) {
+					std::cerr << "-C takes a share of a core from 1 to 100" << std::endl;
+					usage();
+					return 1;
+				}
+				budget.cpu_percent = n;
+				break;
+			case 'K':
+				cache_seconds = strtoul(opts->optarg, nullptr, 10);
+				break;
+			case 'U':
+				cache_scope = hush::crypto::KeyCacheScope::User;
+				break;
+			case 'F':
+				forget = true;
+				break;
+			case 'I':
+				uring = true;
+				break;
+			case 'O':
+				direct = true;
+				break;
+			case 'T':
+				rebuild_tree = true;
+				break;
+			case 'j':
+				crypto_threads = strtoul(opts->optarg, nullptr, 10);
+				break;
 			case 'h':
 				usage();
 				return 0;
@@ -206,6 +456,152 @@ int hush_mount(int main_argc, struct optparse *opts)
 
 	disk_image = tmp;
 
+#ifdef O_DIRECT
+	if (direct && (image_fd = open(disk_image.c_str(), O_RDWR | O_DIRECT)) == -1 && errno == EINVAL) {
+		std::cerr << "The image's filesystem can't do O_DIRECT, using the page cache" << std::endl;
+		direct = false;
+	}
+#else
+	direct = false;
+#endif
+	if (!direct)
+		image_fd = open(disk_image.c_str(), O_RDWR);
+	if (image_fd == -1) {
+		std::cerr << "Error opening image " << disk_image << std::endl;
+		return 1;
+	}
+
+	// held until we exit, so defrag and fsck -y keep off the image meanwhile
+	if (!hush::fs::claim_image(image_fd)) {
+		std::cerr << "Image " << disk_image << " is already mounted, or being repaired or "
+			"defragmented" << std::endl;
+		close(image_fd);
+		return 1;
+	}
+
+	try {
+		attach_image_device(uring, direct);
+
+		hush::fs::Superblock sb;
+		std::vector<hush::fs::KeySlot> slots;
+		hush::utils::Password secret;
+		std::atomic<bool> key_ready(false);
+		// declared last, so an early throw waits out the KDF before the rest goes
+		std::future<int> unlocked;
+
+		/*
+		 * The pwhash behind a key slot takes hundreds of ms and no I/O, so
+		 * it runs on its own while we read and check everything else that
+		 * doesn't need the key.
+		 */
+		hush::fs::load_superblock(image_fd, sb);
+		if (sb.fields.flags & HUSHFS_FLAG_KEY_SLOTS) {
+			hush::fs::load_key_slots(image_fd, slots);
+			cache_name = hush::crypto::key_cache_name(slots);
+			volume_key.reset(new hush::crypto::SecretKey());
+
+			if (forget)
+				hush::crypto::forget_cached_key(cache_name);
+			else
+				cached = hush::crypto::find_cached_key(cache_name, *volume_key);
+
+			// anything running as us can put a key under that name
+			if (cached && !hush::crypto::key_fits_slots(slots, *volume_key)) {
+				std::cerr << "The cached key doesn't fit this image and was dropped" << std::endl;
+				hush::crypto::forget_cached_key(cache_name);
+				cached = false;
+			}
+
+			if (cached) {
+				key_ready = true;
+			} else {
+				if (unlockpath.empty())
+					secret.ask("Passphrase: ", false, true);
+				else
+					secret.read(unlockpath);
+
+				unlocked = std::async(std::launch::async, [&slots, &secret, &key_ready] {
+					int slot = hush::crypto::unlock_key_slots(slots, secret.get(), *volume_key);
+
+					key_ready = true;
+					return slot;
+				});
+			}
+		} else if (rotate) {
+			throw std::string("Only images with key slots have a data key to rotate");
+		}
+
+		MountInfo & mi = MountInfo::get_instance(image_fd);
+		auto suite = (hush::crypto::CipherSuite)mi.get_superblock().fields.cipher;
+
+		symmetric.reset(new hush::crypto::Symmetric(suite));
+		crypto_pool.reset(new hush::utils::WorkPool(crypto_threads));
+		mount_epoch = mi.next_epoch();
+		prefetch_inodes(image_fd, mi.get_superblock());
+
+		if (volume_key) {
+			tag_tree.reset(new hush::fs::MerkleTree(image_fd, mi.get_superblock(),
+						[](hush::fs::MerkleTree::Roots const & roots) {
+							MountInfo::get_instance(image_fd).store_tree(roots);
+						}));
+			tag_tree->preload(key_ready);
+
+			if (!cached && unlocked.get() == -1)
+				throw std::string("No key slot opens with that passphrase");
+
+			try {
+				tag_tree->open(*volume_key, rebuild_tree);
+			} catch (hush::fs::MerkleDirtyException const &) {
+				throw std::string("The tag tree wasn't closed cleanly, so a rollback since the "
+						"last clean unmount can't be ruled out. If the last mount crashed, mount "
+						"with -T to accept the image as it is");
+			}
+			if (cache_seconds > 0) {
+				// older slots have no check yet, without one the cached key would never be used
+				for (unsigned i = 0; i < slots.size() && !cached; i++) {
+					if (slots[i].active && sodium_is_zero(slots[i].key_check, sizeof slots[i].key_check)) {
+						hush::crypto::set_key_check(slots[i], *volume_key);
+						hush::fs::store_key_slot(image_fd, i, slots[i]);
+					}
+				}
+				hush::crypto::cache_key(cache_name, *volume_key, cache_seconds, cache_scope);
+			}
+
+			keyring.reset(new hush::crypto::KeyRing(*volume_key));
+			blockio.reset(new hush::fs::BlockIO(image_fd, mi.get_superblock(), *symmetric,
+						*keyring, *crypto_pool, [] {
+							return MountInfo::get_instance(image_fd).next_epoch();
+						}, tag_tree.get()));
+
+			if (mi.get_superblock().fields.flags & HUSHFS_FLAG_DEDUP) {
+				dedup.reset(new hush::fs::Dedup(image_fd, mi.get_superblock(), *blockio,
+							*volume_key, [] {
+								return MountInfo::get_instance(image_fd).allocate_block();
+							}, [](uint64_t block) {
+								MountInfo::get_instance(image_fd).free_block(block);
+							}, [](bool dirty) {
+								MountInfo::get_instance(image_fd).mark_dedup(dirty);
+							}));
+				dedup->open();
+			}
+
+			if (rotate)
+				mi.begin_rekey();
+			if (mi.get_superblock().fields.flags & HUSHFS_FLAG_REKEYING)
+				rekeyer.reset(new hush::fs::Rekeyer(mi, *blockio, *keyring, budget));
+		}
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		hush::fs::detach_device(image_fd);
+		close(image_fd);
+		return 1;
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+		hush::fs::detach_device(image_fd);
+		close(image_fd);
+		return 1;
+	}
+
 	/*
 	 * I really hate doing this, but fuse REALLY wants to parse the cmdline
 	 * args and prior to 3.0, which isn't installed or available most
@@ -232,6 +628,8 @@ int hush_mount(int main_argc, struct optparse *opts)
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1) {
 				fuse_session_add_chan(se, ch);
+				if (rekeyer)
+					rekeyer->start();
 
 				// main loop ?
 				err = fuse_session_loop(se);
@@ -248,5 +646,15 @@ int hush_mount(int main_argc, struct optparse *opts)
 	for (auto it = args_out.begin(); it != args_out.end(); it++)
 		free(*it);
 
+	rekeyer.reset();
+	dedup.reset();
+	blockio.reset();
+	tag_tree.reset();
+	keyring.reset();
+	crypto_pool.reset();
+	volume_key.reset();
+	hush::fs::detach_device(image_fd);
+	close(image_fd);
+
 	return err ? 1 : 0;
 }
@@ -0,0 +1,209 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "resize.hh"
+#include "utils/optparse.h"
+#include "utils/log.hh"
+#include "utils/tools.hh"
+#include "utils/layout.hh"
+#include "fs.hh"
+
+using LogString = slog::LogString;
+using hush::fs::BlockGroup;
+using hush::fs::Superblock;
+
+static void usage();
+static void grow(int, uint64_t);
+static void write_group_metadata(int, BlockGroup const &, off_t);
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+extern std::string prgname;
+
+/*
+ * Growing never moves existing data: the new space becomes a block group of
+ * its own with its bitmaps and inode table at the front. The backing file is
+ * extended with ftruncate, so the zeroed inode bitmap and inode table cost
+ * nothing until they're used, and the only blocks we actually write are the
+ * block bitmap blocks covering the new group's metadata. The group is
+ * published with a single superblock write, which a mounted hush picks up
+ * the next time it calls MountInfo::refresh(). A thin image is only extended
+ * far enough to hold the new group's metadata.
+ */
+static void grow(int fd, uint64_t new_size)
+{
+	Superblock sb;
+	struct stat st;
+	uint64_t start, num_blocks, file_size;
+	BlockGroup g;
+
+	read_block(fd, &sb, 0);
+
+	if (!hush::fs::is_valid_superblock(sb))
+		throw std::string("Not a hush image, or the superblock is damaged");
+
+	// the backing file has to be able to get that big
+	if (new_size > (uint64_t)std::numeric_limits<off_t>::max()) {
+		LogString ls("New size %1 is too large", new_size);
+		throw ls.str();
+	}
+
+	if (new_size <= sb.fields.disk_size) {
+		LogString ls("New size %1 is not larger than current size %2, shrinking is not supported",
+				new_size, sb.fields.disk_size);
+		throw ls.str();
+	}
+
+	if (sb.fields.group_count == HUSHFS_MAX_GROUPS) {
+		LogString ls("Image already has the maximum of %1 block groups", HUSHFS_MAX_GROUPS);
+		throw ls.str();
+	}
+
+	BlockGroup const & last = sb.groups[sb.fields.group_count - 1];
+	start = last.start_block + last.total_blocks;
+	num_blocks = (new_size / HUSHFS_BLOCK_SIZE) - start;
+
+	g = hush::fs::plan_group(start, num_blocks, sb.fields.total_inodes);
+
+	if (fstat(fd, &st) != 0)
+		throw std::string("Couldn't stat image");
+
+	file_size = (sb.fields.flags & HUSHFS_FLAG_THIN) ?
+		g.first_datablock * HUSHFS_BLOCK_SIZE : new_size;
+
+	if ((uint64_t)st.st_size < file_size && ftruncate(fd, file_size) != 0) {
+		LogString ls("Couldn't extend image to %1 bytes", file_size);
+		throw ls.str();
+	}
+
+	write_group_metadata(fd, g, st.st_size);
+
+	// the new group has to be on disk before the superblock points at it
+	fsync(fd);
+
+	sb.groups[sb.fields.group_count++] = g;
+	sb.fields.disk_size = new_size;
+	sb.fields.total_blocks += num_blocks;
+	sb.fields.total_inodes += g.total_inodes;
+	sb.fields.free_blocks += g.free_blocks;
+	sb.fields.free_inodes += g.free_inodes;
+
+	write_block(fd, &sb, 0);
+	fsync(fd);
+
+	logger.info("Added group %1: %2 blocks starting at block %3, %4 free",
+			sb.fields.group_count - 1, num_blocks, start, g.free_blocks);
+}
+
+static void write_group_metadata(int fd, BlockGroup const & g, off_t old_size)
+{
+	uint64_t meta = hush::fs::group_metadata_blocks(g);
+	uint64_t map_blocks = ((meta + 7) / 8 + HUSHFS_BLOCK_SIZE - 1) / HUSHFS_BLOCK_SIZE;
+	std::vector<uint8_t> map(map_blocks * HUSHFS_BLOCK_SIZE);
+	std::vector<uint8_t> zero(HUSHFS_BLOCK_SIZE);
+
+	/*
+	 * Anything past the old end of file is a hole and already reads back as
+	 * zeros. The old tail, if the image wasn't a whole number of blocks, is
+	 * the only part of the new metadata that might hold stale bytes.
+	 */
+	for (uint64_t b = g.start_block; b < g.first_datablock; b++) {
+		if ((off_t)(b * HUSHFS_BLOCK_SIZE) >= old_size)
+			break;
+		write_block(fd, zero.data(), b * HUSHFS_BLOCK_SIZE);
+	}
+
+	hush::fs::mark_bits(map.data(), 0, meta);
+	write_data(fd, map.data(), g.block_bitmap_offset * HUSHFS_BLOCK_SIZE, map.size());
+
+	logger.debug("Wrote %1 block bitmap blocks for group at %2", map_blocks, g.start_block);
+}
+
+static void usage()
+{
+	std::cerr << "Usage " << prgname << " secret.img [+]N[k|m|g|t]" << std::endl;
+}
+
+int hush_resize(struct optparse *opts)
+{
+	int opt, ret = 0, fd;
+	std::string filename, size;
+	uint64_t amount, new_size;
+	bool relative = false;
+	Superblock sb;
+	char *tmp;
+
+	while ((opt = optparse(opts, "h")) != -1) {
+		switch (opt) {
+			case 'h':
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if ((tmp = optparse_arg(opts)) != nullptr)
+		filename = tmp;
+	if ((tmp = optparse_arg(opts)) != nullptr)
+		size = tmp;
+
+	if (filename.empty() || size.empty()) {
+		usage();
+		return 1;
+	}
+
+	if (size[0] == '+') {
+		relative = true;
+		size.erase(0, 1);
+	}
+
+	if ((amount = parse_size(size)) == 0) {
+		usage();
+		return 1;
+	}
+
+	if ((fd = open(filename.c_str(), O_RDWR)) == -1) {
+		std::cerr << "Error opening file " << filename << std::endl;
+		return 1;
+	}
+
+	/*
+	 * A mounted hush only holds this lock for as long as it takes to write
+	 * its own superblock updates, so we never sit on it for long.
+	 */
+	if (flock(fd, LOCK_EX) != 0) {
+		std::cerr << "Error obtaining exclusive lock on file " << filename << std::endl;
+		close(fd);
+		return 1;
+	}
+
+	try {
+		read_block(fd, &sb, 0);
+		if (relative && amount > UINT64_MAX - sb.fields.disk_size)
+			throw std::string("New size is too large");
+		new_size = relative ? sb.fields.disk_size + amount : amount;
+		grow(fd, new_size);
+		std::cout << "Resized " << filename << " to " << new_size << " bytes" << std::endl;
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		ret = 1;
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+		ret = 1;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return ret;
+}
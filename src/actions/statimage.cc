@@ -0,0 +1,375 @@
+#include <algorithm> // min, max
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "statimage.hh"
+#include "utils/optparse.h"
+#include "utils/tools.hh"
+#include "utils/layout.hh"
+#include "utils/image.hh"
+#include "utils/blockmap.hh"
+#include "utils/json.hh"
+#include "utils/dedup.hh"
+#include "utils/compress.hh"
+#include "crypto/suite.hh"
+#include "fs.hh"
+
+using hush::fs::BlockGroup;
+using hush::fs::DedupEntry;
+using hush::fs::Extent;
+using hush::fs::Inode;
+using hush::fs::InodeTableBlock;
+using hush::fs::Superblock;
+using hush::utils::JsonWriter;
+
+/*
+ * Everything is read in chunks of these sizes and never held whole, so memory
+ * use doesn't grow with the image: a 10TB image has ~330MB of block bitmap.
+ */
+#define TABLE_CHUNK_BLOCKS 256
+#define MAP_CHUNK_BYTES (256 * HUSHFS_BLOCK_SIZE)
+#define WORST_FILES 10
+
+// bucket i counts lengths in [2^i, 2^(i+1))
+using Histogram = std::vector<uint64_t>;
+
+using FileScore = struct {
+	uint64_t i_no;
+	uint64_t blocks;
+	uint64_t extents;
+	double score;
+};
+
+using Report = struct __report {
+	uint64_t files = 0;
+	uint64_t fragmented = 0;
+	uint64_t extents = 0;
+	uint64_t data_blocks = 0;
+	uint64_t indirect_blocks = 0;
+	uint64_t metadata_blocks = 0;
+	uint64_t free_blocks = 0;
+	uint64_t free_runs = 0;
+	uint64_t largest_free_run = 0;
+	Histogram extent_lengths = Histogram(64);
+	Histogram free_lengths = Histogram(64);
+	// the most fragmented files seen so far, least fragmented on top
+	std::priority_queue<FileScore, std::vector<FileScore>,
+		bool (*)(FileScore const &, FileScore const &)> worst{
+			[](FileScore const & a, FileScore const & b) { return a.score > b.score; }};
+};
+
+static void usage();
+static void add(Histogram &, uint64_t);
+static void write_histogram(JsonWriter &, char const *, Histogram const &);
+static void scan_files(int, Superblock const &, Report &, JsonWriter *);
+static void scan_free_space(int, Superblock const &, Report &);
+static void write_report(JsonWriter &, Superblock const &, Report &);
+
+extern std::string prgname;
+
+static void add(Histogram & h, uint64_t len)
+{
+	int bucket = 0;
+
+	while (len >>= 1)
+		bucket++;
+	h[bucket]++;
+}
+
+static void write_histogram(JsonWriter & j, char const *key, Histogram const & h)
+{
+	j.begin_object(key);
+	for (uint64_t i = 0; i < h.size(); i++) {
+		if (h[i] != 0)
+			j.value(std::to_string(1ULL << i).c_str(), h[i]);
+	}
+	j.end_object();
+}
+
+/*
+ * 0 for a file that's in one piece, 1 for one where no two consecutive blocks
+ * are next to each other on disk.
+ */
+static double fragmentation_score(uint64_t blocks, uint64_t extents)
+{
+	if (blocks < 2)
+		return 0.0;
+	return (double)(extents - 1) / (double)(blocks - 1);
+}
+
+static void scan_files(int fd, Superblock const & sb, Report & r, JsonWriter *files)
+{
+	uint64_t ipb = HUSHFS_BLOCK_SIZE / sizeof(Inode);
+	std::vector<InodeTableBlock> table(TABLE_CHUNK_BLOCKS);
+	std::vector<uint8_t> map((TABLE_CHUNK_BLOCKS * ipb) / 8);
+
+	for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+		BlockGroup const & bg = sb.groups[g];
+
+		for (uint64_t t = 0; t < bg.inode_table_blocks; t += TABLE_CHUNK_BLOCKS) {
+			uint64_t n = std::min((uint64_t)TABLE_CHUNK_BLOCKS, bg.inode_table_blocks - t);
+			uint64_t base = t * ipb;
+			uint64_t count = std::min(n * ipb, bg.total_inodes - base);
+
+			read_data(fd, table.data(), (bg.inode_table_offset + t) * HUSHFS_BLOCK_SIZE,
+					n * HUSHFS_BLOCK_SIZE);
+			read_data(fd, map.data(), (bg.inode_bitmap_offset * HUSHFS_BLOCK_SIZE) + (base / 8),
+					(count + 7) / 8);
+
+			for (uint64_t i = 0; i < count; i++) {
+				Inode const & inode = table[i / ipb].inodes[i % ipb];
+				std::vector<Extent> extents;
+				uint64_t indirect, blocks = 0;
+				FileScore score;
+
+				if (!hush::fs::test_bit(map.data(), i))
+					continue;
+
+				extents = hush::fs::file_extents(fd, inode.fields, &indirect);
+				for (Extent const & e : extents) {
+					add(r.extent_lengths, e.length);
+					blocks += e.length;
+				}
+
+				score = { bg.first_inode + base + i + 1, blocks, extents.size(),
+					fragmentation_score(blocks, extents.size()) };
+
+				r.files++;
+				r.extents += extents.size();
+				r.data_blocks += blocks;
+				r.indirect_blocks += indirect;
+				if (extents.size() > 1)
+					r.fragmented++;
+
+				if (score.score > 0.0) {
+					r.worst.push(score);
+					if (r.worst.size() > WORST_FILES)
+						r.worst.pop();
+				}
+
+				if (files) {
+					files->begin_object()
+						.value("inode", score.i_no)
+						.value("blocks", score.blocks)
+						.value("extents", score.extents)
+						.value("score", score.score)
+						.end_object();
+				}
+			}
+		}
+	}
+}
+
+static void scan_free_space(int fd, Superblock const & sb, Report & r)
+{
+	std::vector<uint8_t> map(MAP_CHUNK_BYTES);
+
+	for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+		BlockGroup const & bg = sb.groups[g];
+		uint64_t bit = hush::fs::group_metadata_blocks(bg), run = 0;
+
+		r.metadata_blocks += bit;
+
+		while (bit < bg.total_blocks) {
+			uint64_t first_byte = bit / 8;
+			uint64_t bytes = std::min((uint64_t)MAP_CHUNK_BYTES, ((bg.total_blocks + 7) / 8) - first_byte);
+			uint64_t end = std::min(bg.total_blocks, (first_byte + bytes) * 8);
+
+			read_data(fd, map.data(), (bg.block_bitmap_offset * HUSHFS_BLOCK_SIZE) + first_byte, bytes);
+
+			for (; bit < end; bit++) {
+				if (!hush::fs::test_bit(map.data(), bit - (first_byte * 8))) {
+					run++;
+					continue;
+				}
+				if (run) {
+					add(r.free_lengths, run);
+					r.free_runs++;
+					r.free_blocks += run;
+					r.largest_free_run = std::max(r.largest_free_run, run);
+					run = 0;
+				}
+			}
+		}
+
+		// a run never carries over into the next group's metadata
+		if (run) {
+			add(r.free_lengths, run);
+			r.free_runs++;
+			r.free_blocks += run;
+			r.largest_free_run = std::max(r.largest_free_run, run);
+		}
+	}
+}
+
+static void write_report(JsonWriter & j, Superblock const & sb, Report & r)
+{
+	uint64_t overhead = r.metadata_blocks + r.indirect_blocks;
+	std::vector<FileScore> worst;
+
+	j.begin_object("extents")
+		.value("files", r.files)
+		.value("fragmented_files", r.fragmented)
+		.value("count", r.extents)
+		.value("per_file", r.files ? (double)r.extents / r.files : 0.0);
+	write_histogram(j, "lengths", r.extent_lengths);
+	j.end_object();
+
+	j.begin_object("free_space")
+		.value("blocks", r.free_blocks)
+		.value("runs", r.free_runs)
+		.value("largest_run", r.largest_free_run)
+		.value("superblock_free_blocks", sb.fields.free_blocks);
+	write_histogram(j, "lengths", r.free_lengths);
+	j.end_object();
+
+	j.begin_object("overhead")
+		.value("metadata_blocks", r.metadata_blocks)
+		.value("indirect_blocks", r.indirect_blocks)
+		.value("data_blocks", r.data_blocks)
+		.value("metadata_ratio", (overhead + r.data_blocks) ?
+				(double)overhead / (overhead + r.data_blocks) : 0.0)
+		.end_object();
+
+	while (!r.worst.empty()) {
+		worst.push_back(r.worst.top());
+		r.worst.pop();
+	}
+
+	j.begin_array("most_fragmented");
+	for (auto it = worst.rbegin(); it != worst.rend(); it++) {
+		j.begin_object()
+			.value("inode", it->i_no)
+			.value("blocks", it->blocks)
+			.value("extents", it->extents)
+			.value("score", it->score)
+			.end_object();
+	}
+	j.end_array();
+}
+
+static void usage()
+{
+	std::cerr << "Usage " << prgname << " [-f] secret.img" << std::endl;
+}
+
+int hush_stat_image(struct optparse *opts)
+{
+	int opt, ret = 0, fd;
+	bool per_file = false;
+	std::string filename;
+	JsonWriter j(std::cout);
+	Superblock sb;
+	Report r;
+	char *tmp;
+
+	while ((opt = optparse(opts, "fh")) != -1) {
+		switch (opt) {
+			case 'f':
+				per_file = true;
+				break;
+			case 'h':
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	if ((tmp = optparse_arg(opts)) != nullptr)
+		filename = tmp;
+
+	if (filename.empty()) {
+		usage();
+		return 1;
+	}
+
+	if ((fd = open(filename.c_str(), O_RDONLY)) == -1) {
+		std::cerr << "Error opening file " << filename << std::endl;
+		return 1;
+	}
+
+	// keeps resize, fsck and defrag from changing things underneath us
+	flock(fd, LOCK_SH);
+
+	try {
+		hush::fs::load_superblock(fd, sb);
+
+		j.begin_object()
+			.value("image", filename)
+			.begin_object("superblock")
+				.value("version", (unsigned)sb.fields.version)
+				.value("cipher", hush::crypto::suite_name((hush::crypto::CipherSuite)sb.fields.cipher))
+				.value("compression", hush::fs::compression_name((hush::fs::Compression)sb.fields.compression))
+				.value("thin", (sb.fields.flags & HUSHFS_FLAG_THIN) != 0)
+				.value("mount_epoch", sb.fields.mount_epoch)
+				.value("key_generation", sb.fields.key_generation)
+				.value("rekeying", (sb.fields.flags & HUSHFS_FLAG_REKEYING) != 0)
+				.value("rekey_watermark", sb.fields.rekey_watermark)
+				.value("block_size", sb.fields.block_size)
+				.value("disk_size", sb.fields.disk_size)
+				.value("total_blocks", sb.fields.total_blocks)
+				.value("total_inodes", sb.fields.total_inodes)
+				.value("free_blocks", sb.fields.free_blocks)
+				.value("free_inodes", sb.fields.free_inodes)
+				.value("group_count", sb.fields.group_count)
+			.end_object();
+
+		if (sb.fields.flags & HUSHFS_FLAG_DEDUP) {
+			uint64_t blocks = 0, refs = 0;
+
+			// streamed, so a big index costs no more memory than a small one
+			hush::fs::scan_dedup_index(fd, sb, [&blocks, &refs](uint64_t, DedupEntry const & e) {
+				blocks++;
+				refs += e.refs;
+			});
+
+			// every reference past the first is a block that didn't need writing
+			j.begin_object("dedup")
+				.value("index_blocks", sb.fields.dedup_index_blocks)
+				.value("slots", sb.fields.dedup_index_blocks * HUSHFS_DEDUP_PER_BLOCK)
+				.value("blocks", blocks)
+				.value("saved_blocks", refs - blocks)
+				.value("dirty", (sb.fields.flags & HUSHFS_FLAG_DEDUP_DIRTY) != 0)
+			.end_object();
+		}
+
+		j.begin_array("groups");
+		for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+			BlockGroup const & bg = sb.groups[g];
+			j.begin_object()
+				.value("start_block", bg.start_block)
+				.value("total_blocks", bg.total_blocks)
+				.value("metadata_blocks", hush::fs::group_metadata_blocks(bg))
+				.value("free_blocks", bg.free_blocks)
+				.value("free_inodes", bg.free_inodes)
+				.end_object();
+		}
+		j.end_array();
+
+		if (per_file)
+			j.begin_array("files");
+		scan_files(fd, sb, r, per_file ? &j : nullptr);
+		if (per_file)
+			j.end_array();
+
+		scan_free_space(fd, sb, r);
+		write_report(j, sb, r);
+		j.end_object();
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+		ret = 1;
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	return ret;
+}
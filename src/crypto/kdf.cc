@@ -0,0 +1,61 @@
+#include <algorithm> // max, min
+#include <chrono>
+#include <sodium.h>
+
+#include "crypto/kdf.hh"
+#include "crypto/secretkey.hh"
+
+using hush::crypto::KdfParams;
+
+// below this Argon2 stops being memory hard in any useful sense
+#define MIN_CALIBRATED_MEMLIMIT (8 * 1024 * 1024)
+// timed runs spent correcting the passes after the first estimate
+#define CALIBRATION_ROUNDS 3
+
+static double time_pwhash(KdfParams const & p)
+{
+	unsigned char key[crypto_box_SEEDBYTES];
+	unsigned char salt[crypto_pwhash_SALTBYTES];
+	char const password[] = "calibrate";
+	auto start = std::chrono::steady_clock::now();
+
+	randombytes_buf(salt, sizeof salt);
+	if (crypto_pwhash(key, sizeof key, password, sizeof password - 1, salt,
+				p.opslimit, p.memlimit, crypto_pwhash_ALG_DEFAULT) != 0)
+		throw hush::crypto::SecretKeyException("Can't hash password into key, out of memory");
+
+	sodium_memzero(key, sizeof key);
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+KdfParams hush::crypto::calibrate_kdf(unsigned target_ms, unsigned & took_ms,
+		size_t max_memlimit)
+{
+	KdfParams p;
+	double ms = time_pwhash(p);
+
+	// Argon2's cost is close enough to linear in both memory and passes
+	while (ms * 2 <= target_ms && p.memlimit * 2 <= max_memlimit) {
+		p.memlimit *= 2;
+		ms *= 2;
+	}
+	while (ms > target_ms && p.memlimit / 2 >= MIN_CALIBRATED_MEMLIMIT) {
+		p.memlimit /= 2;
+		ms /= 2;
+	}
+
+	// a short first run extrapolates badly, so measure again and correct
+	for (int round = 0; round < CALIBRATION_ROUNDS && ms > 0; round++) {
+		double ops = p.opslimit * (target_ms / ms);
+
+		p.opslimit = std::max((unsigned long long)crypto_pwhash_OPSLIMIT_MIN,
+				std::min((unsigned long long)ops, (unsigned long long)crypto_pwhash_OPSLIMIT_MAX));
+		ms = time_pwhash(p);
+
+		if (ms > target_ms * 0.9 && ms < target_ms * 1.1)
+			break;
+	}
+
+	took_ms = (unsigned)ms;
+	return p;
+}
@@ -0,0 +1,133 @@
+#include <cstdio> // snprintf
+#include <cstring> // strerror
+#include <sodium.h>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/keyctl.h>
+#endif
+
+#include "crypto/keycache.hh"
+#include "utils/secure.hh"
+#include "utils/log.hh"
+#include "config.h"
+
+using hush::fs::KeySlot;
+using namespace hush::crypto;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+// keyutils.h has these, linux/keyctl.h doesn't
+#define KEY_POS_ALL  0x3f000000
+#define KEY_USR_VIEW 0x00010000
+
+#ifdef __linux__
+/*
+ * glibc has no wrappers for these and libkeyutils isn't worth a dependency
+ * for four calls.
+ */
+static long keyctl(int cmd, unsigned long a2, unsigned long a3=0,
+		unsigned long a4=0, unsigned long a5=0)
+{
+	return syscall(SYS_keyctl, cmd, a2, a3, a4, a5);
+}
+
+static long search(std::string const & name)
+{
+	long id = keyctl(KEYCTL_SEARCH, KEY_SPEC_SESSION_KEYRING,
+			(unsigned long)"user", (unsigned long)name.c_str());
+
+	if (id == -1)
+		id = keyctl(KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING,
+				(unsigned long)"user", (unsigned long)name.c_str());
+	return id;
+}
+#endif
+
+std::string hush::crypto::key_cache_name(std::vector<KeySlot> const & slots)
+{
+	crypto_generichash_state state;
+	unsigned char hash[16];
+	char hex[sizeof hash * 2 + 1];
+
+	// the slots are already public, the hash just names them
+	crypto_generichash_init(&state, nullptr, 0, sizeof hash);
+	for (KeySlot const & slot : slots) {
+		if (!slot.active)
+			continue;
+		crypto_generichash_update(&state, slot.salt, sizeof slot.salt);
+		crypto_generichash_update(&state, slot.wrapped_key, sizeof slot.wrapped_key);
+		crypto_generichash_update(&state, slot.mac, sizeof slot.mac);
+	}
+	crypto_generichash_final(&state, hash, sizeof hash);
+
+	for (size_t i = 0; i < sizeof hash; i++)
+		snprintf(hex + i * 2, 3, "%02x", hash[i]);
+
+	return std::string("hush:") + hex;
+}
+
+bool hush::crypto::find_cached_key(std::string const & name, SecretKey & volume_key)
+{
+#ifdef __linux__
+	hush::secure::vector<unsigned char> key(HUSHFS_KEY_BYTES);
+	long id = search(name);
+
+	if (id == -1)
+		return false;
+
+	if (keyctl(KEYCTL_READ, id, (unsigned long)key.data(), key.size()) != (long)key.size()) {
+		logger.warn("Ignoring unreadable cached key %1", name);
+		return false;
+	}
+
+	volume_key.set_key(key.data());
+	logger.debug("Using the cached key %1", name);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void hush::crypto::cache_key(std::string const & name, SecretKey const & volume_key,
+		unsigned timeout, KeyCacheScope scope)
+{
+#ifdef __linux__
+	int ring = scope == KeyCacheScope::User ? KEY_SPEC_USER_KEYRING : KEY_SPEC_SESSION_KEYRING;
+	long id = syscall(SYS_add_key, "user", name.c_str(), volume_key.get_key(),
+			(size_t)HUSHFS_KEY_BYTES, ring);
+
+	if (id == -1) {
+		slog::LogString ls("Couldn't cache the key: %1", std::string(strerror(errno)));
+		logger.error(ls);
+		throw SecretKeyException(ls.str());
+	}
+
+	// only whoever holds the keyring may read it, others just see it's there
+	if (keyctl(KEYCTL_SET_TIMEOUT, id, timeout) == -1 ||
+			keyctl(KEYCTL_SETPERM, id, KEY_POS_ALL | KEY_USR_VIEW) == -1) {
+		slog::LogString ls("Couldn't limit the cached key: %1", std::string(strerror(errno)));
+
+		keyctl(KEYCTL_INVALIDATE, id);
+		logger.error(ls);
+		throw SecretKeyException(ls.str());
+	}
+
+	logger.debug("Cached the key as %1 for %2s", name, timeout);
+#else
+	throw SecretKeyException("Caching keys needs the Linux keyring");
+#endif
+}
+
+void hush::crypto::forget_cached_key(std::string const & name)
+{
+#ifdef __linux__
+	long id;
+
+	while ((id = search(name)) != -1) {
+		if (keyctl(KEYCTL_INVALIDATE, id) == -1 && keyctl(KEYCTL_REVOKE, id) == -1)
+			break;
+	}
+#endif
+}
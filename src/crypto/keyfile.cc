@@ -0,0 +1,88 @@
+#include <string>
+#include <vector>
+#include <sodium.h>
+
+#include "crypto/keyfile.hh"
+#include "crypto/secretkey.hh"
+#include "crypto/symmetric.hh"
+#include "crypto/ciphertext.hh"
+#include "utils/b64.hh"
+
+using namespace hush::crypto;
+using B64 = hush::utils::B64<std::vector<unsigned char>, std::string>;
+
+#define KDF_NAME "argon2id13"
+
+std::string hush::crypto::seal_private_key(unsigned char const *privkey, size_t len,
+		hush::secure::string const & password, KdfParams const & kdf)
+{
+	B64 b64;
+	B64::Headers headers;
+	SecretKey secretkey;
+	Symmetric symmetric;
+	CipherText ciphertext;
+	hush::secure::vector<unsigned char> message(privkey, privkey + len);
+
+	secretkey.set_salt();
+	secretkey.generate_key(password, kdf.opslimit, kdf.memlimit);
+	symmetric.encipher(ciphertext, secretkey, message);
+
+	headers.emplace_back("KDF", KDF_NAME);
+	headers.emplace_back("Ops-Limit", std::to_string(kdf.opslimit));
+	headers.emplace_back("Mem-Limit", std::to_string(kdf.memlimit));
+	headers.emplace_back("Salt", b64.encode(std::vector<unsigned char>(secretkey.get_salt(),
+					secretkey.get_salt() + crypto_pwhash_SALTBYTES)));
+
+	return b64.pemify(b64.encode(ciphertext), "PRIVATE", headers);
+}
+
+bool hush::crypto::open_private_key(std::string const & pem,
+		hush::secure::string const & password, hush::secure::vector<unsigned char> & privkey)
+{
+	B64 b64;
+	B64::Headers headers;
+	KdfParams kdf;
+	std::vector<unsigned char> salt, nonce, data;
+	std::string body;
+	SecretKey secretkey;
+	Symmetric symmetric;
+	CipherText ciphertext;
+	// the nonce is encoded on its own, ahead of the rest, see B64::encode(CipherText)
+	size_t nonce_chars = ((crypto_secretbox_NONCEBYTES + 2) / 3) * 4;
+
+	try {
+		body = b64.unpemify(pem, headers);
+
+		for (auto const & h : headers) {
+			if (h.first == "KDF" && h.second != KDF_NAME)
+				throw KeyFileException("Key file uses an unknown KDF: " + h.second);
+			else if (h.first == "Ops-Limit")
+				kdf.opslimit = std::stoull(h.second);
+			else if (h.first == "Mem-Limit")
+				kdf.memlimit = std::stoull(h.second);
+			else if (h.first == "Salt")
+				salt = b64.decode(h.second);
+		}
+
+		if (body.size() < nonce_chars)
+			throw KeyFileException("Key file is too short");
+		nonce = b64.decode(body.substr(0, nonce_chars));
+		data = b64.decode(body.substr(nonce_chars));
+	} catch (KeyFileException const &) {
+		throw;
+	} catch (std::logic_error const &) {
+		throw KeyFileException("Key file has a malformed KDF limit");
+	} catch (std::runtime_error const & e) {
+		throw KeyFileException(std::string("Key file isn't valid PEM: ") + e.what());
+	}
+
+	// files from before the salt was saved can't be opened at all
+	if (salt.size() != crypto_pwhash_SALTBYTES)
+		throw KeyFileException("Key file has no usable salt");
+
+	secretkey.set_salt(salt.data());
+	secretkey.generate_key(password, kdf.opslimit, kdf.memlimit);
+
+	ciphertext.set(nonce.data(), nonce.size(), data.data(), data.size());
+	return symmetric.decipher(privkey, secretkey, ciphertext);
+}
@@ -0,0 +1,28 @@
+#include "crypto/keyring.hh"
+
+using namespace hush::crypto;
+
+// crypto_kdf contexts are exactly 8 characters
+static char const data_context[8] = { 'h', 'u', 's', 'h', 'd', 'a', 't', 'a' };
+
+std::shared_ptr<SecretKey const> KeyRing::get(uint64_t generation)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = keys.find(generation);
+
+	if (it == keys.end()) {
+		auto key = std::make_shared<SecretKey>();
+
+		key->derive_key(volume_key, generation, data_context);
+		it = keys.emplace(generation, key).first;
+	}
+
+	return it->second;
+}
+
+void KeyRing::forget_below(uint64_t generation)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	keys.erase(keys.begin(), keys.lower_bound(generation));
+}
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <sodium.h>
+
+#include "crypto/keyslots.hh"
+#include "crypto/symmetric.hh"
+
+using hush::fs::KeySlot;
+using namespace hush::crypto;
+
+static unsigned char const check_message[] = "hush volume key check";
+
+static void key_check(SecretKey const & volume_key, unsigned char *out, size_t len)
+{
+	crypto_generichash(out, len, check_message, sizeof check_message,
+			volume_key.get_key(), crypto_box_SEEDBYTES);
+}
+
+void hush::crypto::set_key_check(KeySlot & slot, SecretKey const & volume_key)
+{
+	key_check(volume_key, slot.key_check, sizeof slot.key_check);
+}
+
+void hush::crypto::seal_key_slot(KeySlot & slot, SecretKey const & volume_key,
+		hush::secure::string const & secret, KdfParams const & kdf)
+{
+	Symmetric symmetric(CipherSuite::XSalsa20Poly1305);
+	SecretKey wrap;
+
+	memset(&slot, 0, sizeof slot);
+	slot.opslimit = kdf.opslimit;
+	slot.memlimit = kdf.memlimit;
+	randombytes_buf(slot.salt, sizeof slot.salt);
+
+	wrap.set_salt(slot.salt);
+	wrap.generate_key(secret, slot.opslimit, slot.memlimit);
+
+	memcpy(slot.wrapped_key, volume_key.get_key(), sizeof slot.wrapped_key);
+	symmetric.encipher(slot.wrapped_key, sizeof slot.wrapped_key, slot.mac, slot.nonce, wrap);
+	set_key_check(slot, volume_key);
+	slot.active = 1;
+}
+
+bool hush::crypto::open_key_slot(KeySlot const & slot, hush::secure::string const & secret,
+		SecretKey & volume_key)
+{
+	Symmetric symmetric(CipherSuite::XSalsa20Poly1305);
+	hush::secure::vector<unsigned char> key(slot.wrapped_key,
+			slot.wrapped_key + sizeof slot.wrapped_key);
+	unsigned char salt[sizeof slot.salt];
+	SecretKey wrap;
+
+	if (!slot.active)
+		return false;
+
+	memcpy(salt, slot.salt, sizeof salt);
+	wrap.set_salt(salt);
+	wrap.generate_key(secret, slot.opslimit, slot.memlimit);
+
+	if (!symmetric.decipher(key.data(), key.size(), slot.mac, slot.nonce, wrap))
+		return false;
+
+	volume_key.set_key(key.data());
+	sodium_memzero(key.data(), key.size());
+	return true;
+}
+
+int hush::crypto::unlock_key_slots(std::vector<KeySlot> const & slots,
+		hush::secure::string const & secret, SecretKey & volume_key)
+{
+	std::vector<std::thread> threads;
+	std::atomic<int> found(-1);
+
+	for (unsigned i = 0; i < slots.size(); i++) {
+		if (!slots[i].active)
+			continue;
+
+		threads.emplace_back([&, i] {
+			SecretKey candidate;
+			int none = -1;
+
+			try {
+				if (!open_key_slot(slots[i], secret, candidate))
+					return;
+			} catch (std::runtime_error const &) {
+				// out of memory for pwhash, the other slots may still open
+				return;
+			}
+
+			// any slot gives the same key, only the first one stores it
+			if (found.compare_exchange_strong(none, i))
+				volume_key.set_key(candidate.get_key());
+		});
+	}
+
+	for (auto & t : threads)
+		t.join();
+
+	return found;
+}
+
+bool hush::crypto::key_fits_slots(std::vector<KeySlot> const & slots, SecretKey const & volume_key)
+{
+	unsigned char check[sizeof slots[0].key_check];
+
+	key_check(volume_key, check, sizeof check);
+
+	for (KeySlot const & slot : slots) {
+		if (!slot.active || sodium_is_zero(slot.key_check, sizeof slot.key_check))
+			continue;
+		if (sodium_memcmp(check, slot.key_check, sizeof check) == 0)
+			return true;
+	}
+	return false;
+}
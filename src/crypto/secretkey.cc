@@ -15,22 +15,37 @@ void SecretKey::set_salt(unsigned char *s)
 	has_salt = true;
 }
 
-void SecretKey::set_key(unsigned char *k)
+void SecretKey::set_key(unsigned char const *k)
 {
 	memcpy(key, k, crypto_box_SEEDBYTES);
 	has_key = true;
 }
 
-void SecretKey::generate_key(hush::secure::string const & input)
+void SecretKey::derive_key(SecretKey const & master, uint64_t id, char const context[8])
+{
+	if (has_key)
+		throw SecretKeyException("Already have a key, aborting!");
+
+	if (crypto_kdf_derive_from_key(key, crypto_box_SEEDBYTES, id, context, master.get_key()) != 0)
+		throw SecretKeyException("Can't derive subkey");
+	has_key = true;
+}
+
+void SecretKey::random_key()
+{
+	randombytes_buf(key, crypto_box_SEEDBYTES);
+	has_key = true;
+}
+
+void SecretKey::generate_key(hush::secure::string const & input,
+		unsigned long long opslimit, size_t memlimit)
 {
 	if (!has_salt)
 		set_salt();
 
 	if (!has_key) {
 		if (crypto_pwhash(key, crypto_box_SEEDBYTES, input.c_str(), input.length(),
-					salt, crypto_pwhash_OPSLIMIT_INTERACTIVE, 
-					crypto_pwhash_MEMLIMIT_INTERACTIVE, 
-					crypto_pwhash_ALG_DEFAULT) != 0)
+					salt, opslimit, memlimit, crypto_pwhash_ALG_DEFAULT) != 0)
 			throw SecretKeyException("Can't hash password into key, out of memory");
 		has_key = true;
 	} else { // has_key
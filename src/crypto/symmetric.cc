@@ -1,26 +1,239 @@
+#include <algorithm> // copy
 #include <vector>
 #include <sodium.h>
 #include <cstdint>
 #include "crypto/symmetric.hh"
 #include "crypto/ciphertext.hh"
+#include "crypto/nonce.hh"
 #include "utils/secure.hh"
 
 using namespace hush::crypto;
 
+using encrypt_fn = int (*)(unsigned char *, unsigned char *, unsigned long long *,
+		unsigned char const *, unsigned long long,
+		unsigned char const *, unsigned long long,
+		unsigned char const *, unsigned char const *, unsigned char const *);
+using decrypt_fn = int (*)(unsigned char *, unsigned char *,
+		unsigned char const *, unsigned long long, unsigned char const *,
+		unsigned char const *, unsigned long long,
+		unsigned char const *, unsigned char const *);
+
+struct Symmetric::Impl {
+	size_t nonce_bytes;
+	size_t mac_bytes;
+	encrypt_fn encrypt;
+	decrypt_fn decrypt;
+	bool authenticates_ad;
+};
+
+// secretbox has no additional data, otherwise it fits the AEAD calling convention
+static int secretbox_encrypt(unsigned char *c, unsigned char *mac, unsigned long long *maclen,
+		unsigned char const *m, unsigned long long mlen,
+		unsigned char const *ad, unsigned long long adlen,
+		unsigned char const *nsec, unsigned char const *npub, unsigned char const *k)
+{
+	if (maclen != nullptr)
+		*maclen = crypto_secretbox_MACBYTES;
+	return crypto_secretbox_detached(c, mac, m, mlen, npub, k);
+}
+
+static int secretbox_decrypt(unsigned char *m, unsigned char *nsec,
+		unsigned char const *c, unsigned long long clen, unsigned char const *mac,
+		unsigned char const *ad, unsigned long long adlen,
+		unsigned char const *npub, unsigned char const *k)
+{
+	return crypto_secretbox_open_detached(m, c, mac, clen, npub, k);
+}
+
+static Symmetric::Impl const xsalsa20poly1305 = {
+	crypto_secretbox_NONCEBYTES,
+	crypto_secretbox_MACBYTES,
+	secretbox_encrypt,
+	secretbox_decrypt,
+	false,
+};
+
+/*
+ * GCM's nonce is only 96 bits, so random nonces are only good for about 2^32
+ * messages under one key before a collision becomes a real risk.
+ */
+static Symmetric::Impl const aes256gcm = {
+	crypto_aead_aes256gcm_NPUBBYTES,
+	crypto_aead_aes256gcm_ABYTES,
+	crypto_aead_aes256gcm_encrypt_detached,
+	crypto_aead_aes256gcm_decrypt_detached,
+	true,
+};
+
+static Symmetric::Impl const xchacha20poly1305 = {
+	crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+	crypto_aead_xchacha20poly1305_ietf_ABYTES,
+	crypto_aead_xchacha20poly1305_ietf_encrypt_detached,
+	crypto_aead_xchacha20poly1305_ietf_decrypt_detached,
+	true,
+};
+
+Symmetric::Symmetric(CipherSuite suite) : suite(suite)
+{
+	if (!is_available(suite))
+		throw SymmetricException(std::string("Cipher suite ") + suite_name(suite) +
+				" isn't supported on this CPU");
+
+	switch (suite) {
+		case CipherSuite::AES256GCM:
+			impl = &aes256gcm;
+			break;
+		case CipherSuite::XChaCha20Poly1305:
+			impl = &xchacha20poly1305;
+			break;
+		case CipherSuite::XSalsa20Poly1305:
+		default:
+			impl = &xsalsa20poly1305;
+			break;
+	}
+}
+
+bool Symmetric::is_available(CipherSuite suite)
+{
+	if (sodium_init() == -1)
+		throw SymmetricException("Couldn't initialize sodium");
+
+	switch (suite) {
+		case CipherSuite::AES256GCM:
+			// checks for AES-NI and PCLMUL
+			return crypto_aead_aes256gcm_is_available() == 1;
+		case CipherSuite::XSalsa20Poly1305:
+		case CipherSuite::XChaCha20Poly1305:
+			return true;
+	}
+	return false;
+}
+
+CipherSuite Symmetric::best_suite()
+{
+	if (is_available(CipherSuite::AES256GCM))
+		return CipherSuite::AES256GCM;
+	return CipherSuite::XChaCha20Poly1305;
+}
+
+size_t Symmetric::nonce_bytes() const
+{
+	return impl->nonce_bytes;
+}
+
+size_t Symmetric::mac_bytes() const
+{
+	return impl->mac_bytes;
+}
+
+bool Symmetric::authenticates_ad() const
+{
+	return impl->authenticates_ad;
+}
+
+/*
+ * CipherText keeps the tag in front of the ciphertext, which is the layout
+ * crypto_secretbox_easy produced, so existing key files still open.
+ */
 void Symmetric::encipher(CipherText& dest, SecretKey const & sk,
 		hush::secure::vector<unsigned char>& message)
 {
-	unsigned char *data;
-	unsigned char nonce[crypto_secretbox_NONCEBYTES];
+	std::vector<unsigned char> nonce(impl->nonce_bytes);
+	std::vector<unsigned char> data(impl->mac_bytes + message.size());
+
+	std::copy(message.begin(), message.end(), data.begin() + impl->mac_bytes);
+	encipher(data.data() + impl->mac_bytes, message.size(), data.data(), nonce.data(), sk);
+
+	dest.set(nonce.data(), nonce.size(), data.data(), data.size());
+}
+
+bool Symmetric::decipher(hush::secure::vector<unsigned char>& dest, SecretKey const & sk,
+		CipherText const & src) const
+{
+	std::vector<unsigned char> const & data = src.get_data();
 
-	uint64_t msglen = crypto_secretbox_MACBYTES + (sizeof(message[0]) * message.size());
+	if (src.get_nonce().size() != impl->nonce_bytes || data.size() < impl->mac_bytes)
+		return false;
 
-	randombytes_buf(nonce, sizeof nonce);
+	dest.assign(data.begin() + impl->mac_bytes, data.end());
 
-	data = (unsigned char *)sodium_malloc(msglen);
+	if (!decipher(dest.data(), dest.size(), data.data(), src.get_nonce().data(), sk)) {
+		sodium_memzero(dest.data(), dest.size());
+		dest.clear();
+		return false;
+	}
+	return true;
+}
+
+void Symmetric::encipher(unsigned char *data, size_t len, unsigned char *mac,
+		unsigned char *nonce, SecretKey const & sk,
+		unsigned char const *ad, size_t adlen) const
+{
+	randombytes_buf(nonce, impl->nonce_bytes);
+
+	encipher_fixed(data, len, mac, nonce, sk, ad, adlen);
+}
+
+void Symmetric::encipher_fixed(unsigned char *data, size_t len, unsigned char *mac,
+		unsigned char const *nonce, SecretKey const & sk,
+		unsigned char const *ad, size_t adlen) const
+{
+	impl->encrypt(data, mac, nullptr, data, len, ad, adlen, nullptr, nonce, sk.get_key());
+}
+
+bool Symmetric::decipher(unsigned char *data, size_t len, unsigned char const *mac,
+		unsigned char const *nonce, SecretKey const & sk,
+		unsigned char const *ad, size_t adlen) const
+{
+	return impl->decrypt(data, nullptr, data, len, mac, ad, adlen, nonce, sk.get_key()) == 0;
+}
+
+// the block number, then the format and sealed length of a packed block; returns its length
+static size_t block_ad(BlockBuffer const & b, unsigned char *ad)
+{
+	for (int i = 0; i < 8; i++)
+		ad[i] = (b.block >> (i * 8)) & 0xFF;
+	if (b.format == 0)
+		return 8;
+
+	for (int i = 0; i < 4; i++)
+		ad[8 + i] = (b.len >> (i * 8)) & 0xFF;
+	ad[12] = b.format;
+	return 13;
+}
+
+void Symmetric::encipher(std::vector<BlockBuffer> & blocks, SecretKey const & sk,
+		hush::utils::WorkPool & pool, uint64_t epoch) const
+{
+	// cheap, and it keeps the throw out of the worker threads
+	for (BlockBuffer & b : blocks) {
+		if (!block_nonce(b.nonce, impl->nonce_bytes, b.block, epoch, b.generation))
+			throw SymmetricException("Block nonce space exhausted, start a new epoch");
+	}
+
+	pool.run(blocks.size(), [&](size_t i) {
+		BlockBuffer & b = blocks[i];
+		unsigned char ad[13];
+		size_t adlen = block_ad(b, ad);
+
+		encipher_fixed(b.data, b.len, b.mac, b.nonce, sk, ad, adlen);
+		return true;
+	});
+}
+
+bool Symmetric::decipher(std::vector<BlockBuffer> & blocks, SecretKey const & sk,
+		hush::utils::WorkPool & pool) const
+{
+	return pool.run(blocks.size(), [&](size_t i) {
+		BlockBuffer & b = blocks[i];
+		unsigned char ad[13];
+		size_t adlen = block_ad(b, ad);
 
-	crypto_secretbox_easy(data, message.data(), message.size(),
-	                          nonce, sk.get_key());
+		// the nonce is all secretbox authenticates, so it has to stand in for the rest
+		if (!impl->authenticates_ad &&
+				(b.format != 0 || nonce_block(b.nonce, impl->nonce_bytes) != b.block))
+			return false;
 
-	dest.set(nonce, sizeof nonce, data, msglen);
+		return decipher(b.data, b.len, b.mac, b.nonce, sk, ad, adlen);
+	});
 }
@@ -8,9 +8,41 @@
 #define KB 1024
 #define MB (1024*KB)
 #define GB (1024*MB)
+#define TB (1024ULL*GB)
 
 #define HUSHFS_BLOCK_SIZE (4 * KB)
 #define HUSHFS_MAGIC "HusH"
+/*
+ * Every image starts out as a single block group; each online resize appends
+ * another one. Their descriptors live in the superblock, so this bounds how
+ * many times an image can be grown.
+ */
+#define HUSHFS_MAX_GROUPS 24
+
+/*
+ * The volume key is stored wrapped in up to this many key slots, one block
+ * each, right after the superblock. Group 0's metadata starts after them.
+ */
+#define HUSHFS_KEY_SLOTS 8
+#define HUSHFS_HEADER_BLOCKS (1 + HUSHFS_KEY_SLOTS)
+#define HUSHFS_KEY_BYTES 32
+
+// superblock flags
+#define HUSHFS_FLAG_THIN (1 << 0)
+#define HUSHFS_FLAG_KEY_SLOTS (1 << 1)
+// a key rotation is under way, see utils/rekey.hh
+#define HUSHFS_FLAG_REKEYING (1 << 2)
+// tags were written since the tag tree root was last stored, see utils/merkle.hh
+#define HUSHFS_FLAG_TREE_DIRTY (1 << 3)
+// the image has a dedup index, see utils/dedup.hh
+#define HUSHFS_FLAG_DEDUP (1 << 4)
+// the dedup index changed since it was last synced, refcounts can't be trusted
+#define HUSHFS_FLAG_DEDUP_DIRTY (1 << 5)
+/*
+ * A thin image's backing file only covers the blocks handed out so far and
+ * is extended this much at a time as the allocator reaches its end.
+ */
+#define HUSHFS_THIN_GROW (64 * MB)
 /*
  * 248 allows 8-byte alignment of struct and 256 byte size allowing even
  * alignment within blocks
@@ -18,7 +50,50 @@
 #define HUSHFS_FILENAME_MAXLEN 248
 
 #define HUSHFS_INODE_ALIGN_SIZE 256
+#define HUSHFS_DIRECT_BLOCKS 12
+// block numbers held by each indirect block
+#define HUSHFS_PTRS_PER_BLOCK ((uint64_t)(HUSHFS_BLOCK_SIZE / sizeof(uint64_t)))
 #define HUSHFS_INODES_PER_BLOCK ((uint64_t)(HUSHFS_BLOCK_SIZE / INODE_ALIGN_SIZE))
 
+// BlockTag flags
+#define HUSHFS_TAG_WRITTEN (1 << 0)
+#define HUSHFS_TAGS_PER_BLOCK ((uint64_t)(HUSHFS_BLOCK_SIZE / 64)) // sizeof(BlockTag)
+
+/*
+ * A compressed block still takes a whole block on disk and only saves on
+ * sealing, so it's kept compressed when it shrinks by at least this much.
+ */
+#define HUSHFS_COMPRESS_MIN_SAVING (HUSHFS_BLOCK_SIZE / 8)
+#define HUSHFS_ZSTD_LEVEL 3
+
+/*
+ * The dedup index is an open addressed hash table with a slot for every data
+ * block of the image when it was created, plus a quarter to keep the probes
+ * short. Blocks written once it's full simply aren't shared.
+ */
+#define HUSHFS_DEDUP_PER_BLOCK ((uint64_t)(HUSHFS_BLOCK_SIZE / 32)) // sizeof(DedupEntry)
+#define HUSHFS_DEDUP_DELETED UINT64_MAX
+
+// requests an io_uring (hush mount -I) can have in flight at once
+#define HUSHFS_URING_ENTRIES 256
+
+/*
+ * Memory for images mounted with O_DIRECT (hush mount -O): bounce buffers of
+ * this many bytes for blocks that aren't in aligned memory, and a cache of
+ * whole blocks for I/O on pieces of them.
+ */
+#define HUSHFS_DIRECT_BOUNCE_BYTES (64 * KB)
+#define HUSHFS_DIRECT_BOUNCE_BLOCKS 256
+#define HUSHFS_DIRECT_CACHE_BLOCKS 1024
+
+// tag blocks rewritten before the tag tree root is recomputed and stored
+#define HUSHFS_MERKLE_BATCH 1024
+
+/*
+ * Secure strings and vectors come out of one mlocked region this big, see
+ * utils/arena.hh; past that they fall back to a sodium_malloc each.
+ */
+#define HUSHFS_SECURE_ARENA_BYTES (256 * KB)
+
 #endif /* CONFIG_H_ */
 
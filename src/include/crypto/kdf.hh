@@ -0,0 +1,26 @@
+#ifndef KDF_HH_
+#define KDF_HH_
+
+#include <cstddef>
+#include <sodium.h>
+
+namespace hush {
+	namespace crypto {
+		// what crypto_pwhash gets asked to spend turning a passphrase into a key
+		struct KdfParams {
+			unsigned long long opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+			size_t memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE;
+		};
+
+		/*
+		 * Time Argon2id on this machine and pick limits that take about
+		 * `target_ms` to unlock. Memory goes up first, since that's what
+		 * costs an attacker, up to `max_memlimit`; passes make up the rest.
+		 * `took_ms` is what the chosen limits actually took.
+		 */
+		KdfParams calibrate_kdf(unsigned target_ms, unsigned & took_ms,
+				size_t max_memlimit=crypto_pwhash_MEMLIMIT_SENSITIVE);
+	};
+};
+
+#endif /* KDF_HH_ */
@@ -0,0 +1,36 @@
+#ifndef KEYCACHE_HH_
+#define KEYCACHE_HH_
+
+#include <string>
+#include <vector>
+
+#include "crypto/secretkey.hh"
+#include "fs.hh"
+
+namespace hush {
+	namespace crypto {
+		enum class KeyCacheScope { Session, User };
+
+		/*
+		 * An unlocked volume key can be parked in the kernel keyring, so the
+		 * next mount of the same image skips the pwhash altogether. The key
+		 * is only readable by processes that possess the keyring it's in and
+		 * expires on its own. Everything here is a no-op off Linux.
+		 *
+		 * The cache is keyed by a hash of the image's key slots, so another
+		 * image or a resealed slot never picks up a stale key.
+		 */
+		std::string key_cache_name(std::vector<hush::fs::KeySlot> const & slots);
+
+		// returns false if there's no cached key under `name`
+		bool find_cached_key(std::string const & name, SecretKey & volume_key);
+
+		// replaces any key already under `name`; throws SecretKeyException
+		void cache_key(std::string const & name, SecretKey const & volume_key,
+				unsigned timeout, KeyCacheScope scope=KeyCacheScope::Session);
+
+		void forget_cached_key(std::string const & name);
+	};
+};
+
+#endif /* KEYCACHE_HH_ */
@@ -0,0 +1,34 @@
+#ifndef KEYFILE_HH_
+#define KEYFILE_HH_
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#include "crypto/kdf.hh"
+#include "utils/secure.hh"
+
+namespace hush {
+	namespace crypto {
+		class KeyFileException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		/*
+		 * The PEM `hush keygen` writes a private key to. It's sealed with a
+		 * key hashed from `password`, and the salt and limits that took go
+		 * in the PEM headers, so opening it redoes exactly the same hash
+		 * however the defaults or the calibration change later.
+		 */
+		std::string seal_private_key(unsigned char const *privkey, size_t len,
+				hush::secure::string const & password, KdfParams const & kdf);
+
+		// false if the password is wrong, throws KeyFileException if the file is
+		bool open_private_key(std::string const & pem, hush::secure::string const & password,
+				hush::secure::vector<unsigned char> & privkey);
+	};
+};
+
+#endif /* KEYFILE_HH_ */
@@ -0,0 +1,40 @@
+#ifndef KEYRING_HH_
+#define KEYRING_HH_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "crypto/secretkey.hh"
+
+namespace hush {
+	namespace crypto {
+		/*
+		 * Data blocks aren't sealed with the volume key from the key slots
+		 * itself but with a data key derived from it for the current key
+		 * generation. Rotating the data key is a matter of moving to the
+		 * next generation and resealing every block, and the key slots never
+		 * change. Each BlockTag records the generation that sealed it.
+		 */
+		class KeyRing
+		{
+		public:
+			KeyRing(SecretKey const & volume_key) : volume_key(volume_key) {};
+
+			KeyRing(KeyRing const &) = delete;
+			void operator=(KeyRing const &) = delete;
+
+			std::shared_ptr<SecretKey const> get(uint64_t generation);
+			// drop the keys of generations no block is sealed with any more
+			void forget_below(uint64_t generation);
+
+		private:
+			SecretKey const & volume_key;
+			std::mutex lock;
+			std::map<uint64_t, std::shared_ptr<SecretKey const>> keys;
+		};
+	};
+};
+
+#endif /* KEYRING_HH_ */
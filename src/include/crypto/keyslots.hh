@@ -0,0 +1,44 @@
+#ifndef KEYSLOTS_HH_
+#define KEYSLOTS_HH_
+
+#include <vector>
+
+#include "crypto/kdf.hh"
+#include "crypto/secretkey.hh"
+#include "utils/secure.hh"
+#include "fs.hh"
+
+namespace hush {
+	namespace crypto {
+		/*
+		 * Wrap `volume_key` into `slot` with a fresh salt and nonce. The
+		 * limits are kept in the slot, so open_key_slot hashes the same way
+		 * whatever `kdf` was.
+		 */
+		void seal_key_slot(hush::fs::KeySlot & slot, SecretKey const & volume_key,
+				hush::secure::string const & secret, KdfParams const & kdf=KdfParams());
+
+		bool open_key_slot(hush::fs::KeySlot const & slot, hush::secure::string const & secret,
+				SecretKey & volume_key);
+
+		/*
+		 * Every slot costs a full pwhash run, so they're all tried at once,
+		 * one thread each, and unlocking takes as long as the slowest slot
+		 * rather than the sum of them. Returns the slot that opened, or -1.
+		 */
+		int unlock_key_slots(std::vector<hush::fs::KeySlot> const & slots,
+				hush::secure::string const & secret, SecretKey & volume_key);
+
+		/*
+		 * Whether `volume_key` is the one the slots wrap, going by their
+		 * key_check, for a key that came from somewhere other than a slot.
+		 * Slots sealed before there was a check can't vouch for any key.
+		 */
+		bool key_fits_slots(std::vector<hush::fs::KeySlot> const & slots,
+				SecretKey const & volume_key);
+		// gives a slot sealed before then its key_check, seal_key_slot sets it anyway
+		void set_key_check(hush::fs::KeySlot & slot, SecretKey const & volume_key);
+	};
+};
+
+#endif /* KEYSLOTS_HH_ */
@@ -0,0 +1,100 @@
+#ifndef NONCE_HH_
+#define NONCE_HH_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace hush {
+	namespace crypto {
+		/*
+		 * Data block nonces aren't random, they're packed little endian from
+		 * the block number, the mount epoch and the block's write generation.
+		 * Nothing in one mount ever reuses a (block, generation) pair, and
+		 * every mount starts a new epoch that's on disk before the first
+		 * block is written, so a crash can't lead to a nonce being used twice
+		 * either.
+		 *
+		 * 24 byte nonces get 64 bits for each field. AES-GCM's 12 byte
+		 * nonce gets 40 bits of block number (4 PiB of 4 KiB blocks), 24 of
+		 * epoch and 32 of generation.
+		 */
+		struct NonceLayout {
+			unsigned block_bits;
+			unsigned epoch_bits;
+			unsigned generation_bits;
+		};
+
+		inline NonceLayout nonce_layout(size_t len)
+		{
+			if (len >= 24)
+				return { 64, 64, 64 };
+			return { 40, 24, 32 };
+		}
+
+		inline bool fits(uint64_t value, unsigned bits)
+		{
+			return bits >= 64 || value < (1ULL << bits);
+		}
+
+		inline void put_bits(unsigned char *out, unsigned & bit, uint64_t value, unsigned bits)
+		{
+			for (unsigned i = 0; i < bits; i += 8, bit += 8)
+				out[bit / 8] = (value >> i) & 0xFF;
+		}
+
+		inline uint64_t get_bits(unsigned char const *in, unsigned & bit, unsigned bits)
+		{
+			uint64_t value = 0;
+
+			for (unsigned i = 0; i < bits; i += 8, bit += 8)
+				value |= (uint64_t)in[bit / 8] << i;
+			return value;
+		}
+
+		/*
+		 * Returns false if a field doesn't fit, which for a 12 byte nonce
+		 * means it's time for a new epoch, or past that, a new key.
+		 */
+		inline bool block_nonce(unsigned char *out, size_t len, uint64_t block,
+				uint64_t epoch, uint64_t generation)
+		{
+			NonceLayout l = nonce_layout(len);
+			unsigned bit = 0;
+
+			if (!fits(block, l.block_bits) || !fits(epoch, l.epoch_bits) ||
+					!fits(generation, l.generation_bits))
+				return false;
+
+			put_bits(out, bit, block, l.block_bits);
+			put_bits(out, bit, epoch, l.epoch_bits);
+			put_bits(out, bit, generation, l.generation_bits);
+			return true;
+		}
+
+		// the block number `nonce` was built for by block_nonce()
+		inline uint64_t nonce_block(unsigned char const *nonce, size_t len)
+		{
+			unsigned bit = 0;
+
+			return get_bits(nonce, bit, nonce_layout(len).block_bits);
+		}
+
+		/*
+		 * The generation to use for the next write of a block whose stored
+		 * nonce is `prev`. A block last written in an earlier epoch starts
+		 * again from zero.
+		 */
+		inline uint64_t next_generation(unsigned char const *prev, size_t len, uint64_t epoch)
+		{
+			NonceLayout l = nonce_layout(len);
+			unsigned bit = l.block_bits;
+			uint64_t prev_epoch = get_bits(prev, bit, l.epoch_bits);
+
+			if (prev_epoch != epoch)
+				return 0;
+			return get_bits(prev, bit, l.generation_bits) + 1;
+		}
+	};
+};
+
+#endif /* NONCE_HH_ */
@@ -1,6 +1,7 @@
 #ifndef SECRETKEY_HH_
 #define SECRETKEY_HH_
 
+#include <cstdint>
 #include <stdexcept>
 #include <sodium.h>
 #include "utils/secure.hh"
@@ -24,9 +25,15 @@ namespace hush {
 			~SecretKey() { sodium_free(key); };
 
 			void set_salt(unsigned char *s=nullptr);
-			void set_key(unsigned char *k);
+			unsigned char const *get_salt() const { return salt; };
+			void set_key(unsigned char const *k);
 			unsigned char const *get_key() const { return key; };
-			void generate_key(hush::secure::string const & input);
+			void generate_key(hush::secure::string const & input,
+					unsigned long long opslimit=crypto_pwhash_OPSLIMIT_INTERACTIVE,
+					size_t memlimit=crypto_pwhash_MEMLIMIT_INTERACTIVE);
+			void random_key();
+			// derive subkey `id` of `master` in `context`, see crypto_kdf
+			void derive_key(SecretKey const & master, uint64_t id, char const context[8]);
 
 		private:
 			bool has_key = false;
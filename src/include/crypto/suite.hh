@@ -0,0 +1,54 @@
+#ifndef SUITE_HH_
+#define SUITE_HH_
+
+#include <cstdint>
+#include <string>
+
+namespace hush {
+	namespace crypto {
+		/*
+		 * The cipher suite a volume's blocks are sealed with. It's chosen
+		 * once by `hush create` and stored in the superblock, so the values
+		 * here are part of the on-disk format and must never be renumbered.
+		 * Images made before suites existed have a zero there, which is
+		 * the original secretbox construction.
+		 *
+		 * secretbox is the one suite with no additional data. A data block
+		 * sealed with it is tied to its block number through the nonce,
+		 * which is built from the number and checked against it when the
+		 * block is opened, and it's never compressed, since nothing could
+		 * authenticate the format and length in its tag.
+		 */
+		enum class CipherSuite : uint8_t {
+			XSalsa20Poly1305  = 0,
+			AES256GCM         = 1,
+			XChaCha20Poly1305 = 2,
+		};
+
+		inline char const *suite_name(CipherSuite suite)
+		{
+			switch (suite) {
+				case CipherSuite::XSalsa20Poly1305:
+					return "xsalsa20poly1305";
+				case CipherSuite::AES256GCM:
+					return "aes256gcm";
+				case CipherSuite::XChaCha20Poly1305:
+					return "xchacha20poly1305";
+			}
+			return "unknown";
+		}
+
+		inline bool parse_suite(std::string const & name, CipherSuite & suite)
+		{
+			for (uint8_t i = 0; i <= (uint8_t)CipherSuite::XChaCha20Poly1305; i++) {
+				if (name == suite_name((CipherSuite)i)) {
+					suite = (CipherSuite)i;
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+};
+
+#endif /* SUITE_HH_ */
@@ -1,21 +1,112 @@
 #ifndef SYMMETRIC_HH_
 #define SYMMETRIC_HH_
 
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
 #include <sodium.h>
 #include "crypto/secretkey.hh"
 #include "crypto/ciphertext.hh"
+#include "crypto/suite.hh"
 #include "utils/secure.hh"
+#include "utils/workpool.hh"
 
 namespace hush {
 	namespace crypto {
+		class SymmetricException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		/*
+		 * One block of a batch. The block number is authenticated along with
+		 * the data, so a block copied to another spot in the image won't
+		 * decipher there. The legacy secretbox suite has no additional
+		 * data and can't offer that.
+		 */
+		struct BlockBuffer {
+			uint64_t block;
+			// see next_generation() in crypto/nonce.hh
+			uint64_t generation;
+			unsigned char *data;
+			size_t len;
+			unsigned char *mac;
+			unsigned char *nonce;
+			/*
+			 * How the plaintext was packed before it was sealed, 0 if it
+			 * wasn't. A packed block's format and `len` are authenticated
+			 * too, so neither can be changed to send it somewhere else to
+			 * be unpacked.
+			 */
+			uint8_t format;
+		};
+
 		class Symmetric
 		{
 		public:
+			/*
+			 * The suite is resolved to a set of libsodium entry points once,
+			 * here, so enciphering a block is a single indirect call. Throws
+			 * SymmetricException if this CPU can't run the suite.
+			 */
+			Symmetric(CipherSuite suite=CipherSuite::XSalsa20Poly1305);
+
+			// AES-256-GCM when the CPU has AES-NI and PCLMUL, XChaCha20-Poly1305 otherwise
+			static CipherSuite best_suite();
+			static bool is_available(CipherSuite suite);
+
+			CipherSuite get_suite() const { return suite; };
+			size_t nonce_bytes() const;
+			size_t mac_bytes() const;
+			// false for secretbox, see suite.hh
+			bool authenticates_ad() const;
+
 			void encipher(CipherText& dest, SecretKey const & sk,
 					hush::secure::vector<unsigned char>& message);
+			bool decipher(hush::secure::vector<unsigned char>& dest, SecretKey const & sk,
+					CipherText const & src) const;
+
+			/*
+			 * The block path. `data` is enciphered in place, and the tag and
+			 * a fresh random nonce go into the caller's `mac` and `nonce`,
+			 * which must hold mac_bytes() and nonce_bytes(). Nothing is
+			 * allocated, so these are safe to call per 4 KiB block. `ad` is
+			 * authenticated but not enciphered; secretbox ignores it,
+			 * see authenticates_ad().
+			 */
+			void encipher(unsigned char *data, size_t len, unsigned char *mac,
+					unsigned char *nonce, SecretKey const & sk,
+					unsigned char const *ad=nullptr, size_t adlen=0) const;
+			// as above, with a nonce the caller built instead of a random one
+			void encipher_fixed(unsigned char *data, size_t len, unsigned char *mac,
+					unsigned char const *nonce, SecretKey const & sk,
+					unsigned char const *ad=nullptr, size_t adlen=0) const;
+			// returns false, leaving `data` unspecified, if the tag doesn't verify
+			bool decipher(unsigned char *data, size_t len, unsigned char const *mac,
+					unsigned char const *nonce, SecretKey const & sk,
+					unsigned char const *ad=nullptr, size_t adlen=0) const;
+
+			/*
+			 * Spread a batch of blocks over `pool` and return once the whole
+			 * batch is done. encipher fills in each block's nonce from its
+			 * number, generation and `epoch`, and throws SymmetricException
+			 * if one won't fit. decipher returns false if any block failed
+			 * to authenticate, or under secretbox, if its nonce wasn't built
+			 * for its block number or it claims to be packed.
+			 */
+			void encipher(std::vector<BlockBuffer> & blocks, SecretKey const & sk,
+					hush::utils::WorkPool & pool, uint64_t epoch) const;
+			bool decipher(std::vector<BlockBuffer> & blocks, SecretKey const & sk,
+					hush::utils::WorkPool & pool) const;
+
+			struct Impl;
+
+		private:
+			CipherSuite suite;
+			Impl const *impl;
 		};
 	};
 };
 
 #endif /* SYMMETRIC_HH_ */
-
@@ -0,0 +1,8 @@
+#ifndef HUSH_DEFRAG_HH
+#define HUSH_DEFRAG_HH
+
+#include "utils/optparse.h"
+
+int hush_defrag(struct optparse *);
+
+#endif /* HUSH_DEFRAG_HH */
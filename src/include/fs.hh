@@ -15,7 +15,9 @@ namespace hush {
 		using SuperblockStats = struct alignas(8) {
 			    char magic[4];
 			uint8_t  version;
-			    char unused[7];
+			uint8_t  cipher; // hush::crypto::CipherSuite
+			uint8_t  compression; // hush::fs::Compression, for blocks written from now on
+			    char unused[5];
 			uint32_t block_size;
 			uint64_t disk_size;
 			uint64_t total_inodes;
@@ -28,12 +30,107 @@ namespace hush {
 			uint64_t block_bitmap_offset;
 			uint64_t inode_table_offset;
 			uint64_t first_datablock;
+			uint64_t free_blocks;
+			uint64_t free_inodes;
+			uint64_t group_count;
+			uint64_t flags;
+			// bumped on every mount, see crypto/nonce.hh
+			uint64_t mount_epoch;
+			// data keys in use, see crypto/keyring.hh and utils/rekey.hh
+			uint64_t key_generation;
+			uint64_t rekey_watermark;
+			// the groups merkle_root covers, see utils/merkle.hh
+			uint64_t merkle_groups;
+			uint8_t  merkle_root[32];
+			// 0 blocks without dedup, see utils/dedup.hh
+			uint64_t dedup_index_offset;
+			uint64_t dedup_index_blocks;
+		};
+
+		/*
+		 * A block group is a self-contained slice of the image with its own
+		 * bitmaps and inode table. Group 0 is laid out by `hush create` and
+		 * mirrors the offsets in SuperblockStats; `hush resize` appends more.
+		 * All offsets are absolute block numbers within the image.
+		 */
+		using BlockGroup = struct alignas(8) __block_group {
+			uint64_t start_block;
+			uint64_t total_blocks;
+			uint64_t first_inode;
+			uint64_t total_inodes;
+			uint64_t inode_bitmap_offset;
+			uint64_t inode_bitmap_blocks;
+			uint64_t block_bitmap_offset;
+			uint64_t block_bitmap_blocks;
+			uint64_t inode_table_offset;
+			uint64_t inode_table_blocks;
+			uint64_t first_datablock;
+			uint64_t free_blocks;
+			uint64_t free_inodes;
+			// one BlockTag per block of the group, 0 blocks before tags existed
+			uint64_t tag_table_offset;
+			uint64_t tag_table_blocks;
+			// root of the hash tree over the tag table
+			uint8_t  merkle_root[32];
 		};
 
-		using Superblock = struct alignas(8) {
+		using Superblock = struct alignas(8) __superblock {
 			SuperblockStats fields;
-			uint8_t padding[HUSHFS_BLOCK_SIZE - sizeof(SuperblockStats)];	
+			BlockGroup groups[HUSHFS_MAX_GROUPS];
+			uint8_t padding[HUSHFS_BLOCK_SIZE - sizeof(SuperblockStats) -
+				(HUSHFS_MAX_GROUPS * sizeof(BlockGroup))];
+		};
+
+		/*
+		 * One copy of the volume key, wrapped with a key derived from a
+		 * passphrase or keyfile and that slot's own salt and pwhash limits.
+		 * Adding or changing a passphrase only rewrites its own slot.
+		 */
+		using KeySlot = struct alignas(8) __key_slot {
+			uint8_t  active;
+			    char unused[7];
+			uint64_t opslimit;
+			uint64_t memlimit;
+			uint8_t  salt[16];
+			uint8_t  nonce[24];
+			uint8_t  mac[16];
+			uint8_t  wrapped_key[HUSHFS_KEY_BYTES];
+			// a hash keyed with the volume key, to tell it apart from any other
+			uint8_t  key_check[32];
+			uint8_t  padding[HUSHFS_BLOCK_SIZE - 24 - 16 - 24 - 16 - HUSHFS_KEY_BYTES - 32];
+		};
+
+		/*
+		 * What it takes to open a sealed data block: its nonce and tag, and
+		 * the generation of the data key it was sealed with. Blocks are
+		 * enciphered in place, so the tag table is the only space overhead.
+		 */
+		using BlockTag = struct alignas(8) __block_tag {
+			uint8_t  nonce[24];
+			uint8_t  mac[16];
+			uint64_t key_generation; // as wide as the superblock's
+			uint32_t flags;
+			// bytes sealed, when the block was compressed with `compression`; both are authenticated
+			uint32_t stored_len;
+			uint8_t  compression; // hush::fs::Compression
+			uint8_t  reserved[7];
+		};
+		static_assert(sizeof(BlockTag) * HUSHFS_TAGS_PER_BLOCK == HUSHFS_BLOCK_SIZE,
+				"BlockTags must pack a block exactly");
+
+		/*
+		 * One slot of the dedup index: a keyed fingerprint of a block's
+		 * plaintext and how many block pointers share that block. Block 0
+		 * marks a slot that was never used, HUSHFS_DEDUP_DELETED one that
+		 * was and has been given up.
+		 */
+		using DedupEntry = struct alignas(8) __dedup_entry {
+			uint8_t  fingerprint[20];
+			uint32_t refs;
+			uint64_t block;
 		};
+		static_assert(sizeof(DedupEntry) * HUSHFS_DEDUP_PER_BLOCK == HUSHFS_BLOCK_SIZE,
+				"DedupEntries must pack a block exactly");
 
 		using Datablock = struct alignas(8) {
 			uint8_t data[HUSHFS_BLOCK_SIZE];
@@ -47,7 +144,7 @@ namespace hush {
 			};
 		};
 
-		using InodeData = struct alignas(8) {
+		using InodeData = struct alignas(8) __inode_data {
 			mode_t mode; //uint32
 			uid_t uid; //uint32
 			gid_t gid; //uint32
@@ -57,7 +154,7 @@ namespace hush {
 			struct timespec mtime; //uint64_t[2]
 			struct timespec ctime; //uint64_t[2]
 
-			uint64_t direct_ptr[12];
+			uint64_t direct_ptr[HUSHFS_DIRECT_BLOCKS];
 			uint64_t single_indirect_ptr;
 			uint64_t double_indirect_ptr;
 			uint64_t triple_indirect_ptr;
@@ -68,7 +165,7 @@ namespace hush {
 			};
 		};
 
-		using Inode = struct alignas(8) {
+		using Inode = struct alignas(8) __inode {
 			InodeData fields;
 			uint8_t padding[HUSHFS_INODE_ALIGN_SIZE - sizeof(InodeData)];
 		};
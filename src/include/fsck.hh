@@ -0,0 +1,8 @@
+#ifndef HUSH_FSCK_HH
+#define HUSH_FSCK_HH
+
+#include "utils/optparse.h"
+
+int hush_fsck(struct optparse *);
+
+#endif /* HUSH_FSCK_HH */
@@ -0,0 +1,8 @@
+#ifndef HUSH_KEYSLOT_HH
+#define HUSH_KEYSLOT_HH
+
+#include "utils/optparse.h"
+
+int hush_keyslot(struct optparse *);
+
+#endif /* HUSH_KEYSLOT_HH */
@@ -0,0 +1,8 @@
+#ifndef HUSH_RESIZE_HH
+#define HUSH_RESIZE_HH
+
+#include "utils/optparse.h"
+
+int hush_resize(struct optparse *);
+
+#endif /* HUSH_RESIZE_HH */
@@ -0,0 +1,8 @@
+#ifndef HUSH_STATIMAGE_HH
+#define HUSH_STATIMAGE_HH
+
+#include "utils/optparse.h"
+
+int hush_stat_image(struct optparse *);
+
+#endif /* HUSH_STATIMAGE_HH */
@@ -0,0 +1,62 @@
+#ifndef ARENA_HH_
+#define ARENA_HH_
+
+#include <array>
+#include <cstddef>
+#include <mutex>
+
+namespace hush {
+	namespace secure {
+		/*
+		 * Hands out power-of-two chunks from 16 bytes up to a block, carved
+		 * on demand from one fixed region and kept on a free list per size
+		 * class once they're given back. Chunks are zeroed as they're freed.
+		 * Anything bigger than a block, or that no longer fits, is the
+		 * caller's to get elsewhere.
+		 */
+		class Arena
+		{
+		public:
+			static size_t const MIN_CHUNK = 16;
+			static size_t const CLASSES = 9; // 16 bytes .. 4 KiB
+
+			Arena(void *base, size_t size);
+
+			Arena(Arena const &) = delete;
+			void operator=(Arena const &) = delete;
+
+			// returns nullptr if `n` bytes can't come from here
+			void *allocate(size_t n);
+			// `n` as passed to allocate(); returns false if `p` isn't ours
+			bool deallocate(void *p, size_t n);
+
+			bool owns(void const *p) const;
+			// bytes handed out and not yet given back, by chunk size
+			size_t in_use() const { return used; };
+
+			/*
+			 * The process-wide arena behind SodiumAllocator: a single
+			 * sodium_malloc'd region, so it's mlocked and fenced by guard
+			 * pages once rather than per allocation.
+			 */
+			static Arena & secure();
+
+		private:
+			struct Chunk {
+				Chunk *next;
+			};
+
+			static unsigned class_of(size_t n);
+
+			std::mutex lock;
+			unsigned char *base;
+			size_t size;
+			// everything below this has been carved
+			size_t carved = 0;
+			size_t used = 0;
+			std::array<Chunk *, CLASSES> free_chunks;
+		};
+	};
+};
+
+#endif /* ARENA_HH_ */
@@ -3,6 +3,9 @@
 
 #include <cstdint>
 #include <stdexcept>
+#include <string>
+#include <utility> // pair
+#include <vector>
 #include <algorithm> // transform, toupper
 #include "crypto/ciphertext.hh"
 
@@ -68,6 +71,7 @@ namespace hush {
 				T out;
 				typename T::value_type item;
 				int8_t a, b, c, d;
+				bool padded;
 
 				for (auto it = in.cbegin(); it != in.cend(); it += 4) {
 					a = decode_byte(*it);
@@ -75,14 +79,15 @@ namespace hush {
 					c = decode_byte(*(it+2));
 					d = decode_byte(*(it+3));
 
-					if (c == -1)
+					// "xx==" carries one byte, a zero second byte is still data
+					if ((padded = (c == -1)))
 						c = 0;
 
 					item = (a << 2) | ((b & 0x30) >> 4);
 					out.push_back(item);
 
 					item = ((b & 0x0F) << 4) | ((c & 0x3C) >> 2);
-					if (item != 0)
+					if (!padded)
 						out.push_back(item);
 
 					if (d != -1)
@@ -107,13 +112,24 @@ namespace hush {
 				return encode(vec);
 			}
 
+			/*
+			 * RFC 1421 style "Name: value" lines between the BEGIN line and
+			 * the data, ended by an empty line. They're not encoded.
+			 */
+			using Headers = std::vector<std::pair<std::string, std::string>>;
+
 			R const pemify(R const & in, char const *keytype) const
 			{
 				std::string k = keytype;
-				return pemify(in, k);
+				return pemify(in, k, Headers());
 			}
 
 			R const pemify(R const & in, std::string const & keytype) const
+			{
+				return pemify(in, keytype, Headers());
+			}
+
+			R const pemify(R const & in, std::string const & keytype, Headers const & headers) const
 			{
 				R out;
 				int linelen = 0;
@@ -121,6 +137,11 @@ namespace hush {
 				std::transform(kt.begin(), kt.end(), kt.begin(), ::toupper); 
 			
 				out = "-----BEGIN SODIUM "+ kt + " KEY-----\r\n";
+				for (auto const & h : headers)
+					out.append(h.first + ": " + h.second + "\r\n");
+				if (!headers.empty())
+					out.append("\r\n");
+
 				for (auto it = in.cbegin(); it != in.cend(); it++) {
 					out.push_back(*it);
 					if (++linelen == 64) {
@@ -135,20 +156,53 @@ namespace hush {
 			};
 
 			R const unpemify(R const & in) const
+			{
+				Headers headers;
+				return unpemify(in, headers);
+			}
+
+			R const unpemify(R const & in, Headers & headers) const
 			{
 				R out;
-				size_t pos;
+				size_t pos, end;
 				std::string marker = "-----";
 
-				if (in.find(marker) != 0)
+				if (in.find(marker) != 0 || (pos = in.find("\r\n")) == R::npos)
 					throw B64Exception("Bad PEM data, can't unencode");
 
-				out = in.substr(in.find("\r\n")+2, in.rfind("\r\n"));
+				pos += 2;
+				if ((end = in.find(marker, pos)) == R::npos)
+					throw B64Exception("Bad PEM data, can't unencode");
+				out = in.substr(pos, end - pos);
+
+				// base64 has no ':', so a first line with one starts the headers
+				headers.clear();
+				if (out.find(':') < out.find("\r\n")) {
+					size_t blank = out.find("\r\n\r\n");
+
+					if (blank == R::npos)
+						throw B64Exception("Bad PEM headers, can't unencode");
+
+					for (size_t line = 0; line < blank + 2; ) {
+						size_t eol = out.find("\r\n", line);
+						R h = out.substr(line, eol - line);
+						size_t colon = h.find(':');
+
+						if (colon == R::npos)
+							throw B64Exception("Bad PEM header, can't unencode");
 
-				while ((pos = out.find("\r\n")) != -1)
+						size_t value = h.find_first_not_of(' ', colon + 1);
+						headers.emplace_back(h.substr(0, colon),
+								value == R::npos ? R() : h.substr(value));
+						line = eol + 2;
+					}
+					out.erase(0, blank + 4);
+				}
+
+				while ((pos = out.find("\r\n")) != R::npos)
 					out.replace(pos, 2, "");
 
-				return out.substr(0, out.find(marker));
+				return out;
 			};
 
 			int const decode_byte(char x) const
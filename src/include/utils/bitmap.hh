@@ -0,0 +1,53 @@
+#ifndef BITMAP_HH_
+#define BITMAP_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace hush {
+	namespace utils {
+		/*
+		 * A fixed size bitmap that many threads can set bits in at once
+		 * without a lock. Each bit lives in a 64-bit word that's updated with
+		 * fetch_or, so test_and_set tells exactly one caller it got there
+		 * first.
+		 */
+		class AtomicBitmap
+		{
+		public:
+			AtomicBitmap(uint64_t bits) :
+				nbits(bits), nwords((bits + 63) / 64),
+				words(new std::atomic<uint64_t>[(bits + 63) / 64])
+			{
+				for (uint64_t i = 0; i < nwords; i++)
+					words[i].store(0, std::memory_order_relaxed);
+			};
+
+			AtomicBitmap(AtomicBitmap const &) = delete;
+			void operator=(AtomicBitmap const &) = delete;
+
+			// returns the previous value of the bit
+			bool test_and_set(uint64_t bit)
+			{
+				uint64_t mask = 1ULL << (bit % 64);
+				return (words[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask) != 0;
+			};
+
+			bool test(uint64_t bit) const
+			{
+				uint64_t mask = 1ULL << (bit % 64);
+				return (words[bit / 64].load(std::memory_order_relaxed) & mask) != 0;
+			};
+
+			uint64_t size() const { return nbits; };
+
+		private:
+			uint64_t nbits;
+			uint64_t nwords;
+			std::unique_ptr<std::atomic<uint64_t>[]> words;
+		};
+	};
+};
+
+#endif /* BITMAP_HH_ */
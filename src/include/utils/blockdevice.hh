@@ -0,0 +1,93 @@
+#ifndef BLOCKDEVICE_HH_
+#define BLOCKDEVICE_HH_
+
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+
+/*
+ * Everything hush reads or writes in an image goes through a BlockDevice.
+ * The image's fd is still what names it, so code that only has an fd (all
+ * of it, through read_data/write_data) picks up whatever device is attached
+ * to that fd. Nothing attached means plain pread/pwrite.
+ *
+ * Like read_data/write_data, devices throw a std::string on I/O errors.
+ * Every call is positioned, none of them move or depend on the fd's file
+ * offset, so they're safe to make from any number of threads at once.
+ */
+namespace hush {
+	namespace fs {
+		class BlockDevice
+		{
+		public:
+			enum class Op { Read, Write };
+
+			struct Request {
+				Op op;
+				void *buf; // only read from for a Write
+				uint64_t offset;
+				uint64_t len;
+			};
+
+			virtual ~BlockDevice() {};
+
+			virtual void read(void *buf, uint64_t offset, uint64_t len) = 0;
+			virtual void write(void const *buf, uint64_t offset, uint64_t len) = 0;
+
+			/*
+			 * Scatter/gather over consecutive bytes starting at `offset`.
+			 * Here they're a batch of one request per buffer.
+			 */
+			virtual void readv(struct iovec const *iov, int count, uint64_t offset);
+			virtual void writev(struct iovec const *iov, int count, uint64_t offset);
+
+			/*
+			 * Start every request of `batch` and return once they've all
+			 * finished, in whatever order the device likes. They mustn't
+			 * overlap. Here they simply run one after another, devices
+			 * that can have several in flight do better.
+			 */
+			virtual void submit(std::vector<Request> const & batch);
+
+			// make what's been written so far durable, false if that failed
+			virtual bool sync() = 0;
+
+			/*
+			 * Memory that much of the I/O will go to and from, for devices
+			 * that can pin it ahead of time; the rest ignore it. Replaces
+			 * whatever was registered before, and like attaching a device,
+			 * only while nothing is doing I/O through it. The memory has to
+			 * stay put until it's replaced or the device goes.
+			 */
+			virtual void register_buffers(std::vector<struct iovec> const & bufs) {};
+		};
+
+		// plain positioned syscalls, retried until the whole range is done
+		class PosixDevice : public BlockDevice
+		{
+		public:
+			PosixDevice(int fd) : fd(fd) {};
+
+			void read(void *buf, uint64_t offset, uint64_t len) override;
+			void write(void const *buf, uint64_t offset, uint64_t len) override;
+			void readv(struct iovec const *iov, int count, uint64_t offset) override;
+			void writev(struct iovec const *iov, int count, uint64_t offset) override;
+			bool sync() override;
+
+		private:
+			int fd;
+		};
+
+		/*
+		 * The device behind `fd`. Attaching and detaching must happen
+		 * while nothing else is doing I/O on the fd, typically right after
+		 * opening the image and right before closing it; the device lives
+		 * until it's detached or replaced.
+		 */
+		BlockDevice & device(int fd);
+		void attach_device(int fd, BlockDevice *dev);
+		void detach_device(int fd);
+	};
+};
+
+#endif /* BLOCKDEVICE_HH_ */
@@ -0,0 +1,92 @@
+#ifndef BLOCKIO_HH_
+#define BLOCKIO_HH_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "crypto/symmetric.hh"
+#include "crypto/keyring.hh"
+#include "utils/workpool.hh"
+#include "utils/merkle.hh"
+#include "fs.hh"
+
+// serialises BlockTag updates, a power of two
+#define HUSHFS_TAG_STRIPES 64
+
+namespace hush {
+	namespace fs {
+		class BlockIOException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		/*
+		 * Sealed data blocks. Every block is enciphered in place with the
+		 * data key of the current generation, and its nonce, tag and key
+		 * generation go to its BlockTag. Blocks that were never written, or
+		 * were written with zeros, read back as zeros without any I/O.
+		 * Blocks are compressed before they're sealed if the image was made
+		 * with compression, see utils/compress.hh. The superblock is read
+		 * for the current epoch, key generation and compression on every
+		 * call, so `sb` has to outlive us; `next_epoch` is called if a
+		 * block runs out of nonces.
+		 *
+		 * Writers of blocks whose tags share a tag block are serialised by
+		 * a striped lock; anything else runs in parallel. With a `tree`,
+		 * every tag block read is checked against it and every one written
+		 * goes into it.
+		 */
+		class BlockIO
+		{
+		public:
+			using EpochSource = std::function<uint64_t()>;
+
+			BlockIO(int fd, Superblock const & sb, hush::crypto::Symmetric const & symmetric,
+					hush::crypto::KeyRing & keys, hush::utils::WorkPool & pool,
+					EpochSource next_epoch, MerkleTree *tree=nullptr) :
+				fd(fd), sb(sb), symmetric(symmetric), keys(keys), pool(pool),
+				next_epoch(next_epoch), tree(tree) {};
+
+			void read(uint64_t first, uint64_t count, uint8_t *buf);
+			void write(uint64_t first, uint64_t count, uint8_t const *buf);
+
+			/*
+			 * Reseal any written block in the range that isn't under the
+			 * current key generation. Returns how many there were.
+			 */
+			uint64_t reseal(uint64_t first, uint64_t count);
+
+			/*
+			 * Make the range read back as zeros without writing anything
+			 * to it, for blocks handed out by preallocation.
+			 */
+			void mark_unwritten(uint64_t first, uint64_t count);
+
+			// move sealed blocks, the block number is part of what's authenticated
+			void relocate(std::vector<uint64_t> const & from, std::vector<uint64_t> const & to);
+
+		private:
+			class Tags;
+			using Locks = std::vector<std::unique_lock<std::mutex>>;
+
+			Locks lock_tags(std::vector<uint64_t> const & blocks);
+			void seal(std::vector<uint64_t> const & blocks, Tags & tags, uint8_t *data);
+			void unseal(std::vector<uint64_t> const & blocks, Tags & tags, uint8_t *data);
+
+			int fd;
+			Superblock const & sb;
+			hush::crypto::Symmetric const & symmetric;
+			hush::crypto::KeyRing & keys;
+			hush::utils::WorkPool & pool;
+			EpochSource next_epoch;
+			MerkleTree *tree;
+			std::mutex stripes[HUSHFS_TAG_STRIPES];
+		};
+	};
+};
+
+#endif /* BLOCKIO_HH_ */
@@ -0,0 +1,74 @@
+#ifndef BLOCKMAP_HH_
+#define BLOCKMAP_HH_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "fs.hh"
+
+namespace hush {
+	namespace fs {
+		/*
+		 * Called once for every non-zero pointer in an inode's block map.
+		 * `logical` is the file block the pointer maps (for an indirect block,
+		 * the first file block underneath it) and `indirect` says whether
+		 * `physical` holds more pointers rather than file data. Returning
+		 * false from an indirect block skips everything below it.
+		 */
+		using BlockVisitor = std::function<bool(uint64_t logical, uint64_t physical, bool indirect)>;
+
+		// Indirect blocks are read from `fd`, so each thread should bring its own.
+		void walk_block_map(int fd, InodeData const & inode, BlockVisitor const & visit);
+
+		// a run of file blocks that are also consecutive on disk
+		using Extent = struct __extent {
+			uint64_t logical;
+			uint64_t physical;
+			uint64_t length;
+		};
+
+		/*
+		 * The data blocks of a file collapsed into extents, in file order. If
+		 * `indirect` is given it's set to the number of indirect blocks seen.
+		 */
+		std::vector<Extent> file_extents(int fd, InodeData const & inode,
+				uint64_t *indirect=nullptr);
+
+		// how many blocks a block map can point at
+		uint64_t max_file_blocks();
+
+		// the block holding file block `logical`, 0 if it's a hole
+		uint64_t map_block(int fd, InodeData const & inode, uint64_t logical);
+
+		/*
+		 * lseek(2)'s SEEK_DATA and SEEK_HOLE on the block map: move `offset`
+		 * to the next byte that's backed by a block, or isn't. The end of
+		 * the file counts as a hole. Both return false, ENXIO, at or past
+		 * the end of the file, and seek_data also when only holes follow.
+		 * Whole subtrees behind a null indirect pointer are skipped without
+		 * reading anything, so a file made with `truncate -s 100G` costs
+		 * nothing to scan.
+		 */
+		bool seek_data(int fd, InodeData const & inode, uint64_t & offset);
+		bool seek_hole(int fd, InodeData const & inode, uint64_t & offset);
+
+		// hands out up to `want` consecutive blocks, see MountInfo::allocate_run
+		using RunAllocator = std::function<uint64_t(uint64_t want, uint64_t & got)>;
+
+		/*
+		 * Point every hole among file blocks [logical, logical + count) at
+		 * a newly allocated block, allocating whole holes as one run where
+		 * the allocator can manage it. Indirect blocks are allocated and
+		 * written as they're needed; the inode itself is only changed in
+		 * memory. The new data blocks go to `added` and hold whatever was
+		 * on disk, so the caller has to make them read back as zeros.
+		 * Returns false if space ran out, or the range goes past
+		 * max_file_blocks(), with what was mapped by then still mapped.
+		 */
+		bool fill_holes(int fd, InodeData & inode, uint64_t logical, uint64_t count,
+				RunAllocator const & allocate, std::vector<Extent> & added);
+	};
+};
+
+#endif /* BLOCKMAP_HH_ */
@@ -0,0 +1,60 @@
+#ifndef BUFFERPOOL_HH_
+#define BUFFERPOOL_HH_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <sys/uio.h>
+
+namespace hush {
+	namespace utils {
+		class BufferPoolException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		/*
+		 * A fixed number of equally sized buffers, aligned for O_DIRECT,
+		 * carved from one allocation made up front. Nothing is allocated
+		 * after that, callers wait for buffers to come back instead, so
+		 * what I/O costs in memory is known when the pool is made.
+		 */
+		class BufferPool
+		{
+		public:
+			// throws BufferPoolException if the memory can't be had
+			BufferPool(size_t buffer_bytes, size_t count, size_t alignment);
+			~BufferPool();
+
+			BufferPool(BufferPool const &) = delete;
+			void operator=(BufferPool const &) = delete;
+
+			/*
+			 * Wait until `n` buffers are free and take them all at once,
+			 * so callers that each need several can't starve each other.
+			 * `n` is at most count().
+			 */
+			std::vector<uint8_t *> get(size_t n);
+			void put(std::vector<uint8_t *> const & bufs);
+
+			size_t buffer_size() const { return buffer_bytes; };
+			size_t count() const { return buffers; };
+			// the whole allocation, for devices that register memory ahead of time
+			struct iovec region() const { return { base, buffer_bytes * buffers }; };
+
+		private:
+			uint8_t *base = nullptr;
+			size_t buffer_bytes;
+			size_t buffers;
+			std::mutex lock;
+			std::condition_variable returned;
+			std::vector<uint8_t *> free_buffers;
+		};
+	};
+};
+
+#endif /* BUFFERPOOL_HH_ */
@@ -0,0 +1,60 @@
+#ifndef COMPRESS_HH_
+#define COMPRESS_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace hush {
+	namespace fs {
+		/*
+		 * How a data block is compressed before it's sealed. The image's
+		 * choice is in the superblock and each block's own is in its
+		 * BlockTag, so these values are part of the on-disk format. Which
+		 * ones a binary can use depends on how it was built, see the
+		 * Makefile.
+		 */
+		enum class Compression : uint8_t {
+			None = 0,
+			LZ4  = 1,
+			Zstd = 2,
+		};
+
+		inline char const *compression_name(Compression c)
+		{
+			switch (c) {
+				case Compression::None:
+					return "none";
+				case Compression::LZ4:
+					return "lz4";
+				case Compression::Zstd:
+					return "zstd";
+			}
+			return "unknown";
+		}
+
+		inline bool parse_compression(std::string const & name, Compression & c)
+		{
+			for (uint8_t i = 0; i <= (uint8_t)Compression::Zstd; i++) {
+				if (name == compression_name((Compression)i)) {
+					c = (Compression)i;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool compression_available(Compression c);
+
+		/*
+		 * Compress a block into `out`, which holds a block. Returns the
+		 * compressed length, or 0 if the block doesn't shrink by at least
+		 * HUSHFS_COMPRESS_MIN_SAVING and should be stored as it is.
+		 */
+		size_t compress_block(Compression c, uint8_t const *in, uint8_t *out);
+		// returns false unless `in` expands to exactly a block
+		bool decompress_block(Compression c, uint8_t const *in, size_t len, uint8_t *out);
+	};
+};
+
+#endif /* COMPRESS_HH_ */
@@ -0,0 +1,119 @@
+#ifndef DEDUP_HH_
+#define DEDUP_HH_
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "crypto/secretkey.hh"
+#include "utils/blockio.hh"
+#include "fs.hh"
+
+namespace hush {
+	namespace fs {
+		class DedupException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		/*
+		 * Shares data blocks between every block pointer that would hold
+		 * the same plaintext. Blocks are named by a BLAKE2b hash keyed with
+		 * a key derived from the volume key, so the index, which isn't
+		 * enciphered, says which blocks are equal and nothing else. It's an
+		 * open addressed table on disk (see DedupEntry); a bloom filter and
+		 * a map from block to slot, both rebuilt from it at open(), keep
+		 * blocks that aren't duplicates off the disk entirely.
+		 *
+		 * Refcounts go up before a caller stores the pointer and come down
+		 * after it's gone, so a crash can only leave one too high. The
+		 * first change after open() sets HUSHFS_FLAG_DEDUP_DIRTY through
+		 * `mark` and close() clears it once the index is synced; an index
+		 * left dirty has to go through `hush fsck -y` before it's trusted.
+		 */
+		class Dedup
+		{
+		public:
+			using Fingerprint = std::array<uint8_t, 20>;
+			using Allocate = std::function<uint64_t()>;
+			using Release = std::function<void(uint64_t block)>;
+			using Mark = std::function<void(bool dirty)>;
+
+			Dedup(int fd, Superblock const & sb, BlockIO & io,
+					hush::crypto::SecretKey const & volume_key,
+					Allocate allocate, Release release, Mark mark);
+
+			Dedup(Dedup const &) = delete;
+			void operator=(Dedup const &) = delete;
+
+			// read the index, throws DedupException if it was left dirty
+			void open();
+			void close();
+
+			/*
+			 * Seal a block of plaintext, or find one that already holds
+			 * it, and take a reference to it. Returns the block number to
+			 * point at, which is 0, a hole, for a block of zeros. Throws
+			 * DedupException if the image is full.
+			 */
+			uint64_t store(uint8_t const *data);
+			// drop a reference, freeing the block with the last one; holes are ignored
+			void release(uint64_t block);
+
+			// 1 for a block the index doesn't know
+			uint32_t refs(uint64_t block);
+
+		private:
+			Fingerprint fingerprint(uint8_t const *data);
+			void remember(Fingerprint const & fp);
+			bool maybe_indexed(Fingerprint const & fp) const;
+			/*
+			 * The slot and entry holding `fp`. `free_slot`, if given, gets
+			 * the first slot on the way that an entry for it could go in,
+			 * or `slots` if there's none.
+			 */
+			bool find(Fingerprint const & fp, uint64_t & slot, DedupEntry & e,
+					uint64_t *free_slot);
+			// take a reference to the block holding `fp`, if there is one
+			bool acquire(Fingerprint const & fp, uint64_t & block);
+			void touch();
+
+			int fd;
+			Superblock const & sb;
+			BlockIO & io;
+			hush::crypto::SecretKey key;
+			Allocate allocate;
+			Release free_block;
+			Mark mark;
+			std::mutex lock;
+			uint64_t slots = 0;
+			std::vector<uint8_t> filter;
+			std::unordered_map<uint64_t, uint64_t> slot_of;
+			bool dirty = false;
+		};
+
+		using DedupRef = struct __dedup_ref {
+			uint64_t slot;
+			uint32_t refs;
+		};
+
+		/*
+		 * Calls visit(slot, entry) for every entry in use, reading the
+		 * index a few blocks at a time; needs no key.
+		 */
+		using DedupVisitor = std::function<void(uint64_t slot, DedupEntry const & e)>;
+		void scan_dedup_index(int fd, Superblock const & sb, DedupVisitor const & visit);
+
+		// every block in the index, for fsck and defrag; needs no key
+		std::unordered_map<uint64_t, DedupRef> load_dedup_refs(int fd, Superblock const & sb);
+		void read_dedup_entry(int fd, Superblock const & sb, uint64_t slot, DedupEntry & e);
+		void write_dedup_entry(int fd, Superblock const & sb, uint64_t slot, DedupEntry const & e);
+	};
+};
+
+#endif /* DEDUP_HH_ */
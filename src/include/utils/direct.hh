@@ -0,0 +1,83 @@
+#ifndef DIRECT_HH_
+#define DIRECT_HH_
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "utils/blockdevice.hh"
+#include "utils/bufferpool.hh"
+
+namespace hush {
+	namespace fs {
+		/*
+		 * Makes any request fit an image opened O_DIRECT, where the kernel
+		 * takes only whole, aligned blocks and caches none of them. Whole
+		 * blocks in an aligned buffer go straight to the device underneath;
+		 * in any other buffer they're bounced through a fixed pool of
+		 * aligned ones.
+		 *
+		 * Pieces of blocks, which is what the metadata mostly comes in, go
+		 * through a small cache of whole blocks that's written through, so
+		 * reading a few inodes or changing a dedup entry costs one block of
+		 * I/O, or none, rather than a trip through the page cache. Whole
+		 * blocks written past it drop any copy it has. Blocks are read
+		 * before a piece of them is written, so the image has to be made
+		 * of whole blocks, as every hush image is, and a piece waits for
+		 * any whole-block write to its block that's under way, so as not
+		 * to put back what that wrote over.
+		 *
+		 * That cache and the pool are all the memory I/O ever takes,
+		 * however much of it there is.
+		 */
+		class DirectDevice : public BlockDevice
+		{
+		public:
+			// takes `inner`; both counts are in blocks
+			DirectDevice(BlockDevice *inner, size_t bounce_blocks, size_t cache_blocks);
+
+			DirectDevice(DirectDevice const &) = delete;
+			void operator=(DirectDevice const &) = delete;
+
+			void read(void *buf, uint64_t offset, uint64_t len) override;
+			void write(void const *buf, uint64_t offset, uint64_t len) override;
+			void submit(std::vector<Request> const & batch) override;
+			bool sync() override;
+
+		private:
+			struct Cached {
+				uint8_t *data;
+				std::list<uint64_t>::iterator recent;
+			};
+
+			// a request inside one block, through the cache
+			void partial(Request const & r);
+			// the block, read in on a miss; with cache_lock held
+			uint8_t *cached(uint64_t block);
+			// drops blocks [first, last] from the cache; with cache_lock held
+			void forget_blocks(uint64_t first, uint64_t last);
+			bool being_written(uint64_t block) const;
+			// whole blocks, in waves of as many as the pool has buffers for
+			void transfer(std::vector<Request> const & direct, std::vector<Request> const & bounced);
+
+			std::unique_ptr<BlockDevice> inner;
+			hush::utils::BufferPool bounce;
+			hush::utils::BufferPool cache_memory;
+
+			std::mutex cache_lock;
+			std::unordered_map<uint64_t, Cached> cache;
+			// most recently used first
+			std::list<uint64_t> recent;
+			std::vector<uint8_t *> spare;
+			// blocks [first, last] of whole-block writes under way
+			std::list<std::pair<uint64_t, uint64_t>> writing;
+			std::condition_variable written;
+		};
+	};
+};
+
+#endif /* DIRECT_HH_ */
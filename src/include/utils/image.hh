@@ -0,0 +1,44 @@
+#ifndef IMAGE_HH_
+#define IMAGE_HH_
+
+#include <cstdint>
+#include <vector>
+
+#include "fs.hh"
+
+/*
+ * Helpers for the tools that work on an image directly rather than through a
+ * mount (fsck, defrag, ...). All of them throw a std::string on I/O errors,
+ * like write_data/read_data.
+ */
+namespace hush {
+	namespace fs {
+		// read and sanity check the superblock
+		void load_superblock(int fd, Superblock & sb);
+
+		void load_group_maps(int fd, BlockGroup const & g, std::vector<uint8_t> & inode_bitmap,
+				std::vector<uint8_t> & block_bitmap);
+
+		void load_inode(int fd, Superblock const & sb, uint64_t i_no, Inode & inode);
+		void store_inode(int fd, Superblock const & sb, Inode const & inode);
+
+		/*
+		 * Take the lock a mount holds on the image for as long as it's up,
+		 * and the tools that rewrite its metadata for as long as they run.
+		 * It's an open file description lock on the first byte, so the
+		 * kernel drops it when `fd` is closed or the process dies, and it
+		 * doesn't get in the way of the flock around superblock updates.
+		 * False if something else has it; `fd` has to be open for writing.
+		 * Where the image's filesystem can't lock, this says so and lets
+		 * it through.
+		 */
+		bool claim_image(int fd);
+
+		// all HUSHFS_KEY_SLOTS of them, active or not
+		void load_key_slots(int fd, std::vector<KeySlot> & slots);
+		// write and sync one slot
+		void store_key_slot(int fd, unsigned n, KeySlot const & slot);
+	};
+};
+
+#endif /* IMAGE_HH_ */
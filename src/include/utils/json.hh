@@ -0,0 +1,141 @@
+#ifndef JSON_HH_
+#define JSON_HH_
+
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace hush {
+	namespace utils {
+		/*
+		 * Writes JSON straight to a stream as it's produced, so a report can
+		 * be as long as it likes without being held in memory. It only keeps
+		 * track of commas; it's up to the caller to nest things properly.
+		 * Keys are ignored inside arrays.
+		 */
+		class JsonWriter
+		{
+		public:
+			JsonWriter(std::ostream & o) : os(o) {};
+
+			JsonWriter & begin_object(char const *key=nullptr)
+			{
+				open(key, '{');
+				return *this;
+			};
+
+			JsonWriter & end_object()
+			{
+				close('}');
+				return *this;
+			};
+
+			JsonWriter & begin_array(char const *key=nullptr)
+			{
+				open(key, '[');
+				return *this;
+			};
+
+			JsonWriter & end_array()
+			{
+				close(']');
+				return *this;
+			};
+
+			template<typename T>
+			JsonWriter & value(char const *key, T v)
+			{
+				static_assert(std::is_arithmetic<T>::value, "JSON values must be numbers or strings");
+				prefix(key);
+				os << v;
+				return *this;
+			};
+
+			JsonWriter & value(char const *key, bool v)
+			{
+				prefix(key);
+				os << (v ? "true" : "false");
+				return *this;
+			};
+
+			JsonWriter & value(char const *key, std::string const & v)
+			{
+				prefix(key);
+				quote(v);
+				return *this;
+			};
+
+			JsonWriter & value(char const *key, char const *v)
+			{
+				return value(key, std::string(v));
+			};
+
+		private:
+			std::ostream & os;
+			// one entry per open object/array: true until it gets its first member
+			std::vector<bool> first;
+
+			void prefix(char const *key)
+			{
+				if (!first.empty()) {
+					if (!first.back())
+						os << ',';
+					first.back() = false;
+				}
+				if (key != nullptr) {
+					quote(key);
+					os << ':';
+				}
+			};
+
+			void open(char const *key, char c)
+			{
+				prefix(key);
+				os << c;
+				first.push_back(true);
+			};
+
+			void close(char c)
+			{
+				first.pop_back();
+				os << c;
+				if (first.empty())
+					os << std::endl;
+			};
+
+			void quote(std::string const & s)
+			{
+				os << '"';
+				for (char c : s) {
+					switch (c) {
+						case '"':
+							os << "\\\"";
+							break;
+						case '\\':
+							os << "\\\\";
+							break;
+						case '\n':
+							os << "\\n";
+							break;
+						case '\t':
+							os << "\\t";
+							break;
+						default:
+							if ((unsigned char)c < 0x20) {
+								char buf[8];
+								snprintf(buf, sizeof buf, "\\u%04x", c);
+								os << buf;
+							} else {
+								os << c;
+							}
+					}
+				}
+				os << '"';
+			};
+		};
+	};
+};
+
+#endif /* JSON_HH_ */
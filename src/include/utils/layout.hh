@@ -0,0 +1,59 @@
+#ifndef LAYOUT_HH_
+#define LAYOUT_HH_
+
+#include <cstdint>
+#include <stdexcept>
+
+#include "fs.hh"
+
+namespace hush {
+	namespace fs {
+		class LayoutException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		/*
+		 * Work out where the bitmaps, inode table and data blocks of a group
+		 * covering `num_blocks` blocks starting at `start_block` go. Block 0 of
+		 * the image is the superblock, so group 0's metadata starts at 1.
+		 */
+		BlockGroup plan_group(uint64_t start_block, uint64_t num_blocks,
+				uint64_t first_inode);
+
+		/*
+		 * Put a dedup index sized for the group's data blocks right after
+		 * its tag table, so it counts as metadata. Returns its length.
+		 */
+		uint64_t plan_dedup_index(BlockGroup & g);
+
+		// number of blocks before first_datablock, i.e. never free
+		uint64_t group_metadata_blocks(BlockGroup const & g);
+
+		// set `count` bits starting at bit `first`, MSB first like the on-disk maps
+		void mark_bits(uint8_t *map, uint64_t first, uint64_t count);
+		bool test_bit(uint8_t const *map, uint64_t bit);
+
+		bool is_valid_superblock(Superblock const & sb);
+
+		// index of the group holding `block`, or -1 if it's past the end
+		int group_of_block(Superblock const & sb, uint64_t block);
+
+		/*
+		 * Where inode `i_no` lives: the inode table block and the slot within
+		 * it. Returns false if there's no such inode.
+		 */
+		bool locate_inode(Superblock const & sb, uint64_t i_no, uint64_t & block,
+				uint64_t & slot);
+
+		/*
+		 * Where data block `block`'s BlockTag lives. Returns false if the
+		 * block's group has no tag table.
+		 */
+		bool locate_tag(Superblock const & sb, uint64_t block, uint64_t & tag_block,
+				uint64_t & slot);
+	};
+};
+
+#endif /* LAYOUT_HH_ */
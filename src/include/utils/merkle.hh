@@ -0,0 +1,131 @@
+#ifndef MERKLE_HH_
+#define MERKLE_HH_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include "crypto/secretkey.hh"
+#include "fs.hh"
+
+namespace hush {
+	namespace fs {
+		class MerkleException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+		// open() found the tree wasn't closed cleanly, and wasn't told to rebuild it
+		class MerkleDirtyException : public MerkleException
+		{
+			using MerkleException::MerkleException;
+		};
+
+		/*
+		 * A hash tree over every tag block in the image, so that rolling a
+		 * block and its tag back to an older, perfectly valid version is
+		 * caught. Each group has its own tree whose root is kept in its
+		 * BlockGroup, and the superblock holds a hash over those roots keyed
+		 * with a key derived from the volume key.
+		 *
+		 * A group's tree is built the first time one of its tags is needed
+		 * and stays in memory, 64 bytes or so per tag block, so checking a
+		 * tag block after that is one hash and no I/O. Changes only touch
+		 * the leaves; the path up to the root is redone for all of them
+		 * together every HUSHFS_MERKLE_BATCH tag block writes, or on flush.
+		 *
+		 * While there are changes that haven't been flushed the superblock
+		 * carries HUSHFS_FLAG_TREE_DIRTY. Finding that at open means the
+		 * last session crashed, or someone set the flag, which nothing
+		 * authenticates. The tree can only be rebuilt from whatever is on
+		 * disk then, which can't tell a rollback from a lost write, so
+		 * open refuses unless it's told to.
+		 */
+		class MerkleTree
+		{
+		public:
+			using Hash = std::array<uint8_t, 32>;
+
+			// what has to go into the superblock, and whether it's clean
+			struct Roots {
+				uint64_t groups;
+				Hash root;
+				std::vector<Hash> group_roots;
+				bool dirty;
+			};
+			using Commit = std::function<void(Roots const & roots)>;
+
+			MerkleTree(int fd, Superblock const & sb, Commit commit) :
+				fd(fd), sb(sb), commit(commit) {};
+
+			MerkleTree(MerkleTree const &) = delete;
+			void operator=(MerkleTree const &) = delete;
+
+			/*
+			 * Read and hash tag tables ahead of open(), a group at a time
+			 * until `stop` is set; none of it needs the key. Nothing built
+			 * here is trusted until open() has checked it.
+			 */
+			void preload(std::atomic<bool> const & stop);
+
+			/*
+			 * Check the superblock's roots, throws MerkleException if
+			 * they're forged. A tree that wasn't closed cleanly throws
+			 * MerkleDirtyException, unless `rebuild_dirty` accepts the tag
+			 * tables as they are.
+			 */
+			void open(hush::crypto::SecretKey const & volume_key, bool rebuild_dirty=false);
+
+			// throws MerkleException unless `tags` is what the tree says is at `tag_block`
+			void verify(uint64_t tag_block, BlockTag const *tags);
+			// call before `tags` goes to disk
+			void update(uint64_t tag_block, BlockTag const *tags);
+
+			bool flush_due();
+			// recompute the roots of changed groups and store them
+			void flush();
+			// take the tag tables as they are, for tools that moved tags around
+			void rebuild();
+
+		private:
+			struct Group {
+				// levels are built, from tags that were all blank if `blank`
+				bool built = false;
+				bool blank = true;
+				// and checked against the group's root
+				bool loaded = false;
+				// levels[0] are the leaves, one per tag block; back() is the root
+				std::vector<std::vector<Hash>> levels;
+				std::set<uint64_t> dirty;
+			};
+
+			Hash leaf_hash(BlockTag const *tags);
+			Hash node_hash(Hash const & left, Hash const & right);
+			Hash root_hash(uint64_t groups);
+			void build(uint64_t g);
+			void load(uint64_t g, bool trusted);
+			Group & group_of(uint64_t tag_block, uint64_t & leaf);
+			void recompute(Group & group);
+			void store(bool dirty);
+
+			int fd;
+			Superblock const & sb;
+			hush::crypto::SecretKey root_key;
+			Commit commit;
+			std::mutex lock;
+			std::vector<Group> groups;
+			std::vector<Hash> roots;
+			uint64_t committed_groups = 0;
+			uint64_t pending = 0;
+			bool dirty = false;
+		};
+	};
+};
+
+#endif /* MERKLE_HH_ */
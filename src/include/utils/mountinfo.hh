@@ -1,11 +1,15 @@
 #ifndef MOUNTINFO_HH_
 #define MOUNTINFO_HH_
 
+#include <functional>
+#include <mutex>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include "fs.hh"
+#include "utils/merkle.hh"
 
 using hush::fs::Superblock;
 
@@ -17,28 +21,97 @@ namespace hush
 		{
 			public:
 				static MountInfo & get_instance(int fd); 
-				~MountInfo();
 
 				MountInfo(MountInfo const &) = delete;
 				void operator=(MountInfo const &) = delete;
 
 				uint64_t next_available_inode(bool mark_used=false);
+				// whether `i_no` is an inode of the image that's marked used
+				bool inode_in_use(uint64_t i_no);
+
+				/*
+				 * Re-read the superblock and pick up any block groups that
+				 * `hush resize` appended since we last looked. Only the new
+				 * groups' bitmaps are read, so this is cheap enough to call
+				 * from statfs or when the allocator runs dry.
+				 */
+				bool refresh();
+
+				Superblock const & get_superblock() const { return superblock; };
+
+				/*
+				 * Hand out the lowest numbered free block, so the used part of
+				 * the image stays packed at the front. Returns 0 when the image
+				 * is full. Thin images have their backing file extended first
+				 * if the block is past its end.
+				 */
+				uint64_t allocate_block();
+				/*
+				 * Hand out the lowest run of `want` free blocks, or failing
+				 * that the longest run there is, and set `got` to its length.
+				 * Returns its first block, 0 when the image is full.
+				 */
+				uint64_t allocate_run(uint64_t want, uint64_t & got);
+				void free_block(uint64_t block);
+
+				// write the free counts back if allocations have changed them
+				void sync();
+
+				/*
+				 * Start a new mount epoch and make sure it's on disk before
+				 * returning it. Called once at mount, and again whenever a
+				 * block's write generation runs out of nonce bits.
+				 */
+				uint64_t next_epoch();
+
+				/*
+				 * Key rotation, see utils/rekey.hh. begin_rekey moves to the
+				 * next data key generation and restarts the watermark, which
+				 * is how far the rekeyer got. The superblock's copy only
+				 * moves when `persist` is set, once the resealed blocks are
+				 * synced. Everything else is synced.
+				 */
+				uint64_t begin_rekey();
+				void set_rekey_watermark(uint64_t block, bool persist);
+				void end_rekey();
+
+				// MerkleTree's Commit
+				void store_tree(MerkleTree::Roots const & roots);
+				// Dedup's Mark
+				void mark_dedup(bool dirty);
 
 			private:
+				using GroupMaps = struct {
+					std::vector<uint8_t> inode_bitmap;
+					std::vector<uint8_t> block_bitmap;
+				};
+
 				int fd;
 				Superblock superblock;
-				uint64_t inode_map_bytes;
-				uint64_t block_map_bytes;
-				uint8_t *inode_bitmap;
-				uint8_t *block_bitmap;
+				std::vector<GroupMaps> groups;
+				// nothing below this block is free
+				uint64_t alloc_hint;
+				// how much of a thin image's backing file exists
+				uint64_t backed_bytes;
+				bool dirty = false;
+				// how far the rekeyer got, the superblock has how far is on disk
+				uint64_t rekey_progress = 0;
+				// the rekeyer thread shares the superblock with fuse's
+				std::recursive_mutex lock;
 
 				MountInfo(int fd);
-				void read_superblock();
-				void read_inode_bitmap();
-				void read_block_bitmap();
+				void read_superblock(Superblock & sb);
+				void read_group_maps(uint64_t group);
+				bool adopt_groups(Superblock const & sb);
+				void set_block(uint64_t block, bool used);
+				// a run within one group, each bitmap block is written once
+				void set_blocks(uint64_t first, uint64_t count, bool used);
+				void ensure_backed(uint64_t block);
+				// read-modify-write the superblock under LOCK_EX
+				void update_superblock(std::function<void(Superblock const & on_disk)> change,
+						bool durable);
 		};
 	};
 };
 
 #endif /* MOUNTINFO_HH_ */
-
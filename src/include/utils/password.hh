@@ -2,6 +2,7 @@
 #define PASSWORD_HH_
 
 #include <stdexcept>
+#include <string>
 #include "utils/secure.hh"
 
 namespace hush {
@@ -16,6 +17,8 @@ namespace hush {
 		{
 		public:
 			void ask(char const *prompt, bool confirm=false, bool show_asterisk=true);
+			// use a keyfile's whole contents in place of a typed password
+			void read(std::string const & path);
 			hush::secure::string get(void) { return password; }
 		
 		private:
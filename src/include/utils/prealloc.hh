@@ -0,0 +1,33 @@
+#ifndef PREALLOC_HH_
+#define PREALLOC_HH_
+
+#include <cstdint>
+
+#include "utils/mountinfo.hh"
+#include "utils/blockio.hh"
+#include "fs.hh"
+
+// blocks marked unwritten per call into BlockIO
+#define HUSHFS_PREALLOC_BATCH 4096
+
+namespace hush {
+	namespace fs {
+		/*
+		 * fallocate(2) with no flags, or only FALLOC_FL_KEEP_SIZE. Every
+		 * hole of `inode` in [offset, offset + length) gets blocks from the
+		 * allocator, a whole hole at a time where it can, and the blocks'
+		 * tags are marked unwritten so they read back as zeros without
+		 * anything being written or deciphered. The host file is asked to
+		 * back them too. The inode is stored, grown to cover the range
+		 * unless `keep_size` is set.
+		 *
+		 * Returns 0 or an errno: EINVAL, EFBIG past what a block map can
+		 * hold, ENOSPC if the image filled up, in which case whatever was
+		 * allocated by then is kept. I/O errors are thrown as usual.
+		 */
+		int preallocate(int fd, Inode & inode, uint64_t offset, uint64_t length,
+				bool keep_size, MountInfo & mi, BlockIO & io);
+	};
+};
+
+#endif /* PREALLOC_HH_ */
@@ -0,0 +1,69 @@
+#ifndef REKEY_HH_
+#define REKEY_HH_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "utils/mountinfo.hh"
+#include "utils/blockio.hh"
+#include "crypto/keyring.hh"
+
+// blocks resealed per step, and how often the watermark is written out
+#define HUSHFS_REKEY_BATCH 256
+#define HUSHFS_REKEY_PERSIST_SECONDS 5
+
+namespace hush {
+	namespace fs {
+		/*
+		 * How hard the rekeyer may work. blocks_per_second caps the I/O
+		 * (0 is no cap), cpu_percent is the share of one core it may keep
+		 * busy; it sleeps off whatever's left of each step.
+		 */
+		struct RekeyBudget {
+			uint64_t blocks_per_second = 0;
+			unsigned cpu_percent = 100;
+		};
+
+		/*
+		 * Online key rotation. After MountInfo::begin_rekey a background
+		 * thread walks the data blocks in order from the superblock's
+		 * watermark and reseals every one still under an older key
+		 * generation. Reads keep working throughout since each BlockTag
+		 * names its own generation, and a restarted mount carries on from
+		 * the last watermark that made it to disk.
+		 */
+		class Rekeyer
+		{
+		public:
+			Rekeyer(MountInfo & mi, BlockIO & io, hush::crypto::KeyRing & keys,
+					RekeyBudget budget) :
+				mi(mi), io(io), keys(keys), budget(budget) {};
+			~Rekeyer() { stop(); };
+
+			Rekeyer(Rekeyer const &) = delete;
+			void operator=(Rekeyer const &) = delete;
+
+			void start();
+			// returns once the thread has written out its watermark and quit
+			void stop();
+
+		private:
+			void run();
+			// the next range of up to `max` data blocks at or after `block`
+			bool next_range(uint64_t & block, uint64_t & count, uint64_t max);
+
+			MountInfo & mi;
+			BlockIO & io;
+			hush::crypto::KeyRing & keys;
+			RekeyBudget budget;
+			std::thread thread;
+			std::mutex lock;
+			std::condition_variable wake;
+			bool stopping = false;
+		};
+	};
+};
+
+#endif /* REKEY_HH_ */
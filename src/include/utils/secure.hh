@@ -9,6 +9,7 @@
 #include <stdexcept>
 
 #include <sodium.h>
+#include "utils/arena.hh"
 
 namespace hush {
 	namespace secure {
@@ -47,9 +48,17 @@ namespace hush {
 				return std::numeric_limits<std::size_t>::max() / sizeof(T);
 			};
 
+			/*
+			 * Small allocations come from the shared secure arena; a
+			 * sodium_malloc costs at least three pages, an mlock and an
+			 * mprotect, which is a lot for a string growing a character at
+			 * a time.
+			 */
 			pointer allocate(size_type num, void const * = 0)
 			{
-				pointer ret = (pointer)sodium_malloc(num * sizeof(T));
+				pointer ret = (pointer)Arena::secure().allocate(num * sizeof(T));
+				if (ret == NULL)
+					ret = (pointer)sodium_malloc(num * sizeof(T));
 				if (ret == NULL)
 					throw std::bad_alloc();
 				return ret;
@@ -67,7 +76,8 @@ namespace hush {
 
 			void deallocate(pointer p, size_type n)
 			{
-				sodium_free(p);
+				if (!Arena::secure().deallocate(p, n * sizeof(T)))
+					sodium_free(p);
 			}
 		private:
 			void init() { if (sodium_init() == -1) throw SodiumInitException("Couldn't initialize sodium"); }
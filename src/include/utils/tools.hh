@@ -23,8 +23,14 @@ void create_and_write(std::string const & name, void const *data, size_t datalen
 template<typename T> void split(std::string const &s, char delimiter, T results);
 std::vector<std::string> split(std::string const &s, char delimiter);
 
-void write_data(int fd, void const * buf, off_t from, uint64_t len, bool error_seek=false);
-void write_block(int fd, void const * buf, off_t from, bool error_seek=false);
+// N[k|m|g|t] in bytes, 0 if it isn't a size or doesn't fit in 64 bits
+uint64_t parse_size(std::string s);
+
+// through the fd's BlockDevice, see utils/blockdevice.hh
+void write_data(int fd, void const * buf, off_t from, uint64_t len);
+void write_block(int fd, void const * buf, off_t from);
+void read_data(int fd, void * buf, off_t from, uint64_t len);
+void read_block(int fd, void * buf, off_t from);
 
 void write_inode(int fd, Superblock const * sb, std::string const & name, 
 		FileType typ, mode_t umask=0022, void const * buf=nullptr, 
@@ -0,0 +1,101 @@
+#ifndef URING_HH_
+#define URING_HH_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <unordered_set>
+#include <stdexcept>
+#include <vector>
+#include <sys/uio.h>
+
+#include "utils/blockdevice.hh"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace hush {
+	namespace fs {
+		class UringException : public std::runtime_error
+		{
+			using std::runtime_error::runtime_error;
+			using std::runtime_error::what;
+		};
+
+#ifdef __linux__
+		/*
+		 * A BlockDevice on an io_uring, set up with the raw syscalls so
+		 * there's no liburing to depend on. The image fd is registered
+		 * with the ring, and so are any buffers handed to
+		 * register_buffers(); requests that land entirely inside one of
+		 * those go out as fixed reads and writes and skip pinning pages on
+		 * every call.
+		 *
+		 * A whole batch goes into the ring with one io_uring_enter. Any
+		 * number of threads may submit at once: whichever of them is
+		 * waiting first reaps completions for everyone and wakes the rest,
+		 * so batches from concurrent requests share the ring instead of
+		 * queueing behind each other. A request that fails or comes up
+		 * short is finished with plain pread/pwrite, which also reports
+		 * the error if there really is one.
+		 */
+		class UringDevice : public BlockDevice
+		{
+		public:
+			// throws UringException if the kernel won't give us a ring
+			UringDevice(int fd, unsigned entries);
+			~UringDevice();
+
+			UringDevice(UringDevice const &) = delete;
+			void operator=(UringDevice const &) = delete;
+
+			void read(void *buf, uint64_t offset, uint64_t len) override;
+			void write(void const *buf, uint64_t offset, uint64_t len) override;
+			void submit(std::vector<Request> const & batch) override;
+			bool sync() override;
+			void register_buffers(std::vector<struct iovec> const & bufs) override;
+
+		private:
+			struct Slot;
+			struct Pending;
+
+			int fixed_index(void const *buf, uint64_t len) const;
+			// queue `count` slots and enter them, they've already been counted in flight
+			void enqueue(Slot *slots, unsigned count);
+			// wait for completions, reaping them if nobody else is, until done() holds
+			template <typename Done> void wait_until(std::unique_lock<std::mutex> & guard, Done done);
+			void reap();
+			void teardown();
+
+			int fd;
+			PosixDevice posix;
+			int ring_fd = -1;
+			unsigned entries;
+
+			void *sq_ring = nullptr, *cq_ring = nullptr;
+			size_t sq_ring_size = 0, cq_ring_size = 0;
+			struct io_uring_sqe *sqes = nullptr;
+			size_t sqes_size = 0;
+			unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+			unsigned *cq_head, *cq_tail, *cq_mask;
+			struct io_uring_cqe *cqes;
+
+			std::vector<struct iovec> fixed;
+
+			// held while filling the submission queue
+			std::mutex sq_lock;
+			// guards everything below and every Pending
+			std::mutex cq_lock;
+			std::condition_variable cq_done;
+			bool reaping = false;
+			// counted before they're queued, so the completion queue can't overflow
+			unsigned in_flight = 0;
+			// in the kernel, reaping waits on these
+			std::unordered_set<Slot *> queued;
+			bool broken = false;
+		};
+#endif
+	};
+};
+
+#endif /* URING_HH_ */
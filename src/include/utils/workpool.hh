@@ -0,0 +1,64 @@
+#ifndef WORKPOOL_HH_
+#define WORKPOOL_HH_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hush {
+	namespace utils {
+		/*
+		 * A fixed set of threads, each pinned to its own core, that work
+		 * through batches of independent items together. The thread that
+		 * submits a batch works on it too, so a batch of one never waits on
+		 * a context switch, and a pool of size zero just runs inline.
+		 */
+		class WorkPool
+		{
+		public:
+			using Task = std::function<bool(size_t)>;
+
+			// threads=0 sizes the pool to leave one core for the caller
+			WorkPool(unsigned threads=0, bool pin=true);
+			~WorkPool();
+
+			WorkPool(WorkPool const &) = delete;
+			void operator=(WorkPool const &) = delete;
+
+			/*
+			 * Call task(i) for every i in [0, count) and return once they've
+			 * all finished. Returns false if any call did.
+			 */
+			bool run(size_t count, Task const & task);
+
+			unsigned size() const { return threads.size(); };
+
+		private:
+			struct Batch {
+				Task const *task;
+				size_t count;
+				std::atomic<size_t> next;
+				std::atomic<size_t> done;
+				std::atomic<bool> ok;
+				// workers currently holding a pointer to this batch
+				unsigned users;
+			};
+
+			void worker(unsigned cpu, bool pin);
+			void work(Batch & batch);
+
+			std::vector<std::thread> threads;
+			std::mutex lock;
+			std::condition_variable wake, finished;
+			std::deque<Batch *> queue;
+			bool stopping = false;
+		};
+	};
+};
+
+#endif /* WORKPOOL_HH_ */
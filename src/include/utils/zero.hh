@@ -0,0 +1,46 @@
+#ifndef ZERO_HH_
+#define ZERO_HH_
+
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+
+namespace hush {
+	namespace utils {
+		/*
+		 * Whether a block of plaintext is all zeros. It looks at a cache
+		 * line per step and gives up at the first one that isn't, so data
+		 * blocks, which almost never start with 64 zero bytes, cost next to
+		 * nothing.
+		 */
+		inline bool is_zero_block(uint8_t const *data)
+		{
+			for (size_t i = 0; i < HUSHFS_BLOCK_SIZE; i += 64) {
+#ifdef __SSE2__
+				__m128i const *p = (__m128i const *)(data + i);
+				__m128i any = _mm_or_si128(
+						_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+						_mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+
+				if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF)
+					return false;
+#else
+				uint64_t w[8], any = 0;
+
+				memcpy(w, data + i, sizeof w);
+				for (uint64_t x : w)
+					any |= x;
+				if (any != 0)
+					return false;
+#endif
+			}
+			return true;
+		}
+	};
+};
+
+#endif /* ZERO_HH_ */
@@ -11,13 +11,18 @@
 #include "keygen.hh"
 #include "create.hh"
 #include "mount.hh"
+#include "resize.hh"
+#include "fsck.hh"
+#include "defrag.hh"
+#include "statimage.hh"
+#include "keyslot.hh"
 #include "utils/optparse.h"
 
 std::string prgname;
 
 static void usage()
 {
-	std::cerr << "Usage " << prgname << " [keygen|create|mount] [...]" << std::endl;
+	std::cerr << "Usage " << prgname << " [keygen|create|mount|resize|fsck|defrag|stat-image|keyslot] [...]" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -63,6 +68,16 @@ int main(int argc, char **argv)
 		return hush_create(&opts);
 	else if (mode == "mount") {
 		return hush_mount(argc, &opts);
+	} else if (mode == "resize") {
+		return hush_resize(&opts);
+	} else if (mode == "fsck") {
+		return hush_fsck(&opts);
+	} else if (mode == "defrag") {
+		return hush_defrag(&opts);
+	} else if (mode == "stat-image") {
+		return hush_stat_image(&opts);
+	} else if (mode == "keyslot") {
+		return hush_keyslot(&opts);
 	} else {
 		usage();
 		return 1;
@@ -0,0 +1,57 @@
+#include <algorithm> // all_of
+#include <cstdint>
+#include <vector>
+#include "utils/arena.hh"
+#include "test/catch.hpp"
+
+using hush::secure::Arena;
+
+TEST_CASE( "Arena", "[hush::secure::Arena]" ) {
+	alignas(16) static unsigned char region[16 * 1024];
+	Arena arena(region, sizeof region);
+
+	SECTION( "Chunks are rounded up to their size class" ) {
+		void *a = arena.allocate(1);
+		void *b = arena.allocate(17);
+
+		REQUIRE(arena.owns(a));
+		REQUIRE(arena.owns(b));
+		REQUIRE(arena.in_use() == 16 + 32);
+		REQUIRE((uintptr_t)a % 16 == 0);
+		REQUIRE((uintptr_t)b % 16 == 0);
+	}
+
+	SECTION( "Freed chunks are zeroed and reused" ) {
+		unsigned char *a = (unsigned char *)arena.allocate(100);
+
+		std::fill(a, a + 100, 0xAA);
+		REQUIRE(arena.deallocate(a, 100));
+		REQUIRE(arena.in_use() == 0);
+		// the free list link is the only thing left behind
+		REQUIRE(std::all_of(a + sizeof(void *), a + 128,
+					[](unsigned char c) { return c == 0; }));
+
+		REQUIRE(arena.allocate(128) == a);
+	}
+
+	SECTION( "Too big or too full goes elsewhere" ) {
+		std::vector<void *> blocks;
+		void *p;
+
+		REQUIRE(arena.allocate(4097) == nullptr);
+
+		while ((p = arena.allocate(4096)) != nullptr)
+			blocks.push_back(p);
+		REQUIRE(blocks.size() == 4);
+		REQUIRE(arena.allocate(16) == nullptr);
+
+		REQUIRE(arena.deallocate(blocks.back(), 4096));
+		REQUIRE(arena.allocate(4096) == blocks.back());
+	}
+
+	SECTION( "Foreign pointers aren't taken back" ) {
+		unsigned char elsewhere[16];
+
+		REQUIRE_FALSE(arena.deallocate(elsewhere, sizeof elsewhere));
+	}
+}
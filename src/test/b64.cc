@@ -38,3 +38,29 @@ TEST_CASE( "encode/decode", "[hush::utils::B64]" ) {
 		REQUIRE(b.unpemify(b.pemify(enc, "TEST")) == enc);
 	}
 }
+
+TEST_CASE( "zero bytes", "[hush::utils::B64]" ) {
+	hush::utils::B64<std::vector<char>, std::string> b;
+	std::vector<char> in = { 'a', 0, 0, 'b', 0 };
+
+	REQUIRE(b.decode(b.encode(in)) == in);
+	REQUIRE(b.decode(b.encode(std::vector<char>{ 0, 0 })) == std::vector<char>({ 0, 0 }));
+}
+
+TEST_CASE( "PEM headers", "[hush::utils::B64]" ) {
+	hush::utils::B64<std::vector<char>, std::string> b;
+	hush::utils::B64<std::vector<char>, std::string>::Headers in, out;
+	std::string enc = b.encode("This is a test of the emergency broadcast system.");
+
+	in.emplace_back("KDF", "argon2id13");
+	in.emplace_back("Ops-Limit", "3");
+	in.emplace_back("Salt", b.encode("0123456789abcdef"));
+
+	std::string pem = b.pemify(enc, "TEST", in);
+
+	REQUIRE(b.unpemify(pem, out) == enc);
+	REQUIRE(out == in);
+
+	REQUIRE(b.unpemify(b.pemify(enc, "TEST"), out) == enc);
+	REQUIRE(out.empty());
+}
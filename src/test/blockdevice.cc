@@ -0,0 +1,52 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "utils/blockdevice.hh"
+#include "test/catch.hpp"
+
+using hush::fs::BlockDevice;
+
+TEST_CASE( "PosixDevice", "[hush::fs::PosixDevice]" ) {
+	FILE *tmp = tmpfile();
+	int fd = fileno(tmp);
+	BlockDevice & dev = hush::fs::device(fd);
+	char a[] = "positioned", b[] = "vectored", got[32] = {};
+
+	SECTION( "Positioned I/O leaves the file offset alone" ) {
+		dev.write(a, 100, sizeof a);
+		REQUIRE(lseek(fd, 0, SEEK_CUR) == 0);
+		dev.read(got, 100, sizeof a);
+		REQUIRE(strcmp(got, a) == 0);
+	}
+
+	SECTION( "Vectors read and write consecutive bytes" ) {
+		struct iovec out[] = { { a, sizeof a }, { b, sizeof b } };
+		char x[sizeof a], y[sizeof b];
+		struct iovec in[] = { { x, sizeof x }, { y, sizeof y } };
+
+		dev.writev(out, 2, 4096);
+		dev.readv(in, 2, 4096);
+		REQUIRE(strcmp(x, a) == 0);
+		REQUIRE(strcmp(y, b) == 0);
+	}
+
+	SECTION( "A batch completes every request" ) {
+		std::vector<BlockDevice::Request> batch = {
+			{ BlockDevice::Op::Write, a, 0, sizeof a },
+			{ BlockDevice::Op::Write, b, 8192, sizeof b },
+		};
+
+		dev.submit(batch);
+		dev.submit({ { BlockDevice::Op::Read, got, 8192, sizeof b } });
+		REQUIRE(strcmp(got, b) == 0);
+	}
+
+	SECTION( "Reading past the end is an error" ) {
+		REQUIRE_THROWS_AS(dev.read(got, 1 << 20, sizeof got), std::string);
+	}
+
+	hush::fs::detach_device(fd);
+	fclose(tmp);
+}
@@ -0,0 +1,357 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include "config.h"
+#include "fs.hh"
+#include "utils/blockmap.hh"
+#include "utils/tools.hh"
+#include "test/catch.hpp"
+
+using hush::fs::InodeData;
+
+#define BS HUSHFS_BLOCK_SIZE
+#define PTRS HUSHFS_PTRS_PER_BLOCK
+
+// where each range of the block map starts
+static uint64_t const single_start = HUSHFS_DIRECT_BLOCKS;
+static uint64_t const double_start = single_start + PTRS;
+static uint64_t const triple_start = double_start + PTRS * PTRS;
+
+/*
+ * A block map on a scratch file. Indirect blocks are handed out from 1 up
+ * as they're needed; data blocks are numbered from 1000000 so they can't be
+ * mistaken for them, and are never written.
+ */
+class Map
+{
+public:
+	Map(uint64_t blocks) : tmp(tmpfile()), fd(fileno(tmp))
+	{
+		inode = {};
+		inode.file_size = blocks * BS;
+	}
+
+	~Map() { fclose(tmp); };
+
+	void set(uint64_t logical)
+	{
+		uint64_t * const roots[] = {
+			&inode.single_indirect_ptr,
+			&inode.double_indirect_ptr,
+			&inode.triple_indirect_ptr,
+		};
+		std::vector<uint64_t> ptrs(PTRS);
+		uint64_t rest = logical, span = 1, *ptr;
+		int depth;
+
+		if (logical < HUSHFS_DIRECT_BLOCKS) {
+			inode.direct_ptr[logical] = data(logical);
+			return;
+		}
+
+		rest -= HUSHFS_DIRECT_BLOCKS;
+		for (depth = 1, span = PTRS; rest >= span; depth++, span *= PTRS)
+			rest -= span;
+
+		for (ptr = roots[depth - 1]; depth > 0; depth--) {
+			uint64_t block;
+
+			if (*ptr == 0) {
+				*ptr = next++;
+				std::fill(ptrs.begin(), ptrs.end(), 0);
+				write_block(fd, ptrs.data(), *ptr * BS);
+			}
+			block = *ptr;
+			read_block(fd, ptrs.data(), block * BS);
+
+			span /= PTRS;
+			if (depth == 1) {
+				ptrs[rest / span] = data(logical);
+				write_block(fd, ptrs.data(), block * BS);
+				return;
+			}
+
+			// follow it down, writing back the pointer to a new one
+			held = ptrs[rest / span];
+			ptr = &held;
+			if (held == 0) {
+				ptrs[rest / span] = next;
+				write_block(fd, ptrs.data(), block * BS);
+			}
+			rest %= span;
+		}
+	}
+
+	static uint64_t data(uint64_t logical) { return 1000000 + logical; };
+
+	uint64_t map(uint64_t logical) { return hush::fs::map_block(fd, inode, logical); };
+
+	// the block seek_data/seek_hole land on from block `from`, or -1 for ENXIO
+	int64_t next_data(uint64_t from) { return seek(from * BS, true); };
+	int64_t next_hole(uint64_t from) { return seek(from * BS, false); };
+
+	int64_t seek(uint64_t offset, bool data)
+	{
+		return moved(offset, data) ? (int64_t)(offset / BS) : -1;
+	}
+
+	bool moved(uint64_t & offset, bool data)
+	{
+		return data ? hush::fs::seek_data(fd, inode, offset) :
+			hush::fs::seek_hole(fd, inode, offset);
+	}
+
+	FILE *tmp;
+	int fd;
+	InodeData inode;
+
+private:
+	uint64_t next = 1;
+	uint64_t held = 0;
+};
+
+TEST_CASE( "map_block", "[hush::fs::map_block]" ) {
+	Map m(triple_start + 10);
+
+	for (uint64_t l : { (uint64_t)0, single_start - 1, single_start, double_start - 1,
+			double_start, triple_start - 1, triple_start, triple_start + 3 })
+		m.set(l);
+
+	SECTION( "Data in every range maps to its block" ) {
+		for (uint64_t l : { (uint64_t)0, single_start - 1, single_start, double_start - 1,
+				double_start, triple_start - 1, triple_start, triple_start + 3 })
+			REQUIRE(m.map(l) == Map::data(l));
+	}
+
+	SECTION( "Holes in every range map to nothing" ) {
+		for (uint64_t l : { (uint64_t)1, single_start + 1, double_start + 1,
+				double_start + PTRS, triple_start + 2, triple_start + PTRS * PTRS })
+			REQUIRE(m.map(l) == 0);
+	}
+
+	SECTION( "Past the triple indirect block there's nothing" ) {
+		REQUIRE(m.map(hush::fs::max_file_blocks()) == 0);
+	}
+}
+
+TEST_CASE( "seek_data and seek_hole", "[hush::fs::seek_data]" ) {
+
+	SECTION( "A hole between data in the direct blocks" ) {
+		Map m(8);
+
+		for (uint64_t l : { 0, 1, 3, 4 })
+			m.set(l);
+		REQUIRE(m.next_hole(0) == 2);
+		REQUIRE(m.next_data(2) == 3);
+		REQUIRE(m.next_hole(3) == 5);
+		REQUIRE(m.next_data(5) == -1);
+	}
+
+	SECTION( "Holes in the single, double and triple indirect ranges" ) {
+		Map m(triple_start + 10);
+
+		for (uint64_t l : { single_start + 1, single_start + 3, double_start + 1,
+				double_start + 3, triple_start + 1, triple_start + 3 })
+			m.set(l);
+
+		for (uint64_t start : { single_start, double_start, triple_start }) {
+			REQUIRE(m.next_hole(start + 1) == (int64_t)start + 2);
+			REQUIRE(m.next_data(start + 2) == (int64_t)start + 3);
+		}
+	}
+
+	SECTION( "Data and holes either side of each range boundary" ) {
+		Map m(triple_start + 10);
+
+		for (uint64_t l : { single_start - 1, single_start, double_start - 1, double_start,
+				triple_start - 1, triple_start })
+			m.set(l);
+
+		REQUIRE(m.next_data(0) == (int64_t)single_start - 1);
+		REQUIRE(m.next_hole(single_start - 1) == (int64_t)single_start + 1);
+		REQUIRE(m.next_data(single_start + 1) == (int64_t)double_start - 1);
+		REQUIRE(m.next_hole(double_start - 1) == (int64_t)double_start + 1);
+		REQUIRE(m.next_data(double_start + 1) == (int64_t)triple_start - 1);
+		REQUIRE(m.next_hole(triple_start - 1) == (int64_t)triple_start + 1);
+	}
+
+	SECTION( "Data after a whole indirect range of nothing" ) {
+		Map m(triple_start + 10);
+
+		m.set(triple_start + 5);
+		REQUIRE(m.next_data(0) == (int64_t)triple_start + 5);
+		REQUIRE(m.next_hole(triple_start + 5) == (int64_t)triple_start + 6);
+	}
+
+	SECTION( "An offset inside a block stays where it is" ) {
+		Map m(4);
+		uint64_t offset = BS + 10;
+
+		m.set(1);
+		REQUIRE(m.moved(offset, true));
+		REQUIRE(offset == BS + 10);
+		offset = 2 * BS + 10;
+		REQUIRE(m.moved(offset, false));
+		REQUIRE(offset == 2 * BS + 10);
+	}
+
+	SECTION( "The end of the file is a hole" ) {
+		Map m(3);
+
+		for (uint64_t l : { 0, 1, 2 })
+			m.set(l);
+		REQUIRE(m.next_hole(0) == 3);
+	}
+
+	SECTION( "Data past the end of the file doesn't count" ) {
+		Map m(3);
+
+		m.set(5);
+		REQUIRE(m.next_data(0) == -1);
+		REQUIRE(m.next_hole(0) == 0);
+	}
+
+	SECTION( "At or past the end of the file is ENXIO" ) {
+		Map m(3);
+
+		m.set(0);
+		REQUIRE(m.seek(3 * BS, true) == -1);
+		REQUIRE(m.seek(3 * BS, false) == -1);
+		REQUIRE(m.seek(3 * BS + 1, true) == -1);
+		REQUIRE(m.seek(100 * BS, false) == -1);
+		REQUIRE(m.seek(3 * BS - 1, false) == 2);
+	}
+
+	SECTION( "A file that's all holes" ) {
+		Map m(triple_start + 10);
+
+		REQUIRE(m.next_data(0) == -1);
+		REQUIRE(m.next_hole(0) == 0);
+		REQUIRE(m.next_hole(triple_start + 9) == (int64_t)triple_start + 9);
+		REQUIRE(m.map(triple_start) == 0);
+	}
+}
+
+/*
+ * Hands out runs from 1 up, at most `cap` blocks at a time and `budget` in
+ * all, leaving a block out between runs so they can't run together.
+ * Remembers what it was asked for.
+ */
+class Runs
+{
+public:
+	Runs(uint64_t cap=UINT64_MAX, uint64_t budget=UINT64_MAX) : cap(cap), budget(budget) {};
+
+	uint64_t operator()(uint64_t want, uint64_t & got)
+	{
+		uint64_t first = next;
+
+		wants.push_back(want);
+		got = std::min(std::min(want, cap), budget);
+		if (got == 0)
+			return 0;
+		budget -= got;
+		next += got + 1;
+		return first;
+	}
+
+	std::vector<uint64_t> wants;
+
+private:
+	uint64_t cap, budget, next = 1;
+};
+
+static bool fill(Map & m, uint64_t logical, uint64_t count, Runs & runs,
+		std::vector<hush::fs::Extent> & added)
+{
+	return hush::fs::fill_holes(m.fd, m.inode, logical, count,
+			[&runs](uint64_t want, uint64_t & got) { return runs(want, got); }, added);
+}
+
+TEST_CASE( "fill_holes", "[hush::fs::fill_holes]" ) {
+	std::vector<hush::fs::Extent> added;
+
+	SECTION( "Each hole gets a run of its own size" ) {
+		Map m(10);
+		Runs runs;
+
+		m.set(5);
+		REQUIRE(fill(m, 0, 10, runs, added));
+		REQUIRE(runs.wants == std::vector<uint64_t>({ 5, 4 }));
+		REQUIRE(added.size() == 2);
+		REQUIRE(added[0].logical == 0);
+		REQUIRE(added[0].length == 5);
+		REQUIRE(added[1].logical == 6);
+		REQUIRE(added[1].length == 4);
+		REQUIRE(m.map(5) == Map::data(5));
+	}
+
+	SECTION( "Indirect blocks come out of the same run" ) {
+		Map m(20);
+		Runs runs;
+
+		REQUIRE(fill(m, 0, 20, runs, added));
+		// twelve direct, the single indirect block, then the rest
+		REQUIRE(m.inode.single_indirect_ptr == 13);
+		REQUIRE(m.map(11) == 12);
+		REQUIRE(m.map(12) == 14);
+		REQUIRE(runs.wants == std::vector<uint64_t>({ 20, 1 }));
+		// the indirect block cost the run its last data block
+		REQUIRE(added.size() == 3);
+		REQUIRE(added[0].length == 12);
+		REQUIRE(added[1].length == 7);
+		REQUIRE(added[2].logical == 19);
+	}
+
+	SECTION( "A run that comes up short is topped up" ) {
+		Map m(8);
+		Runs runs(3);
+
+		REQUIRE(fill(m, 0, 8, runs, added));
+		REQUIRE(runs.wants == std::vector<uint64_t>({ 8, 5, 2 }));
+		REQUIRE(added.size() == 3);
+		for (uint64_t l = 0; l < 8; l++)
+			REQUIRE(m.map(l) != 0);
+	}
+
+	SECTION( "Running out keeps what was mapped, indirect blocks included" ) {
+		Map m(30);
+		Runs runs(UINT64_MAX, 15);
+		uint64_t mapped = 0;
+
+		REQUIRE_FALSE(fill(m, 0, 30, runs, added));
+		for (auto const & e : added)
+			mapped += e.length;
+		REQUIRE(mapped == 14);
+		REQUIRE(m.inode.single_indirect_ptr == 13);
+		REQUIRE(m.map(13) == 15);
+		REQUIRE(m.map(14) == 0);
+	}
+
+	SECTION( "More indirect blocks than are kept at once" ) {
+		uint64_t const count = 70 * PTRS;
+		Map m(double_start + count);
+		Runs runs;
+		uint64_t indirect;
+
+		REQUIRE(fill(m, double_start, count, runs, added));
+		for (uint64_t i = 0; i < 70; i++)
+			REQUIRE(m.map(double_start + i * PTRS) != 0);
+		REQUIRE(hush::fs::file_extents(m.fd, m.inode, &indirect).size() == added.size());
+		REQUIRE(indirect == 71);
+	}
+
+	SECTION( "Nothing maps past max_file_blocks" ) {
+		uint64_t const max = hush::fs::max_file_blocks();
+		Map m(1);
+		Runs runs;
+
+		REQUIRE(max == triple_start + PTRS * PTRS * PTRS);
+		REQUIRE_FALSE(fill(m, max - 2, 5, runs, added));
+		REQUIRE(m.map(max - 2) != 0);
+		REQUIRE(m.map(max - 1) != 0);
+		REQUIRE(added.size() == 1);
+		REQUIRE(added[0].length == 2);
+	}
+}
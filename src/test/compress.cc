@@ -0,0 +1,55 @@
+#include <cstring>
+#include <vector>
+#include "utils/compress.hh"
+#include "config.h"
+#include "test/catch.hpp"
+
+using hush::fs::Compression;
+
+TEST_CASE( "compress_block", "[hush::fs::compress_block]" ) {
+
+	SECTION( "Names round trip" ) {
+		Compression c;
+
+		for (Compression want : { Compression::None, Compression::LZ4, Compression::Zstd }) {
+			REQUIRE(hush::fs::parse_compression(hush::fs::compression_name(want), c));
+			REQUIRE(c == want);
+		}
+		REQUIRE_FALSE(hush::fs::parse_compression("gzip", c));
+	}
+
+	SECTION( "Blocks come back as they went in, or aren't compressed at all" ) {
+		std::vector<uint8_t> in(HUSHFS_BLOCK_SIZE), out(HUSHFS_BLOCK_SIZE), back(HUSHFS_BLOCK_SIZE);
+
+		for (size_t i = 0; i < in.size(); i++)
+			in[i] = "log line\n"[i % 9];
+
+		REQUIRE(hush::fs::compress_block(Compression::None, in.data(), out.data()) == 0);
+
+		for (Compression c : { Compression::LZ4, Compression::Zstd }) {
+			size_t len = hush::fs::compress_block(c, in.data(), out.data());
+
+			if (!hush::fs::compression_available(c)) {
+				REQUIRE(len == 0);
+				continue;
+			}
+			REQUIRE(len > 0);
+			REQUIRE(len <= HUSHFS_BLOCK_SIZE - HUSHFS_COMPRESS_MIN_SAVING);
+			REQUIRE(hush::fs::decompress_block(c, out.data(), len, back.data()));
+			REQUIRE(back == in);
+			REQUIRE_FALSE(hush::fs::decompress_block(c, out.data(), len / 2, back.data()));
+		}
+	}
+
+	SECTION( "Incompressible blocks are left alone" ) {
+		std::vector<uint8_t> in(HUSHFS_BLOCK_SIZE), out(HUSHFS_BLOCK_SIZE);
+		uint64_t x = 88172645463325252ULL;
+
+		for (uint8_t & b : in) {
+			x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+			b = x;
+		}
+		REQUIRE(hush::fs::compress_block(Compression::LZ4, in.data(), out.data()) == 0);
+		REQUIRE(hush::fs::compress_block(Compression::Zstd, in.data(), out.data()) == 0);
+	}
+}
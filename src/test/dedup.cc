@@ -0,0 +1,217 @@
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config.h"
+#include "create.hh"
+#include "fs.hh"
+#include "crypto/keyring.hh"
+#include "crypto/secretkey.hh"
+#include "crypto/symmetric.hh"
+#include "utils/optparse.h"
+#include "utils/tools.hh"
+#include "utils/image.hh"
+#include "utils/blockio.hh"
+#include "utils/dedup.hh"
+#include "utils/workpool.hh"
+#include "test/catch.hpp"
+
+using hush::fs::Dedup;
+using hush::fs::Superblock;
+
+static int run(int (*action)(struct optparse *), std::vector<std::string> args)
+{
+	std::vector<char *> argv;
+	struct optparse opts;
+
+	for (auto & a : args)
+		argv.push_back(&a[0]);
+	argv.push_back(nullptr);
+
+	optparse_init(&opts, argv.data());
+	return action(&opts);
+}
+
+// a block of plaintext nothing else has
+static std::vector<uint8_t> content(uint64_t n)
+{
+	std::vector<uint8_t> data(HUSHFS_BLOCK_SIZE, 0);
+
+	for (unsigned i = 0; i < 8; i++)
+		data[i] = n >> (i * 8);
+	data[HUSHFS_BLOCK_SIZE - 1] = 1;
+	return data;
+}
+
+/*
+ * A dedup index on a real image, with blocks sealed through a BlockIO. The
+ * index is cut down to its first block, so it fills up after 128 entries and
+ * probes run into each other.
+ */
+class Index
+{
+public:
+	Index(std::string const & image) :
+		symmetric(hush::crypto::CipherSuite::XChaCha20Poly1305), keyring(key), pool(1, false)
+	{
+		REQUIRE((fd = open(image.c_str(), O_RDWR)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		sb.fields.dedup_index_blocks = 1;
+		next = sb.groups[0].first_datablock;
+		key.random_key();
+		io.reset(new hush::fs::BlockIO(fd, sb, symmetric, keyring, pool, [] { return 1; }));
+		dedup = make();
+	}
+
+	~Index() { close(fd); };
+
+	std::unique_ptr<Dedup> make()
+	{
+		std::unique_ptr<Dedup> d(new Dedup(fd, sb, *io, key, [this] {
+			return next++;
+		}, [this](uint64_t block) {
+			freed.push_back(block);
+		}, [this](bool dirty) {
+			marks.push_back(dirty);
+		}));
+
+		d->open();
+		return d;
+	}
+
+	uint64_t store(uint64_t n) { return dedup->store(content(n).data()); };
+
+	int fd;
+	Superblock sb;
+	uint64_t next;
+	std::vector<uint64_t> freed;
+	std::vector<bool> marks;
+	hush::crypto::SecretKey key;
+	hush::crypto::Symmetric symmetric;
+	hush::crypto::KeyRing keyring;
+	hush::utils::WorkPool pool;
+	std::unique_ptr<hush::fs::BlockIO> io;
+	std::unique_ptr<Dedup> dedup;
+};
+
+TEST_CASE( "Dedup", "[hush::fs::Dedup]" ) {
+	char dir[] = "/tmp/hush-test-XXXXXX";
+	std::string image, keyfile;
+
+	REQUIRE(mkdtemp(dir) != nullptr);
+	image = std::string(dir) + "/secret.img";
+	keyfile = std::string(dir) + "/key";
+	create_and_write(keyfile, "passphrase", 10);
+	REQUIRE(run(hush_create, { "create", "-D", "-k", keyfile, "-s", "8m", image }) == 0);
+
+	SECTION( "The same block is stored once and freed with its last reference" ) {
+		Index x(image);
+		std::vector<uint8_t> got(HUSHFS_BLOCK_SIZE);
+		uint64_t a = x.store(1), b;
+
+		REQUIRE(x.store(1) == a);
+		REQUIRE(x.dedup->refs(a) == 2);
+		REQUIRE((b = x.store(2)) != a);
+		REQUIRE(x.next == b + 1);
+
+		x.io->read(a, 1, got.data());
+		REQUIRE(got == content(1));
+
+		x.dedup->release(a);
+		REQUIRE(x.dedup->refs(a) == 1);
+		REQUIRE(x.freed.empty());
+		x.dedup->release(a);
+		REQUIRE(x.freed == std::vector<uint64_t>({ a }));
+
+		// gone from the index, though its fingerprint is still in the filter
+		REQUIRE(x.store(1) != a);
+	}
+
+	SECTION( "Zeros need no block" ) {
+		Index x(image);
+		std::vector<uint8_t> zeros(HUSHFS_BLOCK_SIZE, 0);
+		uint64_t next = x.next;
+
+		REQUIRE(x.dedup->store(zeros.data()) == 0);
+		x.dedup->release(0);
+		REQUIRE(x.next == next);
+		REQUIRE(x.freed.empty());
+		REQUIRE(x.marks.empty());
+	}
+
+	SECTION( "Blocks the index doesn't know are freed outright" ) {
+		Index x(image);
+
+		REQUIRE(x.dedup->refs(12345) == 1);
+		x.dedup->release(12345);
+		REQUIRE(x.freed == std::vector<uint64_t>({ 12345 }));
+	}
+
+	SECTION( "Probes go past deleted slots, and new entries reuse them" ) {
+		Index x(image);
+		std::vector<uint64_t> blocks;
+
+		for (uint64_t n = 0; n < 100; n++)
+			blocks.push_back(x.store(n));
+		for (uint64_t n = 0; n < 100; n += 2)
+			x.dedup->release(blocks[n]);
+
+		for (uint64_t n = 1; n < 100; n += 2) {
+			REQUIRE(x.store(n) == blocks[n]);
+			REQUIRE(x.dedup->refs(blocks[n]) == 2);
+		}
+
+		// 50 in use and 50 deleted, room for 78 more
+		for (uint64_t n = 1000; n < 1078; n++) {
+			uint64_t b = x.store(n);
+			REQUIRE(x.store(n) == b);
+		}
+	}
+
+	SECTION( "A full index still stores blocks, unshared" ) {
+		Index x(image);
+		uint64_t a;
+
+		for (uint64_t n = 0; n < HUSHFS_DEDUP_PER_BLOCK; n++)
+			x.store(n);
+		a = x.store(HUSHFS_DEDUP_PER_BLOCK);
+		REQUIRE(x.store(HUSHFS_DEDUP_PER_BLOCK) != a);
+		REQUIRE(x.dedup->refs(a) == 1);
+		REQUIRE(x.store(0) == x.sb.groups[0].first_datablock);
+	}
+
+	SECTION( "Reopening rebuilds the filter and the block map from the index" ) {
+		Index x(image);
+		uint64_t a = x.store(1), b = x.store(2);
+
+		x.store(2);
+		x.dedup->close();
+		x.dedup = x.make();
+
+		REQUIRE(x.dedup->refs(b) == 2);
+		REQUIRE(x.store(1) == a);
+		x.dedup->release(b);
+		x.dedup->release(b);
+		REQUIRE(x.freed == std::vector<uint64_t>({ b }));
+	}
+
+	SECTION( "The first change marks the index dirty and close clears it" ) {
+		Index x(image);
+
+		x.store(1);
+		x.store(1);
+		REQUIRE(x.marks == std::vector<bool>({ true }));
+		x.dedup->close();
+		REQUIRE(x.marks == std::vector<bool>({ true, false }));
+
+		x.sb.fields.flags |= HUSHFS_FLAG_DEDUP_DIRTY;
+		REQUIRE_THROWS_AS(x.make(), std::runtime_error);
+	}
+
+	unlink(image.c_str());
+	unlink(keyfile.c_str());
+	rmdir(dir);
+}
@@ -0,0 +1,179 @@
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config.h"
+#include "create.hh"
+#include "defrag.hh"
+#include "fs.hh"
+#include "utils/optparse.h"
+#include "utils/tools.hh"
+#include "utils/image.hh"
+#include "utils/layout.hh"
+#include "utils/blockmap.hh"
+#include "test/catch.hpp"
+
+using hush::fs::Inode;
+using hush::fs::Superblock;
+
+std::string prgname = "hush";
+
+static int run(int (*action)(struct optparse *), std::vector<std::string> args)
+{
+	std::vector<char *> argv;
+	struct optparse opts;
+
+	for (auto & a : args)
+		argv.push_back(&a[0]);
+	argv.push_back(nullptr);
+
+	optparse_init(&opts, argv.data());
+	return action(&opts);
+}
+
+static void set_bit(std::vector<uint8_t> & map, uint64_t bit)
+{
+	map[bit / 8] |= 0x80 >> (bit % 8);
+}
+
+/*
+ * File `i_no` on `blocks`, the first twelve direct and the rest through
+ * the single indirect block `single`, each holding its inode and file block.
+ */
+static void add_file(int fd, Superblock & sb, uint64_t i_no, std::vector<uint64_t> const & blocks,
+		uint64_t single=0)
+{
+	hush::fs::BlockGroup & bg = sb.groups[0];
+	std::vector<uint8_t> imap, bmap;
+	std::vector<uint64_t> ptrs(HUSHFS_PTRS_PER_BLOCK, 0), mark(HUSHFS_BLOCK_SIZE / 8);
+	Inode inode = {};
+	uint64_t used = blocks.size();
+
+	hush::fs::load_group_maps(fd, bg, imap, bmap);
+
+	for (uint64_t i = 0; i < blocks.size(); i++) {
+		for (uint64_t j = 0; j < mark.size(); j += 2) {
+			mark[j] = i_no;
+			mark[j + 1] = i;
+		}
+		write_block(fd, mark.data(), blocks[i] * HUSHFS_BLOCK_SIZE);
+		set_bit(bmap, blocks[i] - bg.start_block);
+
+		if (i < HUSHFS_DIRECT_BLOCKS)
+			inode.fields.direct_ptr[i] = blocks[i];
+		else
+			ptrs[i - HUSHFS_DIRECT_BLOCKS] = blocks[i];
+	}
+
+	if (single != 0) {
+		write_block(fd, ptrs.data(), single * HUSHFS_BLOCK_SIZE);
+		set_bit(bmap, single - bg.start_block);
+		inode.fields.single_indirect_ptr = single;
+		used++;
+	}
+
+	inode.fields.mode = S_IFREG | 0644;
+	inode.fields.inode_number = i_no;
+	inode.fields.file_size = blocks.size() * HUSHFS_BLOCK_SIZE;
+	hush::fs::store_inode(fd, sb, inode);
+	set_bit(imap, i_no - bg.first_inode - 1);
+
+	write_block(fd, imap.data(), bg.inode_bitmap_offset * HUSHFS_BLOCK_SIZE);
+	write_block(fd, bmap.data(), bg.block_bitmap_offset * HUSHFS_BLOCK_SIZE);
+	bg.free_blocks -= used;
+	bg.free_inodes--;
+	sb.fields.free_blocks -= used;
+	sb.fields.free_inodes--;
+	write_block(fd, &sb, 0);
+}
+
+// every block of file `i_no` still holds what add_file put there
+static bool intact(int fd, Superblock const & sb, uint64_t i_no, uint64_t nblocks)
+{
+	Inode inode;
+	std::vector<uint64_t> got(HUSHFS_BLOCK_SIZE / 8);
+
+	hush::fs::load_inode(fd, sb, i_no, inode);
+	for (uint64_t i = 0; i < nblocks; i++) {
+		uint64_t b = hush::fs::map_block(fd, inode.fields, i);
+
+		if (b == 0)
+			return false;
+		read_block(fd, got.data(), b * HUSHFS_BLOCK_SIZE);
+		if (got[0] != i_no || got[1] != i)
+			return false;
+	}
+	return true;
+}
+
+TEST_CASE( "defrag", "[hush_defrag]" ) {
+	char dir[] = "/tmp/hush-test-XXXXXX";
+	std::string image, keyfile;
+	Superblock sb;
+	Inode inode;
+	int fd;
+
+	REQUIRE(mkdtemp(dir) != nullptr);
+	image = std::string(dir) + "/secret.img";
+	keyfile = std::string(dir) + "/key";
+	create_and_write(keyfile, "passphrase", 10);
+	REQUIRE(run(hush_create, { "create", "-k", keyfile, "-s", "8m", image }) == 0);
+
+	SECTION( "An image with nothing sealed is compacted without a key" ) {
+		std::vector<uint64_t> scattered;
+		uint64_t fdb;
+
+		REQUIRE((fd = open(image.c_str(), O_RDWR)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		fdb = sb.groups[0].first_datablock;
+
+		// only direct blocks, and one with an indirect block too
+		add_file(fd, sb, 1, { fdb + 40, fdb + 7, fdb + 90 });
+		for (uint64_t i = 0; i < 14; i++)
+			scattered.push_back(fdb + 200 + i * 3);
+		add_file(fd, sb, 2, scattered, fdb + 150);
+		close(fd);
+
+		REQUIRE(run(hush_defrag, { "defrag", image }) == 0);
+
+		REQUIRE((fd = open(image.c_str(), O_RDONLY)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		REQUIRE(intact(fd, sb, 1, 3));
+		REQUIRE(intact(fd, sb, 2, 14));
+		for (uint64_t i_no : { 1, 2 }) {
+			hush::fs::load_inode(fd, sb, i_no, inode);
+			REQUIRE(hush::fs::file_extents(fd, inode.fields).size() == 1);
+		}
+		REQUIRE(sb.fields.free_blocks == sb.groups[0].free_blocks);
+		close(fd);
+	}
+
+	SECTION( "A mounted image is left alone" ) {
+		int mount_fd;
+
+		REQUIRE((fd = open(image.c_str(), O_RDWR)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		add_file(fd, sb, 1, { sb.groups[0].first_datablock + 40, sb.groups[0].first_datablock + 7 });
+		close(fd);
+
+		// what a mount holds for as long as it's up
+		REQUIRE((mount_fd = open(image.c_str(), O_RDWR)) != -1);
+		REQUIRE(hush::fs::claim_image(mount_fd));
+		REQUIRE(run(hush_defrag, { "defrag", image }) == 1);
+		REQUIRE(run(hush_defrag, { "defrag", "-n", image }) == 0);
+		close(mount_fd);
+
+		REQUIRE((fd = open(image.c_str(), O_RDONLY)) != -1);
+		hush::fs::load_inode(fd, sb, 1, inode);
+		REQUIRE(hush::fs::file_extents(fd, inode.fields).size() == 2);
+		close(fd);
+
+		REQUIRE(run(hush_defrag, { "defrag", image }) == 0);
+	}
+
+	unlink(image.c_str());
+	unlink(keyfile.c_str());
+	rmdir(dir);
+}
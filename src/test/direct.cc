@@ -0,0 +1,176 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "utils/direct.hh"
+#include "utils/bufferpool.hh"
+#include "config.h"
+#include "test/catch.hpp"
+
+using hush::fs::BlockDevice;
+using hush::fs::DirectDevice;
+using hush::fs::PosixDevice;
+using hush::utils::BufferPool;
+
+// a PosixDevice that counts what O_DIRECT would have refused
+class Strict : public PosixDevice
+{
+public:
+	Strict(int fd, unsigned & refused) : PosixDevice(fd), refused(refused) {};
+
+	void read(void *buf, uint64_t offset, uint64_t len) override
+	{
+		check(buf, offset, len);
+		PosixDevice::read(buf, offset, len);
+	}
+
+	void write(void const *buf, uint64_t offset, uint64_t len) override
+	{
+		check(buf, offset, len);
+		PosixDevice::write(buf, offset, len);
+	}
+
+private:
+	void check(void const *buf, uint64_t offset, uint64_t len)
+	{
+		if ((uintptr_t)buf % HUSHFS_BLOCK_SIZE || offset % HUSHFS_BLOCK_SIZE || len % HUSHFS_BLOCK_SIZE)
+			refused++;
+	}
+
+	unsigned & refused;
+};
+
+TEST_CASE( "DirectDevice", "[hush::fs::DirectDevice]" ) {
+	FILE *tmp = tmpfile();
+	unsigned refused = 0;
+	// two bounce buffers and a cache of two blocks
+	DirectDevice dev(new Strict(fileno(tmp), refused), 2 * HUSHFS_DIRECT_BOUNCE_BYTES / HUSHFS_BLOCK_SIZE, 2);
+	std::vector<uint8_t> zeros(16 * HUSHFS_BLOCK_SIZE + 1, 0);
+
+	dev.write(zeros.data() + 1, 0, zeros.size() - 1);
+
+	SECTION( "Pieces of blocks go through whole ones" ) {
+		std::string s("across two blocks"), got(s.size(), ' ');
+
+		dev.write(s.data(), HUSHFS_BLOCK_SIZE - 5, s.size());
+		dev.read(&got[0], HUSHFS_BLOCK_SIZE - 5, got.size());
+		REQUIRE(got == s);
+
+		// with the cache of two pushed out
+		dev.read(&got[0], 8 * HUSHFS_BLOCK_SIZE, 1);
+		dev.read(&got[0], 9 * HUSHFS_BLOCK_SIZE, 1);
+		dev.read(&got[0], HUSHFS_BLOCK_SIZE - 5, got.size());
+		REQUIRE(got == s);
+	}
+
+	SECTION( "Blocks in unaligned memory are bounced" ) {
+		std::vector<uint8_t> out(40 * HUSHFS_BLOCK_SIZE + 1), in(out.size());
+
+		for (size_t i = 0; i < out.size(); i++)
+			out[i] = i * 31;
+		dev.write(out.data() + 1, 0, out.size() - 1);
+		dev.read(in.data() + 1, 0, in.size() - 1);
+		REQUIRE(std::equal(out.begin() + 1, out.end(), in.begin() + 1));
+	}
+
+	SECTION( "Writing whole blocks drops the cached copy" ) {
+		std::vector<uint8_t> block(2 * HUSHFS_BLOCK_SIZE, 7);
+		uint8_t got = 0;
+
+		dev.read(&got, 3 * HUSHFS_BLOCK_SIZE + 10, 1);
+		REQUIRE(got == 0);
+		dev.write(block.data() + 1, 3 * HUSHFS_BLOCK_SIZE, HUSHFS_BLOCK_SIZE);
+		dev.read(&got, 3 * HUSHFS_BLOCK_SIZE + 10, 1);
+		REQUIRE(got == 7);
+	}
+
+	REQUIRE(refused == 0);
+	fclose(tmp);
+}
+
+// a PosixDevice that dawdles over whole-block writes, so others can get in meanwhile
+class Slow : public PosixDevice
+{
+public:
+	Slow(int fd, std::atomic<bool> & started) : PosixDevice(fd), started(started) {};
+
+	void write(void const *buf, uint64_t offset, uint64_t len) override
+	{
+		if (len > HUSHFS_BLOCK_SIZE) {
+			started = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		PosixDevice::write(buf, offset, len);
+	}
+
+private:
+	std::atomic<bool> & started;
+};
+
+TEST_CASE( "DirectDevice pieces wait for whole-block writes", "[hush::fs::DirectDevice]" ) {
+	FILE *tmp = tmpfile();
+	std::atomic<bool> started(false);
+	DirectDevice dev(new Slow(fileno(tmp), started), HUSHFS_DIRECT_BOUNCE_BYTES / HUSHFS_BLOCK_SIZE, 2);
+	std::vector<uint8_t> zeros(4 * HUSHFS_BLOCK_SIZE, 0), ones(2 * HUSHFS_BLOCK_SIZE, 1), got(zeros.size());
+	uint8_t two = 2;
+
+	for (uint64_t b = 0; b < 4; b++)
+		dev.write(zeros.data(), b * HUSHFS_BLOCK_SIZE, HUSHFS_BLOCK_SIZE);
+
+	// the piece comes in while blocks 1 and 2 are on their way out
+	std::thread whole([&dev, &ones] { dev.write(ones.data(), HUSHFS_BLOCK_SIZE, ones.size()); });
+	while (!started)
+		std::this_thread::yield();
+	dev.write(&two, 2 * HUSHFS_BLOCK_SIZE + 10, 1);
+	whole.join();
+
+	dev.read(got.data(), 0, got.size());
+	REQUIRE(got[HUSHFS_BLOCK_SIZE] == 1);
+	REQUIRE(got[2 * HUSHFS_BLOCK_SIZE + 9] == 1);
+	REQUIRE(got[2 * HUSHFS_BLOCK_SIZE + 10] == 2);
+	REQUIRE(got[3 * HUSHFS_BLOCK_SIZE] == 0);
+	fclose(tmp);
+}
+
+// a device that can't pin anything, like an io_uring over RLIMIT_MEMLOCK
+class Unpinnable : public PosixDevice
+{
+public:
+	Unpinnable(int fd) : PosixDevice(fd) {};
+
+	void register_buffers(std::vector<struct iovec> const & bufs) override
+	{
+		throw std::runtime_error("Couldn't register buffers");
+	}
+};
+
+TEST_CASE( "DirectDevice without fixed buffers", "[hush::fs::DirectDevice]" ) {
+	FILE *tmp = tmpfile();
+	std::unique_ptr<DirectDevice> dev;
+	std::vector<uint8_t> out(2 * HUSHFS_BLOCK_SIZE, 5), in(out.size());
+
+	REQUIRE_NOTHROW(dev.reset(new DirectDevice(new Unpinnable(fileno(tmp)),
+					HUSHFS_DIRECT_BOUNCE_BYTES / HUSHFS_BLOCK_SIZE, 2)));
+	dev->write(out.data(), 0, out.size());
+	dev->read(in.data(), 0, in.size());
+	REQUIRE(in == out);
+	fclose(tmp);
+}
+
+TEST_CASE( "BufferPool", "[hush::utils::BufferPool]" ) {
+	BufferPool pool(HUSHFS_BLOCK_SIZE, 4, HUSHFS_BLOCK_SIZE);
+	std::vector<uint8_t *> bufs = pool.get(3);
+
+	REQUIRE(bufs.size() == 3);
+	for (uint8_t *b : bufs)
+		REQUIRE((uintptr_t)b % HUSHFS_BLOCK_SIZE == 0);
+	REQUIRE_THROWS_AS(pool.get(5), std::runtime_error);
+
+	pool.put(bufs);
+	REQUIRE(pool.get(4).size() == 4);
+}
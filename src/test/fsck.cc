@@ -0,0 +1,113 @@
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config.h"
+#include "create.hh"
+#include "fsck.hh"
+#include "fs.hh"
+#include "utils/optparse.h"
+#include "utils/tools.hh"
+#include "utils/image.hh"
+#include "utils/layout.hh"
+#include "test/catch.hpp"
+
+using hush::fs::BlockGroup;
+using hush::fs::Superblock;
+
+static int run(int (*action)(struct optparse *), std::vector<std::string> args)
+{
+	std::vector<char *> argv;
+	struct optparse opts;
+
+	for (auto & a : args)
+		argv.push_back(&a[0]);
+	argv.push_back(nullptr);
+
+	optparse_init(&opts, argv.data());
+	return action(&opts);
+}
+
+static bool block_marked(int fd, BlockGroup const & bg, uint64_t block)
+{
+	std::vector<uint8_t> imap, bmap;
+
+	hush::fs::load_group_maps(fd, bg, imap, bmap);
+	return hush::fs::test_bit(bmap.data(), block - bg.start_block);
+}
+
+TEST_CASE( "fsck", "[hush_fsck]" ) {
+	char dir[] = "/tmp/hush-test-XXXXXX";
+	std::string image, keyfile;
+	std::vector<uint8_t> imap, bmap;
+	Superblock sb, good;
+	uint64_t stray;
+	int fd;
+
+	REQUIRE(mkdtemp(dir) != nullptr);
+	image = std::string(dir) + "/secret.img";
+	keyfile = std::string(dir) + "/key";
+	create_and_write(keyfile, "passphrase", 10);
+	REQUIRE(run(hush_create, { "create", "-k", keyfile, "-s", "8m", image }) == 0);
+	REQUIRE(run(hush_fsck, { "fsck", image }) == 0);
+
+	// a block marked used that nothing points at, and free counts that are off
+	REQUIRE((fd = open(image.c_str(), O_RDWR)) != -1);
+	hush::fs::load_superblock(fd, good);
+	sb = good;
+	stray = sb.groups[0].first_datablock + 10;
+	hush::fs::load_group_maps(fd, sb.groups[0], imap, bmap);
+	hush::fs::mark_bits(bmap.data(), stray - sb.groups[0].start_block, 1);
+	write_data(fd, bmap.data(), sb.groups[0].block_bitmap_offset * HUSHFS_BLOCK_SIZE, bmap.size());
+	sb.groups[0].free_blocks -= 1;
+	sb.groups[0].free_inodes -= 3;
+	sb.fields.free_blocks -= 5;
+	write_block(fd, &sb, 0);
+	close(fd);
+
+	SECTION( "Without -y it's only reported" ) {
+		REQUIRE(run(hush_fsck, { "fsck", image }) == 1);
+
+		REQUIRE((fd = open(image.c_str(), O_RDONLY)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		REQUIRE(sb.fields.free_blocks == good.fields.free_blocks - 5);
+		REQUIRE(block_marked(fd, sb.groups[0], stray));
+		close(fd);
+	}
+
+	SECTION( "-y puts the bitmap and the counts back" ) {
+		REQUIRE(run(hush_fsck, { "fsck", "-y", image }) == 0);
+		REQUIRE(run(hush_fsck, { "fsck", image }) == 0);
+
+		REQUIRE((fd = open(image.c_str(), O_RDONLY)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		REQUIRE(sb.fields.free_blocks == good.fields.free_blocks);
+		REQUIRE(sb.fields.free_inodes == good.fields.free_inodes);
+		REQUIRE(sb.groups[0].free_blocks == good.groups[0].free_blocks);
+		REQUIRE(sb.groups[0].free_inodes == good.groups[0].free_inodes);
+		REQUIRE_FALSE(block_marked(fd, sb.groups[0], stray));
+		close(fd);
+	}
+
+	SECTION( "-y refuses a mounted image" ) {
+		int mount_fd;
+
+		// what a mount holds for as long as it's up
+		REQUIRE((mount_fd = open(image.c_str(), O_RDWR)) != -1);
+		REQUIRE(hush::fs::claim_image(mount_fd));
+		REQUIRE(run(hush_fsck, { "fsck", "-y", image }) == 1);
+		close(mount_fd);
+
+		REQUIRE((fd = open(image.c_str(), O_RDONLY)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		REQUIRE(sb.fields.free_blocks == good.fields.free_blocks - 5);
+		REQUIRE(block_marked(fd, sb.groups[0], stray));
+		close(fd);
+	}
+
+	unlink(image.c_str());
+	unlink(keyfile.c_str());
+	rmdir(dir);
+}
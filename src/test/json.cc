@@ -0,0 +1,36 @@
+#include <sstream>
+#include <string>
+#include "utils/json.hh"
+#include "test/catch.hpp"
+
+TEST_CASE( "Streaming output", "[hush::utils::JsonWriter]" ) {
+	std::ostringstream os;
+	hush::utils::JsonWriter j(os);
+
+	SECTION( "Empty object" ) {
+		j.begin_object().end_object();
+		REQUIRE(os.str() == "{}\n");
+	}
+
+	SECTION( "Commas between members only" ) {
+		j.begin_object()
+			.value("a", 1)
+			.value("b", std::string("two"))
+			.value("c", true)
+			.end_object();
+		REQUIRE(os.str() == "{\"a\":1,\"b\":\"two\",\"c\":true}\n");
+	}
+
+	SECTION( "Nesting" ) {
+		j.begin_object()
+			.begin_array("xs").value(nullptr, 1).value(nullptr, 2).end_array()
+			.begin_object("o").end_object()
+			.end_object();
+		REQUIRE(os.str() == "{\"xs\":[1,2],\"o\":{}}\n");
+	}
+
+	SECTION( "String escaping" ) {
+		j.begin_array().value(nullptr, "a\"b\\c\n\x01").end_array();
+		REQUIRE(os.str() == "[\"a\\\"b\\\\c\\n\\u0001\"]\n");
+	}
+}
@@ -0,0 +1,71 @@
+#include <string>
+#include <vector>
+#include <sodium.h>
+#include "crypto/keyfile.hh"
+#include "test/catch.hpp"
+
+using hush::crypto::KdfParams;
+using hush::crypto::KeyFileException;
+
+// `pem` without the header line starting with `name`
+static std::string drop_header(std::string const & pem, std::string const & name)
+{
+	size_t start = pem.find("\r\n" + name + ": ");
+	size_t end;
+
+	REQUIRE(start != std::string::npos);
+	end = pem.find("\r\n", start + 2);
+	return pem.substr(0, start) + pem.substr(end);
+}
+
+TEST_CASE( "seal/open_private_key", "[hush::crypto::open_private_key]" ) {
+	unsigned char privkey[crypto_box_SECRETKEYBYTES];
+	hush::secure::vector<unsigned char> got;
+	KdfParams kdf;
+	std::string pem;
+
+	for (unsigned i = 0; i < sizeof privkey; i++)
+		privkey[i] = i;
+	kdf.opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE + 1;
+	pem = hush::crypto::seal_private_key(privkey, sizeof privkey, "password", kdf);
+
+	SECTION( "The limits it was sealed with are in the headers" ) {
+		REQUIRE(pem.find("\r\nKDF: argon2id13\r\n") != std::string::npos);
+		REQUIRE(pem.find("\r\nOps-Limit: " + std::to_string(kdf.opslimit) + "\r\n") !=
+				std::string::npos);
+		REQUIRE(pem.find("\r\nMem-Limit: " + std::to_string(kdf.memlimit) + "\r\n") !=
+				std::string::npos);
+		REQUIRE(pem.find("\r\nSalt: ") != std::string::npos);
+	}
+
+	SECTION( "It opens with the password, and only with it" ) {
+		REQUIRE(hush::crypto::open_private_key(pem, "password", got));
+		REQUIRE(got == hush::secure::vector<unsigned char>(privkey, privkey + sizeof privkey));
+		REQUIRE_FALSE(hush::crypto::open_private_key(pem, "passw0rd", got));
+	}
+
+	SECTION( "Opening hashes with the limits from the file, not the defaults" ) {
+		std::string defaults = drop_header(pem, "Ops-Limit");
+
+		REQUIRE_FALSE(hush::crypto::open_private_key(defaults, "password", got));
+	}
+
+	SECTION( "A file without a salt is refused" ) {
+		std::string unsalted = drop_header(pem, "Salt");
+
+		REQUIRE_THROWS_AS(hush::crypto::open_private_key(unsalted, "password", got),
+				KeyFileException);
+	}
+
+	SECTION( "Bad headers are refused" ) {
+		std::string other = pem, garbled = pem;
+
+		other.replace(other.find("argon2id13"), 10, "scrypt");
+		REQUIRE_THROWS_AS(hush::crypto::open_private_key(other, "password", got),
+				KeyFileException);
+
+		garbled.replace(garbled.find("Ops-Limit: ") + 11, 1, "x");
+		REQUIRE_THROWS_AS(hush::crypto::open_private_key(garbled, "password", got),
+				KeyFileException);
+	}
+}
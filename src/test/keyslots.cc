@@ -0,0 +1,58 @@
+#include <cstring>
+#include <vector>
+#include <sodium.h>
+#include "crypto/keyslots.hh"
+#include "test/catch.hpp"
+
+using hush::crypto::SecretKey;
+using hush::fs::KeySlot;
+
+TEST_CASE( "key_fits_slots", "[hush::crypto::key_fits_slots]" ) {
+	std::vector<KeySlot> slots(2);
+	SecretKey volume_key, other;
+
+	volume_key.random_key();
+	other.random_key();
+	hush::crypto::seal_key_slot(slots[1], volume_key, "passphrase");
+
+	SECTION( "Only the key the slots wrap fits" ) {
+		REQUIRE(hush::crypto::key_fits_slots(slots, volume_key));
+		REQUIRE_FALSE(hush::crypto::key_fits_slots(slots, other));
+	}
+
+	SECTION( "A slot without a check vouches for nothing until it's given one" ) {
+		memset(slots[1].key_check, 0, sizeof slots[1].key_check);
+		REQUIRE_FALSE(hush::crypto::key_fits_slots(slots, volume_key));
+
+		hush::crypto::set_key_check(slots[1], volume_key);
+		REQUIRE(hush::crypto::key_fits_slots(slots, volume_key));
+	}
+
+	SECTION( "Inactive slots don't count" ) {
+		slots[1].active = 0;
+		REQUIRE_FALSE(hush::crypto::key_fits_slots(slots, volume_key));
+	}
+}
+
+TEST_CASE( "seal_key_slot", "[hush::crypto::seal_key_slot]" ) {
+	KeySlot slot;
+	SecretKey volume_key, opened;
+	hush::crypto::KdfParams kdf;
+
+	volume_key.random_key();
+	kdf.opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE + 1;
+	kdf.memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE * 2;
+	hush::crypto::seal_key_slot(slot, volume_key, "passphrase", kdf);
+
+	SECTION( "The slot keeps the limits it was sealed with" ) {
+		REQUIRE(slot.opslimit == kdf.opslimit);
+		REQUIRE(slot.memlimit == kdf.memlimit);
+		REQUIRE(hush::crypto::open_key_slot(slot, "passphrase", opened));
+		REQUIRE(memcmp(opened.get_key(), volume_key.get_key(), crypto_box_SEEDBYTES) == 0);
+	}
+
+	SECTION( "and opening uses them" ) {
+		slot.opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+		REQUIRE_FALSE(hush::crypto::open_key_slot(slot, "passphrase", opened));
+	}
+}
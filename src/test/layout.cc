@@ -0,0 +1,88 @@
+#include <vector>
+#include "config.h"
+#include "utils/layout.hh"
+#include "test/catch.hpp"
+
+TEST_CASE( "plan_group", "[hush::fs::plan_group]" ) {
+
+	SECTION( "Group 0 leaves room for the superblock and key slots" ) {
+		hush::fs::BlockGroup g = hush::fs::plan_group(0, 2560, 0);
+
+		REQUIRE(g.inode_bitmap_offset == HUSHFS_HEADER_BLOCKS);
+		REQUIRE(g.block_bitmap_offset == g.inode_bitmap_offset + g.inode_bitmap_blocks);
+		REQUIRE(g.inode_table_offset == g.block_bitmap_offset + g.block_bitmap_blocks);
+		REQUIRE(g.tag_table_offset == g.inode_table_offset + g.inode_table_blocks);
+		REQUIRE(g.first_datablock == g.tag_table_offset + g.tag_table_blocks);
+		REQUIRE(g.free_blocks == 2560 - g.first_datablock);
+	}
+
+	SECTION( "Appended groups start their metadata at their first block" ) {
+		hush::fs::BlockGroup g = hush::fs::plan_group(2560, 1280, 2560);
+
+		REQUIRE(g.inode_bitmap_offset == 2560);
+		REQUIRE(g.first_inode == 2560);
+		REQUIRE(hush::fs::group_metadata_blocks(g) == g.first_datablock - 2560);
+	}
+
+	SECTION( "Bitmaps are big enough for every bit" ) {
+		// one block of bitmap covers 32768 blocks, one more needs a second
+		hush::fs::BlockGroup g = hush::fs::plan_group(0, (HUSHFS_BLOCK_SIZE * 8) + 1, 0);
+
+		REQUIRE(g.block_bitmap_blocks == 2);
+		REQUIRE(g.inode_bitmap_blocks == 2);
+	}
+
+	SECTION( "Too small to hold its own metadata" ) {
+		REQUIRE_THROWS(hush::fs::plan_group(0, 3, 0));
+	}
+
+	SECTION( "A dedup index has a slot for every data block and sits before them" ) {
+		hush::fs::BlockGroup g = hush::fs::plan_group(0, 2560, 0);
+		uint64_t data_blocks = g.free_blocks;
+		uint64_t tags_end = g.tag_table_offset + g.tag_table_blocks;
+		uint64_t blocks = hush::fs::plan_dedup_index(g);
+
+		REQUIRE(blocks * HUSHFS_DEDUP_PER_BLOCK >= data_blocks);
+		REQUIRE(g.first_datablock == tags_end + blocks);
+		REQUIRE(g.free_blocks == data_blocks - blocks);
+	}
+}
+
+TEST_CASE( "locate_tag", "[hush::fs::locate_tag]" ) {
+	hush::fs::Superblock sb = {};
+	uint64_t block, slot;
+
+	sb.fields.group_count = 2;
+	sb.groups[0] = hush::fs::plan_group(0, 2560, 0);
+	sb.groups[1] = hush::fs::plan_group(2560, 1280, 2560);
+
+	SECTION( "Every block of a group has a tag" ) {
+		REQUIRE(sb.groups[0].tag_table_blocks * HUSHFS_TAGS_PER_BLOCK >= 2560);
+
+		REQUIRE(hush::fs::locate_tag(sb, HUSHFS_TAGS_PER_BLOCK + 1, block, slot));
+		REQUIRE(block == sb.groups[0].tag_table_offset + 1);
+		REQUIRE(slot == 1);
+	}
+
+	SECTION( "Tags are per group" ) {
+		REQUIRE(hush::fs::locate_tag(sb, 2560, block, slot));
+		REQUIRE(block == sb.groups[1].tag_table_offset);
+		REQUIRE(slot == 0);
+	}
+
+	SECTION( "Groups from before tags have none" ) {
+		sb.groups[1].tag_table_blocks = 0;
+		REQUIRE_FALSE(hush::fs::locate_tag(sb, 2600, block, slot));
+		REQUIRE_FALSE(hush::fs::locate_tag(sb, 5000, block, slot));
+	}
+}
+
+TEST_CASE( "mark_bits", "[hush::fs::mark_bits]" ) {
+	std::vector<uint8_t> map(4);
+
+	hush::fs::mark_bits(map.data(), 3, 10);
+
+	REQUIRE(map[0] == 0x1F);
+	REQUIRE(map[1] == 0xF8);
+	REQUIRE(map[2] == 0x00);
+}
@@ -0,0 +1,230 @@
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config.h"
+#include "create.hh"
+#include "resize.hh"
+#include "fs.hh"
+#include "crypto/secretkey.hh"
+#include "utils/optparse.h"
+#include "utils/tools.hh"
+#include "utils/image.hh"
+#include "utils/merkle.hh"
+#include "test/catch.hpp"
+
+using hush::fs::BlockTag;
+using hush::fs::MerkleDirtyException;
+using hush::fs::MerkleException;
+using hush::fs::MerkleTree;
+using hush::fs::Superblock;
+
+static int run(int (*action)(struct optparse *), std::vector<std::string> args)
+{
+	std::vector<char *> argv;
+	struct optparse opts;
+
+	for (auto & a : args)
+		argv.push_back(&a[0]);
+	argv.push_back(nullptr);
+
+	optparse_init(&opts, argv.data());
+	return action(&opts);
+}
+
+// a tag block whose first tag is written, told apart by `version`
+static std::vector<BlockTag> tags(uint64_t version)
+{
+	std::vector<BlockTag> t(HUSHFS_TAGS_PER_BLOCK);
+
+	t[0] = {};
+	t[0].flags = 1;
+	t[0].key_generation = version;
+	return t;
+}
+
+/*
+ * A MerkleTree on the image as a mount would have it, committing its roots
+ * to the superblock the way MountInfo::store_tree does. Each one is a new
+ * session, starting from what's on disk.
+ */
+class Session
+{
+public:
+	Session(std::string const & image, hush::crypto::SecretKey const & key) : key(key)
+	{
+		REQUIRE((fd = open(image.c_str(), O_RDWR)) != -1);
+		hush::fs::load_superblock(fd, sb);
+		tree.reset(new MerkleTree(fd, sb, [this](MerkleTree::Roots const & r) {
+			if (r.dirty) {
+				sb.fields.flags |= HUSHFS_FLAG_TREE_DIRTY;
+			} else {
+				sb.fields.merkle_groups = r.groups;
+				std::copy(r.root.begin(), r.root.end(), sb.fields.merkle_root);
+				for (uint64_t g = 0; g < r.groups; g++)
+					std::copy(r.group_roots[g].begin(), r.group_roots[g].end(),
+							sb.groups[g].merkle_root);
+				sb.fields.flags &= ~HUSHFS_FLAG_TREE_DIRTY;
+			}
+			write_block(fd, &sb, 0);
+		}));
+	}
+
+	~Session() { close(fd); };
+
+	// the first tag block of group `g`
+	uint64_t tag_block(uint64_t g) { return sb.groups[g].tag_table_offset; };
+
+	void write(uint64_t block, uint64_t version)
+	{
+		std::vector<BlockTag> t = tags(version);
+
+		tree->update(block, t.data());
+		write_block(fd, t.data(), block * HUSHFS_BLOCK_SIZE);
+	}
+
+	// what's on disk at `block` against the tree
+	void verify(uint64_t block)
+	{
+		std::vector<BlockTag> t(HUSHFS_TAGS_PER_BLOCK);
+
+		read_block(fd, t.data(), block * HUSHFS_BLOCK_SIZE);
+		tree->verify(block, t.data());
+	}
+
+	int fd;
+	Superblock sb;
+	hush::crypto::SecretKey const & key;
+	std::unique_ptr<MerkleTree> tree;
+};
+
+TEST_CASE( "MerkleTree", "[hush::fs::MerkleTree]" ) {
+	char dir[] = "/tmp/hush-test-XXXXXX";
+	std::string image, keyfile;
+	hush::crypto::SecretKey key;
+	uint64_t block;
+
+	REQUIRE(mkdtemp(dir) != nullptr);
+	image = std::string(dir) + "/secret.img";
+	keyfile = std::string(dir) + "/key";
+	create_and_write(keyfile, "passphrase", 10);
+	REQUIRE(run(hush_create, { "create", "-k", keyfile, "-s", "8m", image }) == 0);
+	key.random_key();
+
+	{
+		Session s(image, key);
+
+		block = s.tag_block(0) + 1;
+		s.tree->open(key);
+		s.write(block, 1);
+		s.tree->flush();
+	}
+
+	SECTION( "What was flushed verifies in the next session" ) {
+		Session s(image, key);
+
+		REQUIRE(s.sb.fields.merkle_groups == 1);
+		REQUIRE((s.sb.fields.flags & HUSHFS_FLAG_TREE_DIRTY) == 0);
+		s.tree->open(key);
+		REQUIRE_NOTHROW(s.verify(block));
+		REQUIRE_NOTHROW(s.verify(s.tag_block(0)));
+	}
+
+	SECTION( "A tag block rolled back to an older copy doesn't verify" ) {
+		std::vector<BlockTag> old = tags(1);
+
+		{
+			Session s(image, key);
+
+			s.tree->open(key);
+			s.write(block, 2);
+			REQUIRE_THROWS_AS(s.tree->verify(block, old.data()), MerkleException);
+			s.tree->flush();
+		}
+
+		{
+			Session s(image, key);
+
+			write_block(s.fd, old.data(), block * HUSHFS_BLOCK_SIZE);
+			s.tree->open(key);
+			REQUIRE_THROWS_AS(s.verify(block), MerkleException);
+		}
+	}
+
+	SECTION( "Roots that weren't stored with the key don't open" ) {
+		Session s(image, key);
+		hush::crypto::SecretKey other;
+
+		other.random_key();
+		REQUIRE_THROWS_AS(s.tree->open(other), MerkleException);
+	}
+
+	SECTION( "A tree that wasn't flushed is refused, unless it's to be rebuilt" ) {
+		{
+			Session s(image, key);
+
+			s.tree->open(key);
+			s.write(block, 2);
+			// and then the session dies
+		}
+
+		{
+			Session s(image, key);
+
+			REQUIRE((s.sb.fields.flags & HUSHFS_FLAG_TREE_DIRTY) != 0);
+			REQUIRE_THROWS_AS(s.tree->open(key), MerkleDirtyException);
+		}
+
+		{
+			Session s(image, key);
+
+			REQUIRE_NOTHROW(s.tree->open(key, true));
+			REQUIRE((s.sb.fields.flags & HUSHFS_FLAG_TREE_DIRTY) == 0);
+			REQUIRE_NOTHROW(s.verify(block));
+		}
+
+		{
+			Session s(image, key);
+
+			REQUIRE_NOTHROW(s.tree->open(key));
+			REQUIRE_NOTHROW(s.verify(block));
+		}
+	}
+
+	SECTION( "A group added by resize has to be blank" ) {
+		REQUIRE(run(hush_resize, { "resize", image, "+4m" }) == 0);
+
+		SECTION( "and then joins the tree" ) {
+			{
+				Session s(image, key);
+
+				s.tree->open(key);
+				s.write(s.tag_block(1), 1);
+				s.tree->flush();
+				REQUIRE(s.sb.fields.merkle_groups == 2);
+			}
+
+			Session s(image, key);
+
+			s.tree->open(key);
+			REQUIRE_NOTHROW(s.verify(s.tag_block(1)));
+		}
+
+		SECTION( "and is rejected if it isn't" ) {
+			Session s(image, key);
+			std::vector<BlockTag> planted = tags(7);
+
+			write_block(s.fd, planted.data(), s.tag_block(1) * HUSHFS_BLOCK_SIZE);
+			s.tree->open(key);
+			REQUIRE_THROWS_AS(s.verify(s.tag_block(1)), MerkleException);
+			REQUIRE_THROWS_AS(s.tree->flush(), MerkleException);
+		}
+	}
+
+	unlink(image.c_str());
+	unlink(keyfile.c_str());
+	rmdir(dir);
+}
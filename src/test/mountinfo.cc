@@ -0,0 +1,123 @@
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config.h"
+#include "create.hh"
+#include "resize.hh"
+#include "fs.hh"
+#include "utils/optparse.h"
+#include "utils/tools.hh"
+#include "utils/image.hh"
+#include "utils/blockmap.hh"
+#include "utils/mountinfo.hh"
+#include "test/catch.hpp"
+
+using hush::fs::BlockGroup;
+using hush::fs::Extent;
+using hush::fs::MountInfo;
+using hush::fs::Superblock;
+
+static int run(int (*action)(struct optparse *), std::vector<std::string> args)
+{
+	std::vector<char *> argv;
+	struct optparse opts;
+
+	for (auto & a : args)
+		argv.push_back(&a[0]);
+	argv.push_back(nullptr);
+
+	optparse_init(&opts, argv.data());
+	return action(&opts);
+}
+
+static bool all_used(int fd, BlockGroup const & bg, uint64_t first, uint64_t count)
+{
+	std::vector<uint8_t> imap, bmap;
+
+	hush::fs::load_group_maps(fd, bg, imap, bmap);
+	for (uint64_t b = first; b < first + count; b++) {
+		uint64_t bit = b - bg.start_block;
+
+		if (!(bmap[bit / 8] & (0x80 >> (bit % 8))))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * MountInfo is one per process, so this is the only test that may have it,
+ * and it all happens on one image in order: a run ends at its group's last
+ * block, then fill_holes() runs the image out of space part way through.
+ */
+TEST_CASE( "MountInfo::allocate_run", "[hush::fs::MountInfo]" ) {
+	char dir[] = "/tmp/hush-test-XXXXXX";
+	std::string image, keyfile;
+	std::vector<Extent> added;
+	hush::fs::InodeData inode = {};
+	Superblock sb;
+	uint64_t got, first, g0_end, g1_end, mapped = 0;
+	int fd;
+
+	REQUIRE(mkdtemp(dir) != nullptr);
+	image = std::string(dir) + "/secret.img";
+	keyfile = std::string(dir) + "/key";
+	create_and_write(keyfile, "passphrase", 10);
+	REQUIRE(run(hush_create, { "create", "-k", keyfile, "-s", "8m", image }) == 0);
+	REQUIRE(run(hush_resize, { "resize", image, "+4m" }) == 0);
+
+	REQUIRE((fd = open(image.c_str(), O_RDWR)) != -1);
+	MountInfo & mi = MountInfo::get_instance(fd);
+	BlockGroup const g0 = mi.get_superblock().groups[0], g1 = mi.get_superblock().groups[1];
+
+	REQUIRE(mi.get_superblock().fields.group_count == 2);
+	g0_end = g0.start_block + g0.total_blocks;
+	g1_end = g1.start_block + g1.total_blocks;
+
+	// all but five blocks at the end of group 0 and three at the end of group 1
+	REQUIRE(mi.allocate_run(g0.free_blocks - 5, got) == g0.first_datablock);
+	REQUIRE(got == g0.free_blocks - 5);
+	REQUIRE(mi.allocate_run(g1.free_blocks - 3, got) == g1.first_datablock);
+	REQUIRE(got == g1.free_blocks - 3);
+
+	// twelve asked for, the longest run there is ends with group 0
+	first = mi.allocate_run(12, got);
+	REQUIRE(first == g0_end - 5);
+	REQUIRE(got == 5);
+	for (uint64_t b = first; b < first + got; b++)
+		mi.free_block(b);
+
+	/*
+	 * Direct blocks 10 and 11, the single indirect block and file blocks 12
+	 * and 13 out of group 0's five, then 14 to 16 out of group 1's three.
+	 */
+	REQUIRE_FALSE(hush::fs::fill_holes(fd, inode, 10, 40,
+			[&mi](uint64_t want, uint64_t & got) { return mi.allocate_run(want, got); }, added));
+	mi.sync();
+
+	for (Extent const & e : added)
+		mapped += e.length;
+	REQUIRE(mapped == 7);
+	REQUIRE(inode.direct_ptr[10] == g0_end - 5);
+	REQUIRE(inode.single_indirect_ptr == g0_end - 3);
+	REQUIRE(hush::fs::map_block(fd, inode, 13) == g0_end - 1);
+	REQUIRE(hush::fs::map_block(fd, inode, 14) == g1_end - 3);
+	REQUIRE(hush::fs::map_block(fd, inode, 16) == g1_end - 1);
+	REQUIRE(hush::fs::map_block(fd, inode, 17) == 0);
+
+	// everything handed out is marked and counted, and nothing else was
+	hush::fs::load_superblock(fd, sb);
+	REQUIRE(all_used(fd, sb.groups[0], g0.first_datablock, g0.free_blocks));
+	REQUIRE(all_used(fd, sb.groups[1], g1.first_datablock, g1.free_blocks));
+	REQUIRE(sb.groups[0].free_blocks == 0);
+	REQUIRE(sb.groups[1].free_blocks == 0);
+	REQUIRE(sb.fields.free_blocks == 0);
+	REQUIRE(mi.allocate_run(1, got) == 0);
+
+	close(fd);
+	unlink(image.c_str());
+	unlink(keyfile.c_str());
+	rmdir(dir);
+}
@@ -0,0 +1,47 @@
+#include <cstring>
+#include "crypto/nonce.hh"
+#include "test/catch.hpp"
+
+TEST_CASE( "block_nonce", "[hush::crypto::block_nonce]" ) {
+
+	SECTION( "Fields are packed little endian" ) {
+		unsigned char n[24];
+
+		REQUIRE(hush::crypto::block_nonce(n, sizeof n, 0x0102, 3, 4));
+		REQUIRE(n[0] == 0x02);
+		REQUIRE(n[1] == 0x01);
+		REQUIRE(n[8] == 3);
+		REQUIRE(n[16] == 4);
+	}
+
+	SECTION( "Short nonces refuse fields that don't fit" ) {
+		unsigned char n[12];
+
+		REQUIRE(hush::crypto::block_nonce(n, sizeof n, (1ULL << 40) - 1, (1ULL << 24) - 1, 0xFFFFFFFF));
+		REQUIRE_FALSE(hush::crypto::block_nonce(n, sizeof n, 1ULL << 40, 1, 0));
+		REQUIRE_FALSE(hush::crypto::block_nonce(n, sizeof n, 1, 1ULL << 24, 0));
+		REQUIRE_FALSE(hush::crypto::block_nonce(n, sizeof n, 1, 1, 1ULL << 32));
+	}
+
+	SECTION( "Different epochs never collide" ) {
+		unsigned char a[12], b[12];
+
+		hush::crypto::block_nonce(a, sizeof a, 9, 1, 5);
+		hush::crypto::block_nonce(b, sizeof b, 9, 2, 5);
+		REQUIRE(memcmp(a, b, sizeof a) != 0);
+	}
+}
+
+TEST_CASE( "next_generation", "[hush::crypto::next_generation]" ) {
+	unsigned char n[12] = {};
+
+	SECTION( "A block that was never written starts at zero" ) {
+		REQUIRE(hush::crypto::next_generation(n, sizeof n, 1) == 0);
+	}
+
+	SECTION( "Generations count up within an epoch and restart in the next" ) {
+		hush::crypto::block_nonce(n, sizeof n, 77, 4, 41);
+		REQUIRE(hush::crypto::next_generation(n, sizeof n, 4) == 42);
+		REQUIRE(hush::crypto::next_generation(n, sizeof n, 5) == 0);
+	}
+}
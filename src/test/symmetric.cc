@@ -0,0 +1,49 @@
+#include <vector>
+#include "crypto/symmetric.hh"
+#include "utils/workpool.hh"
+#include "config.h"
+#include "test/catch.hpp"
+
+using hush::crypto::BlockBuffer;
+using hush::crypto::CipherSuite;
+using hush::crypto::SecretKey;
+using hush::crypto::Symmetric;
+
+// seal one block as `block`, then see whether it opens claiming to be `as`
+static bool reopens(CipherSuite suite, uint64_t block, uint64_t as, uint8_t format=0,
+		size_t len=HUSHFS_BLOCK_SIZE, size_t claimed_len=HUSHFS_BLOCK_SIZE, uint8_t claimed_format=0)
+{
+	Symmetric symmetric(suite);
+	hush::utils::WorkPool pool(1, false);
+	SecretKey key;
+	std::vector<unsigned char> data(HUSHFS_BLOCK_SIZE, 7), mac(symmetric.mac_bytes()), nonce(24);
+	std::vector<BlockBuffer> blocks = { { block, 0, data.data(), len, mac.data(), nonce.data(), format } };
+
+	key.random_key();
+	symmetric.encipher(blocks, key, pool, 1);
+
+	blocks[0].block = as;
+	blocks[0].len = claimed_len;
+	blocks[0].format = claimed_format;
+	return symmetric.decipher(blocks, key, pool);
+}
+
+TEST_CASE( "Symmetric blocks", "[hush::crypto::Symmetric]" ) {
+
+	SECTION( "A block only opens as the block it was sealed as" ) {
+		for (CipherSuite suite : { CipherSuite::XSalsa20Poly1305, CipherSuite::XChaCha20Poly1305 }) {
+			REQUIRE(reopens(suite, 5, 5));
+			REQUIRE_FALSE(reopens(suite, 5, 6));
+		}
+	}
+
+	SECTION( "A packed block's format and length are authenticated" ) {
+		REQUIRE(reopens(CipherSuite::XChaCha20Poly1305, 5, 5, 2, 100, 100, 2));
+		REQUIRE_FALSE(reopens(CipherSuite::XChaCha20Poly1305, 5, 5, 2, 100, 100, 1));
+		REQUIRE_FALSE(reopens(CipherSuite::XChaCha20Poly1305, 5, 5, 2, 100, 100, 0));
+	}
+
+	SECTION( "secretbox blocks never open as packed" ) {
+		REQUIRE_FALSE(reopens(CipherSuite::XSalsa20Poly1305, 5, 5, 0, 100, 100, 2));
+	}
+}
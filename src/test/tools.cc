@@ -0,0 +1,28 @@
+#include <cstdint>
+#include "config.h"
+#include "utils/tools.hh"
+#include "test/catch.hpp"
+
+TEST_CASE( "parse_size", "[parse_size]" ) {
+
+	SECTION( "Suffixes are powers of 1024" ) {
+		REQUIRE(parse_size("512") == 512);
+		REQUIRE(parse_size("8k") == 8 * KB);
+		REQUIRE(parse_size("8M") == 8 * MB);
+		REQUIRE(parse_size("3g") == 3ULL * GB);
+		REQUIRE(parse_size("2t") == 2 * TB);
+	}
+
+	SECTION( "Anything that isn't a size is 0" ) {
+		REQUIRE(parse_size("foo") == 0);
+		REQUIRE(parse_size("") == 0);
+		REQUIRE(parse_size("-5m") == 0);
+		REQUIRE(parse_size("5q") == 0);
+	}
+
+	SECTION( "Sizes that don't fit in 64 bits are 0" ) {
+		REQUIRE(parse_size("99999999999999999999") == 0);
+		REQUIRE(parse_size("16777216t") == 0);
+		REQUIRE(parse_size("16777215t") == 16777215 * TB);
+	}
+}
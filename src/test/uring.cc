@@ -0,0 +1,85 @@
+#ifdef __linux__
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "utils/uring.hh"
+#include "test/catch.hpp"
+
+using hush::fs::BlockDevice;
+using hush::fs::UringDevice;
+
+TEST_CASE( "UringDevice", "[hush::fs::UringDevice]" ) {
+	FILE *tmp = tmpfile();
+	int fd = fileno(tmp);
+	std::unique_ptr<UringDevice> dev;
+
+	try {
+		dev.reset(new UringDevice(fd, 8));
+	} catch (std::runtime_error const & e) {
+		WARN( "No io_uring here: " << e.what() );
+		fclose(tmp);
+		return;
+	}
+
+	SECTION( "A batch bigger than the ring completes every request" ) {
+		std::vector<uint64_t> out(100), in(100);
+		std::vector<BlockDevice::Request> writes, reads;
+
+		for (uint64_t i = 0; i < out.size(); i++) {
+			out[i] = i * 7919;
+			writes.push_back({ BlockDevice::Op::Write, &out[i], i * 4096, sizeof out[i] });
+			reads.push_back({ BlockDevice::Op::Read, &in[i], i * 4096, sizeof in[i] });
+		}
+		dev->submit(writes);
+		dev->submit(reads);
+		REQUIRE(in == out);
+	}
+
+	SECTION( "Registered buffers read and write like any other" ) {
+		std::vector<char> fixed(8192, 'x');
+		char got[16] = {};
+
+		dev->register_buffers({ { fixed.data(), fixed.size() } });
+		dev->write(fixed.data() + 100, 0, sizeof got);
+		dev->read(got, 0, sizeof got);
+		REQUIRE(std::string(got, sizeof got) == std::string(sizeof got, 'x'));
+
+		dev->write("fixed", 0, 5);
+		dev->read(fixed.data() + 4096, 0, 5);
+		REQUIRE(std::string(fixed.data() + 4096, 5) == "fixed");
+		dev->register_buffers({});
+	}
+
+	SECTION( "Threads share the ring" ) {
+		std::vector<std::thread> threads;
+		bool ok[4] = {};
+
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&dev, &ok, t] {
+				std::vector<char> out(64 * 1024, 'a' + t), in(out.size());
+
+				for (int round = 0; round < 20; round++) {
+					dev->write(out.data(), t * out.size(), out.size());
+					dev->read(in.data(), t * out.size(), in.size());
+				}
+				ok[t] = in == out;
+			});
+		}
+		for (std::thread & t : threads)
+			t.join();
+		REQUIRE((ok[0] && ok[1] && ok[2] && ok[3]));
+	}
+
+	SECTION( "Reading past the end is an error" ) {
+		char got[32];
+
+		REQUIRE_THROWS_AS(dev->read(got, 1 << 20, sizeof got), std::string);
+	}
+
+	dev.reset();
+	fclose(tmp);
+}
+#endif
@@ -0,0 +1,36 @@
+#include <algorithm> // count_if
+#include <atomic>
+#include <vector>
+#include "utils/workpool.hh"
+#include "test/catch.hpp"
+
+TEST_CASE( "WorkPool", "[hush::utils::WorkPool]" ) {
+
+	SECTION( "Every item runs exactly once" ) {
+		hush::utils::WorkPool pool(3, false);
+		std::vector<std::atomic<int>> hits(1000);
+
+		for (auto & h : hits)
+			h = 0;
+
+		REQUIRE(pool.run(hits.size(), [&hits](size_t i) { hits[i]++; return true; }));
+
+		REQUIRE(std::count_if(hits.begin(), hits.end(),
+					[](std::atomic<int> const & h) { return h != 1; }) == 0);
+	}
+
+	SECTION( "One failure fails the batch" ) {
+		hush::utils::WorkPool pool(2, false);
+
+		REQUIRE_FALSE(pool.run(64, [](size_t i) { return i != 17; }));
+		REQUIRE(pool.run(64, [](size_t i) { return true; }));
+	}
+
+	SECTION( "A single item runs on the calling thread" ) {
+		hush::utils::WorkPool pool(2, false);
+		std::thread::id ran_on;
+
+		REQUIRE(pool.run(1, [&ran_on](size_t) { ran_on = std::this_thread::get_id(); return true; }));
+		REQUIRE(ran_on == std::this_thread::get_id());
+	}
+}
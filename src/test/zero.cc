@@ -0,0 +1,26 @@
+#include <vector>
+#include "utils/zero.hh"
+#include "test/catch.hpp"
+
+TEST_CASE( "is_zero_block", "[hush::utils::is_zero_block]" ) {
+	std::vector<uint8_t> block(HUSHFS_BLOCK_SIZE + 1);
+
+	SECTION( "A block of zeros is one" ) {
+		REQUIRE(hush::utils::is_zero_block(block.data()));
+		// no alignment is assumed
+		REQUIRE(hush::utils::is_zero_block(block.data() + 1));
+	}
+
+	SECTION( "Any one byte set anywhere isn't" ) {
+		for (size_t i : { (size_t)0, (size_t)15, (size_t)63, (size_t)64, (size_t)HUSHFS_BLOCK_SIZE - 1 }) {
+			block[i] = 0x80;
+			REQUIRE_FALSE(hush::utils::is_zero_block(block.data()));
+			block[i] = 0;
+		}
+	}
+
+	SECTION( "Bytes past the block don't count" ) {
+		block[HUSHFS_BLOCK_SIZE] = 1;
+		REQUIRE(hush::utils::is_zero_block(block.data()));
+	}
+}
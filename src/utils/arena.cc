@@ -0,0 +1,95 @@
+#include <cstdint>
+#include <sodium.h>
+
+#include "utils/arena.hh"
+#include "config.h"
+
+using hush::secure::Arena;
+
+Arena::Arena(void *region, size_t len)
+{
+	uintptr_t start = ((uintptr_t)region + MIN_CHUNK - 1) & ~(uintptr_t)(MIN_CHUNK - 1);
+
+	base = (unsigned char *)start;
+	size = region == nullptr || len < start - (uintptr_t)region ? 0 :
+		len - (start - (uintptr_t)region);
+	free_chunks.fill(nullptr);
+}
+
+unsigned Arena::class_of(size_t n)
+{
+	unsigned c = 0;
+
+	while ((MIN_CHUNK << c) < n)
+		c++;
+	return c;
+}
+
+bool Arena::owns(void const *p) const
+{
+	return p >= base && p < base + size;
+}
+
+void *Arena::allocate(size_t n)
+{
+	unsigned c = class_of(n);
+	size_t chunk = MIN_CHUNK << c;
+	std::lock_guard<std::mutex> guard(lock);
+	void *p;
+
+	if (c >= CLASSES)
+		return nullptr;
+
+	if (free_chunks[c] != nullptr) {
+		Chunk *head = free_chunks[c];
+
+		free_chunks[c] = head->next;
+		head->next = nullptr;
+		p = head;
+	} else if (size - carved >= chunk) {
+		p = base + carved;
+		carved += chunk;
+	} else {
+		return nullptr;
+	}
+
+	used += chunk;
+	return p;
+}
+
+bool Arena::deallocate(void *p, size_t n)
+{
+	unsigned c = class_of(n);
+	size_t chunk = MIN_CHUNK << c;
+
+	if (!owns(p))
+		return false;
+
+	// outside the lock, nobody else can have this chunk yet
+	sodium_memzero(p, chunk);
+
+	std::lock_guard<std::mutex> guard(lock);
+	Chunk *freed = (Chunk *)p;
+
+	freed->next = free_chunks[c];
+	free_chunks[c] = freed;
+	used -= chunk;
+	return true;
+}
+
+Arena & Arena::secure()
+{
+	/*
+	 * Never freed: secure strings in other statics may be destroyed after
+	 * this one would be.
+	 */
+	static Arena *arena = [] {
+		void *region = nullptr;
+
+		if (sodium_init() != -1)
+			region = sodium_malloc(HUSHFS_SECURE_ARENA_BYTES);
+		return new Arena(region, region ? HUSHFS_SECURE_ARENA_BYTES : 0);
+	}();
+
+	return *arena;
+}
@@ -0,0 +1,165 @@
+#include <algorithm> // min
+#include <cerrno>
+#include <cstring> // strerror
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unistd.h>
+
+#include "utils/blockdevice.hh"
+#include "utils/log.hh"
+
+using hush::fs::BlockDevice;
+using hush::fs::PosixDevice;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+// looked up on every I/O, the lock is only held for the lookup
+static std::mutex devices_lock;
+static std::unordered_map<int, std::unique_ptr<BlockDevice>> devices;
+
+// `err` is 0 if the file just ended early
+static void io_error(char const *what, uint64_t offset, uint64_t len, uint64_t done, int err)
+{
+	slog::LogString ls("Error %1 %2 bytes at %3 after %4: %5", what, len, offset, done,
+			std::string(err != 0 ? strerror(err) : "end of file"));
+	logger.error(ls);
+	throw ls.str();
+}
+
+static uint64_t iov_bytes(struct iovec const *iov, int count)
+{
+	uint64_t bytes = 0;
+
+	for (int i = 0; i < count; i++)
+		bytes += iov[i].iov_len;
+	return bytes;
+}
+
+void BlockDevice::submit(std::vector<Request> const & batch)
+{
+	for (Request const & r : batch) {
+		if (r.op == Op::Read)
+			read(r.buf, r.offset, r.len);
+		else
+			write(r.buf, r.offset, r.len);
+	}
+}
+
+void BlockDevice::readv(struct iovec const *iov, int count, uint64_t offset)
+{
+	std::vector<Request> batch;
+
+	for (int i = 0; i < count; offset += iov[i].iov_len, i++)
+		batch.push_back({ Op::Read, iov[i].iov_base, offset, iov[i].iov_len });
+	submit(batch);
+}
+
+void BlockDevice::writev(struct iovec const *iov, int count, uint64_t offset)
+{
+	std::vector<Request> batch;
+
+	for (int i = 0; i < count; offset += iov[i].iov_len, i++)
+		batch.push_back({ Op::Write, iov[i].iov_base, offset, iov[i].iov_len });
+	submit(batch);
+}
+
+void PosixDevice::read(void *buf, uint64_t offset, uint64_t len)
+{
+	uint64_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			io_error("reading", offset, len, done, n < 0 ? errno : 0);
+		done += n;
+	}
+}
+
+void PosixDevice::write(void const *buf, uint64_t offset, uint64_t len)
+{
+	uint64_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pwrite(fd, (char const *)buf + done, len - done, offset + done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			io_error("writing", offset, len, done, n < 0 ? errno : 0);
+		done += n;
+	}
+}
+
+/*
+ * A short transfer is finished off one buffer at a time, it's rare enough
+ * not to be worth rebuilding the vector for.
+ */
+void PosixDevice::readv(struct iovec const *iov, int count, uint64_t offset)
+{
+	ssize_t n;
+
+	while ((n = preadv(fd, iov, count, offset)) < 0 && errno == EINTR)
+		;
+	if (n < 0)
+		io_error("reading", offset, iov_bytes(iov, count), 0, errno);
+
+	for (int i = 0; i < count; offset += iov[i].iov_len, i++) {
+		uint64_t got = std::min((uint64_t)n, (uint64_t)iov[i].iov_len);
+
+		if (got < iov[i].iov_len)
+			read((char *)iov[i].iov_base + got, offset + got, iov[i].iov_len - got);
+		n -= got;
+	}
+}
+
+void PosixDevice::writev(struct iovec const *iov, int count, uint64_t offset)
+{
+	ssize_t n;
+
+	while ((n = pwritev(fd, iov, count, offset)) < 0 && errno == EINTR)
+		;
+	if (n < 0)
+		io_error("writing", offset, iov_bytes(iov, count), 0, errno);
+
+	for (int i = 0; i < count; offset += iov[i].iov_len, i++) {
+		uint64_t put = std::min((uint64_t)n, (uint64_t)iov[i].iov_len);
+
+		if (put < iov[i].iov_len)
+			write((char const *)iov[i].iov_base + put, offset + put, iov[i].iov_len - put);
+		n -= put;
+	}
+}
+
+bool PosixDevice::sync()
+{
+	return fdatasync(fd) == 0;
+}
+
+BlockDevice & hush::fs::device(int fd)
+{
+	std::lock_guard<std::mutex> guard(devices_lock);
+	auto it = devices.find(fd);
+
+	// PosixDevice has no state but the fd, so one made for a closed fd still works for its reuse
+	if (it == devices.end())
+		it = devices.emplace(fd, std::unique_ptr<BlockDevice>(new PosixDevice(fd))).first;
+	return *it->second;
+}
+
+void hush::fs::attach_device(int fd, BlockDevice *dev)
+{
+	std::lock_guard<std::mutex> guard(devices_lock);
+
+	devices[fd].reset(dev);
+}
+
+void hush::fs::detach_device(int fd)
+{
+	std::lock_guard<std::mutex> guard(devices_lock);
+
+	devices.erase(fd);
+}
@@ -0,0 +1,440 @@
+#include <algorithm> // sort, unique, copy
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <fcntl.h>
+#include "utils/blockio.hh"
+#include "utils/blockdevice.hh"
+#include "utils/compress.hh"
+#include "utils/layout.hh"
+#include "utils/tools.hh"
+#include "utils/zero.hh"
+#include "utils/log.hh"
+#include "crypto/nonce.hh"
+#include "config.h"
+
+using hush::fs::BlockDevice;
+using hush::fs::BlockIO;
+using hush::fs::BlockTag;
+using hush::fs::Compression;
+using hush::crypto::BlockBuffer;
+using hush::crypto::SymmetricException;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+/*
+ * The tag blocks one call touches, read on first use and written back by
+ * store() if anything in them changed.
+ */
+class BlockIO::Tags
+{
+public:
+	Tags(int fd, Superblock const & sb, MerkleTree *tree) : fd(fd), sb(sb), tree(tree) {};
+
+	BlockTag & get(uint64_t block, bool modify=false)
+	{
+		uint64_t tag_block, slot;
+
+		if (!locate_tag(sb, block, tag_block, slot)) {
+			slog::LogString ls("Block %1 has no tag", block);
+			logger.error(ls);
+			throw BlockIOException(ls.str());
+		}
+
+		auto it = blocks.find(tag_block);
+		if (it == blocks.end()) {
+			it = blocks.emplace(tag_block, Entry()).first;
+			it->second.tags.resize(HUSHFS_TAGS_PER_BLOCK);
+			read_block(fd, it->second.tags.data(), tag_block * HUSHFS_BLOCK_SIZE);
+			if (tree != nullptr)
+				tree->verify(tag_block, it->second.tags.data());
+		}
+		it->second.dirty |= modify;
+
+		return it->second.tags[slot];
+	}
+
+	void store()
+	{
+		for (auto & b : blocks) {
+			if (!b.second.dirty)
+				continue;
+			if (tree != nullptr)
+				tree->update(b.first, b.second.tags.data());
+			write_block(fd, b.second.tags.data(), b.first * HUSHFS_BLOCK_SIZE);
+			b.second.dirty = false;
+		}
+
+		if (tree != nullptr && tree->flush_due())
+			tree->flush();
+	}
+
+private:
+	struct Entry {
+		std::vector<BlockTag> tags;
+		bool dirty = false;
+	};
+
+	int fd;
+	Superblock const & sb;
+	MerkleTree *tree;
+	std::map<uint64_t, Entry> blocks;
+};
+
+/*
+ * Lock the stripes of every tag block the blocks' tags are in, lowest first
+ * so that two calls can't each hold a stripe the other one wants.
+ */
+BlockIO::Locks BlockIO::lock_tags(std::vector<uint64_t> const & blocks)
+{
+	std::vector<unsigned> wanted;
+	Locks locks;
+
+	for (uint64_t b : blocks) {
+		uint64_t tag_block, slot;
+
+		if (locate_tag(sb, b, tag_block, slot))
+			wanted.push_back(tag_block & (HUSHFS_TAG_STRIPES - 1));
+	}
+
+	std::sort(wanted.begin(), wanted.end());
+	wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+	for (unsigned s : wanted)
+		locks.emplace_back(stripes[s]);
+
+	return locks;
+}
+
+static std::vector<uint64_t> block_range(uint64_t first, uint64_t count)
+{
+	std::vector<uint64_t> blocks(count);
+
+	for (uint64_t i = 0; i < count; i++)
+		blocks[i] = first + i;
+	return blocks;
+}
+
+// one request per block, blocks[i] to or from data + i * HUSHFS_BLOCK_SIZE
+static std::vector<BlockDevice::Request> block_requests(BlockDevice::Op op,
+		std::vector<uint64_t> const & blocks, uint8_t *data)
+{
+	std::vector<BlockDevice::Request> batch;
+
+	for (size_t i = 0; i < blocks.size(); i++)
+		batch.push_back({ op, data + i * HUSHFS_BLOCK_SIZE, blocks[i] * HUSHFS_BLOCK_SIZE,
+				HUSHFS_BLOCK_SIZE });
+	return batch;
+}
+
+// calls visit(start, length) for every run of set entries in `in_run`
+static void for_each_run(std::vector<bool> const & in_run,
+		std::function<void(uint64_t, uint64_t)> const & visit)
+{
+	for (uint64_t i = 0; i < in_run.size(); ) {
+		uint64_t start = i;
+
+		while (i < in_run.size() && in_run[i])
+			i++;
+		if (i > start)
+			visit(start, i - start);
+		else
+			i++;
+	}
+}
+
+/*
+ * Compress each of `count` blocks of `data` in place if it's worth it,
+ * zeroing the rest of the block so none of the plaintext is left behind.
+ * Returns how much of each block there is to seal.
+ */
+static std::vector<uint32_t> pack(Compression c, size_t count, uint8_t *data,
+		hush::utils::WorkPool & pool)
+{
+	std::vector<uint32_t> lens(count, HUSHFS_BLOCK_SIZE);
+
+	if (c == Compression::None)
+		return lens;
+
+	pool.run(count, [&](size_t i) {
+		uint8_t *d = data + i * HUSHFS_BLOCK_SIZE;
+		uint8_t out[HUSHFS_BLOCK_SIZE];
+		size_t len = hush::fs::compress_block(c, d, out);
+
+		if (len > 0) {
+			memcpy(d, out, len);
+			memset(d + len, 0, HUSHFS_BLOCK_SIZE - len);
+			lens[i] = len;
+		}
+		return true;
+	});
+
+	return lens;
+}
+
+/*
+ * Encipher blocks[i], at data + i * HUSHFS_BLOCK_SIZE, under the current
+ * key generation and update its tag to match. Blocks are compressed first
+ * if the image asks for it.
+ */
+void BlockIO::seal(std::vector<uint64_t> const & blocks, Tags & tags, uint8_t *data)
+{
+	size_t nonce_bytes = symmetric.nonce_bytes();
+	uint64_t generation = sb.fields.key_generation;
+	auto key = keys.get(generation);
+	uint64_t epoch = sb.fields.mount_epoch;
+	Compression compression = (Compression)sb.fields.compression;
+	std::vector<BlockBuffer> buffers;
+
+	// there'd be nothing to authenticate the format and length with, see crypto/suite.hh
+	if (!symmetric.authenticates_ad())
+		compression = Compression::None;
+	std::vector<uint32_t> lens;
+
+	if (blocks.empty())
+		return;
+
+	lens = pack(compression, blocks.size(), data, pool);
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		BlockTag & tag = tags.get(blocks[i], true);
+		bool packed = lens[i] < HUSHFS_BLOCK_SIZE;
+
+		buffers.push_back({ blocks[i], 0, data + i * HUSHFS_BLOCK_SIZE, lens[i],
+				tag.mac, tag.nonce, (uint8_t)(packed ? compression : Compression::None) });
+	}
+
+	for (int attempt = 0; ; attempt++) {
+		for (BlockBuffer & b : buffers)
+			b.generation = hush::crypto::next_generation(b.nonce, nonce_bytes, epoch);
+
+		try {
+			symmetric.encipher(buffers, *key, pool, epoch);
+			break;
+		} catch (SymmetricException const & e) {
+			// every generation starts again from zero in a new epoch
+			if (attempt > 0)
+				throw;
+			epoch = next_epoch();
+		}
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		BlockTag & tag = tags.get(blocks[i], true);
+		bool packed = lens[i] < HUSHFS_BLOCK_SIZE;
+
+		tag.key_generation = generation;
+		tag.flags |= HUSHFS_TAG_WRITTEN;
+		tag.stored_len = packed ? lens[i] : 0;
+		tag.compression = (uint8_t)(packed ? compression : Compression::None);
+	}
+}
+
+void BlockIO::unseal(std::vector<uint64_t> const & blocks, Tags & tags, uint8_t *data)
+{
+	std::map<uint64_t, std::vector<BlockBuffer>> by_generation;
+	// index, compression and sealed length of every compressed block
+	std::vector<std::tuple<size_t, Compression, uint32_t>> packed;
+
+	for (size_t i = 0; i < blocks.size(); i++) {
+		BlockTag & tag = tags.get(blocks[i]);
+		uint8_t *d = data + i * HUSHFS_BLOCK_SIZE;
+		size_t len = HUSHFS_BLOCK_SIZE;
+
+		if (!(tag.flags & HUSHFS_TAG_WRITTEN)) {
+			memset(d, 0, HUSHFS_BLOCK_SIZE);
+			continue;
+		}
+
+		if ((Compression)tag.compression != Compression::None) {
+			if (!hush::fs::compression_available((Compression)tag.compression) ||
+					tag.stored_len == 0 || tag.stored_len >= HUSHFS_BLOCK_SIZE) {
+				slog::LogString ls("Block %1 is compressed with %2, which this build can't read",
+						blocks[i], hush::fs::compression_name((Compression)tag.compression));
+				logger.error(ls);
+				throw BlockIOException(ls.str());
+			}
+			len = tag.stored_len;
+			packed.emplace_back(i, (Compression)tag.compression, tag.stored_len);
+		}
+
+		by_generation[tag.key_generation].push_back({ blocks[i], 0, d, len,
+				tag.mac, tag.nonce, tag.compression });
+	}
+
+	for (auto & g : by_generation) {
+		if (!symmetric.decipher(g.second, *keys.get(g.first), pool)) {
+			slog::LogString ls("Blocks %1.. failed to authenticate", g.second.front().block);
+			logger.error(ls);
+			throw BlockIOException(ls.str());
+		}
+	}
+
+	// the compression and sealed length are authenticated above, so these are genuine
+	bool ok = pool.run(packed.size(), [&](size_t p) {
+		uint8_t *d = data + std::get<0>(packed[p]) * HUSHFS_BLOCK_SIZE;
+		uint8_t out[HUSHFS_BLOCK_SIZE];
+
+		if (!hush::fs::decompress_block(std::get<1>(packed[p]), d, std::get<2>(packed[p]), out))
+			return false;
+		memcpy(d, out, HUSHFS_BLOCK_SIZE);
+		return true;
+	});
+
+	if (!ok) {
+		slog::LogString ls("A compressed block in %1.. doesn't decompress", blocks.front());
+		logger.error(ls);
+		throw BlockIOException(ls.str());
+	}
+}
+
+void BlockIO::read(uint64_t first, uint64_t count, uint8_t *buf)
+{
+	std::vector<uint64_t> blocks = block_range(first, count);
+	std::vector<bool> written(count);
+	std::vector<BlockDevice::Request> batch;
+	Locks locks = lock_tags(blocks);
+	Tags tags(fd, sb, tree);
+
+	for (uint64_t i = 0; i < count; i++)
+		written[i] = tags.get(blocks[i]).flags & HUSHFS_TAG_WRITTEN;
+
+	// unwritten blocks are zeros, there's nothing on disk worth reading for them
+	for_each_run(written, [&](uint64_t start, uint64_t n) {
+		batch.push_back({ BlockDevice::Op::Read, buf + start * HUSHFS_BLOCK_SIZE,
+				(first + start) * HUSHFS_BLOCK_SIZE, n * HUSHFS_BLOCK_SIZE });
+	});
+	hush::fs::device(fd).submit(batch);
+	unseal(blocks, tags, buf);
+}
+
+/*
+ * Blocks of zeros aren't sealed or written, their tags are just marked
+ * unwritten, which reads back the same. Whatever they held before is
+ * punched out of the backing file.
+ */
+void BlockIO::write(uint64_t first, uint64_t count, uint8_t const *buf)
+{
+	std::vector<uint64_t> blocks = block_range(first, count), sealed;
+	std::vector<bool> nonzero(count), cleared(count);
+	std::vector<uint8_t> data;
+	std::vector<BlockDevice::Request> batch;
+	Locks locks = lock_tags(blocks);
+	Tags tags(fd, sb, tree);
+	uint64_t next = 0;
+
+	for (uint64_t i = 0; i < count; i++) {
+		uint8_t const *d = buf + i * HUSHFS_BLOCK_SIZE;
+
+		nonzero[i] = !hush::utils::is_zero_block(d);
+		if (nonzero[i]) {
+			sealed.push_back(blocks[i]);
+			data.insert(data.end(), d, d + HUSHFS_BLOCK_SIZE);
+		} else if (tags.get(blocks[i]).flags & HUSHFS_TAG_WRITTEN) {
+			tags.get(blocks[i], true).flags &= ~HUSHFS_TAG_WRITTEN;
+			cleared[i] = true;
+		}
+	}
+
+	seal(sealed, tags, data.data());
+
+	// a crash in between leaves data that doesn't match its tag, never a reused nonce
+	for_each_run(nonzero, [&](uint64_t start, uint64_t n) {
+		batch.push_back({ BlockDevice::Op::Write, data.data() + next * HUSHFS_BLOCK_SIZE,
+				(first + start) * HUSHFS_BLOCK_SIZE, n * HUSHFS_BLOCK_SIZE });
+		next += n;
+	});
+	hush::fs::device(fd).submit(batch);
+	tags.store();
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	// only space is lost if this fails, the tags already say these are zeros
+	for_each_run(cleared, [&](uint64_t start, uint64_t n) {
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(first + start) * HUSHFS_BLOCK_SIZE, n * HUSHFS_BLOCK_SIZE);
+	});
+#endif
+}
+
+void BlockIO::mark_unwritten(uint64_t first, uint64_t count)
+{
+	std::vector<uint64_t> blocks = block_range(first, count);
+	Locks locks = lock_tags(blocks);
+	Tags tags(fd, sb, tree);
+
+	// the nonces stay, the next generation of each block has to follow on from them
+	for (uint64_t b : blocks) {
+		if (tags.get(b).flags & HUSHFS_TAG_WRITTEN)
+			tags.get(b, true).flags &= ~HUSHFS_TAG_WRITTEN;
+	}
+	tags.store();
+}
+
+uint64_t BlockIO::reseal(uint64_t first, uint64_t count)
+{
+	std::vector<uint64_t> blocks = block_range(first, count);
+	std::vector<uint64_t> stale;
+	Locks locks = lock_tags(blocks);
+	Tags tags(fd, sb, tree);
+	std::vector<uint8_t> data;
+
+	for (uint64_t b : blocks) {
+		BlockTag const & tag = tags.get(b);
+
+		if ((tag.flags & HUSHFS_TAG_WRITTEN) && tag.key_generation != sb.fields.key_generation)
+			stale.push_back(b);
+	}
+
+	if (stale.empty())
+		return 0;
+
+	data.resize(stale.size() * HUSHFS_BLOCK_SIZE);
+	hush::fs::device(fd).submit(block_requests(BlockDevice::Op::Read, stale, data.data()));
+
+	unseal(stale, tags, data.data());
+	seal(stale, tags, data.data());
+
+	hush::fs::device(fd).submit(block_requests(BlockDevice::Op::Write, stale, data.data()));
+	tags.store();
+
+	return stale.size();
+}
+
+void BlockIO::relocate(std::vector<uint64_t> const & from, std::vector<uint64_t> const & to)
+{
+	std::vector<uint64_t> both(from);
+	std::vector<uint64_t> sealed_from, sealed_to;
+	std::vector<uint8_t> data(from.size() * HUSHFS_BLOCK_SIZE);
+	std::vector<uint8_t> sealed;
+
+	both.insert(both.end(), to.begin(), to.end());
+
+	Locks locks = lock_tags(both);
+	Tags tags(fd, sb, tree);
+
+	for (size_t i = 0; i < from.size(); i++) {
+		uint8_t *d = data.data() + i * HUSHFS_BLOCK_SIZE;
+
+		read_block(fd, d, from[i] * HUSHFS_BLOCK_SIZE);
+		if (tags.get(from[i]).flags & HUSHFS_TAG_WRITTEN) {
+			sealed_from.push_back(from[i]);
+			sealed_to.push_back(to[i]);
+			sealed.insert(sealed.end(), d, d + HUSHFS_BLOCK_SIZE);
+		} else {
+			tags.get(to[i], true).flags &= ~HUSHFS_TAG_WRITTEN;
+		}
+	}
+
+	// the destination's old nonce is what keeps its next generation unique
+	unseal(sealed_from, tags, sealed.data());
+	seal(sealed_to, tags, sealed.data());
+
+	for (size_t i = 0, s = 0; i < from.size(); i++) {
+		uint8_t const *d = data.data() + i * HUSHFS_BLOCK_SIZE;
+
+		if (s < sealed_from.size() && sealed_from[s] == from[i])
+			d = sealed.data() + (s++) * HUSHFS_BLOCK_SIZE;
+		write_block(fd, d, to[i] * HUSHFS_BLOCK_SIZE);
+	}
+	tags.store();
+}
@@ -0,0 +1,359 @@
+#include <algorithm> // max, min
+#include <map>
+#include <vector>
+
+#include "config.h"
+#include "utils/blockmap.hh"
+#include "utils/tools.hh"
+
+using hush::fs::BlockVisitor;
+using hush::fs::Extent;
+using hush::fs::InodeData;
+
+// returned by find() when there's nothing to find
+#define NOWHERE UINT64_MAX
+// indirect blocks fill_holes() keeps before writing them out
+#define FILL_CACHE_BLOCKS 64
+
+// how many file blocks a pointer at `depth` levels of indirection covers
+static uint64_t span(int depth)
+{
+	uint64_t n = 1;
+
+	while (depth-- > 0)
+		n *= HUSHFS_PTRS_PER_BLOCK;
+	return n;
+}
+
+static void walk(int fd, uint64_t block, int depth, uint64_t logical, BlockVisitor const & visit)
+{
+	std::vector<uint64_t> ptrs(HUSHFS_PTRS_PER_BLOCK);
+
+	if (!visit(logical, block, true) || depth == 0)
+		return;
+
+	read_block(fd, ptrs.data(), block * HUSHFS_BLOCK_SIZE);
+
+	for (uint64_t i = 0; i < HUSHFS_PTRS_PER_BLOCK; i++) {
+		uint64_t l = logical + (i * span(depth - 1));
+
+		if (ptrs[i] == 0)
+			continue;
+
+		if (depth == 1)
+			visit(l, ptrs[i], false);
+		else
+			walk(fd, ptrs[i], depth - 1, l, visit);
+	}
+}
+
+void hush::fs::walk_block_map(int fd, InodeData const & inode, BlockVisitor const & visit)
+{
+	uint64_t logical = HUSHFS_DIRECT_BLOCKS;
+	uint64_t const indirect[] = {
+		inode.single_indirect_ptr,
+		inode.double_indirect_ptr,
+		inode.triple_indirect_ptr,
+	};
+
+	for (uint64_t i = 0; i < HUSHFS_DIRECT_BLOCKS; i++) {
+		if (inode.direct_ptr[i] != 0)
+			visit(i, inode.direct_ptr[i], false);
+	}
+
+	for (int depth = 1; depth <= 3; depth++) {
+		if (indirect[depth - 1] != 0)
+			walk(fd, indirect[depth - 1], depth, logical, visit);
+		logical += span(depth);
+	}
+}
+
+std::vector<Extent> hush::fs::file_extents(int fd, InodeData const & inode,
+		uint64_t *indirect)
+{
+	std::vector<Extent> extents;
+
+	if (indirect)
+		*indirect = 0;
+
+	walk_block_map(fd, inode, [&](uint64_t logical, uint64_t physical, bool is_indirect) -> bool {
+		if (is_indirect) {
+			if (indirect)
+				(*indirect)++;
+			return true;
+		}
+
+		if (!extents.empty()) {
+			Extent & e = extents.back();
+			if (e.logical + e.length == logical && e.physical + e.length == physical) {
+				e.length++;
+				return true;
+			}
+		}
+
+		extents.push_back({ logical, physical, 1 });
+		return true;
+	});
+
+	return extents;
+}
+
+uint64_t hush::fs::max_file_blocks()
+{
+	return HUSHFS_DIRECT_BLOCKS + span(1) + span(2) + span(3);
+}
+
+uint64_t hush::fs::map_block(int fd, InodeData const & inode, uint64_t logical)
+{
+	uint64_t const indirect[] = {
+		inode.single_indirect_ptr,
+		inode.double_indirect_ptr,
+		inode.triple_indirect_ptr,
+	};
+	std::vector<uint64_t> ptrs(HUSHFS_PTRS_PER_BLOCK);
+	uint64_t block;
+	int depth;
+
+	if (logical < HUSHFS_DIRECT_BLOCKS)
+		return inode.direct_ptr[logical];
+	logical -= HUSHFS_DIRECT_BLOCKS;
+
+	for (depth = 1; depth <= 3 && logical >= span(depth); depth++)
+		logical -= span(depth);
+	if (depth > 3)
+		return 0;
+
+	for (block = indirect[depth - 1]; block != 0 && depth > 0; depth--) {
+		read_block(fd, ptrs.data(), block * HUSHFS_BLOCK_SIZE);
+		block = ptrs[logical / span(depth - 1)];
+		logical %= span(depth - 1);
+	}
+
+	return block;
+}
+
+/*
+ * The first file block from `from` on, within the `span(depth)` blocks that
+ * `block` covers starting at `logical`, that's data if `data` is set or a
+ * hole if it isn't. NOWHERE if there's none in this subtree.
+ */
+static uint64_t find(int fd, uint64_t block, int depth, uint64_t logical, uint64_t from, bool data)
+{
+	std::vector<uint64_t> ptrs;
+	uint64_t each;
+
+	if (block == 0)
+		return data ? NOWHERE : std::max(from, logical);
+	if (depth == 0)
+		return data ? std::max(from, logical) : NOWHERE;
+
+	ptrs.resize(HUSHFS_PTRS_PER_BLOCK);
+	read_block(fd, ptrs.data(), block * HUSHFS_BLOCK_SIZE);
+	each = span(depth - 1);
+
+	for (uint64_t i = from > logical ? (from - logical) / each : 0; i < HUSHFS_PTRS_PER_BLOCK; i++) {
+		uint64_t found = find(fd, ptrs[i], depth - 1, logical + i * each, from, data);
+
+		if (found != NOWHERE)
+			return found;
+	}
+
+	return NOWHERE;
+}
+
+static uint64_t find(int fd, InodeData const & inode, uint64_t from, bool data)
+{
+	uint64_t logical = HUSHFS_DIRECT_BLOCKS;
+	uint64_t const indirect[] = {
+		inode.single_indirect_ptr,
+		inode.double_indirect_ptr,
+		inode.triple_indirect_ptr,
+	};
+
+	for (uint64_t i = from; i < HUSHFS_DIRECT_BLOCKS; i++) {
+		if ((inode.direct_ptr[i] != 0) == data)
+			return i;
+	}
+
+	for (int depth = 1; depth <= 3; depth++) {
+		uint64_t found = NOWHERE;
+
+		if (from < logical + span(depth))
+			found = find(fd, indirect[depth - 1], depth, logical, from, data);
+		if (found != NOWHERE)
+			return found;
+		logical += span(depth);
+	}
+
+	// nothing maps past the triple indirect block
+	return data ? NOWHERE : std::max(from, logical);
+}
+
+bool hush::fs::seek_data(int fd, InodeData const & inode, uint64_t & offset)
+{
+	uint64_t block;
+
+	if (offset >= inode.file_size)
+		return false;
+
+	block = find(fd, inode, offset / HUSHFS_BLOCK_SIZE, true);
+	if (block == NOWHERE || block * HUSHFS_BLOCK_SIZE >= inode.file_size)
+		return false;
+
+	offset = std::max(offset, block * HUSHFS_BLOCK_SIZE);
+	return true;
+}
+
+bool hush::fs::seek_hole(int fd, InodeData const & inode, uint64_t & offset)
+{
+	uint64_t block;
+
+	if (offset >= inode.file_size)
+		return false;
+
+	block = find(fd, inode, offset / HUSHFS_BLOCK_SIZE, false);
+	offset = std::max(offset, std::min(block * HUSHFS_BLOCK_SIZE, inode.file_size));
+	return true;
+}
+
+/*
+ * The indirect blocks fill_holes() has read or made. They're written back
+ * before anything reads the block map from disk again, and dropped once
+ * there are enough of them.
+ */
+class IndirectCache
+{
+public:
+	IndirectCache(int fd) : fd(fd) {};
+
+	std::vector<uint64_t> & get(uint64_t block, bool fresh=false)
+	{
+		auto it = blocks.find(block);
+
+		if (it == blocks.end()) {
+			it = blocks.emplace(block, Entry()).first;
+			it->second.ptrs.resize(HUSHFS_PTRS_PER_BLOCK);
+			if (!fresh)
+				read_block(fd, it->second.ptrs.data(), block * HUSHFS_BLOCK_SIZE);
+		}
+		it->second.dirty |= fresh;
+		return it->second.ptrs;
+	}
+
+	void touch(uint64_t block) { blocks[block].dirty = true; };
+
+	void write()
+	{
+		for (auto & b : blocks) {
+			if (b.second.dirty)
+				write_block(fd, b.second.ptrs.data(), b.first * HUSHFS_BLOCK_SIZE);
+			b.second.dirty = false;
+		}
+	}
+
+	void trim()
+	{
+		if (blocks.size() >= FILL_CACHE_BLOCKS) {
+			write();
+			blocks.clear();
+		}
+	}
+
+private:
+	struct Entry {
+		std::vector<uint64_t> ptrs;
+		bool dirty = false;
+	};
+
+	int fd;
+	std::map<uint64_t, Entry> blocks;
+};
+
+/*
+ * Indirect blocks are taken from the same runs as the data around them, the
+ * way ext2 lays them out, so a run never has anything left over: it's sized
+ * for the data blocks of one hole, and an indirect block in the middle only
+ * makes it end sooner.
+ */
+bool hush::fs::fill_holes(int fd, InodeData & inode, uint64_t logical, uint64_t count,
+		RunAllocator const & allocate, std::vector<Extent> & added)
+{
+	uint64_t * const roots[] = {
+		&inode.single_indirect_ptr,
+		&inode.double_indirect_ptr,
+		&inode.triple_indirect_ptr,
+	};
+	IndirectCache cache(fd);
+	uint64_t end = std::min(logical + count, max_file_blocks());
+	uint64_t next = 0, left = 0;
+	bool full = false;
+
+	auto take = [&](uint64_t want) -> uint64_t {
+		if (left == 0 && (next = allocate(want, left)) == 0) {
+			full = true;
+			return 0;
+		}
+		left--;
+		return next++;
+	};
+
+	for (uint64_t l = logical; l < end; l++) {
+		uint64_t *ptr, rest = l, holder = 0, block;
+		int depth;
+
+		if (l < HUSHFS_DIRECT_BLOCKS) {
+			ptr = &inode.direct_ptr[l];
+		} else {
+			rest -= HUSHFS_DIRECT_BLOCKS;
+			for (depth = 1; rest >= span(depth); depth++)
+				rest -= span(depth);
+
+			// down to the pointer, making any indirect block that's missing
+			for (ptr = roots[depth - 1]; depth > 0; depth--) {
+				bool fresh = *ptr == 0;
+
+				if (fresh) {
+					if ((block = take(1)) == 0)
+						break;
+					*ptr = block;
+					if (holder != 0)
+						cache.touch(holder);
+				}
+
+				holder = *ptr;
+				ptr = &cache.get(holder, fresh)[rest / span(depth - 1)];
+				rest %= span(depth - 1);
+			}
+			if (depth > 0)
+				break;
+		}
+
+		if (*ptr != 0)
+			continue;
+
+		// size a new run to the whole hole, so it can come out in one piece
+		if (left == 0) {
+			cache.write();
+			block = take(std::min(find(fd, inode, l, true), end) - l);
+		} else {
+			block = take(1);
+		}
+		if (block == 0)
+			break;
+
+		*ptr = block;
+		if (holder != 0)
+			cache.touch(holder);
+
+		if (!added.empty() && added.back().logical + added.back().length == l &&
+				added.back().physical + added.back().length == block)
+			added.back().length++;
+		else
+			added.push_back({ l, block, 1 });
+
+		cache.trim();
+	}
+
+	cache.write();
+	return !full && end == logical + count;
+}
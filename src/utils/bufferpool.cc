@@ -0,0 +1,60 @@
+#include <cstdlib> // posix_memalign, free
+#include <cstring> // memset
+
+#include "utils/bufferpool.hh"
+#include "utils/log.hh"
+
+using hush::utils::BufferPool;
+using hush::utils::BufferPoolException;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+BufferPool::BufferPool(size_t buffer_bytes, size_t count, size_t alignment) :
+	buffer_bytes(buffer_bytes), buffers(count)
+{
+	void *p;
+
+	if (buffer_bytes % alignment != 0 || posix_memalign(&p, alignment, buffer_bytes * count) != 0) {
+		slog::LogString ls("Couldn't get %1 buffers of %2 bytes aligned to %3", count,
+				buffer_bytes, alignment);
+		logger.error(ls);
+		throw BufferPoolException(ls.str());
+	}
+
+	// touched now, so the pool is all resident from the start
+	base = (uint8_t *)p;
+	memset(base, 0, buffer_bytes * count);
+	for (size_t i = count; i > 0; i--)
+		free_buffers.push_back(base + (i - 1) * buffer_bytes);
+}
+
+BufferPool::~BufferPool()
+{
+	free(base);
+}
+
+std::vector<uint8_t *> BufferPool::get(size_t n)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	std::vector<uint8_t *> bufs;
+
+	if (n > buffers) {
+		slog::LogString ls("Asked for %1 buffers from a pool of %2", n, buffers);
+		logger.error(ls);
+		throw BufferPoolException(ls.str());
+	}
+
+	returned.wait(guard, [this, n] { return free_buffers.size() >= n; });
+	bufs.assign(free_buffers.end() - n, free_buffers.end());
+	free_buffers.resize(free_buffers.size() - n);
+	return bufs;
+}
+
+void BufferPool::put(std::vector<uint8_t *> const & bufs)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		free_buffers.insert(free_buffers.end(), bufs.begin(), bufs.end());
+	}
+	returned.notify_all();
+}
@@ -0,0 +1,92 @@
+#include <memory>
+#ifdef HUSHFS_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef HUSHFS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "utils/compress.hh"
+#include "config.h"
+
+using hush::fs::Compression;
+
+// the longest a block may come out and still be worth storing compressed
+#define COMPRESSED_MAX (HUSHFS_BLOCK_SIZE - HUSHFS_COMPRESS_MIN_SAVING)
+
+#ifdef HUSHFS_WITH_ZSTD
+/*
+ * ZSTD_compress() would set up a context per call, which costs more than a
+ * block's worth of compressing, so every thread keeps its own.
+ */
+static ZSTD_CCtx *cctx()
+{
+	static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(
+			ZSTD_createCCtx(), ZSTD_freeCCtx);
+	return ctx.get();
+}
+
+static ZSTD_DCtx *dctx()
+{
+	static thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(
+			ZSTD_createDCtx(), ZSTD_freeDCtx);
+	return ctx.get();
+}
+#endif
+
+bool hush::fs::compression_available(Compression c)
+{
+	switch (c) {
+		case Compression::None:
+			return true;
+#ifdef HUSHFS_WITH_LZ4
+		case Compression::LZ4:
+			return true;
+#endif
+#ifdef HUSHFS_WITH_ZSTD
+		case Compression::Zstd:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+size_t hush::fs::compress_block(Compression c, uint8_t const *in, uint8_t *out)
+{
+	switch (c) {
+#ifdef HUSHFS_WITH_LZ4
+		case Compression::LZ4:
+			// 0 if it doesn't fit, which also covers incompressible blocks
+			return LZ4_compress_default((char const *)in, (char *)out,
+					HUSHFS_BLOCK_SIZE, COMPRESSED_MAX);
+#endif
+#ifdef HUSHFS_WITH_ZSTD
+		case Compression::Zstd: {
+			size_t len = ZSTD_compressCCtx(cctx(), out, COMPRESSED_MAX, in,
+					HUSHFS_BLOCK_SIZE, HUSHFS_ZSTD_LEVEL);
+			return ZSTD_isError(len) ? 0 : len;
+		}
+#endif
+		default:
+			return 0;
+	}
+}
+
+bool hush::fs::decompress_block(Compression c, uint8_t const *in, size_t len, uint8_t *out)
+{
+	switch (c) {
+#ifdef HUSHFS_WITH_LZ4
+		case Compression::LZ4:
+			return LZ4_decompress_safe((char const *)in, (char *)out, len,
+					HUSHFS_BLOCK_SIZE) == HUSHFS_BLOCK_SIZE;
+#endif
+#ifdef HUSHFS_WITH_ZSTD
+		case Compression::Zstd:
+			return ZSTD_decompressDCtx(dctx(), out, HUSHFS_BLOCK_SIZE, in, len) ==
+				HUSHFS_BLOCK_SIZE;
+#endif
+		default:
+			return false;
+	}
+}
@@ -0,0 +1,312 @@
+#include <algorithm> // min
+#include <sodium.h>
+#include "utils/dedup.hh"
+#include "utils/tools.hh"
+#include "utils/zero.hh"
+#include "utils/log.hh"
+#include "config.h"
+
+using hush::fs::Dedup;
+using hush::fs::DedupEntry;
+using hush::fs::DedupRef;
+
+// index blocks read at a time while loading it
+#define LOAD_BLOCKS 256
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+// crypto_kdf contexts are exactly 8 characters
+static char const dedup_context[8] = { 'h', 'u', 's', 'h', 'd', 'e', 'd', 'u' };
+
+static uint64_t le(uint8_t const *p, unsigned bytes)
+{
+	uint64_t v = 0;
+
+	for (unsigned i = 0; i < bytes; i++)
+		v |= (uint64_t)p[i] << (i * 8);
+	return v;
+}
+
+static bool in_use(DedupEntry const & e)
+{
+	return e.block != 0 && e.block != HUSHFS_DEDUP_DELETED;
+}
+
+Dedup::Dedup(int fd, Superblock const & sb, BlockIO & io,
+		hush::crypto::SecretKey const & volume_key,
+		Allocate allocate, Release release, Mark mark) :
+	fd(fd), sb(sb), io(io), allocate(allocate), free_block(release), mark(mark)
+{
+	key.derive_key(volume_key, 0, dedup_context);
+}
+
+void Dedup::open()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!(sb.fields.flags & HUSHFS_FLAG_DEDUP) || sb.fields.dedup_index_blocks == 0)
+		throw DedupException("This image has no dedup index");
+
+	if (sb.fields.flags & HUSHFS_FLAG_DEDUP_DIRTY) {
+		slog::LogString ls("The dedup index wasn't closed cleanly, run fsck -y on the image");
+		logger.error(ls);
+		throw DedupException(ls.str());
+	}
+
+	// a byte per slot is eight filter bits per entry, about 2% false positives when full
+	slots = sb.fields.dedup_index_blocks * HUSHFS_DEDUP_PER_BLOCK;
+	filter.assign(slots, 0);
+	slot_of.clear();
+
+	scan_dedup_index(fd, sb, [this](uint64_t slot, DedupEntry const & e) {
+		Fingerprint fp;
+
+		std::copy(e.fingerprint, e.fingerprint + fp.size(), fp.begin());
+		remember(fp);
+		slot_of[e.block] = slot;
+	});
+
+	logger.debug("Dedup index has %1 of %2 slots in use", slot_of.size(), slots);
+}
+
+void Dedup::close()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (dirty) {
+		mark(false);
+		dirty = false;
+	}
+}
+
+Dedup::Fingerprint Dedup::fingerprint(uint8_t const *data)
+{
+	Fingerprint fp;
+
+	crypto_generichash(fp.data(), fp.size(), data, HUSHFS_BLOCK_SIZE,
+			key.get_key(), crypto_generichash_KEYBYTES);
+	return fp;
+}
+
+/*
+ * The fingerprint is already uniformly random, so its bytes serve directly as
+ * the home slot (0-7) and the two filter bits (8-11, 12-15).
+ */
+void Dedup::remember(Fingerprint const & fp)
+{
+	uint64_t bits = slots * 8;
+
+	for (unsigned i = 8; i < 16; i += 4) {
+		uint64_t bit = le(fp.data() + i, 4) % bits;
+		filter[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+bool Dedup::maybe_indexed(Fingerprint const & fp) const
+{
+	uint64_t bits = slots * 8;
+
+	for (unsigned i = 8; i < 16; i += 4) {
+		uint64_t bit = le(fp.data() + i, 4) % bits;
+		if (!(filter[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+	return true;
+}
+
+bool Dedup::find(Fingerprint const & fp, uint64_t & slot, DedupEntry & e, uint64_t *free_slot)
+{
+	std::vector<DedupEntry> entries(HUSHFS_DEDUP_PER_BLOCK);
+	uint64_t home = le(fp.data(), 8) % slots, loaded = UINT64_MAX;
+
+	if (free_slot != nullptr)
+		*free_slot = slots;
+
+	for (uint64_t i = 0; i < slots; i++) {
+		uint64_t s = (home + i) % slots;
+
+		if (s / HUSHFS_DEDUP_PER_BLOCK != loaded) {
+			loaded = s / HUSHFS_DEDUP_PER_BLOCK;
+			read_block(fd, entries.data(), (sb.fields.dedup_index_offset + loaded) * HUSHFS_BLOCK_SIZE);
+		}
+
+		DedupEntry const & cur = entries[s % HUSHFS_DEDUP_PER_BLOCK];
+
+		if (!in_use(cur)) {
+			if (free_slot != nullptr && *free_slot == slots)
+				*free_slot = s;
+			// a slot that was never used ends the probe, a deleted one doesn't
+			if (cur.block == 0)
+				return false;
+			continue;
+		}
+
+		if (sodium_memcmp(cur.fingerprint, fp.data(), fp.size()) == 0) {
+			slot = s;
+			e = cur;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Dedup::touch()
+{
+	if (!dirty) {
+		mark(true);
+		dirty = true;
+	}
+}
+
+bool Dedup::acquire(Fingerprint const & fp, uint64_t & block)
+{
+	DedupEntry e;
+	uint64_t slot;
+
+	if (!maybe_indexed(fp) || !find(fp, slot, e, nullptr) || e.refs == UINT32_MAX)
+		return false;
+
+	e.refs++;
+	touch();
+	write_dedup_entry(fd, sb, slot, e);
+	block = e.block;
+	return true;
+}
+
+uint64_t Dedup::store(uint8_t const *data)
+{
+	Fingerprint fp;
+	uint64_t block, other, slot;
+	DedupEntry e = {};
+
+	// the most common duplicate of all needs neither a block nor an entry
+	if (hush::utils::is_zero_block(data))
+		return 0;
+
+	fp = fingerprint(data);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (acquire(fp, block))
+			return block;
+	}
+
+	// sealing a new block is the slow part, it doesn't need the index
+	if ((block = allocate()) == 0) {
+		slog::LogString ls("No free blocks left to store a block in");
+		logger.error(ls);
+		throw DedupException(ls.str());
+	}
+	io.write(block, 1, data);
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	// someone stored the same block meanwhile
+	if (acquire(fp, other)) {
+		free_block(block);
+		return other;
+	}
+
+	find(fp, other, e, &slot);
+	if (slot == slots) {
+		logger.warn("Dedup index is full, block %1 won't be shared", block);
+		return block;
+	}
+
+	std::copy(fp.begin(), fp.end(), e.fingerprint);
+	e.refs = 1;
+	e.block = block;
+	touch();
+	write_dedup_entry(fd, sb, slot, e);
+	remember(fp);
+	slot_of[block] = slot;
+
+	return block;
+}
+
+void Dedup::release(uint64_t block)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	auto it = slot_of.find(block);
+	DedupEntry e;
+
+	if (block == 0)
+		return;
+
+	if (it == slot_of.end()) {
+		guard.unlock();
+		free_block(block);
+		return;
+	}
+
+	read_dedup_entry(fd, sb, it->second, e);
+	if (e.block != block) {
+		slog::LogString ls("Dedup slot %1 should hold block %2 but has %3", it->second, block, e.block);
+		logger.error(ls);
+		throw DedupException(ls.str());
+	}
+
+	touch();
+	if (--e.refs > 0) {
+		write_dedup_entry(fd, sb, it->second, e);
+		return;
+	}
+
+	// the fingerprint stays behind in the filter, it only costs a probe
+	e.block = HUSHFS_DEDUP_DELETED;
+	write_dedup_entry(fd, sb, it->second, e);
+	slot_of.erase(it);
+	guard.unlock();
+
+	free_block(block);
+}
+
+uint32_t Dedup::refs(uint64_t block)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = slot_of.find(block);
+	DedupEntry e;
+
+	if (it == slot_of.end())
+		return 1;
+
+	read_dedup_entry(fd, sb, it->second, e);
+	return e.refs;
+}
+
+void hush::fs::scan_dedup_index(int fd, Superblock const & sb, DedupVisitor const & visit)
+{
+	std::vector<DedupEntry> entries(LOAD_BLOCKS * HUSHFS_DEDUP_PER_BLOCK);
+
+	for (uint64_t b = 0; b < sb.fields.dedup_index_blocks; b += LOAD_BLOCKS) {
+		uint64_t n = std::min((uint64_t)LOAD_BLOCKS, sb.fields.dedup_index_blocks - b);
+
+		read_data(fd, entries.data(), (sb.fields.dedup_index_offset + b) * HUSHFS_BLOCK_SIZE,
+				n * HUSHFS_BLOCK_SIZE);
+
+		for (uint64_t i = 0; i < n * HUSHFS_DEDUP_PER_BLOCK; i++) {
+			if (in_use(entries[i]))
+				visit(b * HUSHFS_DEDUP_PER_BLOCK + i, entries[i]);
+		}
+	}
+}
+
+std::unordered_map<uint64_t, DedupRef> hush::fs::load_dedup_refs(int fd, Superblock const & sb)
+{
+	std::unordered_map<uint64_t, DedupRef> refs;
+
+	scan_dedup_index(fd, sb, [&refs](uint64_t slot, DedupEntry const & e) {
+		refs[e.block] = { slot, e.refs };
+	});
+	return refs;
+}
+
+void hush::fs::read_dedup_entry(int fd, Superblock const & sb, uint64_t slot, DedupEntry & e)
+{
+	read_data(fd, &e, sb.fields.dedup_index_offset * HUSHFS_BLOCK_SIZE + slot * sizeof e, sizeof e);
+}
+
+void hush::fs::write_dedup_entry(int fd, Superblock const & sb, uint64_t slot, DedupEntry const & e)
+{
+	write_data(fd, &e, sb.fields.dedup_index_offset * HUSHFS_BLOCK_SIZE + slot * sizeof e, sizeof e);
+}
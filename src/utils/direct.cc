@@ -0,0 +1,250 @@
+#include <algorithm> // min
+#include <cstring> // memcpy
+#include <stdexcept>
+#include <string>
+
+#include "utils/direct.hh"
+#include "utils/log.hh"
+#include "config.h"
+
+using hush::fs::BlockDevice;
+using hush::fs::DirectDevice;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+static bool aligned(void const *buf)
+{
+	return (uintptr_t)buf % HUSHFS_BLOCK_SIZE == 0;
+}
+
+DirectDevice::DirectDevice(BlockDevice *inner, size_t bounce_blocks, size_t cache_blocks) :
+	inner(inner),
+	bounce(HUSHFS_DIRECT_BOUNCE_BYTES, std::max((size_t)1,
+				bounce_blocks * HUSHFS_BLOCK_SIZE / HUSHFS_DIRECT_BOUNCE_BYTES), HUSHFS_BLOCK_SIZE),
+	cache_memory(HUSHFS_BLOCK_SIZE, std::max((size_t)1, cache_blocks), HUSHFS_BLOCK_SIZE)
+{
+	// the cache never gives blocks back to its pool, it only trades them between entries
+	spare = cache_memory.get(cache_memory.count());
+	// only a speedup, and RLIMIT_MEMLOCK may not stretch to pinning them all
+	try {
+		this->inner->register_buffers({ bounce.region(), cache_memory.region() });
+	} catch (std::runtime_error const & e) {
+		logger.warning("%1, going on without fixed buffers", std::string(e.what()));
+	}
+
+	logger.debug("Direct I/O with %1 bounce buffers of %2 bytes and a cache of %3 blocks",
+			bounce.count(), bounce.buffer_size(), cache_memory.count());
+}
+
+uint8_t *DirectDevice::cached(uint64_t block)
+{
+	auto it = cache.find(block);
+	uint8_t *data;
+
+	if (it != cache.end()) {
+		recent.splice(recent.begin(), recent, it->second.recent);
+		return it->second.data;
+	}
+
+	if (spare.empty()) {
+		auto victim = cache.find(recent.back());
+
+		spare.push_back(victim->second.data);
+		cache.erase(victim);
+		recent.pop_back();
+	}
+
+	data = spare.back();
+	inner->read(data, block * HUSHFS_BLOCK_SIZE, HUSHFS_BLOCK_SIZE);
+	spare.pop_back();
+	recent.push_front(block);
+	cache[block] = { data, recent.begin() };
+	return data;
+}
+
+bool DirectDevice::being_written(uint64_t block) const
+{
+	for (auto const & w : writing) {
+		if (block >= w.first && block <= w.second)
+			return true;
+	}
+	return false;
+}
+
+void DirectDevice::partial(Request const & r)
+{
+	std::unique_lock<std::mutex> guard(cache_lock);
+	uint64_t block = r.offset / HUSHFS_BLOCK_SIZE;
+	uint8_t *data;
+
+	// a read is fine either way, a write would undo it with what it read first
+	if (r.op == Op::Write)
+		written.wait(guard, [this, block] { return !being_written(block); });
+
+	data = cached(block) + r.offset % HUSHFS_BLOCK_SIZE;
+	if (r.op == Op::Read) {
+		memcpy(r.buf, data, r.len);
+		return;
+	}
+
+	memcpy(data, r.buf, r.len);
+	try {
+		inner->write(data - r.offset % HUSHFS_BLOCK_SIZE, block * HUSHFS_BLOCK_SIZE, HUSHFS_BLOCK_SIZE);
+	} catch (std::string const &) {
+		// the copy no longer matches the disk
+		auto it = cache.find(block);
+
+		spare.push_back(it->second.data);
+		recent.erase(it->second.recent);
+		cache.erase(it);
+		throw;
+	}
+}
+
+void DirectDevice::forget_blocks(uint64_t first, uint64_t last)
+{
+	auto drop = [this](std::unordered_map<uint64_t, Cached>::iterator it) {
+		spare.push_back(it->second.data);
+		recent.erase(it->second.recent);
+		return cache.erase(it);
+	};
+
+	// whichever of the range and the cache is smaller
+	if (last - first + 1 > cache.size()) {
+		for (auto it = cache.begin(); it != cache.end(); ) {
+			if (it->first >= first && it->first <= last)
+				it = drop(it);
+			else
+				it++;
+		}
+		return;
+	}
+
+	for (uint64_t b = first; b <= last; b++) {
+		auto it = cache.find(b);
+
+		if (it != cache.end())
+			drop(it);
+	}
+}
+
+void DirectDevice::transfer(std::vector<Request> const & direct, std::vector<Request> const & bounced)
+{
+	size_t i = 0;
+
+	do {
+		size_t n = std::min(bounce.count(), bounced.size() - i);
+		std::vector<uint8_t *> bufs = n > 0 ? bounce.get(n) : std::vector<uint8_t *>();
+		std::vector<Request> wave;
+
+		if (i == 0)
+			wave = direct;
+		for (size_t j = 0; j < n; j++) {
+			Request const & r = bounced[i + j];
+
+			if (r.op == Op::Write)
+				memcpy(bufs[j], r.buf, r.len);
+			wave.push_back({ r.op, bufs[j], r.offset, r.len });
+		}
+
+		try {
+			inner->submit(wave);
+		} catch (std::string const &) {
+			bounce.put(bufs);
+			throw;
+		}
+
+		for (size_t j = 0; j < n; j++) {
+			Request const & r = bounced[i + j];
+
+			if (r.op == Op::Read)
+				memcpy(r.buf, bufs[j], r.len);
+		}
+		bounce.put(bufs);
+		i += n;
+	} while (i < bounced.size());
+}
+
+void DirectDevice::submit(std::vector<Request> const & batch)
+{
+	std::vector<Request> direct, bounced;
+
+	for (Request const & r : batch) {
+		uint64_t end = r.offset + r.len;
+
+		for (uint64_t pos = r.offset; pos < end; ) {
+			uint64_t block_end = (pos / HUSHFS_BLOCK_SIZE + 1) * HUSHFS_BLOCK_SIZE;
+			uint8_t *buf = (uint8_t *)r.buf + (pos - r.offset);
+			uint64_t n;
+
+			// the kernel wouldn't take these, the cache does them now
+			if (pos % HUSHFS_BLOCK_SIZE != 0 || end < block_end) {
+				n = std::min(end, block_end) - pos;
+				partial({ r.op, buf, pos, n });
+				pos += n;
+				continue;
+			}
+
+			n = (end - pos) / HUSHFS_BLOCK_SIZE * HUSHFS_BLOCK_SIZE;
+			if (aligned(buf)) {
+				direct.push_back({ r.op, buf, pos, n });
+			} else {
+				for (uint64_t done = 0; done < n; done += bounce.buffer_size())
+					bounced.push_back({ r.op, buf + done, pos + done,
+							std::min((uint64_t)bounce.buffer_size(), n - done) });
+			}
+			pos += n;
+		}
+	}
+
+	if (direct.empty() && bounced.empty())
+		return;
+
+	std::vector<std::list<std::pair<uint64_t, uint64_t>>::iterator> claimed;
+	{
+		// any piece being written into these has finished, none start till we're done
+		std::lock_guard<std::mutex> guard(cache_lock);
+
+		for (auto const *requests : { &direct, &bounced }) {
+			for (Request const & r : *requests) {
+				if (r.op == Op::Write)
+					claimed.push_back(writing.insert(writing.end(), { r.offset / HUSHFS_BLOCK_SIZE,
+								(r.offset + r.len - 1) / HUSHFS_BLOCK_SIZE }));
+			}
+		}
+	}
+
+	// after the writes, so a block read into the cache meanwhile can't outlive them
+	auto forget_written = [this, &claimed] {
+		std::lock_guard<std::mutex> guard(cache_lock);
+
+		for (auto it : claimed) {
+			forget_blocks(it->first, it->second);
+			writing.erase(it);
+		}
+		written.notify_all();
+	};
+
+	try {
+		transfer(direct, bounced);
+	} catch (std::string const &) {
+		forget_written();
+		throw;
+	}
+	forget_written();
+}
+
+void DirectDevice::read(void *buf, uint64_t offset, uint64_t len)
+{
+	submit({ { Op::Read, buf, offset, len } });
+}
+
+void DirectDevice::write(void const *buf, uint64_t offset, uint64_t len)
+{
+	submit({ { Op::Write, const_cast<void *>(buf), offset, len } });
+}
+
+bool DirectDevice::sync()
+{
+	return inner->sync();
+}
@@ -0,0 +1,104 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "utils/image.hh"
+#include "utils/layout.hh"
+#include "utils/log.hh"
+#include "utils/tools.hh"
+
+using hush::fs::BlockGroup;
+using hush::fs::Inode;
+using hush::fs::InodeTableBlock;
+using hush::fs::KeySlot;
+using hush::fs::Superblock;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+void hush::fs::load_superblock(int fd, Superblock & sb)
+{
+	read_block(fd, &sb, 0);
+
+	if (!is_valid_superblock(sb))
+		throw std::string("Not a hush image, or the superblock is damaged");
+}
+
+void hush::fs::load_group_maps(int fd, BlockGroup const & g, std::vector<uint8_t> & inode_bitmap,
+		std::vector<uint8_t> & block_bitmap)
+{
+	inode_bitmap.resize(g.inode_bitmap_blocks * HUSHFS_BLOCK_SIZE);
+	read_data(fd, inode_bitmap.data(), g.inode_bitmap_offset * HUSHFS_BLOCK_SIZE,
+			inode_bitmap.size());
+
+	block_bitmap.resize(g.block_bitmap_blocks * HUSHFS_BLOCK_SIZE);
+	read_data(fd, block_bitmap.data(), g.block_bitmap_offset * HUSHFS_BLOCK_SIZE,
+			block_bitmap.size());
+}
+
+void hush::fs::load_inode(int fd, Superblock const & sb, uint64_t i_no, Inode & inode)
+{
+	InodeTableBlock table;
+	uint64_t block, slot;
+
+	if (!locate_inode(sb, i_no, block, slot))
+		throw slog::LogString("No such inode %1", i_no).str();
+
+	read_block(fd, &table, block * HUSHFS_BLOCK_SIZE);
+	inode = table.inodes[slot];
+}
+
+void hush::fs::store_inode(int fd, Superblock const & sb, Inode const & inode)
+{
+	InodeTableBlock table;
+	uint64_t block, slot;
+
+	if (!locate_inode(sb, inode.fields.inode_number, block, slot))
+		throw slog::LogString("No such inode %1", inode.fields.inode_number).str();
+
+	read_block(fd, &table, block * HUSHFS_BLOCK_SIZE);
+	table.inodes[slot] = inode;
+	write_block(fd, &table, block * HUSHFS_BLOCK_SIZE);
+}
+
+void hush::fs::load_key_slots(int fd, std::vector<KeySlot> & slots)
+{
+	slots.resize(HUSHFS_KEY_SLOTS);
+	read_data(fd, slots.data(), HUSHFS_BLOCK_SIZE, HUSHFS_KEY_SLOTS * sizeof(KeySlot));
+}
+
+void hush::fs::store_key_slot(int fd, unsigned n, KeySlot const & slot)
+{
+	if (n >= HUSHFS_KEY_SLOTS)
+		throw slog::LogString("No such key slot %1", n).str();
+
+	write_block(fd, &slot, (1 + n) * HUSHFS_BLOCK_SIZE);
+
+	if (fsync(fd) != 0)
+		throw slog::LogString("Couldn't sync key slot %1", n).str();
+}
+
+bool hush::fs::claim_image(int fd)
+{
+	struct flock fl = {};
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 1;
+
+#ifdef F_OFD_SETLK
+	if (fcntl(fd, F_OFD_SETLK, &fl) == 0)
+		return true;
+#else
+	if (fcntl(fd, F_SETLK, &fl) == 0)
+		return true;
+#endif
+	if (errno == EAGAIN || errno == EACCES)
+		return false;
+
+	logger.warning("Couldn't lock the image (%1), nothing stops it being changed under a mount",
+			std::string(strerror(errno)));
+	return true;
+}
@@ -0,0 +1,131 @@
+#include <cstring>
+
+#include "config.h"
+#include "utils/layout.hh"
+#include "utils/log.hh"
+
+using hush::fs::BlockGroup;
+using hush::fs::Inode;
+using hush::fs::Superblock;
+
+static uint64_t blocks_for_bits(uint64_t bits)
+{
+	uint64_t bytes = (bits + 7) / 8;
+	uint64_t blocks = (bytes + HUSHFS_BLOCK_SIZE - 1) / HUSHFS_BLOCK_SIZE;
+
+	return blocks ? blocks : 1;
+}
+
+BlockGroup hush::fs::plan_group(uint64_t start_block, uint64_t num_blocks,
+		uint64_t first_inode)
+{
+	BlockGroup g = {};
+	uint64_t inodes_per_block = (uint64_t)(HUSHFS_BLOCK_SIZE / sizeof(Inode));
+	uint64_t meta_start = (start_block == 0) ? HUSHFS_HEADER_BLOCKS : start_block;
+
+	g.start_block = start_block;
+	g.total_blocks = num_blocks;
+	g.first_inode = first_inode;
+	g.total_inodes = num_blocks;
+
+	g.inode_bitmap_blocks = blocks_for_bits(g.total_inodes);
+	g.block_bitmap_blocks = blocks_for_bits(g.total_blocks);
+	g.inode_table_blocks = (g.total_inodes + inodes_per_block - 1) / inodes_per_block;
+	g.tag_table_blocks = (g.total_blocks + HUSHFS_TAGS_PER_BLOCK - 1) / HUSHFS_TAGS_PER_BLOCK;
+
+	g.inode_bitmap_offset = meta_start;
+	g.block_bitmap_offset = g.inode_bitmap_offset + g.inode_bitmap_blocks;
+	g.inode_table_offset = g.block_bitmap_offset + g.block_bitmap_blocks;
+	g.tag_table_offset = g.inode_table_offset + g.inode_table_blocks;
+	g.first_datablock = g.tag_table_offset + g.tag_table_blocks;
+
+	if (g.first_datablock >= start_block + num_blocks)
+		throw LayoutException(slog::LogString("A group of %1 blocks is too "
+					"small to hold its own metadata", num_blocks).str());
+
+	g.free_blocks = num_blocks - group_metadata_blocks(g);
+	g.free_inodes = g.total_inodes;
+
+	return g;
+}
+
+uint64_t hush::fs::plan_dedup_index(BlockGroup & g)
+{
+	uint64_t data_blocks = g.total_blocks - group_metadata_blocks(g);
+	uint64_t slots = data_blocks + data_blocks / 4;
+	uint64_t blocks = (slots + HUSHFS_DEDUP_PER_BLOCK - 1) / HUSHFS_DEDUP_PER_BLOCK;
+
+	if (blocks >= data_blocks)
+		throw LayoutException(slog::LogString("A group of %1 blocks is too "
+					"small to hold a dedup index", g.total_blocks).str());
+
+	g.first_datablock += blocks;
+	g.free_blocks -= blocks;
+
+	return blocks;
+}
+
+uint64_t hush::fs::group_metadata_blocks(BlockGroup const & g)
+{
+	return g.first_datablock - g.start_block;
+}
+
+void hush::fs::mark_bits(uint8_t *map, uint64_t first, uint64_t count)
+{
+	for (uint64_t i = first; i < first + count; i++)
+		map[i / 8] |= (0x80 >> (i % 8));
+}
+
+bool hush::fs::test_bit(uint8_t const *map, uint64_t bit)
+{
+	return (map[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+bool hush::fs::is_valid_superblock(Superblock const & sb)
+{
+	return memcmp(sb.fields.magic, HUSHFS_MAGIC, 4) == 0 &&
+		sb.fields.block_size == HUSHFS_BLOCK_SIZE &&
+		sb.fields.group_count > 0 &&
+		sb.fields.group_count <= HUSHFS_MAX_GROUPS;
+}
+
+int hush::fs::group_of_block(Superblock const & sb, uint64_t block)
+{
+	for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+		BlockGroup const & bg = sb.groups[g];
+		if (block >= bg.start_block && block < bg.start_block + bg.total_blocks)
+			return g;
+	}
+	return -1;
+}
+
+bool hush::fs::locate_tag(Superblock const & sb, uint64_t block, uint64_t & tag_block,
+		uint64_t & slot)
+{
+	int g = group_of_block(sb, block);
+
+	if (g == -1 || sb.groups[g].tag_table_blocks == 0)
+		return false;
+
+	tag_block = sb.groups[g].tag_table_offset +
+		((block - sb.groups[g].start_block) / HUSHFS_TAGS_PER_BLOCK);
+	slot = (block - sb.groups[g].start_block) % HUSHFS_TAGS_PER_BLOCK;
+	return true;
+}
+
+bool hush::fs::locate_inode(Superblock const & sb, uint64_t i_no, uint64_t & block,
+		uint64_t & slot)
+{
+	uint64_t inodes_per_block = (uint64_t)(HUSHFS_BLOCK_SIZE / sizeof(Inode));
+
+	for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+		BlockGroup const & bg = sb.groups[g];
+		if (i_no > bg.first_inode && i_no <= bg.first_inode + bg.total_inodes) {
+			uint64_t idx = i_no - bg.first_inode - 1;
+			block = bg.inode_table_offset + (idx / inodes_per_block);
+			slot = idx % inodes_per_block;
+			return true;
+		}
+	}
+	return false;
+}
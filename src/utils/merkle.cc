@@ -0,0 +1,358 @@
+#include <algorithm> // min, max
+#include <sodium.h>
+#include "utils/merkle.hh"
+#include "utils/layout.hh"
+#include "utils/tools.hh"
+#include "utils/log.hh"
+#include "config.h"
+
+using hush::fs::MerkleTree;
+using hush::fs::BlockGroup;
+using hush::fs::BlockTag;
+
+// tag blocks read at a time while building a group's tree
+#define LOAD_BLOCKS 256
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+// crypto_kdf contexts are exactly 8 characters
+static char const tree_context[8] = { 'h', 'u', 's', 'h', 't', 'r', 'e', 'e' };
+
+// leaves and inner nodes are hashed with different prefixes so one can't pass for the other
+static uint8_t const leaf_prefix = 0;
+static uint8_t const node_prefix = 1;
+
+MerkleTree::Hash MerkleTree::leaf_hash(BlockTag const *tags)
+{
+	crypto_generichash_state st;
+	Hash h;
+
+	crypto_generichash_init(&st, nullptr, 0, h.size());
+	crypto_generichash_update(&st, &leaf_prefix, 1);
+	crypto_generichash_update(&st, (unsigned char const *)tags, HUSHFS_BLOCK_SIZE);
+	crypto_generichash_final(&st, h.data(), h.size());
+
+	return h;
+}
+
+MerkleTree::Hash MerkleTree::node_hash(Hash const & left, Hash const & right)
+{
+	crypto_generichash_state st;
+	Hash h;
+
+	crypto_generichash_init(&st, nullptr, 0, h.size());
+	crypto_generichash_update(&st, &node_prefix, 1);
+	crypto_generichash_update(&st, left.data(), left.size());
+	crypto_generichash_update(&st, right.data(), right.size());
+	crypto_generichash_final(&st, h.data(), h.size());
+
+	return h;
+}
+
+// the only keyed hash, and the only one an attacker can't recompute
+MerkleTree::Hash MerkleTree::root_hash(uint64_t count)
+{
+	crypto_generichash_state st;
+	unsigned char le[8];
+	Hash h;
+
+	for (int i = 0; i < 8; i++)
+		le[i] = (count >> (i * 8)) & 0xFF;
+
+	crypto_generichash_init(&st, root_key.get_key(), crypto_generichash_KEYBYTES, h.size());
+	crypto_generichash_update(&st, le, sizeof le);
+	for (uint64_t g = 0; g < count; g++)
+		crypto_generichash_update(&st, roots[g].data(), roots[g].size());
+	crypto_generichash_final(&st, h.data(), h.size());
+
+	return h;
+}
+
+// hash group g's tag table into its tree, without judging it
+void MerkleTree::build(uint64_t g)
+{
+	BlockGroup const & bg = sb.groups[g];
+	std::vector<BlockTag> tags(LOAD_BLOCKS * HUSHFS_TAGS_PER_BLOCK);
+	Group & group = groups[g];
+	std::vector<Hash> leaves;
+
+	group.blank = true;
+	for (uint64_t b = 0; b < bg.tag_table_blocks; b += LOAD_BLOCKS) {
+		uint64_t n = std::min((uint64_t)LOAD_BLOCKS, bg.tag_table_blocks - b);
+
+		read_data(fd, tags.data(), (bg.tag_table_offset + b) * HUSHFS_BLOCK_SIZE,
+				n * HUSHFS_BLOCK_SIZE);
+
+		for (uint64_t i = 0; i < n; i++) {
+			BlockTag const *block = tags.data() + i * HUSHFS_TAGS_PER_BLOCK;
+
+			for (uint64_t t = 0; t < HUSHFS_TAGS_PER_BLOCK && group.blank; t++)
+				group.blank = block[t].flags == 0;
+			leaves.push_back(leaf_hash(block));
+		}
+	}
+
+	group.levels.clear();
+	group.levels.push_back(std::move(leaves));
+	while (group.levels.back().size() > 1) {
+		std::vector<Hash> const & below = group.levels.back();
+		std::vector<Hash> level;
+
+		// an odd node out moves up as it is
+		for (size_t i = 0; i < below.size(); i += 2)
+			level.push_back(i + 1 < below.size() ? node_hash(below[i], below[i + 1]) : below[i]);
+		group.levels.push_back(std::move(level));
+	}
+	group.dirty.clear();
+	group.built = true;
+
+	logger.debug("Built tag tree for group %1, %2 leaves", g, bg.tag_table_blocks);
+}
+
+/*
+ * Make group g's tree usable. Unless `trusted`, it has to match the root we
+ * already have for it, or for a group added since the roots were last
+ * stored, every tag in it has to be blank.
+ */
+void MerkleTree::load(uint64_t g, bool trusted)
+{
+	Group & group = groups[g];
+	bool fresh = g >= committed_groups;
+
+	if (!group.built)
+		build(g);
+
+	Hash root = group.levels.back().empty() ? Hash() : group.levels.back()[0];
+
+	if (!trusted && fresh && !group.blank) {
+		slog::LogString ls("Group %1 is new to the tag tree but has written blocks", g);
+		logger.error(ls);
+		group.built = false;
+		throw MerkleException(ls.str());
+	}
+
+	if (!trusted && !fresh && sodium_memcmp(root.data(), roots[g].data(), root.size()) != 0) {
+		slog::LogString ls("Tag table of group %1 doesn't match its root", g);
+		logger.error(ls);
+		group.built = false;
+		throw MerkleException(ls.str());
+	}
+
+	roots[g] = root;
+	group.loaded = true;
+}
+
+void MerkleTree::preload(std::atomic<bool> const & stop)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t count = sb.fields.group_count;
+
+	if (groups.size() < count)
+		groups.resize(count);
+
+	for (uint64_t g = 0; g < count && !stop.load(); g++) {
+		if (!groups[g].built)
+			build(g);
+	}
+}
+
+MerkleTree::Group & MerkleTree::group_of(uint64_t tag_block, uint64_t & leaf)
+{
+	int g = group_of_block(sb, tag_block);
+
+	if (g < 0 || tag_block < sb.groups[g].tag_table_offset ||
+			tag_block >= sb.groups[g].tag_table_offset + sb.groups[g].tag_table_blocks) {
+		slog::LogString ls("Block %1 isn't part of a tag table", tag_block);
+		logger.error(ls);
+		throw MerkleException(ls.str());
+	}
+
+	// the image may have grown since we last looked
+	if (groups.size() < sb.fields.group_count) {
+		groups.resize(sb.fields.group_count);
+		roots.resize(sb.fields.group_count);
+	}
+
+	if (!groups[g].loaded)
+		load(g, false);
+
+	leaf = tag_block - sb.groups[g].tag_table_offset;
+	return groups[g];
+}
+
+void MerkleTree::recompute(Group & group)
+{
+	std::set<uint64_t> changed(std::move(group.dirty));
+
+	for (size_t l = 1; l < group.levels.size(); l++) {
+		std::vector<Hash> const & below = group.levels[l - 1];
+		std::set<uint64_t> parents;
+
+		for (uint64_t i : changed)
+			parents.insert(i / 2);
+
+		for (uint64_t p : parents) {
+			group.levels[l][p] = 2 * p + 1 < below.size() ?
+				node_hash(below[2 * p], below[2 * p + 1]) : below[2 * p];
+		}
+		changed = std::move(parents);
+	}
+	group.dirty.clear();
+}
+
+void MerkleTree::store(bool now_dirty)
+{
+	Roots r;
+
+	r.dirty = now_dirty;
+	if (!now_dirty) {
+		r.groups = sb.fields.group_count;
+		r.root = root_hash(r.groups);
+		r.group_roots.assign(roots.begin(), roots.begin() + r.groups);
+	}
+
+	commit(r);
+
+	if (!now_dirty)
+		committed_groups = r.groups;
+	dirty = now_dirty;
+}
+
+void MerkleTree::open(hush::crypto::SecretKey const & volume_key, bool rebuild_dirty)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t count = sb.fields.group_count;
+
+	root_key.derive_key(volume_key, 0, tree_context);
+
+	committed_groups = sb.fields.merkle_groups;
+	if (committed_groups > HUSHFS_MAX_GROUPS)
+		throw MerkleException("Superblock claims an impossible number of tag tree groups");
+
+	// keeps whatever preload() built
+	groups.resize(std::max(count, committed_groups));
+	roots.assign(groups.size(), Hash());
+	for (uint64_t g = 0; g < committed_groups; g++)
+		std::copy(sb.groups[g].merkle_root, sb.groups[g].merkle_root + 32, roots[g].begin());
+
+	if (sb.fields.flags & HUSHFS_FLAG_TREE_DIRTY) {
+		if (!rebuild_dirty) {
+			slog::LogString ls("The tag tree wasn't closed cleanly, rebuilding it from disk "
+					"would hide any rollback since the last clean unmount");
+			logger.error(ls);
+			throw MerkleDirtyException(ls.str());
+		}
+
+		logger.warn("The tag tree wasn't closed cleanly, rebuilding it from disk as asked; "
+				"rollbacks since the last clean unmount can't be detected");
+		for (uint64_t g = 0; g < count; g++)
+			load(g, true);
+		store(false);
+		return;
+	}
+
+	// on a new image there's no root yet, and every group has to prove it's blank
+	if (committed_groups > 0) {
+		Hash expect = root_hash(committed_groups);
+
+		if (sodium_memcmp(expect.data(), sb.fields.merkle_root, expect.size()) != 0)
+			throw MerkleException("The superblock's tag tree root doesn't verify");
+	}
+
+	// groups defrag dropped don't count any more
+	if (committed_groups > count) {
+		groups.resize(count);
+		roots.resize(count);
+		committed_groups = count;
+	}
+
+	// check what preload() got through now there's something to check it against
+	for (uint64_t g = 0; g < count; g++) {
+		if (groups[g].built)
+			load(g, false);
+	}
+}
+
+void MerkleTree::verify(uint64_t tag_block, BlockTag const *tags)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t leaf;
+	Group & group = group_of(tag_block, leaf);
+	Hash h = leaf_hash(tags);
+
+	if (sodium_memcmp(h.data(), group.levels[0][leaf].data(), h.size()) != 0) {
+		slog::LogString ls("Tag block %1 doesn't match the tag tree, it may have been "
+				"rolled back", tag_block);
+		logger.error(ls);
+		throw MerkleException(ls.str());
+	}
+}
+
+void MerkleTree::update(uint64_t tag_block, BlockTag const *tags)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t leaf;
+	Group & group = group_of(tag_block, leaf);
+
+	// the flag has to be on disk before anything the stored roots don't cover
+	if (!dirty)
+		store(true);
+
+	group.levels[0][leaf] = leaf_hash(tags);
+	group.dirty.insert(leaf);
+	pending++;
+}
+
+bool MerkleTree::flush_due()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return pending >= HUSHFS_MERKLE_BATCH;
+}
+
+void MerkleTree::flush()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t count = sb.fields.group_count;
+
+	if (!dirty && count == committed_groups)
+		return;
+
+	groups.resize(std::max((uint64_t)groups.size(), count));
+	roots.resize(groups.size());
+
+	for (uint64_t g = 0; g < count; g++) {
+		Group & group = groups[g];
+
+		if (!group.loaded) {
+			// a group new since the last flush has no stored root to fall back on
+			if (g >= committed_groups)
+				load(g, false);
+			continue;
+		}
+
+		if (!group.dirty.empty()) {
+			recompute(group);
+			roots[g] = group.levels.back()[0];
+		}
+	}
+
+	store(false);
+	pending = 0;
+}
+
+void MerkleTree::rebuild()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	uint64_t count = sb.fields.group_count;
+
+	groups.resize(count);
+	roots.assign(count, Hash());
+	for (uint64_t g = 0; g < count; g++) {
+		groups[g].built = false;
+		load(g, true);
+	}
+
+	store(false);
+	pending = 0;
+}
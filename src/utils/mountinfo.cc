@@ -1,20 +1,31 @@
+#include <algorithm> // max, copy
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include "utils/mountinfo.hh"
+#include "utils/layout.hh"
+#include "utils/image.hh"
+#include "utils/tools.hh"
+#include "utils/blockdevice.hh"
+#include "utils/log.hh"
 #include "config.h"
 
+using hush::fs::BlockGroup;
 using hush::fs::MountInfo;
 
+static slog::Log logger(slog::LogLevel::DEBUG);
+
 MountInfo::MountInfo(int fd) : fd(fd)
 {
-	read_superblock();
-	read_inode_bitmap();
-	read_block_bitmap();
-}
+	struct stat st;
 
-MountInfo::~MountInfo()
-{
-	delete[] inode_bitmap;
-	delete[] block_bitmap;
+	load_superblock(fd, superblock);
+
+	for (uint64_t i = 0; i < superblock.fields.group_count; i++)
+		read_group_maps(i);
+
+	alloc_hint = superblock.groups[0].first_datablock;
+	backed_bytes = (fstat(fd, &st) == 0) ? st.st_size : superblock.fields.disk_size;
 }
 
 MountInfo & MountInfo::get_instance(int fd)
@@ -24,59 +35,442 @@ MountInfo & MountInfo::get_instance(int fd)
 	return instance;
 }
 
-void MountInfo::read_superblock()
+void MountInfo::read_superblock(Superblock & sb)
 {
-	lseek(fd, 0, SEEK_SET);
-	read(fd, &superblock, sizeof(superblock));
+	read_block(fd, &sb, 0);
 }
 
-void MountInfo::read_inode_bitmap()
+void MountInfo::read_group_maps(uint64_t group)
 {
-	inode_map_bytes = superblock.fields.inode_bitmap_blocks * HUSHFS_BLOCK_SIZE;
+	GroupMaps maps;
 
-	inode_bitmap = new uint8_t[inode_map_bytes];
-	lseek(fd, superblock.fields.inode_bitmap_offset, SEEK_SET);
-	read(fd, inode_bitmap, inode_map_bytes);
+	load_group_maps(fd, superblock.groups[group], maps.inode_bitmap, maps.block_bitmap);
+	groups.push_back(std::move(maps));
 }
 
-void MountInfo::read_block_bitmap()
+/*
+ * Take any groups in `sb` that we don't know about yet. The free counts of
+ * the groups we already have stay ours, since our in-memory bitmaps are the
+ * authority on those while we're mounted.
+ */
+bool MountInfo::adopt_groups(Superblock const & sb)
 {
-	block_map_bytes = superblock.fields.block_bitmap_blocks * HUSHFS_BLOCK_SIZE;
+	uint64_t known = groups.size();
+
+	if (!is_valid_superblock(sb) || sb.fields.group_count <= known)
+		return false;
+
+	for (uint64_t i = known; i < sb.fields.group_count; i++) {
+		BlockGroup const & g = sb.groups[i];
+
+		superblock.groups[i] = g;
+		superblock.fields.total_blocks += g.total_blocks;
+		superblock.fields.total_inodes += g.total_inodes;
+		superblock.fields.free_blocks += g.free_blocks;
+		superblock.fields.free_inodes += g.free_inodes;
+		read_group_maps(i);
+	}
 
-	block_bitmap = new uint8_t[block_map_bytes];
-	lseek(fd, superblock.fields.block_bitmap_offset, SEEK_SET);
-	read(fd, block_bitmap, block_map_bytes);
+	superblock.fields.disk_size = sb.fields.disk_size;
+	superblock.fields.group_count = sb.fields.group_count;
+
+	logger.info("Image grew to %1 blocks in %2 groups",
+			superblock.fields.total_blocks, superblock.fields.group_count);
+
+	return true;
 }
 
-uint64_t MountInfo::next_available_inode(bool mark_used)
+bool MountInfo::refresh()
 {
-	uint64_t i_no = 0;
-	uint8_t val = 0;
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	Superblock sb;
+
+	// resize publishes a new group with a single superblock write under LOCK_EX
+	flock(fd, LOCK_SH);
+	try {
+		read_superblock(sb);
+	} catch (...) {
+		flock(fd, LOCK_UN);
+		throw;
+	}
+	flock(fd, LOCK_UN);
 
-	for (int i = 0; i < inode_map_bytes; i++) {
-		val = inode_bitmap[i];
+	return adopt_groups(sb);
+}
 
-		/*
-		 * These maps start at the 'left' -- the 8th bit being 1, 7th being 2,
-		 * etc. So if the lowest bit is set then they are all set and we can
-		 * just jump to the next byte.
-		 */
-		if (val & 1) {
-			i_no += 8;
-			continue;
+/*
+ * Read-modify-write under the same lock resize uses, so a group it added
+ * since our last refresh isn't dropped by writing our stale copy over it.
+ */
+void MountInfo::update_superblock(std::function<void(Superblock const & on_disk)> change,
+		bool durable)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	Superblock sb;
+
+	flock(fd, LOCK_EX);
+	try {
+		read_superblock(sb);
+		adopt_groups(sb);
+		change(sb);
+		write_block(fd, &superblock, 0);
+	} catch (...) {
+		flock(fd, LOCK_UN);
+		throw;
+	}
+	flock(fd, LOCK_UN);
+
+	if (durable && !device(fd).sync()) {
+		slog::LogString ls("Couldn't sync the superblock");
+		logger.error(ls);
+		throw ls.str();
+	}
+
+	dirty = false;
+}
+
+void MountInfo::sync()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!dirty)
+		return;
+
+	update_superblock([](Superblock const &) {}, false);
+}
+
+uint64_t MountInfo::next_epoch()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	// nonces built from this epoch are only unique if it survives a crash
+	update_superblock([this](Superblock const & on_disk) {
+		superblock.fields.mount_epoch = on_disk.fields.mount_epoch + 1;
+	}, true);
+
+	logger.debug("Starting mount epoch %1", superblock.fields.mount_epoch);
+
+	return superblock.fields.mount_epoch;
+}
+
+uint64_t MountInfo::begin_rekey()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	// nothing may be sealed under the new generation before it's on disk
+	update_superblock([this](Superblock const & on_disk) {
+		superblock.fields.key_generation = on_disk.fields.key_generation + 1;
+		superblock.fields.rekey_watermark = rekey_progress = 0;
+		superblock.fields.flags |= HUSHFS_FLAG_REKEYING;
+	}, true);
+
+	logger.info("Rotating to data key generation %1", superblock.fields.key_generation);
+
+	return superblock.fields.key_generation;
+}
+
+/*
+ * The superblock's watermark only ever moves here, after the blocks under
+ * it are synced, so another update writing the superblock out meanwhile
+ * can't take a watermark to disk ahead of the blocks it skips.
+ */
+void MountInfo::set_rekey_watermark(uint64_t block, bool persist)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	rekey_progress = block;
+	if (!persist)
+		return;
+
+	if (!device(fd).sync()) {
+		slog::LogString ls("Couldn't sync resealed blocks");
+		logger.error(ls);
+		throw ls.str();
+	}
+	update_superblock([this](Superblock const &) {
+		superblock.fields.rekey_watermark = rekey_progress;
+	}, true);
+}
+
+void MountInfo::end_rekey()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (!device(fd).sync()) {
+		slog::LogString ls("Couldn't sync resealed blocks");
+		logger.error(ls);
+		throw ls.str();
+	}
+
+	update_superblock([this](Superblock const &) {
+		superblock.fields.rekey_watermark = rekey_progress = 0;
+		superblock.fields.flags &= ~HUSHFS_FLAG_REKEYING;
+	}, true);
+
+	logger.info("Every block is sealed under key generation %1",
+			superblock.fields.key_generation);
+}
+
+void MountInfo::store_tree(MerkleTree::Roots const & roots)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	if (roots.dirty) {
+		update_superblock([this](Superblock const &) {
+			superblock.fields.flags |= HUSHFS_FLAG_TREE_DIRTY;
+		}, true);
+		return;
+	}
+
+	// the tag blocks these roots cover have to be on disk before they are
+	if (!device(fd).sync()) {
+		slog::LogString ls("Couldn't sync tag tables");
+		logger.error(ls);
+		throw ls.str();
+	}
+
+	update_superblock([this, &roots](Superblock const &) {
+		superblock.fields.merkle_groups = roots.groups;
+		std::copy(roots.root.begin(), roots.root.end(), superblock.fields.merkle_root);
+		for (uint64_t g = 0; g < roots.groups; g++) {
+			std::copy(roots.group_roots[g].begin(), roots.group_roots[g].end(),
+					superblock.groups[g].merkle_root);
+		}
+		superblock.fields.flags &= ~HUSHFS_FLAG_TREE_DIRTY;
+	}, true);
+}
+
+void MountInfo::mark_dedup(bool dirty)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	// the refcounts have to be on disk before the flag vouching for them is gone
+	if (!dirty && !device(fd).sync()) {
+		slog::LogString ls("Couldn't sync dedup index");
+		logger.error(ls);
+		throw ls.str();
+	}
+
+	update_superblock([this, dirty](Superblock const &) {
+		if (dirty)
+			superblock.fields.flags |= HUSHFS_FLAG_DEDUP_DIRTY;
+		else
+			superblock.fields.flags &= ~HUSHFS_FLAG_DEDUP_DIRTY;
+	}, true);
+}
+
+void MountInfo::set_block(uint64_t block, bool used)
+{
+	set_blocks(block, 1, used);
+}
+
+void MountInfo::set_blocks(uint64_t first, uint64_t count, bool used)
+{
+	int g = group_of_block(superblock, first);
+	BlockGroup & bg = superblock.groups[g];
+	std::vector<uint8_t> & map = groups[g].block_bitmap;
+	uint64_t from = first - bg.start_block, to = from + count;
+
+	for (uint64_t bit = from; bit < to; bit++) {
+		if (used)
+			map[bit / 8] |= (0x80 >> (bit % 8));
+		else
+			map[bit / 8] &= ~(0x80 >> (bit % 8));
+	}
+
+	if (used) {
+		bg.free_blocks -= count;
+		superblock.fields.free_blocks -= count;
+	} else {
+		bg.free_blocks += count;
+		superblock.fields.free_blocks += count;
+	}
+
+	for (uint64_t m = from / (HUSHFS_BLOCK_SIZE * 8); m <= (to - 1) / (HUSHFS_BLOCK_SIZE * 8); m++)
+		write_block(fd, map.data() + (m * HUSHFS_BLOCK_SIZE),
+				(bg.block_bitmap_offset + m) * HUSHFS_BLOCK_SIZE);
+	dirty = true;
+}
+
+void MountInfo::ensure_backed(uint64_t block)
+{
+	uint64_t need = (block + 1) * HUSHFS_BLOCK_SIZE;
+	uint64_t grow_to;
+
+	if (!(superblock.fields.flags & HUSHFS_FLAG_THIN) || need <= backed_bytes)
+		return;
+
+	grow_to = ((need + HUSHFS_THIN_GROW - 1) / HUSHFS_THIN_GROW) * HUSHFS_THIN_GROW;
+	if (grow_to > superblock.fields.disk_size)
+		grow_to = superblock.fields.disk_size;
+
+	if (ftruncate(fd, grow_to) != 0) {
+		slog::LogString ls("Couldn't grow thin image to %1 bytes", grow_to);
+		logger.error(ls);
+		throw ls.str();
+	}
+
+	logger.debug("Grew thin image from %1 to %2 bytes", backed_bytes, grow_to);
+	backed_bytes = grow_to;
+}
+
+uint64_t MountInfo::allocate_block()
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		for (uint64_t g = 0; g < groups.size(); g++) {
+			BlockGroup const & bg = superblock.groups[g];
+			std::vector<uint8_t> const & map = groups[g].block_bitmap;
+			uint64_t end = bg.start_block + bg.total_blocks;
+			uint64_t b = std::max(alloc_hint, bg.first_datablock);
+
+			if (bg.free_blocks == 0)
+				continue;
+
+			for (; b < end; b++) {
+				uint64_t bit = b - bg.start_block;
+
+				if (bit % 8 == 0 && map[bit / 8] == 0xFF && b + 8 <= end) {
+					b += 7;
+					continue;
+				}
+
+				if (!test_bit(map.data(), bit)) {
+					ensure_backed(b);
+					set_block(b, true);
+					alloc_hint = b + 1;
+					return b;
+				}
+			}
 		}
 
-		break;
+		// out of space, but the image may have been grown underneath us
+		if (!refresh())
+			break;
 	}
 
-	while (val != 0) {
-		i_no++;
-		val >>= 1;
+	return 0;
+}
+
+uint64_t MountInfo::allocate_run(uint64_t want, uint64_t & got)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	got = 0;
+	if (want == 0)
+		return 0;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		uint64_t best = 0, first_free = 0;
+
+		for (uint64_t g = 0; g < groups.size() && got < want; g++) {
+			BlockGroup const & bg = superblock.groups[g];
+			std::vector<uint8_t> const & map = groups[g].block_bitmap;
+			uint64_t end = bg.start_block + bg.total_blocks;
+			uint64_t b = std::max(alloc_hint, bg.first_datablock), run = 0;
+
+			if (bg.free_blocks == 0)
+				continue;
+
+			// runs don't cross groups, so each one's bitmap is enough
+			for (; b < end && got < want; b++) {
+				uint64_t bit = b - bg.start_block;
+
+				if (run == 0 && bit % 8 == 0 && map[bit / 8] == 0xFF && b + 8 <= end) {
+					b += 7;
+					continue;
+				}
+
+				if (test_bit(map.data(), bit)) {
+					run = 0;
+					continue;
+				}
+
+				if (first_free == 0)
+					first_free = b;
+				if (++run > got) {
+					best = b - run + 1;
+					got = run;
+				}
+			}
+		}
+
+		if (got > 0) {
+			ensure_backed(best + got - 1);
+			set_blocks(best, got, true);
+			// anything free we passed over is still the lowest free block
+			alloc_hint = first_free < best ? first_free : best + got;
+			return best;
+		}
+
+		if (!refresh())
+			break;
 	}
 
-	if (mark_used) {
-		// set the bit in the map and write it back
+	return 0;
+}
+
+void MountInfo::free_block(uint64_t block)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	set_block(block, false);
+	if (block < alloc_hint)
+		alloc_hint = block;
+}
+
+bool MountInfo::inode_in_use(uint64_t i_no)
+{
+	std::lock_guard<std::recursive_mutex> guard(lock);
+
+	for (uint64_t g = 0; g < groups.size(); g++) {
+		BlockGroup const & bg = superblock.groups[g];
+
+		if (i_no > bg.first_inode && i_no <= bg.first_inode + bg.total_inodes)
+			return test_bit(groups[g].inode_bitmap.data(), i_no - bg.first_inode - 1);
+	}
+	return false;
+}
+
+uint64_t MountInfo::next_available_inode(bool mark_used)
+{
+	for (uint64_t g = 0; g < groups.size(); g++) {
+		std::vector<uint8_t> const & map = groups[g].inode_bitmap;
+		uint64_t total = superblock.groups[g].total_inodes;
+		uint64_t i_no = 0;
+		uint8_t val = 0;
+
+		for (uint64_t i = 0; i < map.size(); i++) {
+			val = map[i];
+
+			/*
+			 * These maps start at the 'left' -- the 8th bit being 1, 7th being 2,
+			 * etc. So if the lowest bit is set then they are all set and we can
+			 * just jump to the next byte.
+			 */
+			if (val & 1) {
+				i_no += 8;
+				continue;
+			}
+
+			break;
+		}
+
+		while (val != 0) {
+			i_no++;
+			val >>= 1;
+		}
+
+		if (i_no >= total)
+			continue;
+
+		if (mark_used) {
+			// set the bit in the map and write it back
+		}
+
+		return superblock.groups[g].first_inode + i_no + 1;
 	}
 
-	return i_no + 1;
+	return 0;
 }
@@ -1,4 +1,5 @@
 #include <termios.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <iostream>
@@ -34,6 +35,25 @@ void Password::ask(char const *prompt, bool confirm, bool show_asterisk)
 		throw PasswordException("Passwords don't match!");
 }
 
+void Password::read(std::string const & path)
+{
+	char buf[256];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path.c_str(), O_RDONLY)) == -1)
+		throw PasswordException("Couldn't open keyfile " + path);
+
+	password.clear();
+	while ((n = ::read(fd, buf, sizeof buf)) > 0)
+		password.append(buf, n);
+	sodium_memzero(buf, sizeof buf);
+	close(fd);
+
+	if (n < 0 || password.empty())
+		throw PasswordException("Couldn't read keyfile " + path);
+}
+
 hush::secure::string Password::obtain(char const *prompt, bool show_asterisk)
 {
 	char const BACKSPACE=0x7F;
@@ -0,0 +1,62 @@
+#include <algorithm> // min, max
+#include <errno.h>
+#include <fcntl.h>
+#include <vector>
+#include "utils/prealloc.hh"
+#include "utils/blockmap.hh"
+#include "utils/image.hh"
+#include "utils/log.hh"
+#include "config.h"
+
+using hush::fs::Extent;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+int hush::fs::preallocate(int fd, Inode & inode, uint64_t offset, uint64_t length,
+		bool keep_size, MountInfo & mi, BlockIO & io)
+{
+	std::vector<Extent> added;
+	uint64_t first, last, reserved = 0;
+	bool ok;
+
+	if (length == 0 || offset + length < offset)
+		return EINVAL;
+
+	first = offset / HUSHFS_BLOCK_SIZE;
+	last = (offset + length + HUSHFS_BLOCK_SIZE - 1) / HUSHFS_BLOCK_SIZE;
+	if (last > max_file_blocks())
+		return EFBIG;
+
+	/*
+	 * The blocks are cleared as they're handed out, before any block map
+	 * points at them, so a crash can't expose what a freed block last held.
+	 */
+	auto allocate = [&](uint64_t want, uint64_t & got) -> uint64_t {
+		uint64_t block = mi.allocate_run(want, got);
+
+		for (uint64_t b = 0; block != 0 && b < got; b += HUSHFS_PREALLOC_BATCH)
+			io.mark_unwritten(block + b, std::min((uint64_t)HUSHFS_PREALLOC_BATCH, got - b));
+
+#ifdef FALLOC_FL_KEEP_SIZE
+		// best effort, a sparse image is still correct, only not reserved on the host
+		if (block != 0)
+			fallocate(fd, FALLOC_FL_KEEP_SIZE, block * HUSHFS_BLOCK_SIZE, got * HUSHFS_BLOCK_SIZE);
+#endif
+		return block;
+	};
+
+	ok = fill_holes(fd, inode.fields, first, last - first, allocate, added);
+
+	for (Extent const & e : added)
+		reserved += e.length;
+
+	if (ok && !keep_size)
+		inode.fields.file_size = std::max(inode.fields.file_size, offset + length);
+
+	store_inode(fd, mi.get_superblock(), inode);
+
+	logger.debug("Preallocated %1 blocks in %2 extents for inode %3", reserved,
+			added.size(), inode.fields.inode_number);
+
+	return ok ? 0 : ENOSPC;
+}
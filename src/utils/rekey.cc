@@ -0,0 +1,116 @@
+#include <algorithm> // min
+#include <chrono>
+#include <iostream>
+#include "utils/rekey.hh"
+#include "utils/layout.hh"
+#include "utils/log.hh"
+#include "config.h"
+
+using hush::fs::BlockGroup;
+using hush::fs::Rekeyer;
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+void Rekeyer::start()
+{
+	if (thread.joinable())
+		return;
+
+	stopping = false;
+	thread = std::thread(&Rekeyer::run, this);
+}
+
+void Rekeyer::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	if (thread.joinable())
+		thread.join();
+}
+
+bool Rekeyer::next_range(uint64_t & block, uint64_t & count, uint64_t max)
+{
+	Superblock const & sb = mi.get_superblock();
+
+	for (uint64_t g = 0; g < sb.fields.group_count; g++) {
+		BlockGroup const & bg = sb.groups[g];
+		uint64_t end = bg.start_block + bg.total_blocks;
+
+		if (block >= end || bg.tag_table_blocks == 0)
+			continue;
+
+		if (block < bg.first_datablock)
+			block = bg.first_datablock;
+		count = std::min(max, end - block);
+		return count > 0;
+	}
+
+	return false;
+}
+
+void Rekeyer::run()
+{
+	using clock = std::chrono::steady_clock;
+
+	Superblock const & sb = mi.get_superblock();
+	uint64_t block = sb.fields.rekey_watermark;
+	uint64_t resealed = 0, count;
+	clock::time_point persisted = clock::now();
+	bool done = false;
+
+	logger.info("Resealing from block %1 under key generation %2", block,
+			sb.fields.key_generation);
+
+	try {
+		for (;;) {
+			clock::time_point step = clock::now();
+			clock::duration busy, pause = clock::duration::zero();
+
+			if (!next_range(block, count, HUSHFS_REKEY_BATCH)) {
+				done = true;
+				break;
+			}
+
+			resealed += io.reseal(block, count);
+			block += count;
+			busy = clock::now() - step;
+
+			bool persist = clock::now() - persisted >=
+				std::chrono::seconds(HUSHFS_REKEY_PERSIST_SECONDS);
+			mi.set_rekey_watermark(block, persist);
+			if (persist)
+				persisted = clock::now();
+
+			if (budget.cpu_percent > 0 && budget.cpu_percent < 100)
+				pause = busy * (100 - budget.cpu_percent) / budget.cpu_percent;
+			if (budget.blocks_per_second > 0) {
+				auto quota = std::chrono::duration_cast<clock::duration>(
+						std::chrono::duration<double>((double)count / budget.blocks_per_second));
+
+				if (quota - busy > pause)
+					pause = quota - busy;
+			}
+
+			std::unique_lock<std::mutex> guard(lock);
+			if (wake.wait_for(guard, pause, [this] { return stopping; }))
+				break;
+		}
+
+		if (done) {
+			mi.end_rekey();
+			keys.forget_below(sb.fields.key_generation);
+		} else {
+			mi.set_rekey_watermark(block, true);
+		}
+	} catch (std::string const & e) {
+		std::cerr << e << std::endl;
+	} catch (std::runtime_error const & e) {
+		std::cerr << e.what() << std::endl;
+	}
+
+	logger.info("Resealed %1 blocks, stopped at block %2", resealed, block);
+}
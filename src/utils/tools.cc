@@ -1,4 +1,7 @@
+#include <algorithm> // transform, tolower
+#include <cstdint>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <cstdio>
 #include <sys/types.h>
@@ -10,6 +13,7 @@
 #include "config.h"
 
 #include "utils/tools.hh"
+#include "utils/blockdevice.hh"
 #include "utils/log.hh"
 #include "utils/mountinfo.hh"
 
@@ -84,30 +88,79 @@ void create_and_write(std::string const & name, void const *data, size_t datalen
 	}
 }
 
-void write_data(int fd, void const * buf, off_t from, uint64_t len, bool error_seek)
+uint64_t parse_size(std::string s)
 {
-	off_t oldpos = lseek(fd, 0, SEEK_CUR);
-	ssize_t wrote = 0; 
-
+	std::string suffix;
+	std::string::size_type end = 0;
+	uint64_t n = 0, unit = 1;
+
+	// stoull would take a minus sign and hand back the number wrapped around
+	if (s.find('-') == std::string::npos) {
+		try {
+			n = std::stoull(s, &end, 10);
+		} catch (std::logic_error const &) {
+			// not a number, or more than 64 bits of one
+			end = 0;
+		}
+	}
 
-	if (error_seek && oldpos != from) {
-		slog::LogString ls("Seek error. Specified start location %1 is not the same as natural location of fd %2", from, oldpos);
-		logger.error(ls);
-		throw ls.str();
+	if (end == 0) {
+		std::cerr << "Invalid size specified" << std::endl;
+		return 0;
 	}
 
-	lseek(fd, from, SEEK_SET);
+	if (end < s.length() - 1)
+		std::cerr << "Invalid size specified" << std::endl;
+	suffix = s.substr(end);
+	std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::tolower);
+
+	if (! suffix.empty()) {
+		switch (suffix.at(0)) {
+			case 'k':
+				unit = KB;
+				break;
+			case 'm':
+				unit = MB;
+				break;
+			case 'g':
+				unit = GB;
+				break;
+			case 't':
+				unit = TB;
+				break;
+			default:
+				std::cerr << "Invalid size modifier. If present, must be one of k, m, g, or t"
+						  << std::endl;
+				return 0;
+		}
+	}
 
-	if ((wrote = write(fd, buf, len)) != len) {
-		slog::LogString ls("Error writing data, excpected to write %1 bytes, but wrote %2 bytes.", len, wrote);
-		logger.error(ls);
-		throw ls.str();
+	if (n > UINT64_MAX / unit) {
+		std::cerr << "Size too large" << std::endl;
+		return 0;
 	}
+
+	return n * unit;
+}
+
+void write_data(int fd, void const * buf, off_t from, uint64_t len)
+{
+	hush::fs::device(fd).write(buf, from, len);
+}
+
+void write_block(int fd, void const * buf, off_t from)
+{
+	write_data(fd, buf, from, HUSHFS_BLOCK_SIZE);
+}
+
+void read_data(int fd, void * buf, off_t from, uint64_t len)
+{
+	hush::fs::device(fd).read(buf, from, len);
 }
 
-void write_block(int fd, void const * buf, off_t from, bool error_seek)
+void read_block(int fd, void * buf, off_t from)
 {
-	write_data(fd, buf, from, HUSHFS_BLOCK_SIZE, error_seek);
+	read_data(fd, buf, from, HUSHFS_BLOCK_SIZE);
 }
 
 void write_inode(int fd, Superblock const *sb, std::string const & name, 
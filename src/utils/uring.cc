@@ -0,0 +1,374 @@
+#include "utils/uring.hh"
+
+#ifdef __linux__
+#include <algorithm> // min
+#include <cerrno>
+#include <cstring> // memset, strerror
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "utils/log.hh"
+
+using hush::fs::BlockDevice;
+using hush::fs::UringDevice;
+using hush::fs::UringException;
+
+// io_uring lengths are 32 bits, longer requests go in pieces of this
+#define MAX_PIECE ((uint64_t)1 << 30)
+
+static slog::Log logger(slog::LogLevel::DEBUG);
+
+// glibc has no wrappers for these, liburing would be the only user of a dependency
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(SYS_io_uring_enter, ring_fd, submit, min_complete, flags, nullptr, 0);
+}
+
+static int uring_register(int ring_fd, unsigned op, void const *arg, unsigned count)
+{
+	return syscall(SYS_io_uring_register, ring_fd, op, arg, count);
+}
+
+struct UringDevice::Pending {
+	size_t remaining;
+};
+
+struct UringDevice::Slot {
+	BlockDevice::Request r;
+	struct iovec iov;
+	Pending *pending;
+	int res;
+};
+
+UringDevice::UringDevice(int fd, unsigned entries) : fd(fd), posix(fd)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	memset(&params, 0, sizeof params);
+	if ((ring_fd = uring_setup(entries, &params)) < 0) {
+		slog::LogString ls("Couldn't set up an io_uring: %1", std::string(strerror(errno)));
+		logger.warn(ls);
+		throw UringException(ls.str());
+	}
+	this->entries = params.sq_entries;
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP))
+		cq_ring = sq_ring;
+	else if (sq_ring != MAP_FAILED)
+		cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring_fd, IORING_OFF_CQ_RING);
+	if (sq_ring != MAP_FAILED && cq_ring != MAP_FAILED)
+		sqes = (struct io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED || sqes == nullptr) {
+		slog::LogString ls("Couldn't map the io_uring: %1", std::string(strerror(errno)));
+
+		if (sq_ring == MAP_FAILED)
+			sq_ring = nullptr;
+		if (cq_ring == MAP_FAILED)
+			cq_ring = nullptr;
+		if (sqes == MAP_FAILED)
+			sqes = nullptr;
+		teardown();
+		logger.warn(ls);
+		throw UringException(ls.str());
+	}
+
+	sq = (char *)sq_ring;
+	cq = (char *)cq_ring;
+	sq_head = (unsigned *)(sq + params.sq_off.head);
+	sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + params.sq_off.array);
+	cq_head = (unsigned *)(cq + params.cq_off.head);
+	cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// every request names the image as fixed file 0
+	if (uring_register(ring_fd, IORING_REGISTER_FILES, &fd, 1) < 0) {
+		slog::LogString ls("Couldn't register the image with the io_uring: %1",
+				std::string(strerror(errno)));
+
+		teardown();
+		logger.warn(ls);
+		throw UringException(ls.str());
+	}
+
+	logger.debug("Image I/O goes through an io_uring of %1 entries", this->entries);
+}
+
+UringDevice::~UringDevice()
+{
+	teardown();
+}
+
+void UringDevice::teardown()
+{
+	if (sqes != nullptr)
+		munmap(sqes, sqes_size);
+	if (cq_ring != nullptr && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != nullptr)
+		munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+	sqes = nullptr;
+	sq_ring = cq_ring = nullptr;
+	ring_fd = -1;
+}
+
+void UringDevice::register_buffers(std::vector<struct iovec> const & bufs)
+{
+	if (!fixed.empty())
+		uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+	fixed.clear();
+
+	if (bufs.empty())
+		return;
+
+	if (uring_register(ring_fd, IORING_REGISTER_BUFFERS, bufs.data(), bufs.size()) < 0) {
+		slog::LogString ls("Couldn't register %1 buffers with the io_uring: %2", bufs.size(),
+				std::string(strerror(errno)));
+		logger.error(ls);
+		throw UringException(ls.str());
+	}
+	fixed = bufs;
+}
+
+int UringDevice::fixed_index(void const *buf, uint64_t len) const
+{
+	for (size_t i = 0; i < fixed.size(); i++) {
+		char const *base = (char const *)fixed[i].iov_base;
+
+		if ((char const *)buf >= base && (char const *)buf + len <= base + fixed[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+void UringDevice::enqueue(Slot *slots, unsigned count)
+{
+	std::lock_guard<std::mutex> guard(sq_lock);
+	unsigned tail = *sq_tail, submitted = 0;
+	int ret, err = 0;
+
+	for (unsigned i = 0; i < count; i++, tail++) {
+		Slot & s = slots[i];
+		unsigned idx = tail & *sq_mask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+		int buf_index = fixed_index(s.r.buf, s.r.len);
+		bool reading = s.r.op == Op::Read;
+
+		memset(sqe, 0, sizeof *sqe);
+		sqe->fd = 0;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->off = s.r.offset;
+		sqe->user_data = (uint64_t)(uintptr_t)&s;
+
+		if (buf_index >= 0) {
+			sqe->opcode = reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->addr = (uint64_t)(uintptr_t)s.r.buf;
+			sqe->len = s.r.len;
+			sqe->buf_index = buf_index;
+		} else {
+			// READV rather than READ, which needs 5.6
+			s.iov = { s.r.buf, (size_t)s.r.len };
+			sqe->opcode = reading ? IORING_OP_READV : IORING_OP_WRITEV;
+			sqe->addr = (uint64_t)(uintptr_t)&s.iov;
+			sqe->len = 1;
+		}
+		sq_array[idx] = idx;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (submitted < count) {
+		if ((ret = uring_enter(ring_fd, count - submitted, 0, 0)) >= 0) {
+			submitted += ret;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		err = errno;
+		break;
+	}
+
+	/*
+	 * Nothing but io_uring_enter takes entries off the queue, so the ones
+	 * it refused can simply be taken back. They count as failed, and get
+	 * another go through PosixDevice.
+	 */
+	if (submitted < count) {
+		__atomic_store_n(sq_tail, tail - (count - submitted), __ATOMIC_RELEASE);
+		logger.warn("io_uring took %1 of %2 requests: %3", submitted, count, std::string(strerror(err)));
+	}
+
+	// waiters may be holding off reaping until the kernel has something of ours
+	std::lock_guard<std::mutex> done(cq_lock);
+	for (unsigned i = 0; i < submitted; i++)
+		queued.insert(&slots[i]);
+	for (unsigned i = submitted; i < count; i++) {
+		slots[i].res = -err;
+		slots[i].pending->remaining--;
+		in_flight--;
+	}
+	cq_done.notify_all();
+}
+
+/*
+ * Only the reaper touches the completion queue; it's reaping with `cq_lock`
+ * released, so that others can queue requests meanwhile. It's only ever
+ * started with something in the kernel, so there's always a completion
+ * coming to wake it.
+ *
+ * If the ring can't be waited on, it's given up on for good: everything
+ * still in it is failed over to PosixDevice, and so is everything after.
+ */
+void UringDevice::reap()
+{
+	std::vector<std::pair<Slot *, int>> reaped;
+	unsigned head = *cq_head, tail;
+	int err = 0;
+
+	while ((tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) == head) {
+		if (uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR &&
+				errno != EAGAIN && errno != EBUSY) {
+			err = errno;
+			break;
+		}
+	}
+
+	if (err != 0) {
+		std::lock_guard<std::mutex> guard(cq_lock);
+
+		logger.error("Waiting on the io_uring: %1, using pread/pwrite from now on",
+				std::string(strerror(err)));
+		broken = true;
+		for (Slot *s : queued) {
+			s->res = -err;
+			s->pending->remaining--;
+			in_flight--;
+		}
+		queued.clear();
+		return;
+	}
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe const & cqe = cqes[head & *cq_mask];
+
+		reaped.emplace_back((Slot *)(uintptr_t)cqe.user_data, cqe.res);
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	std::lock_guard<std::mutex> guard(cq_lock);
+	for (auto const & r : reaped) {
+		queued.erase(r.first);
+		r.first->res = r.second;
+		r.first->pending->remaining--;
+		in_flight--;
+	}
+}
+
+template <typename Done>
+void UringDevice::wait_until(std::unique_lock<std::mutex> & guard, Done done)
+{
+	while (!done()) {
+		if (reaping || queued.empty()) {
+			cq_done.wait(guard);
+			continue;
+		}
+
+		reaping = true;
+		guard.unlock();
+		reap();
+		guard.lock();
+		reaping = false;
+		cq_done.notify_all();
+	}
+}
+
+void UringDevice::submit(std::vector<Request> const & batch)
+{
+	std::vector<Slot> slots;
+	Pending pending;
+
+	for (Request const & r : batch) {
+		for (uint64_t done = 0; done < r.len; done += MAX_PIECE) {
+			Request piece = { r.op, (char *)r.buf + done, r.offset + done,
+				std::min(MAX_PIECE, r.len - done) };
+
+			slots.push_back({ piece, {}, &pending, 0 });
+		}
+	}
+	pending.remaining = slots.size();
+
+	// at most a ring's worth in flight, so the completion queue can't overflow
+	for (size_t i = 0; i < slots.size(); ) {
+		unsigned n = std::min((size_t)entries, slots.size() - i);
+
+		{
+			std::unique_lock<std::mutex> guard(cq_lock);
+			wait_until(guard, [this, n] { return broken || in_flight + n <= entries; });
+			// the rest are left with nothing done, for PosixDevice to do
+			if (broken) {
+				pending.remaining -= slots.size() - i;
+				break;
+			}
+			in_flight += n;
+		}
+		enqueue(&slots[i], n);
+		i += n;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(cq_lock);
+		wait_until(guard, [&pending] { return pending.remaining == 0; });
+	}
+
+	for (Slot const & s : slots) {
+		uint64_t done = s.res > 0 ? s.res : 0;
+
+		if (done == s.r.len)
+			continue;
+
+		logger.debug("io_uring did %1 of %2 bytes at %3 (%4), finishing with pread/pwrite",
+				done, s.r.len, s.r.offset, s.res);
+		if (s.r.op == Op::Read)
+			posix.read((char *)s.r.buf + done, s.r.offset + done, s.r.len - done);
+		else
+			posix.write((char const *)s.r.buf + done, s.r.offset + done, s.r.len - done);
+	}
+}
+
+void UringDevice::read(void *buf, uint64_t offset, uint64_t len)
+{
+	submit({ { Op::Read, buf, offset, len } });
+}
+
+void UringDevice::write(void const *buf, uint64_t offset, uint64_t len)
+{
+	submit({ { Op::Write, const_cast<void *>(buf), offset, len } });
+}
+
+bool UringDevice::sync()
+{
+	return posix.sync();
+}
+#endif
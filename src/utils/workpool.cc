@@ -0,0 +1,130 @@
+#include <algorithm> // find
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "utils/workpool.hh"
+
+using hush::utils::WorkPool;
+
+WorkPool::WorkPool(unsigned nthreads, bool pin)
+{
+	if (nthreads == 0) {
+		unsigned cores = std::thread::hardware_concurrency();
+
+		nthreads = cores > 1 ? cores - 1 : 0;
+	}
+
+	for (unsigned i = 0; i < nthreads; i++)
+		threads.emplace_back(&WorkPool::worker, this, i, pin);
+}
+
+WorkPool::~WorkPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (auto & t : threads)
+		t.join();
+}
+
+void WorkPool::worker(unsigned cpu, bool pin)
+{
+#ifdef __linux__
+	/*
+	 * Worker n gets core n+1 (mod the core count); core 0 is usually where
+	 * the fuse loop and interrupts are.
+	 */
+	if (pin) {
+		unsigned cores = std::thread::hardware_concurrency();
+		cpu_set_t set;
+
+		if (cores > 0) {
+			CPU_ZERO(&set);
+			CPU_SET((cpu + 1) % cores, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+		}
+	}
+#endif
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	for (;;) {
+		Batch *batch;
+
+		wake.wait(guard, [this] { return stopping || !queue.empty(); });
+		if (stopping)
+			return;
+
+		batch = queue.front();
+		if (batch->next.load() >= batch->count) {
+			// nothing left to hand out, the rest is already in progress
+			queue.pop_front();
+			continue;
+		}
+
+		batch->users++;
+		guard.unlock();
+		work(*batch);
+		guard.lock();
+
+		if (--batch->users == 0)
+			finished.notify_all();
+	}
+}
+
+void WorkPool::work(Batch & batch)
+{
+	size_t i;
+
+	while ((i = batch.next.fetch_add(1)) < batch.count) {
+		if (!(*batch.task)(i))
+			batch.ok = false;
+
+		if (batch.done.fetch_add(1) + 1 == batch.count) {
+			std::lock_guard<std::mutex> guard(lock);
+			finished.notify_all();
+		}
+	}
+}
+
+bool WorkPool::run(size_t count, Task const & task)
+{
+	Batch batch;
+
+	batch.task = &task;
+	batch.count = count;
+	batch.next = 0;
+	batch.done = 0;
+	batch.ok = true;
+	batch.users = 0;
+
+	if (count == 0)
+		return true;
+
+	if (count > 1 && !threads.empty()) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back(&batch);
+		}
+		wake.notify_all();
+	}
+
+	work(batch);
+
+	std::unique_lock<std::mutex> guard(lock);
+	finished.wait(guard, [&batch] { return batch.done.load() == batch.count; });
+
+	auto it = std::find(queue.begin(), queue.end(), &batch);
+	if (it != queue.end())
+		queue.erase(it);
+
+	// a worker may still be on its way out of work()
+	finished.wait(guard, [&batch] { return batch.users == 0; });
+
+	return batch.ok;
+}